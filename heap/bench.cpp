@@ -0,0 +1,200 @@
+#include "heap.h"
+#include <queue>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+#include <functional>
+
+// ckf::Heap与std::priority_queue对比: 逐个push n个随机数、push后逐个pop到空、用n个元素一次建堆
+// 每项先翻倍迭代次数直到一次运行不少于min_ms毫秒, 再运行reps次, 取每个元素耗时的中位数
+// 输出格式和列与mux/6.epollServer_v4/microbench相同, 结果可以放在一起比较
+// ./bench [format=text|csv|json] [reps=N] [min_ms=M] [label=STR]
+
+static volatile long sink = 0; // 防止编译器把测试代码优化掉
+
+struct Options
+{
+    std::string format = "text";
+    int reps = 9;
+    int min_ms = 20;
+    std::string label;
+};
+
+struct Result
+{
+    std::string name;
+    long iters;
+    double ns, min, max, mad;
+};
+
+double median(std::vector<double> v)
+{
+    std::sort(v.begin(), v.end());
+    size_t n = v.size();
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+// run(iters)处理iters轮, 每轮n个元素; 结果是每个元素的纳秒数
+Result measure(const std::string &name, const std::function<void(long)> &run, size_t n, const Options &opts)
+{
+    typedef std::chrono::steady_clock clock;
+    long iters = 1;
+    for (int i = 0; i < 40; i++)
+    {
+        clock::time_point begin = clock::now();
+        run(iters);
+        if (clock::now() - begin >= std::chrono::milliseconds(opts.min_ms))
+            break;
+        iters *= 2;
+    }
+    std::vector<double> samples;
+    for (int i = 0; i < opts.reps; i++)
+    {
+        clock::time_point begin = clock::now();
+        run(iters);
+        samples.push_back(std::chrono::duration<double, std::nano>(clock::now() - begin).count() / iters / n);
+    }
+    Result r;
+    r.name = name;
+    r.iters = iters;
+    r.ns = median(samples);
+    r.min = *std::min_element(samples.begin(), samples.end());
+    r.max = *std::max_element(samples.begin(), samples.end());
+    std::vector<double> dev;
+    for (size_t i = 0; i < samples.size(); i++)
+        dev.push_back(samples[i] > r.ns ? samples[i] - r.ns : r.ns - samples[i]);
+    r.mad = r.ns > 0 ? median(dev) / r.ns * 100 : 0;
+    return r;
+}
+
+void print(const Result &r, const Options &opts, bool first)
+{
+    if (opts.format == "csv")
+        printf("%s,%s,%ld,%d,%.2f,%.2f,%.2f,%.2f\n", opts.label.c_str(), r.name.c_str(), r.iters, opts.reps, r.ns, r.min, r.max, r.mad);
+    else if (opts.format == "json")
+        printf("%s\n  {\"name\": \"%s\", \"iterations\": %ld, \"reps\": %d, \"ns_per_op\": %.2f, \"min_ns\": %.2f, \"max_ns\": %.2f, \"mad_pct\": %.2f}",
+               first ? "" : ",", r.name.c_str(), r.iters, opts.reps, r.ns, r.min, r.max, r.mad);
+    else
+        printf("%-40s %12.1f %12.1f %12.1f %8.2f %12ld\n", r.name.c_str(), r.ns, r.min, r.max, r.mad, r.iters);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "format=", 7) == 0)
+            opts.format = argv[i] + 7;
+        else if (strncmp(argv[i], "reps=", 5) == 0)
+            opts.reps = atoi(argv[i] + 5);
+        else if (strncmp(argv[i], "min_ms=", 7) == 0)
+            opts.min_ms = atoi(argv[i] + 7);
+        else if (strncmp(argv[i], "label=", 6) == 0)
+            opts.label = argv[i] + 6;
+        else
+            opts.format.clear();
+    }
+    if ((opts.format != "text" && opts.format != "csv" && opts.format != "json") || opts.reps <= 0 || opts.min_ms <= 0 ||
+        opts.label.find_first_of(",\"\\\n") != std::string::npos)
+    {
+        printf("Usage: ./bench [format=text|csv|json] [reps=N] [min_ms=M] [label=STR]\n");
+        return 1;
+    }
+
+    if (opts.format == "csv")
+        printf("label,benchmark,iterations,reps,ns_per_op,min_ns,max_ns,mad_pct\n");
+    else if (opts.format == "json")
+        printf("{\"label\": \"%s\", \"benchmarks\": [", opts.label.c_str());
+    else
+        printf("%-40s %12s %12s %12s %8s %12s\n", "benchmark (per element)", "ns/op", "min ns", "max ns", "mad %", "iterations");
+
+    typedef ckf::Heap<int, std::less<int> > Heap;
+    typedef std::priority_queue<int> Queue;
+    const size_t sizes[] = {1024, 65536, 1 << 20};
+    bool first = true;
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++)
+    {
+        size_t n = sizes[k];
+        std::vector<int> data(n);
+        std::mt19937 rng(49);
+        for (size_t i = 0; i < n; i++)
+            data[i] = rng();
+        std::string suffix = " n=" + std::to_string(n);
+
+        print(measure("heap/ckf push" + suffix, [&data](long iters)
+                      {
+                          for (long it = 0; it < iters; it++)
+                          {
+                              Heap h;
+                              for (size_t i = 0; i < data.size(); i++)
+                                  h.push(data[i]);
+                              sink = sink + h.top();
+                          } },
+                      n, opts),
+              opts, first);
+        first = false;
+        print(measure("heap/priority_queue push" + suffix, [&data](long iters)
+                      {
+                          for (long it = 0; it < iters; it++)
+                          {
+                              Queue q;
+                              for (size_t i = 0; i < data.size(); i++)
+                                  q.push(data[i]);
+                              sink = sink + q.top();
+                          } },
+                      n, opts),
+              opts, first);
+        // pop需要先有一个满的堆, 这一项包括一次建堆, 减去heapify项即为逐个pop的开销
+        print(measure("heap/ckf heapify+pop" + suffix, [&data](long iters)
+                      {
+                          for (long it = 0; it < iters; it++)
+                          {
+                              Heap h(data);
+                              while (!h.empty())
+                              {
+                                  sink = sink + h.top();
+                                  h.pop();
+                              }
+                          } },
+                      n, opts),
+              opts, first);
+        print(measure("heap/priority_queue heapify+pop" + suffix, [&data](long iters)
+                      {
+                          for (long it = 0; it < iters; it++)
+                          {
+                              Queue q(data.begin(), data.end());
+                              while (!q.empty())
+                              {
+                                  sink = sink + q.top();
+                                  q.pop();
+                              }
+                          } },
+                      n, opts),
+              opts, first);
+        print(measure("heap/ckf heapify" + suffix, [&data](long iters)
+                      {
+                          for (long it = 0; it < iters; it++)
+                          {
+                              Heap h(data);
+                              sink = sink + h.top();
+                          } },
+                      n, opts),
+              opts, first);
+        print(measure("heap/priority_queue heapify" + suffix, [&data](long iters)
+                      {
+                          for (long it = 0; it < iters; it++)
+                          {
+                              Queue q(data.begin(), data.end());
+                              sink = sink + q.top();
+                          } },
+                      n, opts),
+              opts, first);
+    }
+    if (opts.format == "json")
+        printf("\n]}\n");
+    return 0;
+}
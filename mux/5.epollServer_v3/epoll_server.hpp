@@ -29,11 +29,11 @@ struct Connection
         : fd_(fd), events_(events), recver_(recver), sender_(sender), excepter_(excepter)
     {
         last_time_ = time(nullptr);
-        pthread_mutex_init(mutex_, nullptr);
+        pthread_mutex_init(&mutex_, nullptr);
     }
     ~Connection()
     {
-        pthread_mutex_destroy(mutex_);
+        pthread_mutex_destroy(&mutex_);
     }
 
     // 连接信息
@@ -51,7 +51,7 @@ struct Connection
 
     // 最近访问时间
     time_t last_time_;
-    pthread_mutex_t *mutex_;
+    pthread_mutex_t mutex_;
 };
 
 // 本服务器默认都采用ET模式
@@ -147,9 +147,9 @@ public:
             uint32_t events = events_.GetEvent(i);
 
             // 更新最近访问时间
-            pthread_mutex_lock(connections_[fd]->mutex_);
+            pthread_mutex_lock(&connections_[fd]->mutex_);
             connections_[fd]->last_time_ = time(nullptr);
-            pthread_mutex_unlock(connections_[fd]->mutex_);
+            pthread_mutex_unlock(&connections_[fd]->mutex_);
 
             // fd的event事件已就绪
 
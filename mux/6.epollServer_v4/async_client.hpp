@@ -0,0 +1,511 @@
+#pragma once
+#include <map>
+#include <deque>
+#include <memory>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include "reactor.hpp"
+#include "Mutex.hpp"
+
+// 非阻塞客户端库: 一个后台线程跑EventLoop, 每个服务器地址一个连接池, 连接上流水线发送请求
+// 任意线程调用Call, 结果通过回调(在后台线程上执行, 不要阻塞)或future返回; 不需要每个请求一个线程
+// 二进制协议的请求带编号, 响应可以乱序返回; 其它协议按请求顺序对应响应
+// 每个请求有超时, 完成时取消; 带编号的请求超时后不再占用连接的名额, 之后迟到的响应直接丢弃
+// 连接断开时其上未完成的请求以CALL_DISCONNECTED失败(不自动重发, 由调用方决定是否重试)
+// 断开的连接按指数退避重连, 期间新请求交给池里其它可用的连接, 都不可用时排队
+//
+// AsyncClient<BinaryCodec> cli;
+// cli.Start();
+// cli.Call(Endpoint(AF_INET, 8080), "127.0.0.1", Request(1, '+', 2), [](int status, Response &resp) { ... });
+// CallResult r = cli.Call(Endpoint(AF_INET, 8080), "127.0.0.1", Request(1, '+', 2)).get();
+
+// 请求的完成状态
+enum CallStatus
+{
+    CALL_OK = 0,
+    CALL_TIMEOUT,      // 超时前没有收到响应
+    CALL_DISCONNECTED, // 连接失败或在等待响应时断开, 或者响应无法解析
+    CALL_OVERLOADED,   // 没有可用的连接, 排队的请求也已经达到上限
+    CALL_STOPPED       // 客户端已经停止
+};
+
+struct CallResult
+{
+    int status_ = CALL_OK;
+    Response resp_;
+};
+
+using call_callback_t = std::function<void(int status, Response &resp)>;
+
+static const size_t client_read_size = 65536; // 每次recv的大小, 流水线的响应一次读完
+
+struct ClientOptions
+{
+    int conns_ = 4;                // 每个地址的连接数
+    size_t max_pending_ = 1024;    // 每个连接上已发出、未收到响应的请求数上限
+    size_t max_queued_ = 65536;    // 每个地址在没有可用连接时排队的请求数上限
+    int timeout_ms_ = 1000;        // 默认的请求超时
+    int backoff_min_ms_ = 10;      // 重连的等待时间从这里开始翻倍
+    int backoff_max_ms_ = 5000;    // 重连等待时间的上限
+};
+
+template <Codec C>
+class AsyncClient
+{
+    // 带编号的请求只有二进制协议支持
+    static constexpr bool tagged = std::is_same_v<C, BinaryCodec>;
+
+    enum
+    {
+        CONN_IDLE,       // 还没有连接, 或者断开后在等待重连
+        CONN_CONNECTING, // 非阻塞connect进行中, 等待可写
+        CONN_READY
+    };
+
+    struct Pool;
+
+    struct PendingCall
+    {
+        call_callback_t cb_;
+        Request req_;         // 排队时保存, 发出后不再需要
+        Pool *pool_ = nullptr;
+        int conn_ = -1;       // 发出所在的连接, -1为还在排队
+        uint64_t timer_ = 0;  // 超时定时器, 完成时取消; 0为已经触发
+    };
+
+    struct PoolConn
+    {
+        int fd_ = -1;
+        uint64_t seq_ = 0; // EventLoop给连接的序号, 异步回调确认还是原来的连接
+        int state_ = CONN_IDLE;
+        C codec_;
+        int attempts_ = 0;    // 连续失败的次数, 决定下次重连的等待时间
+        bool flushpending_ = false;
+        std::unordered_map<uint32_t, uint64_t> tags_; // 带编号: 请求编号 -> call id, 超时的立即删除
+        std::deque<uint64_t> order_;                  // 按顺序: 已发出的call id, 超时的也留着占住响应的位置
+
+        size_t Pending() const { return tagged ? tags_.size() : order_.size(); }
+    };
+
+    struct Pool
+    {
+        Endpoint ep_;
+        std::string host_;
+        std::vector<PoolConn> conns_;
+        std::deque<uint64_t> queue_; // 等待可用连接的call id, 已超时的在取出时跳过
+        size_t next_ = 0;            // 轮流选择连接
+    };
+
+public:
+    AsyncClient(const ClientOptions &opts = ClientOptions()) : opts_(opts), nextcall_(1), stop_(false), closed_(false)
+    {
+        loop_.Init();
+    }
+
+    ~AsyncClient()
+    {
+        Stop();
+    }
+
+    void Start()
+    {
+        thread_ = std::thread([this]()
+                              {
+                                  while (!stop_)
+                                      loop_.LoopOnce(-1);
+                                  Shutdown(); });
+    }
+
+    // 所有未完成的请求以CALL_STOPPED完成, 关闭所有连接, 等后台线程退出
+    // 之后的Call在调用线程上立即以CALL_STOPPED完成
+    void Stop()
+    {
+        {
+            lockGuard lg(&callmtx_);
+            closed_ = true;
+        }
+        if (!thread_.joinable())
+            return;
+        loop_.Post([this]()
+                   { stop_ = true; });
+        thread_.join();
+    }
+
+    // 线程安全; host: 对端IP(unix地址忽略), timeout_ms < 0时用ClientOptions中的默认超时
+    void Call(const Endpoint &ep, const std::string &host, Request req, call_callback_t cb, int timeout_ms = -1)
+    {
+        {
+            // 与Stop互斥: 投递成功的请求都排在停止之前, 一定会被后台线程完成
+            lockGuard lg(&callmtx_);
+            if (!closed_)
+            {
+                loop_.Post([this, ep, host, req = std::move(req), cb = std::move(cb), timeout_ms]() mutable
+                           { Submit(ep, host, std::move(req), std::move(cb), timeout_ms < 0 ? opts_.timeout_ms_ : timeout_ms); });
+                return;
+            }
+        }
+        Response resp;
+        cb(CALL_STOPPED, resp);
+    }
+
+    std::future<CallResult> Call(const Endpoint &ep, const std::string &host, Request req, int timeout_ms = -1)
+    {
+        auto promise = std::make_shared<std::promise<CallResult>>();
+        std::future<CallResult> f = promise->get_future();
+        Call(ep, host, std::move(req), [promise](int status, Response &resp)
+             {
+                 CallResult r;
+                 r.status_ = status;
+                 r.resp_ = std::move(resp);
+                 promise->set_value(std::move(r)); },
+             timeout_ms);
+        return f;
+    }
+
+private:
+    void Submit(const Endpoint &ep, const std::string &host, Request req, call_callback_t cb, int timeout_ms)
+    {
+        if (stop_)
+        {
+            Response resp;
+            cb(CALL_STOPPED, resp);
+            return;
+        }
+        Pool *pool = GetPool(ep, host);
+        uint64_t id = nextcall_++;
+        PendingCall &call = calls_[id];
+        call.cb_ = std::move(cb);
+        call.req_ = std::move(req);
+        call.pool_ = pool;
+        call.timer_ = loop_.AddTimer(timeout_ms, [this, id]()
+                                     { Timeout(id); });
+        int i = PickConn(pool);
+        if (i >= 0)
+        {
+            SendCall(pool, i, id);
+            return;
+        }
+        if (pool->queue_.size() >= opts_.max_queued_)
+        {
+            Finish(id, CALL_OVERLOADED, nullptr);
+            return;
+        }
+        pool->queue_.push_back(id);
+    }
+
+    Pool *GetPool(const Endpoint &ep, const std::string &host)
+    {
+        std::unique_ptr<Pool> &pool = pools_[ep.ToString() + "@" + host];
+        if (!pool)
+        {
+            pool.reset(new Pool);
+            pool->ep_ = ep;
+            pool->host_ = host;
+            pool->conns_.resize(opts_.conns_);
+            for (int i = 0; i < opts_.conns_; i++)
+                Connect(pool.get(), i);
+        }
+        return pool.get();
+    }
+
+    // 轮流选一个已连接且没有达到max_pending_的连接, 没有返回-1
+    int PickConn(Pool *pool)
+    {
+        for (size_t k = 0; k < pool->conns_.size(); k++)
+        {
+            size_t i = (pool->next_ + k) % pool->conns_.size();
+            PoolConn &conn = pool->conns_[i];
+            if (conn.state_ == CONN_READY && conn.Pending() < opts_.max_pending_)
+            {
+                pool->next_ = i + 1;
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // 编码进发送缓冲区; 同一轮事件处理中发往同一连接的请求攒在一起, 在本轮最后一次发出
+    void SendCall(Pool *pool, int i, uint64_t id)
+    {
+        PoolConn &pc = pool->conns_[i];
+        PendingCall &call = calls_[id];
+        call.conn_ = i;
+        call.req_._id = (uint32_t)id;
+        call.req_._hasid = tagged;
+        Connection *conn = loop_.GetConnection(pc.fd_);
+        pc.codec_.Encode(call.req_, &conn->outbuffer_);
+        call.req_ = Request();
+        if (tagged)
+            pc.tags_[(uint32_t)id] = id;
+        else
+            pc.order_.push_back(id);
+        if (pc.flushpending_)
+            return;
+        pc.flushpending_ = true;
+        int fd = pc.fd_;
+        uint64_t seq = pc.seq_;
+        loop_.AddTimer(0, [this, pool, i, fd, seq]()
+                       {
+                           PoolConn &pc = pool->conns_[i];
+                           Connection *c = loop_.GetConnection(fd);
+                           if (pc.fd_ != fd || pc.seq_ != seq || c == nullptr)
+                               return;
+                           pc.flushpending_ = false;
+                           loop_.Send(c); });
+    }
+
+    void Connect(Pool *pool, int i)
+    {
+        PoolConn &pc = pool->conns_[i];
+        int fd = socket(pool->ep_.family_, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        struct sockaddr_storage ss;
+        socklen_t len = pool->ep_.ToSockaddr(&ss, pool->ep_.family_ == AF_UNIX ? "" : pool->host_);
+        if (fd < 0 || len == 0 || (connect(fd, (struct sockaddr *)&ss, len) < 0 && errno != EINPROGRESS))
+        {
+            LogMessage(DEBUG, "connect %s %s fail: %s\n", pool->host_.c_str(), pool->ep_.ToString().c_str(), strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            Retry(pool, i);
+            return;
+        }
+        if (pool->ep_.family_ != AF_UNIX)
+            util::SetNoDelay(fd);
+        loop_.AddConnection(fd, EPOLLIN,
+                            [this, pool, i](Connection *c)
+                            { OnReadable(pool, i, c); },
+                            [this, pool, i](Connection *c)
+                            { OnWritable(pool, i, c); },
+                            [this, pool, i](Connection *)
+                            { Disconnect(pool, i); });
+        Connection *conn = loop_.GetConnection(fd);
+        pc.fd_ = fd;
+        pc.seq_ = conn->seq_;
+        pc.state_ = CONN_CONNECTING;
+        pc.codec_ = C();
+        loop_.EnableIO(fd, true, true); // 连接建立(或失败)时可写
+    }
+
+    void OnWritable(Pool *pool, int i, Connection *c)
+    {
+        PoolConn &pc = pool->conns_[i];
+        if (pc.state_ == CONN_CONNECTING)
+        {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(pc.fd_, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+            {
+                LogMessage(DEBUG, "connect %s %s fail: %s\n", pool->host_.c_str(), pool->ep_.ToString().c_str(), strerror(err));
+                Disconnect(pool, i);
+                return;
+            }
+            pc.state_ = CONN_READY;
+            pc.attempts_ = 0;
+            loop_.EnableIO(pc.fd_, true, false);
+            Drain(pool);
+            return;
+        }
+        loop_.Send(c);
+        if (loop_.GetConnection(pc.fd_) == c && c->outbuffer_.empty())
+            loop_.EnableIO(pc.fd_, true, false);
+    }
+
+    void OnReadable(Pool *pool, int i, Connection *c)
+    {
+        PoolConn &pc = pool->conns_[i];
+        if (pc.state_ != CONN_READY)
+        {
+            OnWritable(pool, i, c); // 连接失败时同时报告可读
+            return;
+        }
+        char buffer[client_read_size];
+        while (true)
+        {
+            ssize_t n = c->Read(buffer, sizeof(buffer));
+            if (n > 0)
+            {
+                c->inbuffer_.append(buffer, n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            Disconnect(pool, i); // 对端关闭或出错
+            return;
+        }
+        std::string_view frame;
+        int ret;
+        while ((ret = pc.codec_.Next(c->inbuffer_, &frame)) > 0)
+        {
+            Response resp;
+            uint64_t id = 0;
+            bool ok = pc.codec_.Decode(frame, &resp);
+            if (ok && tagged)
+            {
+                auto it = pc.tags_.find(resp._id);
+                ok = resp._hasid;
+                if (ok && it == pc.tags_.end())
+                {
+                    LogMessage(DEBUG, "%s: late response %u dropped\n", pool->ep_.ToString().c_str(), resp._id);
+                    continue; // 请求已经超时
+                }
+                if (ok)
+                {
+                    id = it->second;
+                    pc.tags_.erase(it);
+                }
+            }
+            else if (ok)
+            {
+                ok = !pc.order_.empty();
+                if (ok)
+                {
+                    id = pc.order_.front();
+                    pc.order_.pop_front();
+                }
+            }
+            if (!ok)
+            {
+                LogMessage(WARNING, "%s: unexpected response, reconnecting\n", pool->ep_.ToString().c_str());
+                Disconnect(pool, i);
+                return;
+            }
+            Finish(id, CALL_OK, &resp); // 已经超时的请求在这里被忽略
+        }
+        if (ret < 0)
+        {
+            Disconnect(pool, i);
+            return;
+        }
+        pc.codec_.Consume(c->inbuffer_);
+        Drain(pool);
+    }
+
+    // 把排队的请求交给有空位的连接
+    void Drain(Pool *pool)
+    {
+        while (!pool->queue_.empty())
+        {
+            uint64_t id = pool->queue_.front();
+            if (calls_.find(id) == calls_.end()) // 排队时已经超时
+            {
+                pool->queue_.pop_front();
+                continue;
+            }
+            int i = PickConn(pool);
+            if (i < 0)
+                break;
+            pool->queue_.pop_front();
+            SendCall(pool, i, id);
+        }
+    }
+
+    // 关闭连接, 其上未完成的请求以CALL_DISCONNECTED完成, 退避后重连
+    void Disconnect(Pool *pool, int i)
+    {
+        PoolConn &pc = pool->conns_[i];
+        if (pc.fd_ < 0)
+            return;
+        Connection *c = loop_.GetConnection(pc.fd_);
+        if (c)
+            loop_.HandleException(c);
+        pc.fd_ = -1;
+        pc.state_ = CONN_IDLE;
+        pc.flushpending_ = false;
+        std::vector<uint64_t> ids;
+        for (auto &kv : pc.tags_)
+            ids.push_back(kv.second);
+        ids.insert(ids.end(), pc.order_.begin(), pc.order_.end());
+        pc.tags_.clear();
+        pc.order_.clear();
+        for (uint64_t id : ids)
+            Finish(id, CALL_DISCONNECTED, nullptr);
+        if (!stop_)
+            Retry(pool, i);
+    }
+
+    void Retry(Pool *pool, int i)
+    {
+        PoolConn &pc = pool->conns_[i];
+        int ms = opts_.backoff_min_ms_ << std::min(pc.attempts_, 20);
+        ms = std::min(ms, opts_.backoff_max_ms_);
+        pc.attempts_++;
+        pc.state_ = CONN_IDLE;
+        loop_.AddTimer(ms, [this, pool, i]()
+                       {
+                           if (!stop_ && pool->conns_[i].state_ == CONN_IDLE)
+                               Connect(pool, i); });
+        // 整个池都连不上时排队的请求不必等到超时
+        bool any = false;
+        for (const PoolConn &c : pool->conns_)
+            any = any || c.state_ != CONN_IDLE;
+        if (!any)
+        {
+            std::deque<uint64_t> queue;
+            queue.swap(pool->queue_);
+            for (uint64_t id : queue)
+                Finish(id, CALL_DISCONNECTED, nullptr);
+        }
+    }
+
+    // 超时定时器触发; 带编号的请求从连接上删除编号, 空出名额, 迟到的响应找不到编号时丢弃
+    // 按顺序的请求仍然留在order_里, 占住响应的位置
+    void Timeout(uint64_t id)
+    {
+        auto it = calls_.find(id);
+        if (it == calls_.end())
+            return;
+        PendingCall &call = it->second;
+        call.timer_ = 0;
+        if (tagged && call.conn_ >= 0)
+            call.pool_->conns_[call.conn_].tags_.erase((uint32_t)id);
+        Finish(id, CALL_TIMEOUT, nullptr);
+    }
+
+    // 完成一个请求, 每个请求只完成一次(响应、超时、断开三者先到者)
+    void Finish(uint64_t id, int status, Response *resp)
+    {
+        auto it = calls_.find(id);
+        if (it == calls_.end())
+            return;
+        if (it->second.timer_)
+            loop_.CancelTimer(it->second.timer_);
+        call_callback_t cb = std::move(it->second.cb_);
+        calls_.erase(it);
+        Response empty;
+        cb(status, resp ? *resp : empty);
+    }
+
+    // 后台线程退出前: 关闭连接, 未完成的请求以CALL_STOPPED完成
+    void Shutdown()
+    {
+        for (auto &kv : pools_)
+        {
+            for (PoolConn &pc : kv.second->conns_)
+            {
+                Connection *c = pc.fd_ >= 0 ? loop_.GetConnection(pc.fd_) : nullptr;
+                if (c)
+                    loop_.HandleException(c);
+                pc.fd_ = -1;
+            }
+        }
+        std::vector<uint64_t> ids;
+        for (auto &kv : calls_)
+            ids.push_back(kv.first);
+        for (uint64_t id : ids)
+            Finish(id, CALL_STOPPED, nullptr);
+    }
+
+private:
+    ClientOptions opts_;
+    EventLoop loop_;
+    std::thread thread_;
+    std::map<std::string, std::unique_ptr<Pool>> pools_; // 地址 + "@" + host -> 连接池
+    std::unordered_map<uint64_t, PendingCall> calls_;    // 未完成的请求
+    uint64_t nextcall_;
+    bool stop_; // 只在后台线程读写
+    Mutex callmtx_;
+    bool closed_; // Stop之后不再投递新请求, 由callmtx_保护
+};
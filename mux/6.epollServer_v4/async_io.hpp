@@ -0,0 +1,263 @@
+#pragma once
+#include <string>
+#include <type_traits>
+#include <functional>
+#include <coroutine>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "mysocket.hpp"
+#include "reactor.hpp"
+#include "task.hpp"
+
+// 协程中可以co_await的操作, 全部在当前Reactor线程上恢复:
+// 1.Sleep(ms): 定时器
+// 2.Offload(fn): 把耗时计算放到线程池, 算完后回到Reactor线程
+// 3.AsyncSock: 基于Epoller的非阻塞socket, 读写不就绪时挂起协程, 事件就绪后恢复
+
+struct SleepAwaiter
+{
+    int ms_;
+
+    bool await_ready() { return ms_ <= 0; }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        EventLoop::Current()->AddTimer(ms_, [h]()
+                                     { h.resume(); });
+    }
+    void await_resume() {}
+};
+
+inline SleepAwaiter Sleep(int ms)
+{
+    return SleepAwaiter{ms};
+}
+
+template <class F>
+class OffloadAwaiter
+{
+    using result_t = std::invoke_result_t<F>;
+    using storage_t = std::conditional_t<std::is_void_v<result_t>, char, result_t>;
+
+public:
+    OffloadAwaiter(F fn, work_pool_t *pool) : fn_(std::move(fn)), pool_(pool) {}
+
+    bool await_ready() { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        EventLoop *r = EventLoop::Current();
+        bool pushed = pool_->pushTask([this, h, r]()
+                                      {
+                                          Call();
+                                          r->Post([h]() { h.resume(); }); });
+        if (!pushed) // 线程池已关闭, 就地计算, 不挂起
+            Call();
+        return pushed;
+    }
+
+    result_t await_resume()
+    {
+        if constexpr (!std::is_void_v<result_t>)
+            return std::move(*result_);
+    }
+
+private:
+    void Call()
+    {
+        if constexpr (std::is_void_v<result_t>)
+            fn_();
+        else
+            result_.emplace(fn_());
+    }
+
+    F fn_;
+    work_pool_t *pool_;
+    std::optional<storage_t> result_;
+};
+
+// pool为空时使用当前事件循环的计算线程池(见EventLoop::SetWorkPool, ReactorServer的协程版本会设置), 没有时使用进程级默认的
+template <class F>
+OffloadAwaiter<F> Offload(F fn, work_pool_t *pool = nullptr)
+{
+    if (pool == nullptr && EventLoop::Current())
+        pool = EventLoop::Current()->WorkPool();
+    if (pool == nullptr)
+        pool = work_pool_t::get_instance(offload_thread_num);
+    return OffloadAwaiter<F>(std::move(fn), pool);
+}
+
+class AsyncSock
+{
+public:
+    explicit AsyncSock(EventLoop *r = EventLoop::Current()) : r_(r), fd_(defaultfd) {}
+    ~AsyncSock()
+    {
+        Close();
+    }
+    AsyncSock(const AsyncSock &) = delete;
+    AsyncSock &operator=(const AsyncSock &) = delete;
+
+    // 接管一个已经建立的连接fd, 注册到Reactor
+    void Attach(int fd)
+    {
+        Close();
+        fd_ = fd;
+        r_->AddConnection(fd_, EPOLLIN | EPOLLOUT,
+                          [this](Connection *)
+                          { Wake(&reader_); },
+                          [this](Connection *)
+                          { Wake(&writer_); },
+                          nullptr);
+    }
+
+    // 连接ep: tcp/tcp6连接ip(IPv4点分十进制或IPv6冒号格式), unix地址忽略ip
+    // 套接字由Sock::Socket创建(close-on-exec), 注册到Reactor后非阻塞地connect
+    // 成功返回0, 失败返回-1, errno是失败原因(例如ECONNREFUSED)
+    Task<int> Connect(Endpoint ep, std::string ip = "")
+    {
+        struct sockaddr_storage svr;
+        socklen_t len = ep.ToSockaddr(&svr, ep.family_ == AF_UNIX ? "" : ip);
+        if (len == 0)
+        {
+            errno = EINVAL;
+            co_return -1;
+        }
+        Sock sock;
+        sock.Socket(ep.family_);
+        Attach(sock.Release());
+        if (connect(fd_, (struct sockaddr *)&svr, len) == 0)
+            co_return 0;
+        // unix套接字的全连接队列满时非阻塞connect返回EAGAIN, 不会再完成
+        if (errno != EINPROGRESS)
+            co_return -1;
+
+        // 非阻塞connect, 等待写就绪后检查连接结果
+        co_await WaitWritable();
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        if (getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+            co_return -1;
+        if (err != 0)
+        {
+            errno = err;
+            co_return -1;
+        }
+        co_return 0;
+    }
+
+    // 按ip的格式选择IPv4或IPv6
+    Task<int> Connect(std::string ip, uint16_t port)
+    {
+        co_return co_await Connect(Endpoint(ip.find(':') == std::string::npos ? AF_INET : AF_INET6, port), ip);
+    }
+
+    // 读到数据返回字节数, 对端关闭返回0, 出错返回-1, errno是失败原因
+    Task<ssize_t> Read(char *buf, size_t len)
+    {
+        while (true)
+        {
+            ssize_t n = recv(fd_, buf, len, 0);
+            if (n >= 0)
+                co_return n;
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                co_return -1;
+            co_await WaitReadable();
+        }
+    }
+
+    // 全部写完返回len, 出错返回-1, errno是失败原因(例如对端已关闭时为EPIPE)
+    Task<ssize_t> Write(const char *buf, size_t len)
+    {
+        size_t sent = 0;
+        while (sent < len)
+        {
+            ssize_t n = send(fd_, buf + sent, len - sent, MSG_NOSIGNAL);
+            if (n >= 0)
+            {
+                sent += n;
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                co_return -1;
+            co_await WaitWritable();
+        }
+        co_return (ssize_t)sent;
+    }
+
+    // 向同协议的服务发送一个请求, 并等待响应; C: 对端服务使用的编解码方式
+    // 每次调用从报文边界开始解析, 所以Codec不需要跨调用保存状态
+    template <Codec C = JsonCodec>
+    Task<bool> Call(const Request &req, Response *resp)
+    {
+        C codec;
+        std::string reqstr;
+        codec.Encode(req, &reqstr);
+        if (co_await Write(reqstr.c_str(), reqstr.size()) < 0)
+            co_return false;
+
+        std::string_view frame;
+        int ret = 0;
+        while ((ret = codec.Next(inbuffer_, &frame)) == 0)
+        {
+            char buffer[buffersize];
+            ssize_t n = co_await Read(buffer, sizeof(buffer));
+            if (n <= 0)
+                co_return false;
+            inbuffer_.append(buffer, n);
+        }
+        bool ok = ret > 0 && codec.Decode(frame, resp);
+        codec.Consume(inbuffer_);
+        co_return ok;
+    }
+
+    void Close()
+    {
+        if (fd_ < 0)
+            return;
+        Connection *conn = r_->GetConnection(fd_);
+        if (conn)
+            r_->HandleException(conn); // 撤销epoll管理并关闭fd
+        else
+            close(fd_);
+        fd_ = defaultfd;
+    }
+
+    int GetSockfd() const
+    {
+        return fd_;
+    }
+
+private:
+    struct WaitAwaiter
+    {
+        std::coroutine_handle<> *slot_;
+
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> h) { *slot_ = h; }
+        void await_resume() {}
+    };
+
+    WaitAwaiter WaitReadable() { return WaitAwaiter{&reader_}; }
+    WaitAwaiter WaitWritable() { return WaitAwaiter{&writer_}; }
+
+    // 事件就绪, 恢复等待的协程; 先取出句柄, 恢复后本对象可能已经被销毁
+    static void Wake(std::coroutine_handle<> *slot)
+    {
+        std::coroutine_handle<> h = *slot;
+        *slot = nullptr;
+        if (h)
+            h.resume();
+    }
+
+    EventLoop *r_;
+    int fd_;
+    std::coroutine_handle<> reader_;
+    std::coroutine_handle<> writer_;
+    std::string inbuffer_;
+};
@@ -0,0 +1,1101 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <signal.h>
+#include <sys/wait.h>
+#include <netinet/tcp.h>
+#include <jsoncpp/json/json.h>
+#include "codec.hpp"
+#include "calc_kernel.hpp"
+#include "response_cache.hpp"
+#include "reactor_server.hpp"
+#include "async_io.hpp"
+#include "pipeline_client.hpp"
+#include "async_client.hpp"
+#include "expr_engine.hpp"
+
+// 微基准测试: ./bench [报文个数]
+
+using namespace protocol_ns_json;
+
+static volatile size_t sink = 0; // 防止编译器把测试代码优化掉
+
+// 生成n个连续的请求报文
+std::string MakeStream(int n)
+{
+    std::string stream;
+    for (int i = 0; i < n; i++)
+    {
+        Request req(i, '+', i + 1);
+        std::string reqstr;
+        req.Serialize(&reqstr);
+        AddHeader(reqstr);
+        stream += reqstr;
+    }
+    return stream;
+}
+
+// 以chunk字节为单位模拟数据到达, chunk == 0表示一次全部到达
+// 返回每秒解析的报文数
+double BenchParse(const std::string &stream, int n, size_t chunk)
+{
+    auto begin = std::chrono::steady_clock::now();
+    std::string buf, package;
+    int frames = 0;
+    size_t step = chunk == 0 ? stream.size() : chunk;
+    for (size_t off = 0; off < stream.size(); off += step)
+    {
+        buf.append(stream, off, step);
+        int len = 0;
+        while ((len = Parse(buf, &package)) > 0)
+        {
+            RemoveHeader(package, len);
+            sink = sink + package.size();
+            frames++;
+        }
+    }
+    std::chrono::duration<double> cost = std::chrono::steady_clock::now() - begin;
+    if (frames != n)
+        std::cerr << "Parse: frame count mismatch" << std::endl;
+    return frames / cost.count();
+}
+
+double BenchFrameParser(const std::string &stream, int n, size_t chunk)
+{
+    auto begin = std::chrono::steady_clock::now();
+    std::string buf;
+    FrameParser parser;
+    std::string_view payload;
+    int frames = 0;
+    size_t step = chunk == 0 ? stream.size() : chunk;
+    for (size_t off = 0; off < stream.size(); off += step)
+    {
+        buf.append(stream, off, step);
+        while (parser.Next(buf, &payload) > 0)
+        {
+            sink = sink + payload.size();
+            frames++;
+        }
+        parser.Consume(buf);
+    }
+    std::chrono::duration<double> cost = std::chrono::steady_clock::now() - begin;
+    if (frames != n)
+        std::cerr << "FrameParser: frame count mismatch" << std::endl;
+    return frames / cost.count();
+}
+
+// 一次完整的往返: 客户端编码请求 -> 服务器切分、解码请求, 编码响应 -> 客户端切分、解码响应
+// 与Reactor<C>::Recv/CompleteRequest走同样的Codec调用
+// 输出每个请求的线上字节数(请求+响应)和CPU耗时
+template <Codec C>
+void BenchCodec(int n)
+{
+    size_t bytes = 0;
+    std::string reqbuf, respbuf;
+    C client, server;
+    std::string_view frame;
+
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++)
+    {
+        Request req(i, '+', i + 1);
+        client.Encode(req, &reqbuf);
+        bytes += reqbuf.size();
+
+        Request sreq;
+        server.Next(reqbuf, &frame);
+        server.Decode(frame, &sreq);
+        server.Consume(reqbuf);
+        Response sresp;
+        sresp._ret = sreq._x + sreq._y;
+        server.Encode(sresp, &respbuf);
+        bytes += respbuf.size();
+
+        Response resp;
+        client.Next(respbuf, &frame);
+        client.Decode(frame, &resp);
+        client.Consume(respbuf);
+        sink = sink + resp._ret;
+    }
+    std::chrono::duration<double, std::nano> cost = std::chrono::steady_clock::now() - begin;
+    printf("%-32s %14.1f %14.1f\n", C::name, (double)bytes / n, cost.count() / n);
+}
+
+// jsoncpp与json_fast的请求解码、编码吞吐量, 单位: 次/秒
+void BenchJson(int n)
+{
+    Request req(123456, '*', -789);
+    std::string doc;
+    req.Serialize(&doc);
+
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++)
+    {
+        Json::Value root;
+        Json::Reader reader;
+        reader.parse(doc.data(), doc.data() + doc.size(), root);
+        sink = sink + root["x"].asInt() + root["opt"].asInt() + root["y"].asInt();
+    }
+    std::chrono::duration<double> cost = std::chrono::steady_clock::now() - begin;
+    printf("%-32s %14.0f\n", "jsoncpp/decode", n / cost.count());
+
+    begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++)
+    {
+        Request r;
+        r.Deserialize(doc);
+        sink = sink + r._x + r._opt + r._y;
+    }
+    cost = std::chrono::steady_clock::now() - begin;
+    printf("%-32s %14.0f\n", "json_fast/decode", n / cost.count());
+
+    begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++)
+    {
+        Json::Value root;
+        root["x"] = req._x + i;
+        root["opt"] = req._opt;
+        root["y"] = req._y;
+        Json::StyledWriter writer;
+        sink = sink + writer.write(root).size();
+    }
+    cost = std::chrono::steady_clock::now() - begin;
+    printf("%-32s %14.0f\n", "jsoncpp/encode", n / cost.count());
+
+    begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++)
+    {
+        char buf[max_json_len];
+        Request r(req._x + i, req._opt, req._y);
+        sink = sink + r.SerializeTo(buf);
+    }
+    cost = std::chrono::steady_clock::now() - begin;
+    printf("%-32s %14.0f\n", "json_fast/encode", n / cost.count());
+}
+
+// 第i个运算的运算符, 伪随机, 避免分支预测器记住固定的规律
+size_t Pick(int i, size_t nopt)
+{
+    return ((uint32_t)i * 2654435761u >> 16) % nopt;
+}
+
+// 计算器吞吐量, 单位: 运算/秒
+// single: 每个运算一个二进制报文, 走完整的编码、切分、解码、计算、回包
+// batch: 每batch个运算一个批量报文, 同样走完整流程
+// opts: 运算符的取值范围, "+"为同一种运算符, "+-*/%"为随机混合
+double BenchCalcFrames(int n, int batch, const char *opts)
+{
+    size_t nopt = strlen(opts);
+    BinaryCodec client, server;
+    std::string reqbuf, respbuf;
+    std::string_view frame;
+    int done = 0;
+
+    auto begin = std::chrono::steady_clock::now();
+    while (done < n)
+    {
+        Request req;
+        if (batch == 1)
+        {
+            req = Request(done, opts[Pick(done, nopt)], done % 7);
+        }
+        else
+        {
+            req._xs.resize(batch);
+            req._ys.resize(batch);
+            req._opts.resize(batch);
+            for (int i = 0; i < batch; i++)
+            {
+                req._xs[i] = done + i;
+                req._ys[i] = (done + i) % 7;
+                req._opts[i] = opts[Pick(done + i, nopt)];
+            }
+        }
+        client.Encode(req, &reqbuf);
+
+        Request sreq;
+        server.Next(reqbuf, &frame);
+        server.Decode(frame, &sreq);
+        server.Consume(reqbuf);
+        Response sresp;
+        if (sreq.IsBatch())
+        {
+            size_t m = sreq._opts.size();
+            sresp._rets.resize(m);
+            sresp._codes.resize(m);
+            calc::EvalBatch(sreq._xs.data(), sreq._opts.data(), sreq._ys.data(), m, sresp._rets.data(), sresp._codes.data());
+        }
+        else
+            calc::Eval(sreq._x, sreq._opt, sreq._y, &sresp._ret, &sresp._code);
+        server.Encode(sresp, &respbuf);
+
+        Response resp;
+        client.Next(respbuf, &frame);
+        client.Decode(frame, &resp);
+        client.Consume(respbuf);
+        sink = sink + (batch == 1 ? resp._ret : resp._rets.back());
+        done += batch;
+    }
+    std::chrono::duration<double> cost = std::chrono::steady_clock::now() - begin;
+    return done / cost.count();
+}
+
+// 只测计算核心: 逐个Eval与EvalBatch
+double BenchCalcKernel(int n, bool batch, const char *opts)
+{
+    size_t nopt = strlen(opts);
+    std::vector<int> x(n), y(n), ret(n), code(n);
+    std::vector<char> opt(n);
+    for (int i = 0; i < n; i++)
+    {
+        x[i] = i * 31;
+        y[i] = i % 7;
+        opt[i] = opts[Pick(i, nopt)];
+    }
+    const int rounds = 20;
+    auto begin = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++)
+    {
+        if (batch)
+            calc::EvalBatch(x.data(), opt.data(), y.data(), n, ret.data(), code.data());
+        else
+            for (int i = 0; i < n; i++)
+                calc::Eval(x[i], opt[i], y[i], &ret[i], &code[i]);
+        sink = sink + ret[r % n];
+    }
+    std::chrono::duration<double> cost = std::chrono::steady_clock::now() - begin;
+    return (double)n * rounds / cost.count();
+}
+
+// 服务器收到一个请求报文后的处理耗时, 单位: 纳秒/请求
+// nocache: 解码 -> 计算 -> 编码; cache: 查缓存, 命中直接追加已编码的响应, 未命中走完整流程后放入缓存
+// keys: 不同请求的个数, 决定命中率
+template <Codec C>
+double BenchCache(int n, int keys, bool usecache)
+{
+    C client, server;
+    std::string stream, out;
+    for (int i = 0; i < n; i++)
+        client.Encode(Request(i % keys, '*', 3), &stream);
+    ResponseCache cache(16 << 20);
+    std::string_view frame;
+
+    auto begin = std::chrono::steady_clock::now();
+    while (server.Next(stream, &frame) > 0)
+    {
+        if (usecache)
+        {
+            const std::string *hit = cache.Get(server.FrameKind(), frame);
+            if (hit)
+            {
+                out += *hit;
+                continue;
+            }
+        }
+        Request req;
+        server.Decode(frame, &req);
+        Response resp;
+        calc::Eval(req._x, req._opt, req._y, &resp._ret, &resp._code);
+        size_t old = out.size();
+        server.Encode(resp, &out);
+        if (usecache)
+            cache.Put(server.FrameKind(), frame, std::string_view(out.data() + old, out.size() - old));
+    }
+    std::chrono::duration<double, std::nano> cost = std::chrono::steady_clock::now() - begin;
+    sink = sink + out.size();
+    return cost.count() / n;
+}
+
+static const char *bench_int_expr = "(a + b) * 3 - a % 7 + (b - 2) * (a + 1)";
+static const char *bench_double_expr = "(x * 1.5 + y) * (x - y / 3.0) - 0.25 * x";
+
+// 单组取值的表达式请求, 单位: 纳秒/请求
+// cached: 通过ProgramCache取编译好的程序(服务器的做法); 否则每个请求都重新编译
+double BenchExprSingle(int n, bool cached)
+{
+    std::vector<std::string> names = {"a", "b"};
+    std::vector<uint8_t> types = {expr::INT64, expr::INT64};
+    expr::ProgramCache cache(16);
+    expr::Program prog;
+    int64_t sum = 0;
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++)
+    {
+        int64_t vars[2] = {i, i + 3}, ret;
+        const expr::Program *p = &prog;
+        if (cached)
+            p = cache.Get(bench_int_expr, names, types);
+        else
+            expr::Compile(bench_int_expr, names, types, &prog);
+        expr::Eval(*p, vars, &ret);
+        sum += ret;
+    }
+    std::chrono::duration<double, std::nano> cost = std::chrono::steady_clock::now() - begin;
+    sink = sink + sum;
+    return cost.count() / n;
+}
+
+// 多组取值, 单位: 组/秒; batch: 按列批量求值, 否则逐组调用Eval
+double BenchExprRows(size_t rows, bool batch, bool isdouble)
+{
+    std::vector<std::string> names = isdouble ? std::vector<std::string>{"x", "y"} : std::vector<std::string>{"a", "b"};
+    std::vector<uint8_t> types(2, isdouble ? expr::DOUBLE : expr::INT64);
+    expr::Program prog;
+    expr::Compile(isdouble ? bench_double_expr : bench_int_expr, names, types, &prog);
+    std::vector<int64_t> vals(2 * rows), ret(rows);
+    std::vector<int> code(rows);
+    for (size_t r = 0; r < rows; r++)
+    {
+        vals[r] = isdouble ? std::bit_cast<int64_t>(r * 0.5) : (int64_t)r;
+        vals[rows + r] = isdouble ? std::bit_cast<int64_t>(r * 0.25 + 1) : (int64_t)r + 3;
+    }
+
+    int rounds = 200;
+    auto begin = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++)
+    {
+        if (batch)
+            expr::EvalBatch(prog, vals.data(), rows, ret.data(), code.data());
+        else
+            for (size_t r = 0; r < rows; r++)
+            {
+                int64_t vars[2] = {vals[r], vals[rows + r]};
+                code[r] = expr::Eval(prog, vars, &ret[r]);
+            }
+        sink = sink + ret[round % rows];
+    }
+    std::chrono::duration<double> cost = std::chrono::steady_clock::now() - begin;
+    return rows * rounds / cost.count();
+}
+
+// 流水线延迟: 一个连接上保持window个未完成的请求, 其中一部分是慢请求
+// ordered: 不带编号, 服务器按请求顺序应答, 慢请求后面的快请求要等它完成
+// tagged: 带编号, 服务器完成一个发回一个
+static const uint16_t bench_port = 18080;
+static const int slow_ms = 2;
+static const int slow_percent = 5;
+static const size_t pipeline_window = 32;
+
+// 运算符为'S'的请求模拟慢请求(例如等待下游服务), 在定时器上等待, 不占用线程
+Task<Response> SlowService(const Request &req)
+{
+    if (req._opt == 'S')
+        co_await Sleep(slow_ms);
+    Response resp;
+    calc::Eval(req._x, '+', req._y, &resp._ret, &resp._code);
+    co_return resp;
+}
+
+// 在子进程中启动服务器, 服务器的日志丢弃
+// 默认的AutoCodec: 同一个端口上二进制、JSON和HTTP连接共用同样的Reactor
+// endpoints: 监听地址, 为空时只监听tcp:port; capture: 流量捕获文件名前缀, 为空不捕获
+pid_t StartBenchServer(uint16_t port = bench_port, const AcceptOptions &opts = AcceptOptions(),
+                       const std::vector<Endpoint> &endpoints = {}, const std::string &capture = "")
+{
+    fflush(stdout); // 子进程会继承还没输出的缓冲区
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (freopen("/dev/null", "w", stdout) == nullptr)
+            exit(1);
+        SetLogLevel(INFO); // 日志反正丢弃, 不计格式化DEBUG日志的开销
+        ReactorServer<AutoCodec> svr(SlowService, port);
+        svr.SetAcceptOptions(opts);
+        for (const Endpoint &ep : endpoints)
+            svr.AddEndpoint(ep);
+        if (!capture.empty())
+            svr.EnableCapture(capture);
+        svr.Init();
+        svr.Start();
+        exit(0);
+    }
+    return pid;
+}
+
+// 连接本机上的服务器: tcp连127.0.0.1, tcp6连::1, unix连ep.path_
+int ConnectBenchServer(const Endpoint &ep)
+{
+    struct sockaddr_storage svr;
+    socklen_t len = ep.ToSockaddr(&svr, ep.family_ == AF_INET ? "127.0.0.1" : ep.family_ == AF_INET6 ? "::1" : "");
+    for (int i = 0; i < 100; i++) // 等服务器开始监听
+    {
+        int fd = socket(ep.family_, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&svr, len) == 0)
+        {
+            int one = 1;
+            if (ep.family_ != AF_UNIX)
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return fd;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+int ConnectBenchServer(uint16_t port = bench_port)
+{
+    return ConnectBenchServer(Endpoint(AF_INET, port));
+}
+
+double Percentile(std::vector<double> &v, double p)
+{
+    if (v.empty())
+        return 0;
+    size_t k = std::min(v.size() - 1, (size_t)(p * v.size()));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+// 输出快请求和全部请求的延迟分位数(微秒)
+void BenchPipeline(int n, bool tagged)
+{
+    int fd = ConnectBenchServer();
+    if (fd < 0)
+    {
+        printf("pipeline: connect failed\n");
+        return;
+    }
+    PipelineClient<BinaryCodec> cli(fd, tagged);
+    std::mt19937 rng(20261019);
+    using clock = std::chrono::steady_clock;
+    std::vector<clock::time_point> sent(n);
+    std::vector<bool> slow(n);
+    std::vector<double> fast_us, all_us;
+
+    auto begin = clock::now();
+    int submitted = 0;
+    while (submitted < n || cli.Pending() > 0)
+    {
+        while (submitted < n && cli.Pending() < pipeline_window)
+        {
+            slow[submitted] = (int)(rng() % 100) < slow_percent;
+            Request req(submitted, slow[submitted] ? 'S' : '+', 1);
+            uint32_t id = cli.Submit(req);
+            sent[id] = clock::now();
+            submitted++;
+            if (!cli.Flush())
+                return;
+        }
+        Response resp;
+        if (!cli.Wait(&resp) || resp._ret != (int)resp._id + 1)
+        {
+            printf("pipeline: bad response\n");
+            close(fd);
+            return;
+        }
+        double us = std::chrono::duration<double, std::micro>(clock::now() - sent[resp._id]).count();
+        all_us.push_back(us);
+        if (!slow[resp._id])
+            fast_us.push_back(us);
+    }
+    double secs = std::chrono::duration<double>(clock::now() - begin).count();
+    close(fd);
+
+    const char *mode = tagged ? "tagged" : "ordered";
+    printf("%-10s %-6s %10.0f %10.0f %10.0f %10.0f\n", mode, "fast", Percentile(fast_us, 0.5), Percentile(fast_us, 0.99),
+           Percentile(fast_us, 0.999), n / secs);
+    printf("%-10s %-6s %10.0f %10.0f %10.0f\n", mode, "all", Percentile(all_us, 0.5), Percentile(all_us, 0.99),
+           Percentile(all_us, 0.999));
+}
+
+// 流水线吞吐量: 一个连接上保持window个未完成的请求, 没有慢请求, 按请求顺序应答, 单位: 请求/秒
+// 与Codec的CPU开销一起比较HTTP与原生协议的差距: 线上字节更多, 首部解析更重
+template <Codec C>
+double BenchThroughput(int n, uint16_t port = bench_port)
+{
+    int fd = ConnectBenchServer(port);
+    if (fd < 0)
+        return 0;
+    PipelineClient<C> cli(fd, false);
+    auto begin = std::chrono::steady_clock::now();
+    int submitted = 0;
+    while (submitted < n || cli.Pending() > 0)
+    {
+        while (submitted < n && cli.Pending() < pipeline_window)
+            cli.Submit(Request(submitted++, '+', 1));
+        Response resp;
+        if (!cli.Wait(&resp) || resp._ret != (int)resp._id + 1)
+        {
+            close(fd);
+            return 0;
+        }
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    close(fd);
+    return n / secs;
+}
+
+// 非阻塞客户端库: 一个线程一次发出一批请求(每个一个future), 由连接池的conns个连接流水线发送, 等齐后再发下一批
+double BenchAsyncClient(int n, int conns, int batch)
+{
+    SetLogLevel(INFO); // EventLoop每次读写都有DEBUG日志
+    ClientOptions opts;
+    opts.conns_ = conns;
+    AsyncClient<BinaryCodec> cli(opts);
+    cli.Start();
+    Endpoint ep(AF_INET, bench_port);
+    bool ok = cli.Call(ep, "127.0.0.1", Request(0, '+', 1)).get().status_ == CALL_OK; // 建立连接
+    std::vector<std::future<CallResult>> results;
+    auto begin = std::chrono::steady_clock::now();
+    for (int base = 0; ok && base < n; base += batch)
+    {
+        results.clear();
+        for (int i = base; i < std::min(n, base + batch); i++)
+            results.push_back(cli.Call(ep, "127.0.0.1", Request(i, '+', 1)));
+        for (int i = 0; i < (int)results.size(); i++)
+        {
+            CallResult r = results[i].get();
+            ok = ok && r.status_ == CALL_OK && r.resp_._ret == base + i + 1;
+        }
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    cli.Stop();
+    SetLogLevel(TRACE);
+    return ok ? n / secs : 0;
+}
+
+// 同一主机上不同传输方式的请求延迟: 一个连接上一问一答(窗口为1), 输出延迟分位数(微秒)和每秒请求数
+// 服务器在同一组Reactor上同时监听tcp6(双栈, 127.0.0.1也连到它)、unix抽象地址和共享内存
+// 共享内存的两端都在忙轮询, 一问一答不做系统调用
+void BenchTransport(const char *name, const Endpoint &ep, int n)
+{
+    int fd = ConnectBenchServer(ep);
+    if (fd < 0)
+    {
+        printf("%-24s connect failed\n", name);
+        return;
+    }
+    ShmChannel chan;
+    if (ep.shm_ && !chan.Connect(fd))
+    {
+        printf("%-24s shm handshake failed\n", name);
+        close(fd);
+        return;
+    }
+    PipelineClient<BinaryCodec> cli = ep.shm_ ? PipelineClient<BinaryCodec>(&chan, false) : PipelineClient<BinaryCodec>(fd, false);
+    using clock = std::chrono::steady_clock;
+    std::vector<double> us;
+    us.reserve(n);
+    for (int i = 0; i < n / 10; i++) // 预热
+    {
+        Response resp;
+        cli.Submit(Request(i, '+', 1));
+        if (!cli.Flush() || !cli.Wait(&resp))
+            break;
+    }
+    auto begin = clock::now();
+    for (int i = 0; i < n; i++)
+    {
+        Response resp;
+        auto start = clock::now();
+        cli.Submit(Request(i, '+', 1));
+        if (!cli.Flush() || !cli.Wait(&resp) || resp._ret != i + 1)
+        {
+            printf("%-24s bad response\n", name);
+            close(fd);
+            return;
+        }
+        us.push_back(std::chrono::duration<double, std::micro>(clock::now() - start).count());
+    }
+    double secs = std::chrono::duration<double>(clock::now() - begin).count();
+    close(fd);
+    printf("%-24s %10.1f %10.1f %10.1f %12.0f\n", name, Percentile(us, 0.5), Percentile(us, 0.99), Percentile(us, 0.999), n / secs);
+}
+
+// UDP: 一个数据报一个二进制请求, 用sendmmsg一次发出window个带编号的请求, recvmmsg收齐响应再发下一批
+// window为1时输出一问一答的延迟分位数(微秒); 等响应超过udp_bench_timeout_ms算丢失, 丢失的不计入请求数
+static const int udp_bench_timeout_ms = 100;
+
+void BenchUdp(const char *name, uint16_t port, int n, int window)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    Endpoint ep(AF_INET, port);
+    struct sockaddr_storage svr;
+    socklen_t len = ep.ToSockaddr(&svr, "127.0.0.1");
+    struct timeval tv = {0, udp_bench_timeout_ms * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *)&svr, len) < 0)
+    {
+        printf("%-24s connect failed\n", name);
+        close(fd);
+        return;
+    }
+    window = std::min(window, udp_batch);
+    BinaryCodec codec;
+    std::vector<std::string> reqs(window);
+    std::vector<char> bufs(window * 256);
+    struct mmsghdr msgs[udp_batch];
+    struct iovec iovs[udp_batch];
+    using clock = std::chrono::steady_clock;
+    std::vector<double> us;
+    std::vector<clock::time_point> sent(window);
+    uint64_t ok = 0, lost = 0, bad = 0;
+    int warmup = std::max(n / 10, window); // 预热, 也等服务器开始监听
+    auto begin = clock::now();
+    for (int base = -warmup; base < n; base += window)
+    {
+        if (base == 0)
+        {
+            begin = clock::now();
+            ok = lost = bad = 0;
+            us.clear();
+        }
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < window; i++)
+        {
+            Request req(base + i, '+', 1);
+            req._id = i;
+            req._hasid = true;
+            reqs[i].clear();
+            codec.Encode(req, &reqs[i]);
+            iovs[i] = {reqs[i].data(), reqs[i].size()};
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            sent[i] = clock::now();
+        }
+        if (sendmmsg(fd, msgs, window, 0) != window)
+        {
+            printf("%-24s sendmmsg failed: %s\n", name, strerror(errno));
+            close(fd);
+            return;
+        }
+        int got = 0;
+        while (got < window)
+        {
+            for (int i = 0; i < window; i++)
+            {
+                iovs[i] = {&bufs[i * 256], 256};
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            int m = recvmmsg(fd, msgs, window - got, MSG_WAITFORONE, nullptr);
+            if (m <= 0)
+                break; // 超时, 剩下的算丢失
+            auto now = clock::now();
+            for (int i = 0; i < m; i++)
+            {
+                std::string in(&bufs[i * 256], msgs[i].msg_len);
+                std::string_view frame;
+                Response resp;
+                bool valid = codec.Next(in, &frame) > 0 && codec.Decode(frame, &resp);
+                codec.Consume(in); // Codec记着已解析到的位置, 每个数据报用完都要Consume
+                if (!valid || resp._id >= (uint32_t)window || resp._ret != base + (int)resp._id + 1)
+                {
+                    bad++;
+                    continue;
+                }
+                if (window == 1)
+                    us.push_back(std::chrono::duration<double, std::micro>(now - sent[resp._id]).count());
+                ok++;
+            }
+            got += m;
+        }
+        lost += window - got;
+    }
+    double secs = std::chrono::duration<double>(clock::now() - begin).count();
+    close(fd);
+    if (window == 1)
+        printf("%-24s %10.1f %10.1f %10.1f %12.0f %8llu\n", name, Percentile(us, 0.5), Percentile(us, 0.99), Percentile(us, 0.999),
+               ok / secs, (unsigned long long)(lost + bad));
+    else
+        printf("%-24s %10s %10s %10s %12.0f %8llu\n", name, "-", "-", "-", ok / secs, (unsigned long long)(lost + bad));
+}
+
+// 短连接: threads个线程各自循环 建立连接 -> 发一个二进制请求 -> 收到响应 -> 关闭, 共n次
+// 输出每秒完成的连接数和单次的耗时分位数(微秒); 客户端用RST关闭, 不留TIME_WAIT占用端口
+void BenchConnectRate(const char *name, int n, int threads, const AcceptOptions &opts, uint16_t port)
+{
+    pid_t server = StartBenchServer(port, opts);
+    int probe = ConnectBenchServer(port);
+    if (probe < 0)
+    {
+        printf("%-24s connect failed\n", name);
+        kill(server, SIGKILL);
+        waitpid(server, nullptr, 0);
+        return;
+    }
+    close(probe);
+
+    std::string frame;
+    BinaryCodec().Encode(Request(1, '+', 1), &frame);
+    std::vector<std::vector<double>> costs(threads);
+    std::atomic<int> failures(0);
+    std::vector<std::thread> workers;
+    auto begin = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&, t]()
+                             {
+            struct sockaddr_in svr;
+            memset(&svr, 0, sizeof(svr));
+            svr.sin_family = AF_INET;
+            svr.sin_port = htons(port);
+            svr.sin_addr.s_addr = inet_addr("127.0.0.1");
+            struct linger lg = {1, 0};
+            for (int i = t; i < n; i += threads)
+            {
+                auto start = std::chrono::steady_clock::now();
+                int fd = socket(AF_INET, SOCK_STREAM, 0);
+                bool ok = connect(fd, (struct sockaddr *)&svr, sizeof(svr)) == 0 &&
+                          write(fd, frame.data(), frame.size()) == (ssize_t)frame.size();
+                BinaryCodec codec;
+                std::string in;
+                std::string_view resp;
+                while (ok && codec.Next(in, &resp) == 0)
+                {
+                    char buf[256];
+                    ssize_t r = read(fd, buf, sizeof(buf));
+                    ok = r > 0;
+                    if (ok)
+                        in.append(buf, r);
+                }
+                setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+                close(fd);
+                if (!ok)
+                    failures++;
+                costs[t].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+            } });
+    }
+    for (auto &w : workers)
+        w.join();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    kill(server, SIGKILL);
+    waitpid(server, nullptr, 0);
+
+    std::vector<double> all;
+    for (auto &c : costs)
+        all.insert(all.end(), c.begin(), c.end());
+    printf("%-24s %8d %12.0f %10.1f %10.1f %8d\n", name, threads, n / secs, Percentile(all, 0.5), Percentile(all, 0.99),
+           failures.load());
+}
+
+// 只测服务器接收连接这一段: 先让batch个连接在全连接队列里排好, 再计时取出并设置好每个连接
+// legacy: accept + 两次fcntl设非阻塞 + setsockopt(TCP_NODELAY), 原来的做法
+// accept4: accept4直接得到非阻塞fd, TCP_NODELAY从监听套接字继承, 低延迟配置只再设一次QUICKACK
+// 返回每个连接的平均耗时(纳秒)
+double BenchAcceptPath(int n, bool legacy)
+{
+    const int batch = 1000;
+    SetLogLevel(INFO); // 不计Sock里DEBUG日志的开销
+    Sock listensock;
+    listensock.Socket();
+    if (!legacy)
+        util::SetListenProfile(listensock.GetSockfd(), util::PROFILE_LOW_LATENCY);
+    listensock.Bind(bench_port + 9);
+    listensock.Listen(batch);
+    util::SetNonBlock(listensock.GetSockfd());
+    struct sockaddr_in svr;
+    memset(&svr, 0, sizeof(svr));
+    svr.sin_family = AF_INET;
+    svr.sin_port = htons(bench_port + 9);
+    svr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    struct linger lg = {1, 0};
+
+    double ns = 0;
+    int done = 0;
+    std::vector<int> clients, accepted;
+    while (done < n)
+    {
+        for (int i = 0; i < batch; i++)
+        {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (connect(fd, (struct sockaddr *)&svr, sizeof(svr)) == 0)
+                clients.push_back(fd);
+            else
+                close(fd);
+        }
+        auto begin = std::chrono::steady_clock::now();
+        while (true)
+        {
+            int fd;
+            if (legacy)
+            {
+                fd = accept(listensock.GetSockfd(), nullptr, nullptr);
+                if (fd >= 0)
+                {
+                    util::SetNonBlock(fd);
+                    util::SetNoDelay(fd);
+                }
+            }
+            else
+            {
+                fd = listensock.Accept();
+                if (fd >= 0)
+                    util::SetConnProfile(fd, util::PROFILE_LOW_LATENCY);
+            }
+            if (fd < 0)
+                break;
+            accepted.push_back(fd);
+        }
+        ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+        done += accepted.size();
+        if (accepted.empty())
+            return 0;
+        for (int fd : clients)
+        {
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+            close(fd);
+        }
+        for (int fd : accepted)
+            close(fd);
+        clients.clear();
+        accepted.clear();
+    }
+    SetLogLevel(TRACE);
+    return ns / done;
+}
+
+enum benchlog_t
+{
+    BENCH_LOG_SYNC,
+    BENCH_LOG_ASYNC,
+    BENCH_LOG_BINARY
+};
+
+// 一次LogMessage调用在调用线程上的耗时分布(纳秒), threads个线程同时各写n条
+// sync: 没有启动异步日志时的同步输出(标准输出临时重定向到/dev/null)
+// async: 异步日志写到/dev/null, 缓冲区满时按policy丢弃或等待
+// binary: 二进制日志写到/tmp下的mmap段, 测完删除
+// cpu/msg: 整个进程(包括异步日志的后台线程)的CPU时间除以条数, 含计时本身的开销
+void BenchLog(int n, int threads, benchlog_t mode, logfull_t policy)
+{
+    int saved = -1;
+    bool async = mode == BENCH_LOG_ASYNC;
+    size_t oldfiles = BinaryLogger::Instance().Files().size();
+    if (async)
+        AsyncLogger::Instance().Start("/dev/null", policy);
+    else if (mode == BENCH_LOG_BINARY)
+        BinaryLogger::Instance().Start("/tmp/bench_binlog");
+    else
+    {
+        fflush(stdout);
+        saved = dup(STDOUT_FILENO);
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        close(devnull);
+    }
+    uint64_t dropped = async ? AsyncLogger::Instance().Dropped() : 0;
+
+    std::vector<std::vector<double>> costs(threads);
+    std::vector<std::thread> workers;
+    struct timespec cpu0, cpu1;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu0);
+    auto begin = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&costs, t, n]()
+                             {
+                                 costs[t].reserve(n);
+                                 for (int i = 0; i < n; i++)
+                                 {
+                                     auto start = std::chrono::steady_clock::now();
+                                     LogMessage(DEBUG, "fd: %d, 本轮数据发送成功, 发送字节数: %d\n", t + 5, i);
+                                     costs[t].push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+                                 } });
+    }
+    for (auto &w : workers)
+        w.join();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    if (async)
+    {
+        dropped = AsyncLogger::Instance().Dropped() - dropped;
+        AsyncLogger::Instance().Stop();
+    }
+    else if (mode == BENCH_LOG_BINARY)
+    {
+        BinaryLogger::Instance().Stop();
+        std::vector<std::string> files = BinaryLogger::Instance().Files();
+        for (size_t i = oldfiles; i < files.size(); i++)
+            unlink(files[i].c_str());
+    }
+    else
+    {
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu1);
+    double cpu = ((cpu1.tv_sec - cpu0.tv_sec) * 1e9 + (cpu1.tv_nsec - cpu0.tv_nsec)) / ((double)threads * n);
+    std::vector<double> all;
+    for (auto &c : costs)
+        all.insert(all.end(), c.begin(), c.end());
+    const char *name = mode == BENCH_LOG_SYNC ? "sync printf" : mode == BENCH_LOG_BINARY ? "binary/mmap" : policy == LOG_DROP ? "async/drop" : "async/block";
+    printf("%-14s %8d %10.0f %10.0f %10.0f %10.0f %12.0f %10llu %10.0f\n", name, threads, Percentile(all, 0.5),
+           Percentile(all, 0.99), Percentile(all, 0.999), *std::max_element(all.begin(), all.end()), threads * n / secs,
+           (unsigned long long)dropped, cpu);
+}
+
+// 被运行期等级过滤掉的日志: 参数里有一次字符串拼接(类似ServiceTask里的request.c_str()), 过滤后不求值
+// enabled: 同样的调用实际写入异步日志(/dev/null), 作为对照
+double BenchLogFiltered(int n, bool enabled)
+{
+    std::string request = "{\"x\":10,\"y\":20,\"opt\":\"+\"}";
+    if (enabled)
+        AsyncLogger::Instance().Start("/dev/null", LOG_DROP);
+    SetLogLevel(enabled ? TRACE : INFO);
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++)
+        LogMessage(DEBUG, "fd: %d, request: %s\n", i, (request + std::to_string(i)).c_str());
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count() / n;
+    SetLogLevel(TRACE);
+    if (enabled)
+        AsyncLogger::Instance().Stop();
+    return ns;
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 20000;
+    std::string stream = MakeStream(n);
+
+    printf("%-32s %14s\n", "benchmark", "frames/s");
+    printf("%-32s %14.0f\n", "Parse/bulk", BenchParse(stream, n, 0));
+    printf("%-32s %14.0f\n", "Parse/1byte", BenchParse(stream, n, 1));
+    printf("%-32s %14.0f\n", "FrameParser/bulk", BenchFrameParser(stream, n, 0));
+    printf("%-32s %14.0f\n", "FrameParser/1byte", BenchFrameParser(stream, n, 1));
+
+    printf("\n%-32s %14s %14s\n", "codec", "bytes/req", "ns/req");
+    BenchCodec<JsonCodec>(n);
+    BenchCodec<BinaryCodec>(n);
+    BenchCodec<LineCodec>(n);
+    BenchCodec<AutoCodec>(n);
+    BenchCodec<HttpCodec>(n);
+
+    printf("\n%-32s %14s\n", "json", "ops/s");
+    BenchJson(n * 10);
+
+    printf("\n%-32s %14s\n", "calc", "ops/s");
+    printf("%-32s %14.0f\n", "frames/single/+", BenchCalcFrames(n * 10, 1, "+"));
+    printf("%-32s %14.0f\n", "frames/single/mixed", BenchCalcFrames(n * 10, 1, "+-*/%"));
+    printf("%-32s %14.0f\n", "frames/batch1024/+", BenchCalcFrames(n * 100, 1024, "+"));
+    printf("%-32s %14.0f\n", "frames/batch1024/mixed", BenchCalcFrames(n * 100, 1024, "+-*/%"));
+    printf("%-32s %14.0f\n", "kernel/scalar/+", BenchCalcKernel(4096, false, "+"));
+    printf("%-32s %14.0f\n", "kernel/simd/+", BenchCalcKernel(4096, true, "+"));
+    printf("%-32s %14.0f\n", "kernel/scalar/mixed", BenchCalcKernel(4096, false, "+-*/%"));
+    printf("%-32s %14.0f\n", "kernel/simd/mixed", BenchCalcKernel(4096, true, "+-*/%"));
+
+    printf("\n%-32s %14s\n", "response cache", "ns/req");
+    printf("%-32s %14.1f\n", "json/nocache", BenchCache<JsonCodec>(n * 10, 100, false));
+    printf("%-32s %14.1f\n", "json/cache/hot(100 keys)", BenchCache<JsonCodec>(n * 10, 100, true));
+    printf("%-32s %14.1f\n", "json/cache/cold(all distinct)", BenchCache<JsonCodec>(n * 10, n * 10, true));
+    printf("%-32s %14.1f\n", "binary/nocache", BenchCache<BinaryCodec>(n * 10, 100, false));
+    printf("%-32s %14.1f\n", "binary/cache/hot(100 keys)", BenchCache<BinaryCodec>(n * 10, 100, true));
+
+    printf("\n%-32s %14s\n", "expr", "ns/req");
+    printf("%-32s %14.1f\n", "single/compile every time", BenchExprSingle(n * 10, false));
+    printf("%-32s %14.1f\n", "single/program cache", BenchExprSingle(n * 10, true));
+    printf("%-32s %14s\n", "expr rows(4096 bindings)", "rows/s");
+    printf("%-32s %14.0f\n", "int64/Eval per row", BenchExprRows(4096, false, false));
+    printf("%-32s %14.0f\n", "int64/EvalBatch", BenchExprRows(4096, true, false));
+    printf("%-32s %14.0f\n", "double/Eval per row", BenchExprRows(4096, false, true));
+    printf("%-32s %14.0f\n", "double/EvalBatch", BenchExprRows(4096, true, true));
+
+    printf("\npipeline: %d%% slow(%dms), window %zu, latency us\n", slow_percent, slow_ms, pipeline_window);
+    printf("%-10s %-6s %10s %10s %10s %10s\n", "mode", "reqs", "p50", "p99", "p99.9", "req/s");
+    pid_t server = StartBenchServer();
+    BenchPipeline(n / 4, false);
+    BenchPipeline(n / 4, true);
+
+    printf("\n%-32s %14s %14s\n", "pipelined throughput(window 32)", "req/s", "vs binary");
+    double binary = BenchThroughput<BinaryCodec>(n * 5);
+    printf("%-32s %14.0f %14.2f\n", BinaryCodec::name, binary, 1.0);
+    double json = BenchThroughput<JsonCodec>(n * 5);
+    printf("%-32s %14.0f %14.2f\n", JsonCodec::name, json, json / binary);
+    double http = BenchThroughput<HttpCodec>(n * 5);
+    printf("%-32s %14.0f %14.2f\n", HttpCodec::name, http, http / binary);
+    double async1 = BenchAsyncClient(n * 5, 1, 32);
+    printf("%-32s %14.0f %14.2f\n", "async client(1 conn, batch 32)", async1, async1 / binary);
+    double async4 = BenchAsyncClient(n * 5, 4, 1024);
+    printf("%-32s %14.0f %14.2f\n", "async client(4 conns, batch 1k)", async4, async4 / binary);
+    kill(server, SIGKILL);
+    waitpid(server, nullptr, 0);
+
+    printf("\ntransport(1 request in flight), latency us\n");
+    printf("%-24s %10s %10s %10s %12s\n", "transport", "p50", "p99", "p99.9", "req/s");
+    std::string uds = "@reactor_bench." + std::to_string(getpid());
+    Endpoint tcp6(AF_INET6, bench_port + 4);
+    std::string shm = "@reactor_bench_shm." + std::to_string(getpid());
+    server = StartBenchServer(bench_port + 4, AcceptOptions(), {tcp6, Endpoint(uds), Endpoint(shm, true)});
+    BenchTransport("tcp 127.0.0.1", Endpoint(AF_INET, bench_port + 4), n);
+    BenchTransport("tcp6 ::1", tcp6, n);
+    BenchTransport("unix(abstract)", Endpoint(uds), n);
+    BenchTransport("shm ring", Endpoint(shm, true), n * 5);
+    kill(server, SIGKILL);
+    waitpid(server, nullptr, 0);
+
+    // 流量捕获的开销: 同样的流水线请求, 捕获写文件与不捕获的吞吐量和单个请求的延迟
+    printf("\ncapture overhead(window 1: latency us; window 32: pipelined)\n");
+    printf("%-24s %10s %10s %10s %12s\n", "server", "p50", "p99", "p99.9", "req/s");
+    std::string capbase = "/tmp/reactor_bench_capture." + std::to_string(getpid());
+    for (int capture = 0; capture < 2; capture++)
+    {
+        server = StartBenchServer(bench_port + 7, AcceptOptions(), {}, capture ? capbase : "");
+        BenchTransport(capture ? "capture/window 1" : "no capture/window 1", Endpoint(AF_INET, bench_port + 7), n);
+        printf("%-24s %10s %10s %10s %12.0f\n", capture ? "capture/window 32" : "no capture/window 32", "-", "-", "-",
+               BenchThroughput<BinaryCodec>(n * 5, bench_port + 7));
+        kill(server, SIGKILL);
+        waitpid(server, nullptr, 0);
+    }
+    for (int i = 1; i <= reactor_num; i++)
+        unlink((capbase + "." + std::to_string(i) + ".cap").c_str());
+
+    printf("\nudp vs tcp(window 1: latency us; window 32: pipelined, one datagram per request)\n");
+    printf("%-24s %10s %10s %10s %12s %8s\n", "transport", "p50", "p99", "p99.9", "req/s", "lost");
+    AcceptOptions gso;
+    gso.udp_offload_ = true;
+    Endpoint udp(AF_INET, bench_port + 5), udpgso(AF_INET, bench_port + 6);
+    udp.udp_ = udpgso.udp_ = true;
+    server = StartBenchServer(bench_port + 5, AcceptOptions(), {Endpoint(AF_INET, bench_port + 5), udp});
+    BenchUdp("udp/window 1", bench_port + 5, n, 1); // 先发数据报也等服务器开始监听
+    BenchTransport("tcp/window 1", Endpoint(AF_INET, bench_port + 5), n);
+    BenchUdp("udp/window 32", bench_port + 5, n * 5, pipeline_window);
+    printf("%-24s %10s %10s %10s %12.0f %8s\n", "tcp/window 32", "-", "-", "-", BenchThroughput<BinaryCodec>(n * 5, bench_port + 5), "-");
+    kill(server, SIGKILL);
+    waitpid(server, nullptr, 0);
+    server = StartBenchServer(bench_port + 6, gso, {udpgso});
+    BenchUdp("udp+gro/gso/window 1", bench_port + 6, n, 1);
+    BenchUdp("udp+gro/gso/window 32", bench_port + 6, n * 5, pipeline_window);
+    kill(server, SIGKILL);
+    waitpid(server, nullptr, 0);
+
+    printf("\n%-32s %14s\n", "accept path(per connection)", "ns");
+    printf("%-32s %14.0f\n", "accept+fcntl*2+nodelay", BenchAcceptPath(n, true));
+    printf("%-32s %14.0f\n", "accept4+quickack", BenchAcceptPath(n, false));
+
+    printf("\nconnection rate(connect + 1 request + close)\n");
+    printf("%-24s %8s %12s %10s %10s %8s\n", "accept options", "threads", "conns/s", "p50 us", "p99 us", "failed");
+    AcceptOptions lowlatency, bulk, defer;
+    bulk.profile_ = util::PROFILE_BULK;
+    defer.defer_accept_ = 5;
+    for (int threads : {1, 8})
+    {
+        BenchConnectRate("lowlatency", n, threads, lowlatency, bench_port + 1);
+        BenchConnectRate("bulk", n, threads, bulk, bench_port + 2);
+        BenchConnectRate("lowlatency+defer", n, threads, defer, bench_port + 3);
+    }
+
+    printf("\nLogMessage latency, ns\n");
+    printf("%-14s %8s %10s %10s %10s %10s %12s %10s %10s\n", "mode", "threads", "p50", "p99", "p99.9", "max", "msgs/s", "dropped",
+           "cpu/msg");
+    for (int threads : {1, 4})
+    {
+        BenchLog(n * 5, threads, BENCH_LOG_SYNC, LOG_DROP);
+        BenchLog(n * 5, threads, BENCH_LOG_ASYNC, LOG_DROP);
+        BenchLog(n * 5, threads, BENCH_LOG_ASYNC, LOG_BLOCK);
+        BenchLog(n * 5, threads, BENCH_LOG_BINARY, LOG_DROP);
+    }
+
+    printf("\n%-32s %14s\n", "LogMessage(DEBUG) level filter", "ns/call");
+    printf("%-32s %14.1f\n", "filtered(runtime level INFO)", BenchLogFiltered(n * 50, false));
+    printf("%-32s %14.1f\n", "enabled(async)", BenchLogFiltered(n * 50, true));
+    return 0;
+}
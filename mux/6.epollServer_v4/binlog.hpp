@@ -0,0 +1,700 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "Mutex.hpp"
+
+// 二进制日志
+// 一条日志只写 格式串ID + 原始参数, 写日志的线程不做格式化; 离线用logdecode还原成文本
+// 每个线程写自己的mmap段文件 <base>.<pid>.<线程序号>.<段序号>.bin, 写满换下一个段; 除换段外不加锁、不做系统调用
+// 数据直接写进页缓存, 进程崩溃也不丢; 段里第一次用到某个格式串时先写一条格式定义, 每个段都能单独解码
+// 字符串参数整个拷贝(上限log_max_string), 不会像文本日志那样截断到log_body_size
+
+static const size_t log_segment_size = 4 << 20; // 每个段文件的大小
+static const size_t log_max_string = 64 << 10;  // 单个字符串参数的最大长度, 超过截断
+static const uint32_t log_max_formats = 4096;   // 格式串个数上限, 超过的按文本记录
+static const uint8_t log_format_def = 0xFF;     // 记录头的lv_为这个值时, 记录是一条格式定义
+static const char log_segment_magic[8] = {'B', 'I', 'N', 'L', 'O', 'G', '0', '1'};
+
+struct LogSegmentHeader
+{
+    char magic_[8];
+    uint32_t pid_;
+    uint32_t thread_; // 线程序号, 进程内从0开始
+    uint32_t segno_;  // 这个线程的第几个段
+    uint32_t reserved_;
+    int64_t ns_; // 段的创建时间, CLOCK_REALTIME
+};
+
+// 记录从8字节对齐的位置开始, size_为0表示段里后面没有记录了
+// size_最后写入: 非0时整条记录已经写完, 进程写到一半崩溃也只丢这一条
+struct LogRecordHeader
+{
+    uint32_t size_; // 整条记录的字节数, 包括记录头, 不含对齐填充
+    uint16_t id_;   // 格式串ID
+    uint8_t lv_;    // 日志等级, 或log_format_def
+    uint8_t reserved_;
+    int64_t ns_; // CLOCK_REALTIME
+};
+static_assert(sizeof(LogSegmentHeader) == 32 && sizeof(LogRecordHeader) == 16);
+
+size_t LogAlign(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+// 参数在记录中的类型
+enum logarg_t : char
+{
+    LOG_ARG_NONE = 0,      // "%%", 不占参数
+    LOG_ARG_INT = 'i',     // int及更短的整数、%c, 4字节
+    LOG_ARG_LONG = 'l',    // l/ll/z/j/t修饰的整数, 8字节
+    LOG_ARG_DOUBLE = 'd',  // 8字节
+    LOG_ARG_LDOUBLE = 'D', // L修饰的浮点数, sizeof(long double)字节
+    LOG_ARG_STRING = 's',  // 4字节长度 + 内容, 不含'\0'
+    LOG_ARG_PTR = 'p'      // 8字节
+};
+
+// 格式串中的一个转换说明, 例如"%-*.3f"
+struct LogSpec
+{
+    uint16_t begin_; // 在格式串中的位置[begin_, end_), 以'%'开头
+    uint16_t end_;
+    uint8_t stars_; // 宽度、精度中'*'的个数, 每个占一个int参数, 写在值之前
+    logarg_t type_;
+};
+
+// 解析printf格式串; 不支持的转换(%n、%ls、%lc等)返回false, 用这种格式串的日志按文本记录
+bool ParseLogFormat(const char *format, std::vector<LogSpec> *specs)
+{
+    specs->clear();
+    size_t len = strlen(format);
+    if (len > UINT16_MAX)
+        return false;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (format[i] != '%')
+            continue;
+        LogSpec spec{(uint16_t)i, 0, 0, LOG_ARG_NONE};
+        size_t j = i + 1;
+        while (j < len && strchr("-+ #0'", format[j]))
+            j++;
+        if (j < len && format[j] == '*')
+            spec.stars_++, j++;
+        while (j < len && format[j] >= '0' && format[j] <= '9')
+            j++;
+        if (j < len && format[j] == '.')
+        {
+            j++;
+            if (j < len && format[j] == '*')
+                spec.stars_++, j++;
+            while (j < len && format[j] >= '0' && format[j] <= '9')
+                j++;
+        }
+        bool wide = false, ldouble = false;
+        if (j < len && format[j] == 'h')
+            j += (j + 1 < len && format[j + 1] == 'h') ? 2 : 1;
+        else if (j < len && format[j] == 'l')
+            wide = true, j += (j + 1 < len && format[j + 1] == 'l') ? 2 : 1;
+        else if (j < len && strchr("zjt", format[j]))
+            wide = true, j++;
+        else if (j < len && format[j] == 'L')
+            ldouble = true, j++;
+        if (j >= len)
+            return false;
+
+        switch (format[j])
+        {
+        case '%':
+            if (j != i + 1)
+                return false;
+            break;
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            spec.type_ = wide ? LOG_ARG_LONG : LOG_ARG_INT;
+            break;
+        case 'c':
+            spec.type_ = LOG_ARG_INT;
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            spec.type_ = ldouble ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+            break;
+        case 's':
+            spec.type_ = LOG_ARG_STRING;
+            break;
+        case 'p':
+            spec.type_ = LOG_ARG_PTR;
+            break;
+        default:
+            return false;
+        }
+        // L只能修饰浮点数, l不能修饰%c、%s
+        if ((ldouble && spec.type_ != LOG_ARG_LDOUBLE && spec.type_ != LOG_ARG_DOUBLE) ||
+            (wide && (format[j] == 'c' || format[j] == 's')))
+            return false;
+        spec.end_ = j + 1;
+        specs->push_back(spec);
+        i = j;
+    }
+    return true;
+}
+
+template <class T>
+bool LogPut(char **p, char *end, T v)
+{
+    if ((size_t)(end - *p) < sizeof(T))
+        return false;
+    memcpy(*p, &v, sizeof(T));
+    *p += sizeof(T);
+    return true;
+}
+
+template <class T>
+bool LogTake(const char **p, const char *end, T *v)
+{
+    if ((size_t)(end - *p) < sizeof(T))
+        return false;
+    memcpy(v, *p, sizeof(T));
+    *p += sizeof(T);
+    return true;
+}
+
+// 按specs把参数写到[*p, end), 空间不够返回false
+bool EncodeLogArgs(const std::vector<LogSpec> &specs, va_list ap, char **p, char *end)
+{
+    for (const LogSpec &spec : specs)
+    {
+        for (int i = 0; i < spec.stars_; i++)
+        {
+            if (!LogPut(p, end, (int32_t)va_arg(ap, int)))
+                return false;
+        }
+        bool ok = true;
+        switch (spec.type_)
+        {
+        case LOG_ARG_NONE:
+            break;
+        case LOG_ARG_INT:
+            ok = LogPut(p, end, (int32_t)va_arg(ap, int));
+            break;
+        case LOG_ARG_LONG:
+            ok = LogPut(p, end, (int64_t)va_arg(ap, long long));
+            break;
+        case LOG_ARG_DOUBLE:
+            ok = LogPut(p, end, va_arg(ap, double));
+            break;
+        case LOG_ARG_LDOUBLE:
+            ok = LogPut(p, end, va_arg(ap, long double));
+            break;
+        case LOG_ARG_PTR:
+            ok = LogPut(p, end, (uint64_t)(uintptr_t)va_arg(ap, void *));
+            break;
+        case LOG_ARG_STRING:
+        {
+            const char *s = va_arg(ap, const char *);
+            if (s == nullptr)
+                s = "(null)";
+            uint32_t n = strnlen(s, log_max_string);
+            ok = LogPut(p, end, n) && (size_t)(end - *p) >= n;
+            if (ok)
+            {
+                memcpy(*p, s, n);
+                *p += n;
+            }
+            break;
+        }
+        }
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+// 用单个参数格式化一个转换说明, 追加到out
+template <class T>
+void AppendLogValue(std::string *out, const char *conv, T v)
+{
+    char buf[128];
+    int n = snprintf(buf, sizeof(buf), conv, v);
+    if (n < 0)
+        return;
+    if (n < (int)sizeof(buf))
+    {
+        out->append(buf, n);
+        return;
+    }
+    size_t old = out->size();
+    out->resize(old + n + 1);
+    snprintf(&(*out)[old], n + 1, conv, v);
+    out->resize(old + n);
+}
+
+// 按格式串把[p, end)中的参数还原成文本, 追加到out; 参数和格式串对不上返回false
+bool FormatLogArgs(const char *format, const std::vector<LogSpec> &specs, const char *p, const char *end,
+                   std::string *out)
+{
+    size_t last = 0;
+    for (const LogSpec &spec : specs)
+    {
+        out->append(format + last, spec.begin_ - last);
+        last = spec.end_;
+        if (spec.type_ == LOG_ARG_NONE)
+        {
+            out->push_back('%');
+            continue;
+        }
+        // 重新拼出只带一个参数的转换说明: '*'换成记录里的值, 8字节整数的长度修饰统一成ll
+        char conv[96];
+        size_t k = 0;
+        if (spec.end_ - spec.begin_ > 48)
+            return false;
+        for (size_t i = spec.begin_; i + 1 < spec.end_; i++)
+        {
+            char c = format[i];
+            if (c == '*')
+            {
+                int32_t v;
+                if (!LogTake(&p, end, &v))
+                    return false;
+                if (conv[k - 1] == '.' && v < 0) // 负的精度等于没有精度
+                    k--;
+                else
+                    k += snprintf(conv + k, sizeof(conv) - k, "%d", v);
+            }
+            else if (!strchr("lzjt", c))
+                conv[k++] = c;
+        }
+        if (spec.type_ == LOG_ARG_LONG)
+        {
+            conv[k++] = 'l';
+            conv[k++] = 'l';
+        }
+        conv[k++] = format[spec.end_ - 1];
+        conv[k] = '\0';
+
+        bool ok = true;
+        switch (spec.type_)
+        {
+        case LOG_ARG_INT:
+        {
+            int32_t v;
+            if ((ok = LogTake(&p, end, &v)))
+                AppendLogValue(out, conv, (int)v);
+            break;
+        }
+        case LOG_ARG_LONG:
+        {
+            int64_t v;
+            if ((ok = LogTake(&p, end, &v)))
+                AppendLogValue(out, conv, (long long)v);
+            break;
+        }
+        case LOG_ARG_DOUBLE:
+        {
+            double v;
+            if ((ok = LogTake(&p, end, &v)))
+                AppendLogValue(out, conv, v);
+            break;
+        }
+        case LOG_ARG_LDOUBLE:
+        {
+            long double v;
+            if ((ok = LogTake(&p, end, &v)))
+                AppendLogValue(out, conv, v);
+            break;
+        }
+        case LOG_ARG_PTR:
+        {
+            uint64_t v;
+            if ((ok = LogTake(&p, end, &v)))
+                AppendLogValue(out, conv, (void *)(uintptr_t)v);
+            break;
+        }
+        case LOG_ARG_STRING:
+        {
+            uint32_t n;
+            if ((ok = LogTake(&p, end, &n) && (size_t)(end - p) >= n))
+            {
+                AppendLogValue(out, conv, std::string(p, n).c_str());
+                p += n;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        if (!ok)
+            return false;
+    }
+    out->append(format + last);
+    return p == end;
+}
+
+struct LogFormat
+{
+    std::string text_;
+    std::vector<LogSpec> specs_;
+};
+
+// 格式串登记表: 每个LogMessage调用点第一次执行时登记一次, 之后用ID找到解析好的格式
+// ID 0固定为"%s": 格式串解析不了或者登记满了的日志先格式化成文本, 按ID 0记录
+class LogFormats
+{
+public:
+    static LogFormats &Instance()
+    {
+        static LogFormats formats;
+        return formats;
+    }
+
+    uint32_t Register(const char *format)
+    {
+        LogFormat *f = new LogFormat;
+        f->text_ = format;
+        if (!ParseLogFormat(format, &f->specs_))
+        {
+            delete f;
+            return 0;
+        }
+        lockGuard lg(&mtx_);
+        uint32_t id = count_.load(std::memory_order_relaxed);
+        if (id == log_max_formats)
+        {
+            delete f;
+            return 0;
+        }
+        formats_[id] = f;
+        count_.store(id + 1, std::memory_order_release);
+        return id;
+    }
+
+    const LogFormat *Get(uint32_t id) const
+    {
+        return id < count_.load(std::memory_order_acquire) ? formats_[id] : nullptr;
+    }
+
+private:
+    LogFormats()
+    {
+        formats_[0] = new LogFormat;
+        formats_[0]->text_ = "%s";
+        ParseLogFormat("%s", &formats_[0]->specs_);
+    }
+
+    Mutex mtx_;
+    LogFormat *formats_[log_max_formats] = {nullptr};
+    std::atomic<uint32_t> count_{1};
+};
+
+class BinaryLogger
+{
+public:
+    static BinaryLogger &Instance()
+    {
+        static BinaryLogger logger;
+        return logger;
+    }
+
+    // base: 段文件名前缀; 先在调用线程上建第一个段, 路径不可写时返回false
+    bool Start(const char *base, size_t segsize = log_segment_size)
+    {
+        if (running_.load())
+            return true;
+        base_ = base;
+        segsize_ = LogAlign(segsize);
+        gen_.fetch_add(1);
+        running_.store(true, std::memory_order_release);
+        if (!Roll(Local()))
+        {
+            running_.store(false);
+            return false;
+        }
+        return true;
+    }
+
+    // 停止记录, 收尾调用线程自己的段
+    // 其它线程的段在它们退出时收尾; 没有收尾的段末尾是全0, 解码时自动跳过
+    void Stop()
+    {
+        if (!running_.exchange(false))
+            return;
+        Local().Finish();
+    }
+
+    bool Running() const
+    {
+        return running_.load(std::memory_order_acquire);
+    }
+
+    // 生产者: 写一条记录, id为LogFormats登记的格式串ID; 返回false表示被丢弃
+    bool Append(uint8_t lv, int64_t ns, uint32_t id, const char *format, va_list ap)
+    {
+        Segment &seg = Local();
+        if (seg.base_ == nullptr || seg.gen_ != gen_.load(std::memory_order_relaxed))
+        {
+            if (seg.failed_ == gen_.load(std::memory_order_relaxed) || !Roll(seg))
+                return Drop();
+        }
+        va_list copy;
+        va_copy(copy, ap);
+        bool ok = Write(seg, lv, ns, id, format, copy);
+        va_end(copy);
+        if (!ok) // 段满了, 换一个新段再写一次
+        {
+            if (!Roll(seg))
+                return Drop();
+            va_copy(copy, ap);
+            ok = Write(seg, lv, ns, id, format, copy);
+            va_end(copy);
+            if (!ok) // 一条记录比整个段还大
+                return Drop();
+        }
+        return true;
+    }
+
+    // 因为建段失败或记录太大而丢弃的记录数
+    uint64_t Dropped() const
+    {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+    // 已经创建的段文件
+    std::vector<std::string> Files()
+    {
+        lockGuard lg(&filesmtx_);
+        return files_;
+    }
+
+private:
+    BinaryLogger() : segsize_(log_segment_size), pid_(getpid()) {}
+
+    // 每个线程正在写的段
+    struct Segment
+    {
+        int fd_ = -1;
+        char *base_ = nullptr;
+        size_t size_ = 0;
+        size_t pos_ = 0;
+        uint32_t gen_ = 0;    // 所属的Start
+        uint32_t failed_ = 0; // 这次Start里建段失败过, 不再重试
+        uint32_t thread_ = UINT32_MAX;
+        uint32_t segno_ = 0;
+        uint32_t stamp_ = 0;           // 每换一个段加1
+        std::vector<uint32_t> defined_; // defined_[id] == stamp_: 当前段已经写过这个格式串的定义
+
+        // 解除映射, 文件截到实际写入的长度
+        void Finish()
+        {
+            if (base_ == nullptr)
+                return;
+            munmap(base_, size_);
+            int ret = ftruncate(fd_, pos_); // 截断失败也能解码, 只是文件末尾多一段0
+            (void)ret;
+            close(fd_);
+            base_ = nullptr;
+            fd_ = -1;
+        }
+        ~Segment()
+        {
+            Finish();
+        }
+    };
+
+    Segment &Local()
+    {
+        static thread_local Segment seg;
+        return seg;
+    }
+
+    bool Drop()
+    {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // 收尾当前段, 建下一个段
+    bool Roll(Segment &seg)
+    {
+        seg.Finish();
+        uint32_t gen = gen_.load(std::memory_order_relaxed);
+        if (seg.thread_ == UINT32_MAX)
+            seg.thread_ = threads_.fetch_add(1);
+        seg.segno_ = seg.gen_ == gen ? seg.segno_ + 1 : 0;
+        seg.gen_ = gen;
+
+        std::string path = base_ + "." + std::to_string(pid_) + "." + std::to_string(seg.thread_) + "." +
+                           std::to_string(seg.segno_) + ".bin";
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            seg.failed_ = gen;
+            return false;
+        }
+        // 预先分配磁盘空间: 磁盘满时在这里失败, 而不是之后写映射时收到SIGBUS
+        void *p = MAP_FAILED;
+        if (posix_fallocate(fd, 0, segsize_) == 0)
+            p = mmap(nullptr, segsize_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            close(fd);
+            unlink(path.c_str());
+            seg.failed_ = gen;
+            return false;
+        }
+        seg.fd_ = fd;
+        seg.base_ = static_cast<char *>(p);
+        seg.size_ = segsize_;
+        seg.stamp_++;
+        if (seg.defined_.empty())
+            seg.defined_.resize(log_max_formats, 0);
+
+        LogSegmentHeader *hdr = reinterpret_cast<LogSegmentHeader *>(seg.base_);
+        memcpy(hdr->magic_, log_segment_magic, sizeof(hdr->magic_));
+        hdr->pid_ = pid_;
+        hdr->thread_ = seg.thread_;
+        hdr->segno_ = seg.segno_;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        hdr->ns_ = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        seg.pos_ = sizeof(LogSegmentHeader);
+
+        lockGuard lg(&filesmtx_);
+        files_.push_back(path);
+        return true;
+    }
+
+    // 在当前段末尾写一条记录, 需要时先写格式定义; 空间不够返回false
+    bool Write(Segment &seg, uint8_t lv, int64_t ns, uint32_t id, const char *format, va_list ap)
+    {
+        const LogFormat *f = LogFormats::Instance().Get(id);
+        if (f == nullptr)
+            f = LogFormats::Instance().Get(id = 0);
+        char *end = seg.base_ + seg.size_;
+        if (seg.defined_[id] != seg.stamp_)
+        {
+            size_t size = sizeof(LogRecordHeader) + f->text_.size();
+            if (seg.size_ - seg.pos_ < size)
+                return false;
+            char *p = seg.base_ + seg.pos_;
+            memcpy(p + sizeof(LogRecordHeader), f->text_.data(), f->text_.size());
+            Publish(p, size, id, log_format_def, 0);
+            seg.pos_ = LogAlign(seg.pos_ + size);
+            seg.defined_[id] = seg.stamp_;
+        }
+
+        if (seg.size_ - seg.pos_ < sizeof(LogRecordHeader))
+            return false;
+        char *rec = seg.base_ + seg.pos_;
+        char *p = rec + sizeof(LogRecordHeader);
+        if (id == 0)
+        {
+            // 按文本记录: 4字节长度 + vsnprintf的结果
+            va_list copy;
+            va_copy(copy, ap);
+            int n = vsnprintf(nullptr, 0, format, copy);
+            va_end(copy);
+            uint32_t len = n < 0 ? 0 : n < (int)log_max_string ? n : log_max_string;
+            if ((size_t)(end - p) < sizeof(len) + len + 1)
+                return false;
+            LogPut(&p, end, len);
+            vsnprintf(p, len + 1, format, ap);
+            p += len;
+        }
+        else if (!EncodeLogArgs(f->specs_, ap, &p, end))
+            return false;
+        Publish(rec, p - rec, id, lv, ns);
+        seg.pos_ = LogAlign(seg.pos_ + (p - rec));
+        return true;
+    }
+
+    // 写记录头, size_最后写
+    void Publish(char *rec, size_t size, uint32_t id, uint8_t lv, int64_t ns)
+    {
+        LogRecordHeader *h = reinterpret_cast<LogRecordHeader *>(rec);
+        h->id_ = id;
+        h->lv_ = lv;
+        h->ns_ = ns;
+        std::atomic_ref<uint32_t>(h->size_).store(size, std::memory_order_release);
+    }
+
+private:
+    std::string base_;
+    size_t segsize_;
+    uint32_t pid_;
+    std::atomic<bool> running_{false};
+    std::atomic<uint32_t> gen_{0};
+    std::atomic<uint32_t> threads_{0};
+    std::atomic<uint64_t> dropped_{0};
+
+    Mutex filesmtx_; // 只在换段时加锁
+    std::vector<std::string> files_;
+};
+
+// 一条解码后的日志
+struct LogLine
+{
+    int64_t ns_;
+    uint8_t lv_;
+    std::string body_;
+};
+
+// 解码一个段文件的内容, 追加到lines; 不是段文件或记录损坏返回false
+bool DecodeLogSegment(const char *data, size_t len, LogSegmentHeader *hdr, std::vector<LogLine> *lines)
+{
+    if (len < sizeof(LogSegmentHeader) || memcmp(data, log_segment_magic, sizeof(log_segment_magic)) != 0)
+        return false;
+    memcpy(hdr, data, sizeof(*hdr));
+    std::vector<LogFormat> formats(log_max_formats);
+    std::vector<bool> defined(log_max_formats, false);
+    size_t pos = sizeof(LogSegmentHeader);
+    while (pos + sizeof(LogRecordHeader) <= len)
+    {
+        LogRecordHeader rh;
+        memcpy(&rh, data + pos, sizeof(rh));
+        if (rh.size_ == 0)
+            break;
+        if (rh.size_ < sizeof(rh) || rh.size_ > len - pos || rh.id_ >= log_max_formats)
+            return false;
+        const char *body = data + pos + sizeof(rh);
+        const char *end = data + pos + rh.size_;
+        if (rh.lv_ == log_format_def)
+        {
+            formats[rh.id_].text_.assign(body, end);
+            if (!ParseLogFormat(formats[rh.id_].text_.c_str(), &formats[rh.id_].specs_))
+                return false;
+            defined[rh.id_] = true;
+        }
+        else
+        {
+            if (!defined[rh.id_])
+                return false;
+            LogLine line{rh.ns_, rh.lv_, std::string()};
+            const LogFormat &f = formats[rh.id_];
+            if (!FormatLogArgs(f.text_.c_str(), f.specs_, body, end, &line.body_))
+                return false;
+            lines->push_back(std::move(line));
+        }
+        pos = LogAlign(pos + rh.size_);
+    }
+    return true;
+}
@@ -0,0 +1,764 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <vector>
+#include <deque>
+#include <climits>
+#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "epoller.hpp"
+#include "codec.hpp"
+#include "histogram.hpp"
+#include "util.hpp"
+#include "err.hpp"
+
+// C10K对比: 依次启动mux/下各代服务器, 每一档连接数跑同一种负载, 记录吞吐量、延迟分位数、服务器的CPU和内存, 汇成一张表
+// 每一档都重新启动服务器, 先建好conns个连接(ramp), 再让其中一部分连接闭环地一问一答(每个连接同时只有一个未完成的请求), 其余的只连着
+//   idle: 活跃连接固定为active个(默认100), 看空闲连接增多时活跃连接的吞吐量、延迟, 以及每个连接的内存开销
+//   busy: 所有连接都活跃
+// 负载: 各代服务器能处理的报文不同, 按服务器换成它能听懂的同一个请求(1 + 2)
+//   line: 行协议报文, select/poll/epoll/epoll_v2原样回显(响应格式不一, 有的不带换行, 收到数据即算一个响应), reactor按行协议计算
+//   json: 长度报头 + JSON, epoll_v3和reactor都能处理
+// 除了reactor, 各代服务器都写死了监听8080, 所以一个接一个地跑; 服务器的输出重定向到/dev/null
+// 客户端和服务器在同一台机器上, 各自要为每个连接占一个文件描述符: nofile的硬上限不够的档位直接跳过并在报告里注明
+// 客户端轮流用127.0.0.2 ~ 127.0.0.9作源地址, 每个源地址有一套临时端口, 10万以上的连接不会耗尽临时端口
+// 先在各个目录下make出服务器, 在本目录下运行:
+// ./c10k [servers=NAME,...] [levels=N,...] [mode=idle|busy|both] [active=N] [duration=S] [warmup=S] [format=text|csv|json] [out=FILE]
+// 例如: ulimit -n 300000; ./c10k levels=1000,10000,100000 format=csv out=c10k.csv
+//       ./c10k servers=epoll_v2,reactor levels=5000 mode=idle duration=10
+
+void Usage()
+{
+    std::cout << "Usage: ./c10k [servers=NAME,...] [levels=N,...] [mode=idle|busy|both] [active=N] [duration=S] [warmup=S]" << std::endl
+              << "              [format=text|csv|json] [out=FILE]" << std::endl;
+}
+
+static const uint16_t c10k_port = 8080;
+static const int c10k_fd_reserve = 64;             // 连接以外需要的文件描述符
+static const int c10k_connect_window = 256;        // 同时在进行中的connect个数
+static const uint64_t c10k_connect_timeout_ms = 5000; // 单个connect的超时, 服务器的全连接队列满了时内核会丢弃SYN, 客户端1秒、3秒后重发
+static const uint64_t c10k_ramp_timeout_ms = 60000;  // 建连接阶段的总时长上限, 到时还没发起的connect记为失败
+static const uint64_t c10k_start_timeout_ms = 5000; // 等服务器开始监听的时长上限
+static const uint64_t c10k_settle_ms = 300;        // 连接建好后等一会, 让服务器关掉它不接受的连接(如select的fd_set满了)
+static const uint64_t c10k_stall_ms = 1000;        // 测量结束时请求已经等了这么久还没有响应, 视为卡住
+static const int c10k_source_addrs = 8;            // 源地址127.0.0.2开始的个数
+static const int c10k_events = 1024;
+static const size_t c10k_readsize = 4096;
+
+// 参与对比的服务器, 路径相对于本目录
+struct ServerSpec
+{
+    const char *name_;
+    const char *path_;
+    const char *codec_; // 客户端用来组帧的Codec
+    const char *args_;  // reactor_server的Codec参数, 它另外加上listen=; 其它服务器不接受参数, 为nullptr
+};
+
+static const ServerSpec c10k_servers[] = {
+    {"select", "../selectServer/select_server", "echo", nullptr},
+    {"poll", "../pollServer/poll_server", "echo", nullptr},
+    {"epoll", "../epollServer/epoll_server", "echo", nullptr},
+    {"epoll_v2", "../epollServer_v2/epoll_server", "echo", nullptr},
+    {"epoll_v3", "../5.epollServer_v3/epoll_server", "json", nullptr},
+    {"reactor", "./reactor_server", "line", "line"},
+    {"reactor_json", "./reactor_server", "json", "json"},
+};
+
+// 回显服务器的响应没有统一的格式, 每个连接同时只有一个请求, 收到数据就算一个响应; 请求按行协议编码
+class EchoCodec : public LineCodec
+{
+public:
+    static constexpr const char *name = "echo";
+
+    int Next(const std::string &buf, std::string_view *frame)
+    {
+        if (taken_ || buf.empty())
+            return 0;
+        taken_ = true;
+        *frame = buf;
+        return 1;
+    }
+    void Consume(std::string &buf)
+    {
+        if (taken_)
+            buf.clear();
+        taken_ = false;
+    }
+
+private:
+    bool taken_ = false;
+};
+
+struct C10kOptions
+{
+    std::vector<const ServerSpec *> servers_;
+    std::vector<int> levels_ = {1000, 10000, 100000};
+    std::string mode_ = "both";
+    int active_ = 100;
+    int duration_ = 5;
+    int warmup_ = 1;
+    std::string format_ = "text";
+    std::string out_;
+};
+
+// 报告中的一行
+struct C10kResult
+{
+    std::string server_;
+    std::string workload_;
+    std::string mode_;
+    int conns_ = 0;       // 目标连接数
+    int active_ = 0;      // 发请求的连接数
+    int established_ = 0; // 客户端看到建立成功, 且测量结束时还没有断开的连接数
+    int accepted_ = 0;    // 测量结束时服务器多打开的文件描述符数, 约等于它accept了的连接数
+    int failed_ = 0;      // connect失败、超时, 或者建立后被服务器断开的连接数
+    double ramp_s_ = 0;   // 建立所有连接花的时间
+    double rps_ = 0;      // 每秒完成的请求数
+    double p50_us_ = 0;
+    double p99_us_ = 0;
+    double max_us_ = 0;
+    int stalled_ = 0;     // 测量结束时等待响应超过c10k_stall_ms的活跃连接数
+    double server_cpu_ = 0; // 测量期间服务器进程(所有线程)的CPU占用, 100为一个核
+    double client_cpu_ = 0; // 同一时间客户端自己的CPU占用, 两者在同一台机器上争用CPU
+    long rss0_kb_ = 0;    // 服务器启动后、建连接之前的常驻内存
+    long rss_kb_ = 0;     // 测量结束时的常驻内存
+    double kb_per_conn_ = 0;
+    std::string status_ = "ok";
+};
+
+// /proc/<pid>中读到的服务器状态
+struct ProcSample
+{
+    uint64_t ticks_ = 0; // utime + stime, 单位为时钟滴答
+    long rss_kb_ = 0;
+    int fds_ = 0;
+};
+
+bool SampleProc(pid_t pid, ProcSample *s)
+{
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *fp = fopen(path, "r");
+    if (fp == nullptr)
+        return false;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+    // 进程名在括号里, 可能带空格, 从最后一个')'之后数: state为第3个字段, utime、stime为第14、15个字段
+    const char *p = strrchr(buf, ')');
+    unsigned long long utime, stime;
+    if (p == nullptr || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+        return false;
+    s->ticks_ = utime + stime;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    if ((fp = fopen(path, "r")) == nullptr)
+        return false;
+    s->rss_kb_ = 0;
+    while (fgets(buf, sizeof(buf), fp))
+    {
+        if (strncmp(buf, "VmRSS:", 6) == 0)
+            s->rss_kb_ = atol(buf + 6);
+    }
+    fclose(fp);
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    DIR *dir = opendir(path);
+    if (dir == nullptr)
+        return false;
+    s->fds_ = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != nullptr)
+    {
+        if (ent->d_name[0] != '.')
+            s->fds_++;
+    }
+    closedir(dir);
+    return true;
+}
+
+// 本进程用掉的CPU时间(微秒)
+uint64_t SelfCpuUs()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+// 服务器在127.0.0.1:c10k_port上接受连接了吗
+bool PortOpen()
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(c10k_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bool ok = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    close(fd);
+    return ok;
+}
+
+// 服务器是否已经退出; 退出时把原因写进status
+bool Exited(pid_t pid, std::string *status)
+{
+    int wstatus;
+    if (waitpid(pid, &wstatus, WNOHANG) != pid)
+        return false;
+    if (WIFSIGNALED(wstatus))
+        *status = std::string("server killed by ") + strsignal(WTERMSIG(wstatus));
+    else
+        *status = "server exited with " + std::to_string(WEXITSTATUS(wstatus));
+    return true;
+}
+
+// 启动服务器并等它开始监听; 失败返回-1, 原因写进status
+pid_t StartServer(const ServerSpec &spec, std::string *status)
+{
+    if (access(spec.path_, X_OK) != 0)
+    {
+        *status = std::string("not built: ") + spec.path_;
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        *status = std::string("fork failed: ") + strerror(errno);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, 0);
+        dup2(null, 1);
+        dup2(null, 2);
+        std::string listen = "listen=tcp:" + std::to_string(c10k_port);
+        if (spec.args_)
+            execl(spec.path_, spec.path_, spec.args_, listen.c_str(), (char *)nullptr);
+        else
+            execl(spec.path_, spec.path_, (char *)nullptr);
+        _exit(127);
+    }
+    uint64_t deadline = util::NowMs() + c10k_start_timeout_ms;
+    while (!PortOpen())
+    {
+        if (Exited(pid, status))
+            return -1;
+        if (util::NowMs() > deadline)
+        {
+            kill(pid, SIGKILL);
+            waitpid(pid, nullptr, 0);
+            *status = "server did not listen on port " + std::to_string(c10k_port);
+            return -1;
+        }
+        usleep(20000);
+    }
+    return pid;
+}
+
+void StopServer(pid_t pid)
+{
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+}
+
+template <class C>
+struct C10kConn
+{
+    int fd_ = -1;
+    bool connecting_ = false;
+    bool active_ = false;
+    bool waiting_ = false; // 有一个请求还没有收到响应
+    uint64_t since_ = 0;   // 开始connect或发出请求的时刻
+    C codec_;
+    std::string inbuffer_;
+};
+
+// 对一个已经启动的服务器跑一档: 建conns个连接, 其中active个闭环发请求, 测duration秒
+template <class C>
+class C10kRun
+{
+public:
+    C10kRun(const C10kOptions &opts, pid_t pid, int conns, int active, C10kResult *result)
+        : opts_(opts), pid_(pid), conns_(conns), active_(active), result_(result)
+    {
+        Request req(1, '+', 2);
+        C codec;
+        codec.Encode(req, &request_);
+    }
+
+    ~C10kRun()
+    {
+        // SO_LINGER为0, close直接发RST, 两边都不留TIME_WAIT, 下一档马上能复用端口
+        struct linger lg = {1, 0};
+        for (auto &conn : conns_)
+        {
+            if (conn.fd_ >= 0)
+            {
+                setsockopt(conn.fd_, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+                close(conn.fd_);
+            }
+        }
+    }
+
+    void Run()
+    {
+        epoller_.Create();
+        uint64_t begin = util::NowMs();
+        if (!Ramp())
+            return;
+        result_->ramp_s_ = (util::NowMs() - begin) / 1000.0;
+        if (!Pump(util::NowMs() + c10k_settle_ms))
+            return;
+
+        // 活跃连接均匀地分布在所有连接中, select/poll线性扫描时不会只占前面的位置
+        std::vector<int> open;
+        for (size_t i = 0; i < conns_.size(); i++)
+        {
+            if (conns_[i].fd_ >= 0)
+                open.push_back(i);
+        }
+        int active = std::min<int>(active_, open.size());
+        result_->active_ = active;
+        for (int j = 0; j < active; j++)
+        {
+            C10kConn<C> &conn = conns_[open[(size_t)j * open.size() / active]];
+            conn.active_ = true;
+            Send(conn);
+        }
+        if (!Pump(util::NowMs() + opts_.warmup_ * 1000))
+            return;
+
+        hist_.Reset();
+        completed_ = 0;
+        ProcSample before, after;
+        SampleProc(pid_, &before);
+        uint64_t cpu = SelfCpuUs(), start = util::NowNs();
+        if (!Pump(util::NowMs() + opts_.duration_ * 1000))
+            return;
+        double secs = (util::NowNs() - start) / 1e9;
+        if (!SampleProc(pid_, &after))
+        {
+            Exited(pid_, &result_->status_);
+            return;
+        }
+        result_->client_cpu_ = (SelfCpuUs() - cpu) / 1e4 / secs;
+        result_->server_cpu_ = (double)(after.ticks_ - before.ticks_) / sysconf(_SC_CLK_TCK) * 100 / secs;
+        result_->rss_kb_ = after.rss_kb_;
+        result_->accepted_ = after.fds_ - fds0_;
+        result_->rps_ = completed_ / secs;
+        result_->p50_us_ = hist_.Percentile(0.50) / 1000.0;
+        result_->p99_us_ = hist_.Percentile(0.99) / 1000.0;
+        result_->max_us_ = hist_.Max() / 1000.0;
+        uint64_t now = util::NowNs();
+        for (auto &conn : conns_)
+        {
+            if (conn.fd_ >= 0)
+                result_->established_++;
+            if (conn.fd_ >= 0 && conn.waiting_ && now - conn.since_ > c10k_stall_ms * 1000000)
+                result_->stalled_++;
+        }
+        if (result_->established_ > 0)
+            result_->kb_per_conn_ = (double)(result_->rss_kb_ - result_->rss0_kb_) / result_->established_;
+    }
+
+    // 建连接之前记下服务器的基线
+    void Baseline(const ProcSample &s)
+    {
+        fds0_ = s.fds_;
+        result_->rss0_kb_ = s.rss_kb_;
+    }
+
+private:
+    // 非阻塞地connect, 同时进行的不超过c10k_connect_window个
+    bool Ramp()
+    {
+        size_t next = 0;
+        std::deque<int> pending; // 进行中的connect, 按开始的先后
+        uint64_t deadline = util::NowMs() + c10k_ramp_timeout_ms;
+        while (next < conns_.size() || !pending.empty())
+        {
+            while (next < conns_.size() && pending.size() < (size_t)c10k_connect_window && util::NowMs() < deadline)
+            {
+                if (Connect(next))
+                    pending.push_back(next);
+                next++;
+            }
+            if (util::NowMs() >= deadline) // 剩下的不再发起
+            {
+                result_->failed_ += conns_.size() - next;
+                next = conns_.size();
+            }
+            if (!Pump(0))
+                return false;
+            uint64_t now = util::NowNs();
+            while (!pending.empty())
+            {
+                C10kConn<C> &conn = conns_[pending.front()];
+                if (conn.connecting_ && now - conn.since_ < c10k_connect_timeout_ms * 1000000)
+                    break;
+                if (conn.connecting_)
+                    Drop(conn);
+                pending.pop_front();
+            }
+        }
+        return true;
+    }
+
+    bool Connect(int i)
+    {
+        C10kConn<C> &conn = conns_[i];
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            result_->failed_++;
+            return false;
+        }
+        // 只绑定源地址, 端口推迟到connect时按四元组分配, 每个源地址各有一套临时端口
+        int one = 1;
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+        struct sockaddr_in local = {};
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + i % c10k_source_addrs);
+        struct sockaddr_in peer = {};
+        peer.sin_family = AF_INET;
+        peer.sin_port = htons(c10k_port);
+        peer.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0 ||
+            (connect(fd, (struct sockaddr *)&peer, sizeof(peer)) < 0 && errno != EINPROGRESS))
+        {
+            close(fd);
+            result_->failed_++;
+            return false;
+        }
+        util::SetNoDelay(fd);
+        conn.fd_ = fd;
+        conn.connecting_ = true;
+        conn.since_ = util::NowNs();
+        if ((size_t)fd >= fdindex_.size())
+            fdindex_.resize(fd + 1);
+        fdindex_[fd] = i;
+        epoller_.Register(fd, EPOLLOUT | EPOLLIN);
+        return true;
+    }
+
+    // 处理事件直到deadline(毫秒), deadline为0时只处理一轮; 服务器退出时返回false
+    bool Pump(uint64_t deadline)
+    {
+        do
+        {
+            int n = epoller_.Wait(events_, c10k_events, deadline ? 10 : 1);
+            for (int i = 0; i < n; i++)
+            {
+                C10kConn<C> &conn = conns_[fdindex_[events_.GetFd(i)]];
+                uint32_t ev = events_.GetEvent(i);
+                if (conn.connecting_)
+                    OnConnect(conn, ev);
+                else if (ev & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                    OnRead(conn);
+            }
+            if (util::NowMs() >= last_check_ + 100)
+            {
+                last_check_ = util::NowMs();
+                if (Exited(pid_, &result_->status_))
+                    return false;
+            }
+        } while (util::NowMs() < deadline);
+        return true;
+    }
+
+    void OnConnect(C10kConn<C> &conn, uint32_t ev)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if ((ev & EPOLLERR) || getsockopt(conn.fd_, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+        {
+            Drop(conn);
+            return;
+        }
+        conn.connecting_ = false;
+        epoller_.Modify(conn.fd_, EPOLLIN);
+    }
+
+    void OnRead(C10kConn<C> &conn)
+    {
+        char buffer[c10k_readsize];
+        while (true)
+        {
+            ssize_t n = recv(conn.fd_, buffer, sizeof(buffer), 0);
+            if (n > 0)
+            {
+                conn.inbuffer_.append(buffer, n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                Drop(conn);
+                return;
+            }
+            break;
+        }
+        std::string_view frame;
+        int ret, got = 0;
+        while ((ret = conn.codec_.Next(conn.inbuffer_, &frame)) > 0)
+            got++;
+        conn.codec_.Consume(conn.inbuffer_);
+        if (ret < 0)
+        {
+            Drop(conn);
+            return;
+        }
+        if (got > 0 && conn.waiting_)
+        {
+            hist_.Record(util::NowNs() - conn.since_);
+            completed_++;
+            conn.waiting_ = false;
+            Send(conn);
+        }
+    }
+
+    // 请求只有十几个字节, 连接上同时只有一个, 发送缓冲区不会满
+    void Send(C10kConn<C> &conn)
+    {
+        conn.since_ = util::NowNs();
+        conn.waiting_ = true;
+        if (send(conn.fd_, request_.data(), request_.size(), MSG_NOSIGNAL) != (ssize_t)request_.size())
+            Drop(conn);
+    }
+
+    // connect失败, 或者连接被服务器断开
+    void Drop(C10kConn<C> &conn)
+    {
+        epoller_.Remove(conn.fd_);
+        close(conn.fd_);
+        conn.fd_ = -1;
+        conn.connecting_ = false;
+        conn.waiting_ = false;
+        result_->failed_++;
+    }
+
+    const C10kOptions &opts_;
+    pid_t pid_;
+    std::vector<C10kConn<C>> conns_;
+    int active_;
+    C10kResult *result_;
+    Epoller epoller_;
+    Events events_;
+    std::vector<int> fdindex_;
+    std::string request_;
+    LatencyHistogram hist_;
+    uint64_t completed_ = 0;
+    int fds0_ = 0;
+    uint64_t last_check_ = 0;
+};
+
+template <class C>
+void RunLevel(const C10kOptions &opts, const ServerSpec &spec, C10kResult *result)
+{
+    pid_t pid = StartServer(spec, &result->status_);
+    if (pid < 0)
+        return;
+    ProcSample s;
+    SampleProc(pid, &s);
+    {
+        C10kRun<C> run(opts, pid, result->conns_, result->active_, result);
+        run.Baseline(s);
+        run.Run();
+    }
+    if (result->status_ == "ok") // 否则服务器已经退出并被回收了
+        StopServer(pid);
+}
+
+void PrintHeader(FILE *out, const C10kOptions &opts)
+{
+    if (opts.format_ == "csv")
+        fprintf(out, "server,workload,mode,conns,active,established,accepted,failed,ramp_s,rps,p50_us,p99_us,max_us,stalled,"
+                     "server_cpu_pct,client_cpu_pct,rss0_kb,rss_kb,kb_per_conn,status\n");
+    else if (opts.format_ == "json")
+        fprintf(out, "{\"port\": %d, \"duration_s\": %d, \"runs\": [", c10k_port, opts.duration_);
+    else
+        fprintf(out, "%-13s %-4s %-4s %7s %6s %7s %7s %6s %7s %9s %9s %9s %9s %7s %6s %6s %8s %8s %7s  %s\n",
+                "server", "load", "mode", "conns", "active", "estab", "accept", "failed", "ramp_s", "req/s", "p50_us", "p99_us",
+                "max_us", "stalled", "srv%", "cli%", "rss0_kb", "rss_kb", "kb/conn", "status");
+    fflush(out);
+}
+
+void PrintResult(FILE *out, const C10kOptions &opts, const C10kResult &r, bool first)
+{
+    const char *server = r.server_.c_str(), *workload = r.workload_.c_str(), *mode = r.mode_.c_str(), *status = r.status_.c_str();
+    if (opts.format_ == "csv")
+        fprintf(out, "%s,%s,%s,%d,%d,%d,%d,%d,%.2f,%.0f,%.1f,%.1f,%.1f,%d,%.1f,%.1f,%ld,%ld,%.2f,\"%s\"\n",
+                server, workload, mode, r.conns_, r.active_, r.established_, r.accepted_, r.failed_, r.ramp_s_, r.rps_,
+                r.p50_us_, r.p99_us_, r.max_us_, r.stalled_, r.server_cpu_, r.client_cpu_, r.rss0_kb_, r.rss_kb_, r.kb_per_conn_, status);
+    else if (opts.format_ == "json")
+        fprintf(out, "%s\n  {\"server\": \"%s\", \"workload\": \"%s\", \"mode\": \"%s\", \"conns\": %d, \"active\": %d, "
+                     "\"established\": %d, \"accepted\": %d, \"failed\": %d, \"ramp_s\": %.2f, \"rps\": %.0f, \"p50_us\": %.1f, "
+                     "\"p99_us\": %.1f, \"max_us\": %.1f, \"stalled\": %d, \"server_cpu_pct\": %.1f, \"client_cpu_pct\": %.1f, "
+                     "\"rss0_kb\": %ld, \"rss_kb\": %ld, \"kb_per_conn\": %.2f, \"status\": \"%s\"}",
+                first ? "" : ",", server, workload, mode, r.conns_, r.active_, r.established_, r.accepted_, r.failed_, r.ramp_s_,
+                r.rps_, r.p50_us_, r.p99_us_, r.max_us_, r.stalled_, r.server_cpu_, r.client_cpu_, r.rss0_kb_, r.rss_kb_,
+                r.kb_per_conn_, status);
+    else
+        fprintf(out, "%-13s %-4s %-4s %7d %6d %7d %7d %6d %7.2f %9.0f %9.1f %9.1f %9.1f %7d %6.1f %6.1f %8ld %8ld %7.2f  %s\n",
+                server, workload, mode, r.conns_, r.active_, r.established_, r.accepted_, r.failed_, r.ramp_s_, r.rps_,
+                r.p50_us_, r.p99_us_, r.max_us_, r.stalled_, r.server_cpu_, r.client_cpu_, r.rss0_kb_, r.rss_kb_, r.kb_per_conn_, status);
+    fflush(out);
+}
+
+void PrintFooter(FILE *out, const C10kOptions &opts)
+{
+    if (opts.format_ == "json")
+        fprintf(out, "\n]}\n");
+    fflush(out);
+}
+
+// 逗号分隔的正整数
+bool ParseLevels(const char *s, std::vector<int> *levels)
+{
+    levels->clear();
+    while (*s)
+    {
+        char *end;
+        long n = strtol(s, &end, 10);
+        if (end == s || n <= 0 || (*end != ',' && *end != '\0'))
+            return false;
+        levels->push_back(n);
+        s = *end ? end + 1 : end;
+    }
+    return !levels->empty();
+}
+
+bool ParseServers(const char *s, std::vector<const ServerSpec *> *servers)
+{
+    servers->clear();
+    std::string list = s;
+    size_t pos = 0;
+    while (pos <= list.size())
+    {
+        size_t comma = list.find(',', pos);
+        if (comma == std::string::npos)
+            comma = list.size();
+        std::string name = list.substr(pos, comma - pos);
+        const ServerSpec *found = nullptr;
+        for (const ServerSpec &spec : c10k_servers)
+        {
+            if (name == spec.name_)
+                found = &spec;
+        }
+        if (found == nullptr)
+            return false;
+        servers->push_back(found);
+        pos = comma + 1;
+    }
+    return !servers->empty();
+}
+
+int main(int argc, char *argv[])
+{
+    C10kOptions opts;
+    for (const ServerSpec &spec : c10k_servers)
+        opts.servers_.push_back(&spec);
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        bool ok = true;
+        if (strncmp(arg, "servers=", 8) == 0)
+            ok = ParseServers(arg + 8, &opts.servers_);
+        else if (strncmp(arg, "levels=", 7) == 0)
+            ok = ParseLevels(arg + 7, &opts.levels_);
+        else if (strncmp(arg, "mode=", 5) == 0)
+            opts.mode_ = arg + 5;
+        else if (strncmp(arg, "active=", 7) == 0)
+            opts.active_ = atoi(arg + 7);
+        else if (strncmp(arg, "duration=", 9) == 0)
+            opts.duration_ = atoi(arg + 9);
+        else if (strncmp(arg, "warmup=", 7) == 0)
+            opts.warmup_ = atoi(arg + 7);
+        else if (strncmp(arg, "format=", 7) == 0)
+            opts.format_ = arg + 7;
+        else if (strncmp(arg, "out=", 4) == 0)
+            opts.out_ = arg + 4;
+        else
+            ok = false;
+        if (!ok)
+        {
+            Usage();
+            exit(USAGE_ERR);
+        }
+    }
+    if ((opts.mode_ != "idle" && opts.mode_ != "busy" && opts.mode_ != "both") || opts.active_ <= 0 || opts.duration_ <= 0 ||
+        opts.warmup_ < 0 || (opts.format_ != "text" && opts.format_ != "csv" && opts.format_ != "json"))
+    {
+        Usage();
+        exit(USAGE_ERR);
+    }
+    if (PortOpen())
+    {
+        std::cout << "port " << c10k_port << " is already in use, stop the server listening on it first" << std::endl;
+        exit(BIND_ERR);
+    }
+    FILE *out = stdout;
+    if (!opts.out_.empty() && (out = fopen(opts.out_.c_str(), "w")) == nullptr)
+    {
+        std::cout << "open " << opts.out_ << " failed: " << strerror(errno) << std::endl;
+        exit(WRITE_ERR);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // 软上限提到硬上限, 服务器进程继承同样的上限
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    long maxfds = rl.rlim_cur == RLIM_INFINITY ? LONG_MAX : (long)rl.rlim_cur;
+
+    std::vector<std::string> modes;
+    if (opts.mode_ != "busy")
+        modes.push_back("idle");
+    if (opts.mode_ != "idle")
+        modes.push_back("busy");
+
+    PrintHeader(out, opts);
+    bool first = true;
+    for (const ServerSpec *spec : opts.servers_)
+    {
+        for (int conns : opts.levels_)
+        {
+            for (const std::string &mode : modes)
+            {
+                C10kResult r;
+                r.server_ = spec->name_;
+                r.workload_ = strcmp(spec->codec_, JsonCodec::name) == 0 ? "json" : "line";
+                r.mode_ = mode;
+                r.conns_ = conns;
+                r.active_ = mode == "idle" ? std::min(opts.active_, conns) : conns;
+                std::cerr << "running " << r.server_ << " " << mode << " conns=" << conns << " ..." << std::endl;
+                if (conns + c10k_fd_reserve > maxfds)
+                    r.status_ = "skipped: RLIMIT_NOFILE hard limit " + std::to_string(maxfds) + " too low";
+                else if (strcmp(spec->codec_, EchoCodec::name) == 0)
+                    RunLevel<EchoCodec>(opts, *spec, &r);
+                else if (strcmp(spec->codec_, LineCodec::name) == 0)
+                    RunLevel<LineCodec>(opts, *spec, &r);
+                else
+                    RunLevel<JsonCodec>(opts, *spec, &r);
+                PrintResult(out, opts, r, first);
+                first = false;
+            }
+        }
+    }
+    PrintFooter(out, opts);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
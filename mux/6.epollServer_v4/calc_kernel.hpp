@@ -0,0 +1,274 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// 计算器的计算核心, 单个请求和批量请求共用同一套语义:
+// 1.+ - * 按32位补码回绕, 不会出现有符号溢出的未定义行为
+// 2.除数为0: '/'错误码1, '%'错误码2, 结果为0
+// 3.INT_MIN / -1 结果为INT_MIN, INT_MIN % -1 结果为0 (硬件除法会触发SIGFPE)
+// 4.未知运算符: 错误码3, 结果为0
+// 批量计算按运算符分组, 用SSE2一次算4个:
+// + - 直接向量加减; * 用两次32位无符号乘法拼出低32位; / % 转成double相除后截断,
+// double有53位精度, 32位整数相除截断后的结果是精确的
+// 整批只有一种运算符时用该运算符的核心函数; 运算符混合时按运算符生成掩码, 在向量内选择结果
+// (先按运算符把操作数收集到连续数组再计算, 收集和放回的开销比计算本身还大, 实测比标量还慢)
+
+namespace calc
+{
+    inline int Add(int x, int y) { return (int)((uint32_t)x + (uint32_t)y); }
+    inline int Sub(int x, int y) { return (int)((uint32_t)x - (uint32_t)y); }
+    inline int Mul(int x, int y) { return (int)((uint32_t)x * (uint32_t)y); }
+    inline int Div(int x, int y) { return y == -1 ? Sub(0, x) : x / y; }
+    inline int Mod(int x, int y) { return y == -1 ? 0 : x % y; }
+
+    // 单个请求
+    inline void Eval(int x, char opt, int y, int *ret, int *code)
+    {
+        *ret = 0;
+        *code = 0;
+        switch (opt)
+        {
+        case '+':
+            *ret = Add(x, y);
+            break;
+        case '-':
+            *ret = Sub(x, y);
+            break;
+        case '*':
+            *ret = Mul(x, y);
+            break;
+        case '/':
+            if (y == 0)
+                *code = 1;
+            else
+                *ret = Div(x, y);
+            break;
+        case '%':
+            if (y == 0)
+                *code = 2;
+            else
+                *ret = Mod(x, y);
+            break;
+        default:
+            *code = 3;
+        }
+    }
+
+    // 以下核心函数都处理n个连续元素, 结果写入ret/code
+    // 先用SSE2处理4的整数倍个, 剩余的用标量处理
+
+#ifdef __SSE2__
+    // 4个32位整数相乘, 取低32位
+    inline __m128i MulLo(__m128i a, __m128i b)
+    {
+        __m128i even = _mm_mul_epu32(a, b);
+        __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+        return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                                  _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+    }
+
+    // 4个32位整数相除, 向0截断; y中不能有0
+    inline __m128i DivTrunc(__m128i x, __m128i y)
+    {
+        __m128d lo = _mm_div_pd(_mm_cvtepi32_pd(x), _mm_cvtepi32_pd(y));
+        __m128d hi = _mm_div_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2))),
+                                _mm_cvtepi32_pd(_mm_shuffle_epi32(y, _MM_SHUFFLE(1, 0, 3, 2))));
+        // 越界(只有INT_MIN / -1)时cvttpd得到0x80000000, 恰好是回绕的结果
+        return _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo), _mm_cvttpd_epi32(hi));
+    }
+#endif
+
+    inline void AddN(const int *x, const int *y, size_t n, int *ret, int *code)
+    {
+        size_t i = 0;
+#ifdef __SSE2__
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)(x + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(y + i));
+            _mm_storeu_si128((__m128i *)(ret + i), _mm_add_epi32(a, b));
+            _mm_storeu_si128((__m128i *)(code + i), _mm_setzero_si128());
+        }
+#endif
+        for (; i < n; i++)
+        {
+            ret[i] = Add(x[i], y[i]);
+            code[i] = 0;
+        }
+    }
+
+    inline void SubN(const int *x, const int *y, size_t n, int *ret, int *code)
+    {
+        size_t i = 0;
+#ifdef __SSE2__
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)(x + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(y + i));
+            _mm_storeu_si128((__m128i *)(ret + i), _mm_sub_epi32(a, b));
+            _mm_storeu_si128((__m128i *)(code + i), _mm_setzero_si128());
+        }
+#endif
+        for (; i < n; i++)
+        {
+            ret[i] = Sub(x[i], y[i]);
+            code[i] = 0;
+        }
+    }
+
+    inline void MulN(const int *x, const int *y, size_t n, int *ret, int *code)
+    {
+        size_t i = 0;
+#ifdef __SSE2__
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)(x + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(y + i));
+            _mm_storeu_si128((__m128i *)(ret + i), MulLo(a, b));
+            _mm_storeu_si128((__m128i *)(code + i), _mm_setzero_si128());
+        }
+#endif
+        for (; i < n; i++)
+        {
+            ret[i] = Mul(x[i], y[i]);
+            code[i] = 0;
+        }
+    }
+
+    // mod: false为'/', true为'%'; 除数为0的元素错误码分别为1和2
+    inline void DivModN(const int *x, const int *y, size_t n, int *ret, int *code, bool mod)
+    {
+        size_t i = 0;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i one = _mm_set1_epi32(1);
+        const __m128i errcode = _mm_set1_epi32(mod ? 2 : 1);
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)(x + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(y + i));
+            __m128i bad = _mm_cmpeq_epi32(b, zero);
+            __m128i q = DivTrunc(a, _mm_or_si128(b, _mm_and_si128(bad, one))); // 除数0换成1, 结果再清零
+            __m128i r = mod ? _mm_sub_epi32(a, MulLo(q, b)) : q;
+            _mm_storeu_si128((__m128i *)(ret + i), _mm_andnot_si128(bad, r));
+            _mm_storeu_si128((__m128i *)(code + i), _mm_and_si128(bad, errcode));
+        }
+#endif
+        for (; i < n; i++)
+            Eval(x[i], mod ? '%' : '/', y[i], ret + i, code + i);
+    }
+
+    // 运算符在分组中的下标, 未知运算符为kind_num
+    static const int kind_num = 5;
+    inline int Kind(char opt)
+    {
+        switch (opt)
+        {
+        case '+':
+            return 0;
+        case '-':
+            return 1;
+        case '*':
+            return 2;
+        case '/':
+            return 3;
+        case '%':
+            return 4;
+        default:
+            return kind_num;
+        }
+    }
+
+    inline void KernelN(int kind, const int *x, const int *y, size_t n, int *ret, int *code)
+    {
+        switch (kind)
+        {
+        case 0:
+            AddN(x, y, n, ret, code);
+            break;
+        case 1:
+            SubN(x, y, n, ret, code);
+            break;
+        case 2:
+            MulN(x, y, n, ret, code);
+            break;
+        case 3:
+            DivModN(x, y, n, ret, code, false);
+            break;
+        case 4:
+            DivModN(x, y, n, ret, code, true);
+            break;
+        default:
+            for (size_t i = 0; i < n; i++)
+            {
+                ret[i] = 0;
+                code[i] = 3;
+            }
+        }
+    }
+
+    // 运算符混合的批量计算: 每4个元素一组, 用各运算符的掩码选出每个元素的结果
+    // 只有组内出现'/'或'%'时才做除法
+    inline void MixedN(const int *x, const char *opt, const int *y, size_t n, int *ret, int *code)
+    {
+        size_t i = 0;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i one = _mm_set1_epi32(1);
+        const __m128i two = _mm_set1_epi32(2);
+        const __m128i three = _mm_set1_epi32(3);
+        const __m128i addop = _mm_set1_epi32('+'), subop = _mm_set1_epi32('-'), mulop = _mm_set1_epi32('*');
+        const __m128i divop = _mm_set1_epi32('/'), modop = _mm_set1_epi32('%');
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)(x + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(y + i));
+            int ops;
+            memcpy(&ops, opt + i, 4);
+            __m128i o = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(ops), zero), zero); // 4个运算符扩展成32位
+
+            __m128i madd = _mm_cmpeq_epi32(o, addop), msub = _mm_cmpeq_epi32(o, subop), mmul = _mm_cmpeq_epi32(o, mulop);
+            __m128i mdiv = _mm_cmpeq_epi32(o, divop), mmod = _mm_cmpeq_epi32(o, modop);
+            __m128i r = _mm_or_si128(_mm_and_si128(madd, _mm_add_epi32(a, b)), _mm_and_si128(msub, _mm_sub_epi32(a, b)));
+            r = _mm_or_si128(r, _mm_and_si128(mmul, MulLo(a, b)));
+            __m128i known = _mm_or_si128(_mm_or_si128(madd, msub), _mm_or_si128(mmul, _mm_or_si128(mdiv, mmod)));
+            __m128i c = _mm_andnot_si128(known, three);
+
+            __m128i mdm = _mm_or_si128(mdiv, mmod);
+            if (_mm_movemask_epi8(mdm))
+            {
+                __m128i bad = _mm_cmpeq_epi32(b, zero);
+                __m128i q = DivTrunc(a, _mm_or_si128(b, _mm_and_si128(bad, one))); // 除数0换成1, 结果再清零
+                __m128i rem = _mm_sub_epi32(a, MulLo(q, b));
+                __m128i ok = _mm_andnot_si128(bad, mdm);
+                r = _mm_or_si128(r, _mm_and_si128(ok, _mm_or_si128(_mm_and_si128(mdiv, q), _mm_and_si128(mmod, rem))));
+                c = _mm_or_si128(c, _mm_and_si128(bad, _mm_or_si128(_mm_and_si128(mdiv, one), _mm_and_si128(mmod, two))));
+            }
+            _mm_storeu_si128((__m128i *)(ret + i), r);
+            _mm_storeu_si128((__m128i *)(code + i), c);
+        }
+#endif
+        for (; i < n; i++)
+            Eval(x[i], opt[i], y[i], ret + i, code + i);
+    }
+
+    // 批量计算, 结果与逐个调用Eval相同
+    // 按运算符分组: 只有一种运算符时整批用该运算符的核心函数计算, 否则用MixedN按运算符掩码计算
+    inline void EvalBatch(const int *x, const char *opt, const int *y, size_t n, int *ret, int *code)
+    {
+        if (n == 0)
+            return;
+        int first = Kind(opt[0]);
+        size_t same = 1;
+        while (same < n && Kind(opt[same]) == first)
+            same++;
+        if (same == n)
+            KernelN(first, x, y, n, ret, code);
+        else
+            MixedN(x, opt, y, n, ret, code);
+    }
+};
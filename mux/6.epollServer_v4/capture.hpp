@@ -0,0 +1,236 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "histogram.hpp"
+
+// 流量捕获: 记录收到的每个请求报文和它到达的时刻, 以及对应的响应编码好的时刻, 供./replay重放
+// 每个IO Reactor写自己的文件 <base>.<线程序号>.cap, 只在本线程写, 不加锁
+// 记录先攒在内存里, 攒够capture_buffer_size或定时器到期时一次write追加到文件; 进程被杀时最多丢最后一个周期
+// 文件: CaptureFileHeader + 若干条 CaptureRecord(+ 请求报文), 记录不对齐, 读的时候memcpy
+// 文件末尾写到一半的记录在读取时丢弃
+// 同一次运行的各个文件共用一个起点start_ns_, 时刻可以直接比较
+
+static const size_t capture_buffer_size = 256 << 10; // 内存中攒够这么多字节写一次文件
+static const int capture_flush_ms = 100;             // 定时写文件的周期(毫秒)
+static const char capture_magic[8] = {'R', 'C', 'A', 'P', 'T', 'R', '0', '1'};
+
+enum capture_t : uint8_t
+{
+    CAPTURE_REQUEST = 1,  // 请求报文, 报文紧跟在记录头后面
+    CAPTURE_RESPONSE = 2, // 响应编码进发送缓冲区的时刻, 没有报文
+};
+
+struct CaptureFileHeader
+{
+    char magic_[8];
+    char codec_[16]; // 服务器的Codec名字(C::name), 以'\0'结尾
+    uint64_t start_ns_; // 捕获开始的时刻, 单调时钟
+};
+
+struct CaptureRecord
+{
+    uint64_t ns_;   // 相对start_ns_的纳秒数
+    uint32_t conn_; // 连接序号
+    uint32_t key_;  // 有序请求: 连接上的顺序号; 带编号的请求: 请求编号; 请求和它的响应相同
+    uint32_t len_;  // 请求报文的字节数, 响应为0
+    uint8_t type_;  // capture_t
+    uint8_t tagged_; // key_是请求编号
+    uint16_t reserved_;
+};
+static_assert(sizeof(CaptureFileHeader) == 32 && sizeof(CaptureRecord) == 24);
+
+class CaptureWriter
+{
+public:
+    CaptureWriter() = default;
+    CaptureWriter(const CaptureWriter &) = delete;
+    CaptureWriter &operator=(const CaptureWriter &) = delete;
+    ~CaptureWriter()
+    {
+        Close();
+    }
+
+    // 新建(或截断)path, 写文件头; 失败返回false, errno为原因
+    bool Open(const std::string &path, const char *codec, uint64_t start_ns)
+    {
+        Close();
+        fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ < 0)
+            return false;
+        CaptureFileHeader header = {};
+        memcpy(header.magic_, capture_magic, sizeof(capture_magic));
+        strncpy(header.codec_, codec, sizeof(header.codec_) - 1);
+        header.start_ns_ = start_ns;
+        start_ = start_ns;
+        buf_.reserve(capture_buffer_size + sizeof(CaptureRecord));
+        buf_.append((const char *)&header, sizeof(header));
+        return true;
+    }
+
+    // ns: 单调时钟的绝对时刻
+    void Request(uint64_t ns, uint32_t conn, uint32_t key, bool tagged, std::string_view frame)
+    {
+        Append(ns, conn, key, tagged, CAPTURE_REQUEST, frame);
+    }
+    void Response(uint64_t ns, uint32_t conn, uint32_t key, bool tagged)
+    {
+        Append(ns, conn, key, tagged, CAPTURE_RESPONSE, std::string_view());
+    }
+
+    // 把攒下的记录写进文件; 写失败时丢弃并计数, 不影响服务
+    void Flush()
+    {
+        size_t off = 0;
+        while (fd_ >= 0 && off < buf_.size())
+        {
+            ssize_t n = write(fd_, buf_.data() + off, buf_.size() - off);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                lost_ += buf_.size() - off;
+                break;
+            }
+            off += n;
+        }
+        buf_.clear();
+    }
+
+    void Close()
+    {
+        if (fd_ < 0)
+            return;
+        Flush();
+        close(fd_);
+        fd_ = -1;
+    }
+
+    uint64_t Records() const { return records_; }
+    uint64_t Lost() const { return lost_; } // 写文件失败丢掉的字节数
+
+private:
+    void Append(uint64_t ns, uint32_t conn, uint32_t key, bool tagged, uint8_t type, std::string_view frame)
+    {
+        if (fd_ < 0)
+            return;
+        CaptureRecord rec = {};
+        rec.ns_ = ns > start_ ? ns - start_ : 0;
+        rec.conn_ = conn;
+        rec.key_ = key;
+        rec.len_ = frame.size();
+        rec.type_ = type;
+        rec.tagged_ = tagged;
+        buf_.append((const char *)&rec, sizeof(rec));
+        buf_.append(frame.data(), frame.size());
+        records_++;
+        if (buf_.size() >= capture_buffer_size)
+            Flush();
+    }
+
+    int fd_ = -1;
+    uint64_t start_ = 0;
+    std::string buf_;
+    uint64_t records_ = 0;
+    uint64_t lost_ = 0;
+};
+
+// 读出的一条记录, frame_指向CaptureFile::data_
+struct CaptureEvent
+{
+    CaptureRecord rec_;
+    std::string_view frame_;
+};
+
+// 整个读进内存的捕获文件
+struct CaptureFile
+{
+    CaptureFileHeader header_;
+    std::string data_;
+    std::vector<CaptureEvent> events_; // 文件中的顺序, 即写入线程上发生的顺序
+    bool truncated_ = false;           // 末尾有写到一半的记录
+};
+
+// 读取并校验捕获文件; 读失败返回false, 不是捕获文件时errno为EINVAL
+bool ReadCapture(const std::string &path, CaptureFile *file)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    file->data_.clear();
+    file->events_.clear();
+    file->truncated_ = false;
+    char buffer[65536];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) != 0)
+    {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            close(fd);
+            return false;
+        }
+        file->data_.append(buffer, n);
+    }
+    close(fd);
+    const std::string &data = file->data_;
+    if (data.size() < sizeof(CaptureFileHeader) || memcmp(data.data(), capture_magic, sizeof(capture_magic)) != 0)
+    {
+        errno = EINVAL;
+        return false;
+    }
+    memcpy(&file->header_, data.data(), sizeof(CaptureFileHeader));
+    file->header_.codec_[sizeof(file->header_.codec_) - 1] = '\0';
+    size_t pos = sizeof(CaptureFileHeader);
+    while (pos < data.size())
+    {
+        CaptureEvent ev;
+        if (data.size() - pos < sizeof(CaptureRecord))
+        {
+            file->truncated_ = true;
+            break;
+        }
+        memcpy(&ev.rec_, data.data() + pos, sizeof(CaptureRecord));
+        pos += sizeof(CaptureRecord);
+        if ((ev.rec_.type_ != CAPTURE_REQUEST && ev.rec_.type_ != CAPTURE_RESPONSE) || data.size() - pos < ev.rec_.len_)
+        {
+            file->truncated_ = true;
+            break;
+        }
+        ev.frame_ = std::string_view(data.data() + pos, ev.rec_.len_);
+        pos += ev.rec_.len_;
+        file->events_.push_back(ev);
+    }
+    return true;
+}
+
+// 按(连接, 编号)把响应对上请求, 服务器端的延迟(请求读入 -> 响应编码)记入hist; 返回没有对上响应的请求数
+// 连接被关闭等原因没有响应的请求不计入延迟
+uint64_t CaptureLatencies(const CaptureFile &file, LatencyHistogram *hist)
+{
+    std::unordered_map<uint64_t, uint64_t> arrivals; // (连接 << 33 | tagged << 32 | key) -> 到达时刻
+    for (const CaptureEvent &ev : file.events_)
+    {
+        const CaptureRecord &r = ev.rec_;
+        uint64_t id = (uint64_t)r.conn_ << 33 | (uint64_t)(r.tagged_ != 0) << 32 | r.key_;
+        if (r.type_ == CAPTURE_REQUEST)
+        {
+            arrivals[id] = r.ns_;
+            continue;
+        }
+        auto it = arrivals.find(id);
+        if (it == arrivals.end()) // 非法报文的错误响应, 或者请求在捕获开始之前
+            continue;
+        hist->Record(r.ns_ >= it->second ? r.ns_ - it->second : 0);
+        arrivals.erase(it);
+    }
+    return arrivals.size();
+}
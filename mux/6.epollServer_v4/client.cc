@@ -1,25 +1,59 @@
 #include <iostream>
 #include <string>
+#include <cstring>
+#include <vector>
+#include <sstream>
+#include <bit>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include "mysocket.hpp"
-#include "protocol_netcal.hpp"
+#include "codec.hpp"
+#include "pipeline_client.hpp"
 #include "err.hpp"
 
 void Usage()
 {
     std::cout << "Please enter the correct format: "
-              << "./client [server's ip] [server's port]" << std::endl;
+              << "./client [server's ip] [server's port] [json|binary|line|http]" << std::endl
+              << "                                  ./client unix:PATH|shm:PATH [json|binary|line|http]" << std::endl;
 }
 
 using namespace protocol_ns_json;
 
-int Enter(Request &req)
+// 表达式请求(只有二进制协议支持): "=表达式 [@ 变量=值 ...]", 例如"=(a+b)*2.5 @ a=1 b=2"
+// 值带小数点或指数时为double, 否则为int64
+int ParseExpr(const std::string &str, Request &req)
 {
-    std::string str;
-    std::getline(std::cin, str);
-    if (str == "quit")
-        return -1;
+    size_t at = str.find('@');
+    req._expr = str.substr(1, at == std::string::npos ? std::string::npos : at - 1);
+    req._rows = 1;
+    if (at == std::string::npos)
+        return req._expr.empty() ? 0 : 1;
+    std::istringstream bindings(str.substr(at + 1));
+    std::string kv;
+    while (bindings >> kv)
+    {
+        size_t eq = kv.find('=');
+        if (eq == std::string::npos || eq == 0 || eq + 1 == kv.size())
+            return 0;
+        std::string value = kv.substr(eq + 1);
+        char *end = nullptr;
+        bool isdouble = value.find_first_of(".eE") != std::string::npos;
+        int64_t v = isdouble ? std::bit_cast<int64_t>(strtod(value.c_str(), &end)) : strtoll(value.c_str(), &end, 10);
+        if (*end != '\0')
+            return 0;
+        req._names.push_back(kv.substr(0, eq));
+        req._types.push_back(isdouble ? 1 : 0);
+        req._vals.push_back(v);
+    }
+    return req._expr.empty() ? 0 : 1;
+}
+
+// 解析一个计算式, 成功返回1, 非法返回0
+int Parse(const std::string &str, Request &req)
+{
+    if (!str.empty() && str[0] == '=')
+        return ParseExpr(str, req);
     // 1+2
     int i = 0;
     while (i < str.size() && isdigit(str[i]))
@@ -41,7 +75,7 @@ int Enter(Request &req)
     // str[i]必须是"+-*/%"
     const char *opts = "+-*/%";
     bool flag = 0;
-    while (opts)
+    while (*opts)
     {
         if (str[i] == *opts)
         {
@@ -59,28 +93,40 @@ int Enter(Request &req)
     return 1;
 }
 
-int main(int argc, char *argv[])
+// 一行可以输入多个计算式, 用';'分隔, 例如"1+2;3*4;=1.5*(2+3)", 一次全部发出
+int Enter(std::vector<Request> &reqs)
 {
-    if (argc != 3)
+    std::string line;
+    if (!std::getline(std::cin, line) || line == "quit")
+        return -1;
+    size_t begin = 0;
+    while (begin <= line.size())
     {
-        Usage();
-        exit(USAGE_ERR);
+        size_t end = line.find(';', begin);
+        if (end == std::string::npos)
+            end = line.size();
+        Request req;
+        if (Parse(line.substr(begin, end - begin), req) == 0)
+            return 0;
+        reqs.push_back(req);
+        begin = end + 1;
     }
+    return 1;
+}
 
-    Sock connectsock;
-    connectsock.Socket();
-    std::string svr_ip(argv[1]);
-    uint16_t svr_port = atoi(argv[2]);
-
-    if (connectsock.Connect(svr_ip, svr_port) < 0)
-        exit(CONNECT_ERR);
-
+// 与服务器交互, C: 编解码方式, 需与服务器一致(服务器默认的auto接受json、binary和http)
+// 二进制协议下请求带编号, 响应按完成顺序显示; 其它协议按请求顺序显示
+template <Codec C>
+int Run(Sock &connectsock, ShmChannel *shm)
+{
+    bool tagged = std::is_same_v<C, BinaryCodec>;
+    PipelineClient<C> cli = shm ? PipelineClient<C>(shm, tagged) : PipelineClient<C>(connectsock.GetSockfd(), tagged);
     while (true)
     {
         // 1.用户输入计算任务
-        Request req;
+        std::vector<Request> reqs;
         std::cout << "Enter Calculate Task:> ";
-        int flag = Enter(req);
+        int flag = Enter(reqs);
         if (flag == -1)
         {
             std::cout << "calculator quit" << std::endl;
@@ -92,66 +138,88 @@ int main(int argc, char *argv[])
             continue;
         }
 
-        // 2.序列化计算请求
-        std::string reqStr;
-        req.Serialize(&reqStr);
-
-        // 3.添加报头
-        AddHeader(reqStr);
-
-        // 4.发送str到服务器
-        ssize_t n = send(connectsock.GetSockfd(), reqStr.c_str(), reqStr.size(), 0);
-        if (n < 0)
+        // 2.序列化计算请求, 添加报头, 放入发送缓冲区
+        // 3.一次发送到服务器
+        std::vector<uint32_t> ids;
+        for (auto &req : reqs)
+            ids.push_back(cli.Submit(req));
+        if (!cli.Flush())
         {
             exit(SEND_ERR);
         }
+        std::cout << "发送成功: " << reqs.size() << " 个请求" << std::endl;
 
-        std::cout << "发送成功: " << reqStr.c_str() << std::endl;
-
-        // 5.接收服务器发回的响应
-        std::string inbuffer;
-        std::string response;
-
-        while (true)
+        // 4.接收服务器发回的响应, 解开报头, 反序列化
+        // 5.show result, 编号是本行中的第几个计算式
+        for (size_t i = 0; i < reqs.size(); i++)
         {
-            char buffer[1024] = {0};
-            ssize_t n = recv(connectsock.GetSockfd(), buffer, sizeof(buffer), 0);
-            if (n < 0)
-            {
-                connectsock.Close();
-                return RECV_ERR;
-            }
-            else if (n == 0)
+            Response resp;
+            if (!cli.Wait(&resp))
             {
                 LogMessage(DEBUG, "与服务器断开连接了...\n");
                 connectsock.Close();
-                return 0;
+                return RECV_ERR;
             }
-            else
+            std::cout << "#" << resp._id - ids[0] + 1 << ": ";
+            if (resp.IsExpr() && resp._code == 0)
             {
-                buffer[n] = 0;
-                inbuffer += buffer;
-                int len = Parse(inbuffer, &response);
-                if (len == 0)
-                    continue;
+                if (resp._type == 1)
+                    std::cout << std::bit_cast<double>(resp._vals[0]);
                 else
-                {
-                    // 读取到一个完整的响应package
-                    std::cout << "接收成功: " << response.c_str() << std::endl;
-                    // 6.解开报头
-                    RemoveHeader(response, len);
-                    break;
-                }
+                    std::cout << resp._vals[0];
+                std::cout << " [code: " << resp._codes[0] << "]" << std::endl;
             }
+            else
+                std::cout << resp._ret << " [code: " << resp._code << "]" << std::endl;
         }
+    }
+    return 0;
+}
 
-        // 7.反序列化响应
-        Response resp;
-        resp.Deserialize(response);
+// 服务器IP可以是IPv4或IPv6地址; unix:PATH连接本机的Unix域套接字(@开头为抽象命名空间), 不需要端口
+// shm:PATH: 在PATH上握手, 之后数据走共享内存(见shm_ring.hpp)
+int main(int argc, char *argv[])
+{
+    Endpoint ep;
+    bool local = argc > 1 && (strncmp(argv[1], "unix:", 5) == 0 || strncmp(argv[1], "shm:", 4) == 0);
+    int nargs = local ? 2 : 3; // 编解码方式之前的参数个数
+    if ((argc != nargs && argc != nargs + 1) || (local && !Endpoint::Parse(argv[1], &ep)))
+    {
+        Usage();
+        exit(USAGE_ERR);
+    }
+    // 编解码方式, 默认JSON
+    const char *codec = argc == nargs + 1 ? argv[nargs] : JsonCodec::name;
+    if (strcmp(codec, JsonCodec::name) != 0 && strcmp(codec, BinaryCodec::name) != 0 && strcmp(codec, LineCodec::name) != 0 &&
+        strcmp(codec, HttpCodec::name) != 0)
+    {
+        Usage();
+        exit(USAGE_ERR);
+    }
 
-        // 8.show result
-        std::cout << resp._ret << " [code: " << resp._code << "]" << std::endl;
+    std::string svr_ip;
+    if (!local)
+    {
+        svr_ip = argv[1];
+        ep = Endpoint(svr_ip.find(':') != std::string::npos ? AF_INET6 : AF_INET, atoi(argv[2]));
+    }
+    Sock connectsock;
+    connectsock.Socket(ep.family_);
+    if (connectsock.Connect(ep, svr_ip) < 0)
+        exit(CONNECT_ERR);
+    ShmChannel chan;
+    ShmChannel *shm = ep.shm_ ? &chan : nullptr;
+    if (shm && !chan.Connect(connectsock.GetSockfd()))
+    {
+        LogMessage(WARNING, "shared memory handshake failed\n");
+        exit(CONNECT_ERR);
     }
 
-    return 0;
+    if (strcmp(codec, BinaryCodec::name) == 0)
+        return Run<BinaryCodec>(connectsock, shm);
+    if (strcmp(codec, LineCodec::name) == 0)
+        return Run<LineCodec>(connectsock, shm);
+    if (strcmp(codec, HttpCodec::name) == 0)
+        return Run<HttpCodec>(connectsock, shm);
+    return Run<JsonCodec>(connectsock, shm);
 }
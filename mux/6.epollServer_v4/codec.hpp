@@ -0,0 +1,377 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <concepts>
+#include "protocol_netcal.hpp"
+
+// 编解码层: Reactor<Codec>/ReactorServer<Codec>在编译期选定协议
+// 报文切分、反序列化、序列化都是普通成员函数, 直接内联到Recv循环中, 没有虚函数
+// 每个连接持有一个Codec对象, 保存该连接的增量解析状态
+// Codec需要提供:
+// 1.Next(buf, &frame): 切分出一个报文, 返回1/0/-1, 同FrameParser::Next
+// 2.Consume(buf): 从buf中删除已经被Next取走的报文; Parsed(): buf开头已经被Next取走的字节数, 即取走的报文的原始字节
+// 3.Decode(frame, &req/&resp): 反序列化, 失败返回false
+// 4.Encode(req/resp, out): 在out末尾追加一个完整报文
+// 5.FrameKind(): 最近一个报文的类型, 与有效载荷一起唯一确定一个请求, 用作响应缓存的键
+// 6.WantClose(): 最近一个请求要求发完它的响应后关闭连接(HTTP的Connection: close)
+// 7.Reject(out): 报文非法时, 在out末尾追加给对端的错误响应(可以为空), 发完前面请求的响应和它之后关闭连接
+// 8.name: 协议名
+// 9.SetMaxFrame(n): 单个报文(含报头)的最大长度, 超过的报文在Next中判为非法, 不等它到齐; 服务器按MemoryLimits::max_frame_设置
+
+using protocol_ns_json::Request;
+using protocol_ns_json::Response;
+using protocol_ns_json::service_t;
+using protocol_ns_json::async_service_t;
+
+template <class C>
+concept Codec = std::default_initializable<C> &&
+                requires(C c, std::string &buf, std::string_view frame, Request req, Response resp, std::string *out) {
+                    { c.Next(buf, &frame) } -> std::same_as<int>;
+                    c.Consume(buf);
+                    { c.Parsed() } -> std::same_as<size_t>;
+                    { c.Decode(frame, &req) } -> std::same_as<bool>;
+                    { c.Decode(frame, &resp) } -> std::same_as<bool>;
+                    c.Encode(req, out);
+                    c.Encode(resp, out);
+                    { c.FrameKind() } -> std::same_as<uint8_t>;
+                    { c.WantClose() } -> std::same_as<bool>;
+                    c.Reject(out);
+                    c.SetMaxFrame(size_t());
+                    { C::name } -> std::convertible_to<const char *>;
+                };
+
+// 长度报头 + JSON
+// 批量请求、表达式请求和请求编号只有二进制协议支持
+class JsonCodec
+{
+public:
+    static constexpr const char *name = "json";
+
+    int Next(const std::string &buf, std::string_view *frame) { return parser_.Next(buf, frame); }
+    void Consume(std::string &buf) { parser_.Consume(buf); }
+    size_t Parsed() const { return parser_.Parsed(); }
+    void SetMaxFrame(size_t n) { parser_.SetMaxFrame(n); }
+    uint8_t FrameKind() const { return 0; }
+    bool WantClose() const { return false; }
+    void Reject(std::string *) {}
+
+    bool Decode(std::string_view frame, Request *req) { return req->Deserialize(frame); }
+    bool Decode(std::string_view frame, Response *resp) { return resp->Deserialize(frame); }
+
+    void Encode(const Request &req, std::string *out)
+    {
+        char body[protocol_ns_json::max_json_len];
+        protocol_ns_json::AppendFrame(out, body, req.SerializeTo(body));
+    }
+    void Encode(const Response &resp, std::string *out)
+    {
+        char body[protocol_ns_json::max_json_len];
+        protocol_ns_json::AppendFrame(out, body, resp.SerializeTo(body));
+    }
+
+private:
+    protocol_ns_json::FrameParser parser_;
+};
+
+// 类型标签 + 定长二进制
+class BinaryCodec
+{
+public:
+    static constexpr const char *name = "binary";
+
+    int Next(const std::string &buf, std::string_view *frame) { return parser_.Next(buf, frame, &tag_); }
+    void Consume(std::string &buf) { parser_.Consume(buf); }
+    size_t Parsed() const { return parser_.Parsed(); }
+    void SetMaxFrame(size_t n) { parser_.SetMaxFrame(n); }
+    // 单个和批量报文的有效载荷可能相同; 带编号的报文有效载荷中含编号, 不同编号的请求不会命中同一个缓存
+    uint8_t FrameKind() const { return tag_; }
+    bool WantClose() const { return false; }
+    void Reject(std::string *) {}
+
+    // 报文的类型标签必须与要解出的类型一致, 单个和批量报文都解到同一个Request/Response
+    // 带编号的报文同时解出_id/_hasid
+    bool Decode(std::string_view frame, Request *req)
+    {
+        uint8_t tag = tag_;
+        if (!protocol_ns_binary::SplitId(&tag, &frame, &req->_id, &req->_hasid))
+            return false;
+        if (tag == protocol_ns_binary::TAG_REQUEST)
+            return protocol_ns_binary::DecodeRequest(frame, req);
+        if (tag == protocol_ns_binary::TAG_BATCH_REQUEST)
+            return protocol_ns_binary::DecodeBatchRequest(frame, req);
+        if (tag == protocol_ns_binary::TAG_EXPR_REQUEST)
+            return protocol_ns_binary::DecodeExprRequest(frame, req);
+        return false;
+    }
+    bool Decode(std::string_view frame, Response *resp)
+    {
+        uint8_t tag = tag_;
+        if (!protocol_ns_binary::SplitId(&tag, &frame, &resp->_id, &resp->_hasid))
+            return false;
+        if (tag == protocol_ns_binary::TAG_RESPONSE)
+            return protocol_ns_binary::DecodeResponse(frame, resp);
+        if (tag == protocol_ns_binary::TAG_BATCH_RESPONSE)
+            return protocol_ns_binary::DecodeBatchResponse(frame, resp);
+        if (tag == protocol_ns_binary::TAG_EXPR_RESPONSE)
+            return protocol_ns_binary::DecodeExprResponse(frame, resp);
+        return false;
+    }
+
+    void Encode(const Request &req, std::string *out)
+    {
+        if (req.IsExpr())
+            protocol_ns_binary::EncodeExprRequest(req, out);
+        else if (req.IsBatch())
+            protocol_ns_binary::EncodeBatchRequest(req, out);
+        else
+            protocol_ns_binary::EncodeRequest(req, out);
+    }
+    void Encode(const Response &resp, std::string *out)
+    {
+        if (resp.IsExpr())
+            protocol_ns_binary::EncodeExprResponse(resp, out);
+        else if (resp.IsBatch())
+            protocol_ns_binary::EncodeBatchResponse(resp, out);
+        else
+            protocol_ns_binary::EncodeResponse(resp, out);
+    }
+
+private:
+    protocol_ns_binary::FrameParser parser_;
+    uint8_t tag_ = 0; // 最近一个报文的类型标签
+};
+
+// 按行分隔的文本
+class LineCodec
+{
+public:
+    static constexpr const char *name = "line";
+
+    int Next(const std::string &buf, std::string_view *frame) { return parser_.Next(buf, frame); }
+    void Consume(std::string &buf) { parser_.Consume(buf); }
+    size_t Parsed() const { return parser_.Parsed(); }
+    void SetMaxFrame(size_t n) { parser_.SetMaxFrame(n); }
+    uint8_t FrameKind() const { return 0; }
+    bool WantClose() const { return false; }
+    void Reject(std::string *) {}
+
+    bool Decode(std::string_view frame, Request *req) { return protocol_ns_line::DecodeRequest(frame, req); }
+    bool Decode(std::string_view frame, Response *resp) { return protocol_ns_line::DecodeResponse(frame, resp); }
+
+    void Encode(const Request &req, std::string *out) { protocol_ns_line::EncodeRequest(req, out); }
+    void Encode(const Response &resp, std::string *out) { protocol_ns_line::EncodeResponse(resp, out); }
+
+private:
+    protocol_ns_line::FrameParser parser_;
+};
+
+// HTTP/1.1, 服务器端只接受POST /calc, 报文体是JSON协议的有效载荷
+// 同一个Codec也用于客户端(PipelineClient<HttpCodec>): 解析响应, 编码请求
+class HttpCodec
+{
+public:
+    static constexpr const char *name = "http";
+
+    // 请求在这里完成路由, 不是POST /calc的请求都是非法报文, 由Reject给出对应的状态码
+    int Next(const std::string &buf, std::string_view *frame)
+    {
+        int ret = parser_.Next(buf, &msg_);
+        if (ret < 0)
+            return Fail(parser_.Status());
+        if (ret == 0)
+            return 0;
+        if (!msg_.response_)
+        {
+            if (msg_.minor_ >= 1)
+                kind_ = msg_.keepalive_ ? KIND_HTTP11 : KIND_HTTP11_CLOSE;
+            else
+                kind_ = msg_.keepalive_ ? KIND_HTTP10_KEEPALIVE : KIND_HTTP10;
+            if (msg_.target_ != protocol_ns_http::calc_path)
+                return Fail(404);
+            if (msg_.method_ != "POST")
+                return Fail(405);
+            if (!msg_.haslength_)
+                return Fail(411);
+        }
+        *frame = msg_.body_;
+        return 1;
+    }
+    void Consume(std::string &buf) { parser_.Consume(buf); }
+    size_t Parsed() const { return parser_.Parsed(); }
+    void SetMaxFrame(size_t n) { parser_.SetMaxFrame(n); }
+
+    // 响应首部随请求的版本和Connection选项而不同, 四种情况的响应报文分别缓存
+    // 响应按最近一个请求的版本编码, 同一连接上的请求版本一致
+    uint8_t FrameKind() const { return kind_; }
+    bool WantClose() const { return !msg_.keepalive_; }
+    void Reject(std::string *out) { protocol_ns_http::EncodeError(status_, out); }
+
+    bool Decode(std::string_view frame, Request *req)
+    {
+        if (!msg_.response_ && req->Deserialize(frame))
+            return true;
+        status_ = 400;
+        return false;
+    }
+    // 非200的响应(例如请求非法)视为失败
+    bool Decode(std::string_view frame, Response *resp)
+    {
+        return msg_.response_ && msg_.status_ == 200 && resp->Deserialize(frame);
+    }
+
+    void Encode(const Request &req, std::string *out) { protocol_ns_http::EncodeRequest(req, out); }
+    // 发完响应后要关闭连接的, 响应中声明Connection: close
+    void Encode(const Response &resp, std::string *out)
+    {
+        protocol_ns_http::EncodeResponse(resp, kind_ == KIND_HTTP11 ? nullptr : kind_ == KIND_HTTP10_KEEPALIVE ? "keep-alive" : "close", out);
+    }
+
+private:
+    enum
+    {
+        KIND_HTTP11,
+        KIND_HTTP10_KEEPALIVE,
+        KIND_HTTP10,
+        KIND_HTTP11_CLOSE
+    };
+
+    int Fail(int status)
+    {
+        status_ = status;
+        return -1;
+    }
+
+    protocol_ns_http::FrameParser parser_;
+    protocol_ns_http::Message msg_; // 最近一个报文, 指向接收缓冲区
+    uint8_t kind_ = KIND_HTTP11;
+    int status_ = 400; // 报文非法时应答的状态码
+};
+
+// 编解码方式, 由连接的第一个字节决定
+enum codec_t
+{
+    CODEC_UNKNOWN,
+    CODEC_JSON,
+    CODEC_BINARY,
+    CODEC_HTTP
+};
+
+// JSON报文以十进制长度开头, 二进制报文以类型标签开头, 类型标签都不是数字, HTTP请求以大写的方法名开头
+codec_t DetectCodec(char first)
+{
+    if (first >= '0' && first <= '9')
+        return CODEC_JSON;
+    if (first >= 'A' && first <= 'Z')
+        return CODEC_HTTP;
+    if (protocol_ns_binary::ValidTag((uint8_t)first))
+        return CODEC_BINARY;
+    return CODEC_UNKNOWN;
+}
+
+// 服务器默认的编解码方式: 每个连接根据第一个字节在JSON、二进制和HTTP之间选择
+// 只是在几个内联的Codec之间做一次分支, 同样没有虚函数
+// 还没有收到数据时按JSON编码
+class AutoCodec
+{
+public:
+    static constexpr const char *name = "auto";
+
+    int Next(const std::string &buf, std::string_view *frame)
+    {
+        if (codec_ == CODEC_UNKNOWN)
+        {
+            if (buf.empty())
+                return 0;
+            codec_ = DetectCodec(buf[0]);
+        }
+        if (codec_ == CODEC_JSON)
+            return json_.Next(buf, frame);
+        if (codec_ == CODEC_BINARY)
+            return binary_.Next(buf, frame);
+        if (codec_ == CODEC_HTTP)
+            return http_.Next(buf, frame);
+        return -1;
+    }
+    size_t Parsed() const
+    {
+        if (codec_ == CODEC_BINARY)
+            return binary_.Parsed();
+        if (codec_ == CODEC_JSON)
+            return json_.Parsed();
+        return codec_ == CODEC_HTTP ? http_.Parsed() : 0;
+    }
+    void Consume(std::string &buf)
+    {
+        if (codec_ == CODEC_BINARY)
+            binary_.Consume(buf);
+        else if (codec_ == CODEC_JSON)
+            json_.Consume(buf);
+        else if (codec_ == CODEC_HTTP)
+            http_.Consume(buf);
+    }
+    void SetMaxFrame(size_t n)
+    {
+        json_.SetMaxFrame(n);
+        binary_.SetMaxFrame(n);
+        http_.SetMaxFrame(n);
+    }
+
+    bool Decode(std::string_view frame, Request *req)
+    {
+        if (codec_ == CODEC_BINARY)
+            return binary_.Decode(frame, req);
+        return codec_ == CODEC_HTTP ? http_.Decode(frame, req) : json_.Decode(frame, req);
+    }
+    bool Decode(std::string_view frame, Response *resp)
+    {
+        if (codec_ == CODEC_BINARY)
+            return binary_.Decode(frame, resp);
+        return codec_ == CODEC_HTTP ? http_.Decode(frame, resp) : json_.Decode(frame, resp);
+    }
+
+    void Encode(const Request &req, std::string *out)
+    {
+        if (codec_ == CODEC_BINARY)
+            binary_.Encode(req, out);
+        else if (codec_ == CODEC_HTTP)
+            http_.Encode(req, out);
+        else
+            json_.Encode(req, out);
+    }
+    void Encode(const Response &resp, std::string *out)
+    {
+        if (codec_ == CODEC_BINARY)
+            binary_.Encode(resp, out);
+        else if (codec_ == CODEC_HTTP)
+            http_.Encode(resp, out);
+        else
+            json_.Encode(resp, out);
+    }
+
+    // JSON报文的类型为0, 二进制报文的类型标签都在0xB1以上
+    // HTTP与JSON的有效载荷相同, 类型必须区分开, 否则会从缓存中取到另一种协议的响应
+    uint8_t FrameKind() const
+    {
+        if (codec_ == CODEC_BINARY)
+            return binary_.FrameKind();
+        return codec_ == CODEC_HTTP ? http_kind_base + http_.FrameKind() : 0;
+    }
+    bool WantClose() const { return codec_ == CODEC_HTTP && http_.WantClose(); }
+    void Reject(std::string *out)
+    {
+        if (codec_ == CODEC_HTTP)
+            http_.Reject(out);
+    }
+
+    codec_t Detected() const { return codec_; }
+
+private:
+    static const uint8_t http_kind_base = 0x10;
+
+    codec_t codec_ = CODEC_UNKNOWN;
+    JsonCodec json_;
+    BinaryCodec binary_;
+    HttpCodec http_;
+};
+
+static_assert(Codec<JsonCodec> && Codec<BinaryCodec> && Codec<LineCodec> && Codec<HttpCodec> && Codec<AutoCodec>);
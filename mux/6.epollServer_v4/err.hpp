@@ -14,5 +14,8 @@ enum ERR_TYPE
     INPUT_ERR,
     EPOLL_CREATE_ERR,
     EPOLL_WAIT_ERR,
-    EPOLL_CTL_ERR
+    EPOLL_CTL_ERR,
+    LOG_OPEN_ERR,
+    LOG_DECODE_ERR,
+    CAPTURE_OPEN_ERR
 };
\ No newline at end of file
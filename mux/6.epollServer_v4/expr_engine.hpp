@@ -0,0 +1,733 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <charconv>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// 表达式引擎: 把表达式文本编译成寄存器字节码, 再用解释器循环求值
+// 语法: + - * / % 一元+-, 括号, 整数/小数常量, 变量名([A-Za-z_][A-Za-z0-9_]*)
+// 类型: int64和double, 整数常量为int64, 带小数点或指数的常量为double, 变量的类型由调用者给出
+//       两个操作数有一个是double时按double计算, 否则按int64计算
+// 语义与calc_kernel.hpp一致: int64的+ - *按补码回绕; 除数为0时'/'错误码1, '%'错误码2;
+//       INT64_MIN / -1 结果为INT64_MIN, % -1 结果为0; double按IEEE 754计算, '%'为fmod, 不产生错误码
+// 一组取值出错时结果为0, 错误码为求值顺序上第一个错误
+// 编译期确定每个中间结果的类型, 字节码中没有类型判断; 常量表达式在编译期折叠
+// 批量求值按列进行: 每条指令一次处理batch_chunk组取值, 循环次数固定, 编译器可以向量化
+// (int64乘法、除法、取模和fmod没有对应的SSE2指令, 仍逐个计算)
+
+namespace expr
+{
+    enum value_t : uint8_t
+    {
+        INT64 = 0,
+        DOUBLE = 1
+    };
+
+    // 错误码: 1/2对每组取值, 其余对整个请求
+    static const int ERR_DIV_ZERO = 1;
+    static const int ERR_MOD_ZERO = 2;
+    static const int ERR_SYNTAX = 4;
+    static const int ERR_UNKNOWN_VAR = 5;
+    static const int ERR_TOO_COMPLEX = 6;
+
+    static const size_t max_expr_len = 1024;
+    static const size_t max_vars = 64;
+    static const size_t max_name_len = 32;
+    static const size_t max_regs = 256; // 每种类型的寄存器个数上限
+    static const int max_depth = 64;     // 括号和一元运算的嵌套深度上限
+    static const size_t batch_chunk = 256;
+
+    inline int64_t AddI(int64_t x, int64_t y) { return (int64_t)((uint64_t)x + (uint64_t)y); }
+    inline int64_t SubI(int64_t x, int64_t y) { return (int64_t)((uint64_t)x - (uint64_t)y); }
+    inline int64_t MulI(int64_t x, int64_t y) { return (int64_t)((uint64_t)x * (uint64_t)y); }
+    inline int64_t NegI(int64_t x) { return (int64_t)(0 - (uint64_t)x); }
+    inline int64_t DivI(int64_t x, int64_t y) { return y == -1 ? NegI(x) : x / y; } // y不为0
+    inline int64_t ModI(int64_t x, int64_t y) { return y == -1 ? 0 : x % y; }
+
+    enum op_t : uint8_t
+    {
+        ADDI,
+        SUBI,
+        MULI,
+        DIVI,
+        MODI,
+        NEGI,
+        ADDD,
+        SUBD,
+        MULD,
+        DIVD,
+        MODD,
+        NEGD,
+        I2D // int64寄存器a转成double写入double寄存器dst
+    };
+
+    // 寄存器按类型分成两组, 操作数和结果在哪一组由op决定
+    struct Instr
+    {
+        op_t op_;
+        uint16_t dst_;
+        uint16_t a_;
+        uint16_t b_;
+    };
+
+    struct Program
+    {
+        int err_ = 0; // 编译错误码, 不为0时其余字段无效
+        std::vector<Instr> code_;
+        std::vector<int64_t> iinit_; // int64寄存器的初值(常量已经放好)
+        std::vector<double> dinit_;
+        struct Input
+        {
+            uint16_t var_; // 变量下标
+            uint16_t reg_; // 所在寄存器, 寄存器组由变量类型决定
+            value_t type_;
+        };
+        std::vector<Input> inputs_; // 表达式中用到的变量
+        value_t type_ = INT64;      // 结果类型
+        uint16_t result_ = 0;       // 结果所在寄存器
+    };
+
+    // 递归下降, 边解析边生成代码
+    // 中间结果用完就释放寄存器, 寄存器个数取决于表达式的嵌套深度而不是长度
+    // 先分配结果寄存器再释放操作数, 一条指令的结果寄存器不会与操作数相同(批量求值的列运算依赖这一点)
+    class Compiler
+    {
+    public:
+        Compiler(std::string_view text, const std::vector<std::string> &names, const std::vector<uint8_t> &types, Program *p)
+            : text_(text), names_(names), types_(types), p_(p), pos_(0), err_(0), varreg_(names.size(), -1)
+        {
+        }
+
+        // 返回0或错误码, 错误码同时写入Program::err_
+        int Run()
+        {
+            Operand r;
+            if (text_.size() > max_expr_len || names_.size() > max_vars || names_.size() != types_.size())
+                err_ = ERR_SYNTAX;
+            else if (Expr(&r, 0))
+            {
+                SkipSpace();
+                if (pos_ != text_.size())
+                    err_ = ERR_SYNTAX;
+                else if (Materialize(&r))
+                {
+                    p_->type_ = r.type_;
+                    p_->result_ = r.reg_;
+                }
+            }
+            p_->err_ = err_;
+            return err_;
+        }
+
+    private:
+        // 编译期的操作数: 常量(可以继续折叠)或寄存器
+        struct Operand
+        {
+            value_t type_ = INT64;
+            bool const_ = true;
+            int64_t i_ = 0;
+            double d_ = 0;
+            uint16_t reg_ = 0;
+            bool temp_ = false; // 临时寄存器, 用完释放; 常量和变量的寄存器不释放
+        };
+
+        void SkipSpace()
+        {
+            while (pos_ < text_.size() && (text_[pos_] == ' ' || text_[pos_] == '\t'))
+                pos_++;
+        }
+
+        bool Fail(int err)
+        {
+            if (err_ == 0)
+                err_ = err;
+            return false;
+        }
+
+        // expr := term (('+' | '-') term)*
+        bool Expr(Operand *out, int depth)
+        {
+            if (!Term(out, depth))
+                return false;
+            while (true)
+            {
+                SkipSpace();
+                if (pos_ == text_.size() || (text_[pos_] != '+' && text_[pos_] != '-'))
+                    return true;
+                char op = text_[pos_++];
+                Operand rhs;
+                if (!Term(&rhs, depth) || !Binary(op, *out, rhs, out))
+                    return false;
+            }
+        }
+
+        // term := unary (('*' | '/' | '%') unary)*
+        bool Term(Operand *out, int depth)
+        {
+            if (!Unary(out, depth))
+                return false;
+            while (true)
+            {
+                SkipSpace();
+                if (pos_ == text_.size() || (text_[pos_] != '*' && text_[pos_] != '/' && text_[pos_] != '%'))
+                    return true;
+                char op = text_[pos_++];
+                Operand rhs;
+                if (!Unary(&rhs, depth) || !Binary(op, *out, rhs, out))
+                    return false;
+            }
+        }
+
+        // unary := ('-' | '+') unary | primary
+        bool Unary(Operand *out, int depth)
+        {
+            if (depth > max_depth)
+                return Fail(ERR_TOO_COMPLEX);
+            SkipSpace();
+            if (pos_ < text_.size() && (text_[pos_] == '-' || text_[pos_] == '+'))
+            {
+                char op = text_[pos_++];
+                if (!Unary(out, depth + 1))
+                    return false;
+                return op == '+' || Negate(out);
+            }
+            return Primary(out, depth);
+        }
+
+        // primary := number | name | '(' expr ')'
+        bool Primary(Operand *out, int depth)
+        {
+            if (pos_ == text_.size())
+                return Fail(ERR_SYNTAX);
+            char c = text_[pos_];
+            if (c == '(')
+            {
+                pos_++;
+                if (!Expr(out, depth + 1))
+                    return false;
+                SkipSpace();
+                if (pos_ == text_.size() || text_[pos_] != ')')
+                    return Fail(ERR_SYNTAX);
+                pos_++;
+                return true;
+            }
+            if ((c >= '0' && c <= '9') || c == '.')
+                return Number(out);
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_')
+                return Variable(out);
+            return Fail(ERR_SYNTAX);
+        }
+
+        bool Number(Operand *out)
+        {
+            size_t end = pos_;
+            bool isdouble = false;
+            while (end < text_.size() && text_[end] >= '0' && text_[end] <= '9')
+                end++;
+            if (end < text_.size() && text_[end] == '.')
+            {
+                isdouble = true;
+                end++;
+                while (end < text_.size() && text_[end] >= '0' && text_[end] <= '9')
+                    end++;
+            }
+            if (end < text_.size() && (text_[end] == 'e' || text_[end] == 'E'))
+            {
+                isdouble = true;
+                end++;
+                if (end < text_.size() && (text_[end] == '+' || text_[end] == '-'))
+                    end++;
+                while (end < text_.size() && text_[end] >= '0' && text_[end] <= '9')
+                    end++;
+            }
+            const char *first = text_.data() + pos_, *last = text_.data() + end;
+            std::from_chars_result res;
+            if (isdouble)
+                res = std::from_chars(first, last, out->d_);
+            else
+                res = std::from_chars(first, last, out->i_); // 超出int64范围视为语法错误
+            if (res.ec != std::errc() || res.ptr != last)
+                return Fail(ERR_SYNTAX);
+            out->type_ = isdouble ? DOUBLE : INT64;
+            out->const_ = true;
+            pos_ = end;
+            return true;
+        }
+
+        bool Variable(Operand *out)
+        {
+            size_t end = pos_;
+            while (end < text_.size() && ((text_[end] >= 'a' && text_[end] <= 'z') || (text_[end] >= 'A' && text_[end] <= 'Z') ||
+                                          (text_[end] >= '0' && text_[end] <= '9') || text_[end] == '_'))
+                end++;
+            std::string_view name = text_.substr(pos_, end - pos_);
+            pos_ = end;
+            size_t k = 0;
+            while (k < names_.size() && names_[k] != name)
+                k++;
+            if (k == names_.size())
+                return Fail(ERR_UNKNOWN_VAR);
+
+            value_t type = types_[k] == DOUBLE ? DOUBLE : INT64;
+            if (varreg_[k] < 0)
+            {
+                int reg = AllocFixed(type);
+                if (reg < 0)
+                    return false;
+                varreg_[k] = reg;
+                p_->inputs_.push_back({(uint16_t)k, (uint16_t)reg, type});
+            }
+            out->type_ = type;
+            out->const_ = false;
+            out->reg_ = varreg_[k];
+            out->temp_ = false;
+            return true;
+        }
+
+        // 寄存器分配: 常量和变量各占一个固定寄存器, 中间结果用临时寄存器, 用完放回空闲表
+        int AllocFixed(value_t type)
+        {
+            size_t n = type == DOUBLE ? p_->dinit_.size() : p_->iinit_.size();
+            if (n >= max_regs)
+            {
+                Fail(ERR_TOO_COMPLEX);
+                return -1;
+            }
+            if (type == DOUBLE)
+                p_->dinit_.push_back(0);
+            else
+                p_->iinit_.push_back(0);
+            return (int)n;
+        }
+        int AllocTemp(value_t type)
+        {
+            std::vector<uint16_t> &freelist = type == DOUBLE ? dfree_ : ifree_;
+            if (!freelist.empty())
+            {
+                int reg = freelist.back();
+                freelist.pop_back();
+                return reg;
+            }
+            return AllocFixed(type);
+        }
+        void Release(const Operand &o)
+        {
+            if (!o.const_ && o.temp_)
+                (o.type_ == DOUBLE ? dfree_ : ifree_).push_back(o.reg_);
+        }
+
+        // 常量放进寄存器
+        bool Materialize(Operand *o)
+        {
+            if (!o->const_)
+                return true;
+            int reg = AllocFixed(o->type_);
+            if (reg < 0)
+                return false;
+            if (o->type_ == DOUBLE)
+                p_->dinit_[reg] = o->d_;
+            else
+                p_->iinit_[reg] = o->i_;
+            o->const_ = false;
+            o->reg_ = reg;
+            o->temp_ = false;
+            return true;
+        }
+
+        void Emit(op_t op, uint16_t dst, uint16_t a, uint16_t b = 0)
+        {
+            p_->code_.push_back(Instr{op, dst, a, b});
+        }
+
+        bool ToDouble(Operand *o)
+        {
+            if (o->type_ == DOUBLE)
+                return true;
+            if (o->const_)
+            {
+                o->d_ = (double)o->i_;
+                o->type_ = DOUBLE;
+                return true;
+            }
+            int reg = AllocTemp(DOUBLE);
+            if (reg < 0)
+                return false;
+            Release(*o);
+            Emit(I2D, reg, o->reg_);
+            o->type_ = DOUBLE;
+            o->reg_ = reg;
+            o->temp_ = true;
+            return true;
+        }
+
+        bool Negate(Operand *o)
+        {
+            if (o->const_)
+            {
+                if (o->type_ == DOUBLE)
+                    o->d_ = -o->d_;
+                else
+                    o->i_ = NegI(o->i_);
+                return true;
+            }
+            int reg = AllocTemp(o->type_);
+            if (reg < 0)
+                return false;
+            Release(*o);
+            Emit(o->type_ == DOUBLE ? NEGD : NEGI, reg, o->reg_);
+            o->reg_ = reg;
+            o->temp_ = true;
+            return true;
+        }
+
+        bool Binary(char op, Operand a, Operand b, Operand *out)
+        {
+            value_t type = a.type_ == DOUBLE || b.type_ == DOUBLE ? DOUBLE : INT64;
+            if (type == DOUBLE && (!ToDouble(&a) || !ToDouble(&b)))
+                return false;
+
+            // 常量折叠; 除数为0的整数除法留到运行时, 由每组取值报告错误
+            if (a.const_ && b.const_ && (type == DOUBLE || (op != '/' && op != '%') || b.i_ != 0))
+            {
+                out->type_ = type;
+                out->const_ = true;
+                if (type == DOUBLE)
+                    out->d_ = FoldD(op, a.d_, b.d_);
+                else
+                    out->i_ = FoldI(op, a.i_, b.i_);
+                return true;
+            }
+
+            if (!Materialize(&a) || !Materialize(&b))
+                return false;
+            int reg = AllocTemp(type);
+            if (reg < 0)
+                return false;
+            Release(a);
+            Release(b);
+            static const op_t iops[] = {ADDI, SUBI, MULI, DIVI, MODI};
+            static const op_t dops[] = {ADDD, SUBD, MULD, DIVD, MODD};
+            int k = op == '+' ? 0 : op == '-' ? 1 : op == '*' ? 2 : op == '/' ? 3 : 4;
+            Emit(type == DOUBLE ? dops[k] : iops[k], reg, a.reg_, b.reg_);
+            out->type_ = type;
+            out->const_ = false;
+            out->reg_ = reg;
+            out->temp_ = true;
+            return true;
+        }
+
+        static int64_t FoldI(char op, int64_t x, int64_t y)
+        {
+            switch (op)
+            {
+            case '+':
+                return AddI(x, y);
+            case '-':
+                return SubI(x, y);
+            case '*':
+                return MulI(x, y);
+            case '/':
+                return DivI(x, y);
+            default:
+                return ModI(x, y);
+            }
+        }
+        static double FoldD(char op, double x, double y)
+        {
+            switch (op)
+            {
+            case '+':
+                return x + y;
+            case '-':
+                return x - y;
+            case '*':
+                return x * y;
+            case '/':
+                return x / y;
+            default:
+                return std::fmod(x, y);
+            }
+        }
+
+        std::string_view text_;
+        const std::vector<std::string> &names_;
+        const std::vector<uint8_t> &types_;
+        Program *p_;
+        size_t pos_;
+        int err_;
+        std::vector<int> varreg_; // 变量下标 -> 寄存器, -1表示还没用到
+        std::vector<uint16_t> ifree_;
+        std::vector<uint16_t> dfree_;
+    };
+
+    // names/types: 变量名和类型(value_t), 一一对应
+    inline int Compile(std::string_view text, const std::vector<std::string> &names, const std::vector<uint8_t> &types, Program *p)
+    {
+        *p = Program();
+        return Compiler(text, names, types, p).Run();
+    }
+
+    // 求值一组取值: vars[k]为第k个变量的值(double按位存放在int64中)
+    // 结果(按位)写入*ret, 返回错误码
+    inline int Eval(const Program &p, const int64_t *vars, int64_t *ret)
+    {
+        int64_t ir[max_regs];
+        double dr[max_regs];
+        memcpy(ir, p.iinit_.data(), p.iinit_.size() * sizeof(int64_t));
+        memcpy(dr, p.dinit_.data(), p.dinit_.size() * sizeof(double));
+        for (const Program::Input &in : p.inputs_)
+        {
+            if (in.type_ == DOUBLE)
+                dr[in.reg_] = std::bit_cast<double>(vars[in.var_]);
+            else
+                ir[in.reg_] = vars[in.var_];
+        }
+
+        int code = 0;
+        for (const Instr &ins : p.code_)
+        {
+            switch (ins.op_)
+            {
+            case ADDI:
+                ir[ins.dst_] = AddI(ir[ins.a_], ir[ins.b_]);
+                break;
+            case SUBI:
+                ir[ins.dst_] = SubI(ir[ins.a_], ir[ins.b_]);
+                break;
+            case MULI:
+                ir[ins.dst_] = MulI(ir[ins.a_], ir[ins.b_]);
+                break;
+            case DIVI:
+            case MODI:
+            {
+                int64_t x = ir[ins.a_], y = ir[ins.b_];
+                if (y == 0)
+                {
+                    if (code == 0)
+                        code = ins.op_ == DIVI ? ERR_DIV_ZERO : ERR_MOD_ZERO;
+                    ir[ins.dst_] = 0;
+                }
+                else
+                    ir[ins.dst_] = ins.op_ == DIVI ? DivI(x, y) : ModI(x, y);
+                break;
+            }
+            case NEGI:
+                ir[ins.dst_] = NegI(ir[ins.a_]);
+                break;
+            case ADDD:
+                dr[ins.dst_] = dr[ins.a_] + dr[ins.b_];
+                break;
+            case SUBD:
+                dr[ins.dst_] = dr[ins.a_] - dr[ins.b_];
+                break;
+            case MULD:
+                dr[ins.dst_] = dr[ins.a_] * dr[ins.b_];
+                break;
+            case DIVD:
+                dr[ins.dst_] = dr[ins.a_] / dr[ins.b_];
+                break;
+            case MODD:
+                dr[ins.dst_] = std::fmod(dr[ins.a_], dr[ins.b_]);
+                break;
+            case NEGD:
+                dr[ins.dst_] = -dr[ins.a_];
+                break;
+            case I2D:
+                dr[ins.dst_] = (double)ir[ins.a_];
+                break;
+            }
+        }
+        if (code != 0)
+            *ret = 0;
+        else
+            *ret = p.type_ == DOUBLE ? std::bit_cast<int64_t>(dr[p.result_]) : ir[p.result_];
+        return code;
+    }
+
+    // 批量求值的列运算, 每次处理batch_chunk个元素; 结果列与操作数列不重叠, 循环次数固定, -O2就能向量化
+    template <class T, class F>
+    inline void Column(T *__restrict d, const T *__restrict a, const T *__restrict b, F f)
+    {
+        for (size_t i = 0; i < batch_chunk; i++)
+            d[i] = f(a[i], b[i]);
+    }
+
+    // 整数除法和取模逐个判断除数, 不能向量化
+    inline void DivModColumn(int64_t *d, const int64_t *a, const int64_t *b, int *code, bool mod)
+    {
+        for (size_t i = 0; i < batch_chunk; i++)
+        {
+            int64_t x = a[i], y = b[i];
+            if (y == 0)
+            {
+                if (code[i] == 0)
+                    code[i] = mod ? ERR_MOD_ZERO : ERR_DIV_ZERO;
+                d[i] = 0;
+            }
+            else
+                d[i] = mod ? ModI(x, y) : DivI(x, y);
+        }
+    }
+
+    // 批量求值rows组取值, 结果与逐组调用Eval相同
+    // vals按变量分列存放: 第k个变量的第r组取值为vals[k * rows + r]; 结果和错误码写入ret/code
+    inline void EvalBatch(const Program &p, const int64_t *vals, size_t rows, int64_t *ret, int *code)
+    {
+        // 每个寄存器一列; 常量寄存器在整个批量中不变, 只填一次
+        thread_local std::vector<int64_t> icol;
+        thread_local std::vector<double> dcol;
+        icol.resize(p.iinit_.size() * batch_chunk);
+        dcol.resize(p.dinit_.size() * batch_chunk);
+        for (size_t r = 0; r < p.iinit_.size(); r++)
+            std::fill_n(icol.data() + r * batch_chunk, batch_chunk, p.iinit_[r]);
+        for (size_t r = 0; r < p.dinit_.size(); r++)
+            std::fill_n(dcol.data() + r * batch_chunk, batch_chunk, p.dinit_[r]);
+        auto I = [&](uint16_t r)
+        { return icol.data() + r * batch_chunk; };
+        auto D = [&](uint16_t r)
+        { return dcol.data() + r * batch_chunk; };
+
+        for (size_t base = 0; base < rows; base += batch_chunk)
+        {
+            size_t m = std::min(batch_chunk, rows - base); // 最后一块不足时多算的部分取值为0, 结果丢弃
+            for (const Program::Input &in : p.inputs_)
+            {
+                const int64_t *src = vals + in.var_ * rows + base;
+                if (in.type_ == DOUBLE)
+                {
+                    double *dst = D(in.reg_);
+                    for (size_t i = 0; i < m; i++)
+                        dst[i] = std::bit_cast<double>(src[i]);
+                    std::fill(dst + m, dst + batch_chunk, 0.0);
+                }
+                else
+                {
+                    int64_t *dst = I(in.reg_);
+                    memcpy(dst, src, m * sizeof(int64_t));
+                    std::fill(dst + m, dst + batch_chunk, 0);
+                }
+            }
+
+            int c[batch_chunk] = {0};
+            for (const Instr &ins : p.code_)
+            {
+                switch (ins.op_)
+                {
+                case ADDI:
+                    Column(I(ins.dst_), I(ins.a_), I(ins.b_), AddI);
+                    break;
+                case SUBI:
+                    Column(I(ins.dst_), I(ins.a_), I(ins.b_), SubI);
+                    break;
+                case MULI:
+                    Column(I(ins.dst_), I(ins.a_), I(ins.b_), MulI);
+                    break;
+                case DIVI:
+                    DivModColumn(I(ins.dst_), I(ins.a_), I(ins.b_), c, false);
+                    break;
+                case MODI:
+                    DivModColumn(I(ins.dst_), I(ins.a_), I(ins.b_), c, true);
+                    break;
+                case NEGI:
+                    Column(I(ins.dst_), I(ins.a_), I(ins.a_), [](int64_t x, int64_t)
+                           { return NegI(x); });
+                    break;
+                case ADDD:
+                    Column(D(ins.dst_), D(ins.a_), D(ins.b_), [](double x, double y)
+                           { return x + y; });
+                    break;
+                case SUBD:
+                    Column(D(ins.dst_), D(ins.a_), D(ins.b_), [](double x, double y)
+                           { return x - y; });
+                    break;
+                case MULD:
+                    Column(D(ins.dst_), D(ins.a_), D(ins.b_), [](double x, double y)
+                           { return x * y; });
+                    break;
+                case DIVD:
+                    Column(D(ins.dst_), D(ins.a_), D(ins.b_), [](double x, double y)
+                           { return x / y; });
+                    break;
+                case MODD:
+                    Column(D(ins.dst_), D(ins.a_), D(ins.b_), [](double x, double y)
+                           { return std::fmod(x, y); });
+                    break;
+                case NEGD:
+                    Column(D(ins.dst_), D(ins.a_), D(ins.a_), [](double x, double)
+                           { return -x; });
+                    break;
+                case I2D:
+                {
+                    double *d = D(ins.dst_);
+                    const int64_t *a = I(ins.a_);
+                    for (size_t i = 0; i < batch_chunk; i++)
+                        d[i] = (double)a[i];
+                    break;
+                }
+                }
+            }
+
+            for (size_t i = 0; i < m; i++)
+            {
+                code[base + i] = c[i];
+                if (c[i] != 0)
+                    ret[base + i] = 0;
+                else
+                    ret[base + i] = p.type_ == DOUBLE ? std::bit_cast<int64_t>(D(p.result_)[i]) : I(p.result_)[i];
+            }
+        }
+    }
+
+    // 编译结果的缓存, 键为 变量类型 + 变量名 + 表达式文本, 编译失败的结果也缓存
+    // 每个线程一份, 不加锁; 满了以后随机淘汰一个(哈希表的第一个元素)
+    class ProgramCache
+    {
+    public:
+        explicit ProgramCache(size_t capacity) : capacity_(capacity), hits_(0), misses_(0)
+        {
+        }
+
+        // 返回的指针在下一次Get之前有效
+        const Program *Get(std::string_view text, const std::vector<std::string> &names, const std::vector<uint8_t> &types)
+        {
+            key_.clear();
+            key_.append((const char *)types.data(), types.size());
+            for (const std::string &name : names)
+            {
+                key_ += name;
+                key_ += '\0';
+            }
+            key_ += '\1';
+            key_.append(text);
+
+            auto it = programs_.find(key_);
+            if (it != programs_.end())
+            {
+                hits_++;
+                return &it->second;
+            }
+            misses_++;
+            if (programs_.size() >= capacity_)
+                programs_.erase(programs_.begin());
+            Program &p = programs_[key_];
+            Compile(text, names, types, &p);
+            return &p;
+        }
+
+        uint64_t Hits() const { return hits_; }
+        uint64_t Misses() const { return misses_; }
+
+    private:
+        size_t capacity_;
+        uint64_t hits_;
+        uint64_t misses_;
+        std::string key_; // 复用的键缓冲, 命中时不申请内存
+        std::unordered_map<std::string, Program> programs_;
+    };
+};
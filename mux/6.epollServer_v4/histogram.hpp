@@ -0,0 +1,91 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+// 延迟直方图(HDR风格的对数-线性分桶): 小于hist_sub_buckets的值每个一个桶, 之后每翻一倍分hist_sub_buckets/2个桶
+// 任何值落在桶里的相对误差不超过2/hist_sub_buckets, 记录一次只是几次位运算和一次加法, 不分配内存
+// 多个线程各记各的, 结束后Merge到一起再算分位数
+static const int hist_sub_bits = 7;
+static const uint64_t hist_sub_buckets = 1 << hist_sub_bits;
+static const size_t hist_buckets = hist_sub_buckets + (64 - hist_sub_bits) * (hist_sub_buckets / 2);
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram() : counts_(hist_buckets, 0)
+    {
+    }
+
+    void Record(uint64_t v, uint64_t count = 1)
+    {
+        counts_[Index(v)] += count;
+        total_ += count;
+        sum_ += v * count;
+        max_ = std::max(max_, v);
+        min_ = std::min(min_, v);
+    }
+
+    void Merge(const LatencyHistogram &other)
+    {
+        for (size_t i = 0; i < hist_buckets; i++)
+            counts_[i] += other.counts_[i];
+        total_ += other.total_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+        min_ = std::min(min_, other.min_);
+    }
+
+    void Reset()
+    {
+        std::fill(counts_.begin(), counts_.end(), 0);
+        total_ = sum_ = max_ = 0;
+        min_ = UINT64_MAX;
+    }
+
+    // 第p分位(0 <= p <= 1)所在桶的上界, 不超过记录过的最大值; 没有记录时返回0
+    uint64_t Percentile(double p) const
+    {
+        if (total_ == 0)
+            return 0;
+        uint64_t rank = std::max<uint64_t>(1, (uint64_t)(p * total_ + 0.5)), seen = 0;
+        for (size_t i = 0; i < hist_buckets; i++)
+        {
+            seen += counts_[i];
+            if (seen >= rank)
+                return std::max(min_, std::min(max_, Highest(i)));
+        }
+        return max_;
+    }
+
+    uint64_t Count() const { return total_; }
+    uint64_t Max() const { return max_; }
+    uint64_t Min() const { return total_ ? min_ : 0; }
+    double Mean() const { return total_ ? (double)sum_ / total_ : 0; }
+
+    static size_t Index(uint64_t v)
+    {
+        if (v < hist_sub_buckets)
+            return v;
+        int shift = 63 - __builtin_clzll(v) - (hist_sub_bits - 1); // v >> shift落在[sub/2, sub)
+        return hist_sub_buckets + (shift - 1) * (hist_sub_buckets / 2) + ((v >> shift) - hist_sub_buckets / 2);
+    }
+
+    // 第i个桶里最大的值
+    static uint64_t Highest(size_t i)
+    {
+        if (i < hist_sub_buckets)
+            return i;
+        size_t shift = (i - hist_sub_buckets) / (hist_sub_buckets / 2) + 1;
+        uint64_t top = (i - hist_sub_buckets) % (hist_sub_buckets / 2) + hist_sub_buckets / 2;
+        return ((top + 1) << shift) - 1;
+    }
+
+private:
+    std::vector<uint64_t> counts_;
+    uint64_t total_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t max_ = 0;
+    uint64_t min_ = UINT64_MAX;
+};
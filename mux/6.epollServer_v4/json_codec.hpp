@@ -0,0 +1,534 @@
+#pragma once
+#include <string_view>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <climits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// 协议专用的JSON编解码, 替代热路径上的jsoncpp
+// 1.按字段表(schema)解码: 单遍扫描, 不建DOM树, 不申请堆内存, 只提取字段表中的整数字段
+// 2.接受的输入与jsoncpp Reader(默认配置) + asInt()一致:
+//   注释(// 和 /* */)、任意键顺序、重复键取最后一个、未知键(任意嵌套)跳过并校验
+//   数值: 整数、小数和指数(截断为int)、true/false(1/0)、null(0), 超出int范围或字符串/数组/对象视为失败(jsoncpp会抛异常)
+//   对象之后的多余内容忽略
+//   不同之处: jsoncpp解析出错时会保留已解析的部分字段, 这里直接返回失败;
+//   jsoncpp在值后面的注释之后会把任意一个记号当作','吞掉(如 1 /*c*/ 7), 这里不模仿, 视为格式错误
+// 3.字符串内容用SSE2一次扫描16字节, 查找'"'和'\\'
+
+namespace json_fast
+{
+    static const int max_depth = 1000; // 与jsoncpp的嵌套深度限制一致
+    static const size_t max_number_len = 256;
+
+    enum kind_t
+    {
+        KIND_NULL, // 字段不存在或为null
+        KIND_INT,
+        KIND_REAL,
+        KIND_BAD // 字符串、数组、对象, 或者超出范围的整数
+    };
+
+    // 字段表的一项
+    struct Field
+    {
+        Field(const char *name = "") : name_(name), len_(strlen(name)) {}
+
+        const char *name_;
+        size_t len_;
+        kind_t kind_ = KIND_NULL;
+        long long int_ = 0;
+        double real_ = 0;
+    };
+
+    class Decoder
+    {
+    public:
+        Decoder(std::string_view doc) : p_(doc.data()), end_(doc.data() + doc.size()) {}
+
+        // 解码一个JSON对象, 结果存入fields中同名的字段
+        bool DecodeObject(Field *fields, int n)
+        {
+            if (!SkipWs())
+                return false;
+            if (p_ == end_)
+                return false;
+            // 根为null时, jsoncpp的root["x"]得到null, 所有字段都是0
+            if (*p_ == 'n')
+                return Literal("null", 4);
+            if (*p_ != '{')
+                return false;
+            return ParseObject(0, fields, n);
+        }
+
+    private:
+        // 只跳过空白
+        void SkipSpaces()
+        {
+            while (p_ < end_ && (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r'))
+                p_++;
+        }
+
+        // 跳过空白和注释
+        bool SkipWs()
+        {
+            while (p_ < end_)
+            {
+                char c = *p_;
+                if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+                {
+                    p_++;
+                    continue;
+                }
+                if (c != '/')
+                    return true;
+                if (p_ + 1 >= end_)
+                    return false;
+                if (p_[1] == '/')
+                {
+                    p_ += 2;
+                    while (p_ < end_ && *p_ != '\n' && *p_ != '\r')
+                        p_++;
+                }
+                else if (p_[1] == '*')
+                {
+                    const char *close = nullptr;
+                    for (const char *q = p_ + 2; q + 1 < end_; q++)
+                    {
+                        if (q[0] == '*' && q[1] == '/')
+                        {
+                            close = q;
+                            break;
+                        }
+                    }
+                    if (close == nullptr)
+                        return false;
+                    p_ = close + 2;
+                }
+                else
+                    return false;
+            }
+            return true;
+        }
+
+        bool Literal(const char *lit, size_t len)
+        {
+            if ((size_t)(end_ - p_) < len || memcmp(p_, lit, len) != 0)
+                return false;
+            p_ += len;
+            return true;
+        }
+
+        static int Hex(char c)
+        {
+            if (c >= '0' && c <= '9')
+                return c - '0';
+            if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+            return -1;
+        }
+
+        // p_指向\u后的4个十六进制数字
+        bool Unicode(unsigned *cp)
+        {
+            if (end_ - p_ < 4)
+                return false;
+            unsigned v = 0;
+            for (int i = 0; i < 4; i++)
+            {
+                int h = Hex(p_[i]);
+                if (h < 0)
+                    return false;
+                v = (v << 4) | h;
+            }
+            p_ += 4;
+            *cp = v;
+            return true;
+        }
+
+        // 找到下一个'"'或'\\'
+        const char *ScanString(const char *p)
+        {
+#ifdef __SSE2__
+            const __m128i quote = _mm_set1_epi8('"');
+            const __m128i slash = _mm_set1_epi8('\\');
+            while (end_ - p >= 16)
+            {
+                __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+                int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, slash)));
+                if (mask != 0)
+                    return p + __builtin_ctz(mask);
+                p += 16;
+            }
+#endif
+            while (p < end_ && *p != '"' && *p != '\\')
+                p++;
+            return p;
+        }
+
+        // p_指向'"', 解析字符串并校验转义序列
+        // key不为空时, 把解码后的内容(只保留ASCII)写入key, 长度写入*keylen, 超长或含非ASCII字符时*keylen = -1
+        bool String(char *key = nullptr, size_t keycap = 0, long *keylen = nullptr)
+        {
+            p_++;
+            long klen = 0;
+            while (true)
+            {
+                const char *q = ScanString(p_);
+                if (q >= end_)
+                    return false;
+                if (key && klen >= 0)
+                {
+                    size_t n = q - p_;
+                    if (klen + n <= keycap)
+                    {
+                        memcpy(key + klen, p_, n);
+                        klen += n;
+                    }
+                    else
+                        klen = -1;
+                }
+                p_ = q + 1;
+                if (*q == '"')
+                    break;
+
+                // 转义序列
+                if (p_ >= end_)
+                    return false;
+                char e = *p_++;
+                char ch = 0;
+                switch (e)
+                {
+                case '"':
+                case '/':
+                case '\\':
+                    ch = e;
+                    break;
+                case 'b':
+                    ch = '\b';
+                    break;
+                case 'f':
+                    ch = '\f';
+                    break;
+                case 'n':
+                    ch = '\n';
+                    break;
+                case 'r':
+                    ch = '\r';
+                    break;
+                case 't':
+                    ch = '\t';
+                    break;
+                case 'u':
+                {
+                    unsigned cp = 0;
+                    if (!Unicode(&cp))
+                        return false;
+                    // 高位代理必须紧跟第二个\u
+                    if (cp >= 0xD800 && cp <= 0xDBFF)
+                    {
+                        if (end_ - p_ < 6 || p_[0] != '\\' || p_[1] != 'u')
+                            return false;
+                        p_ += 2;
+                        unsigned low = 0;
+                        if (!Unicode(&low))
+                            return false;
+                        cp = 0x80; // 非ASCII
+                    }
+                    if (cp >= 0x80)
+                        klen = -1;
+                    ch = (char)cp;
+                    break;
+                }
+                default:
+                    return false;
+                }
+                if (key && klen >= 0)
+                {
+                    if ((size_t)klen < keycap)
+                        key[klen++] = ch;
+                    else
+                        klen = -1;
+                }
+            }
+            if (keylen)
+                *keylen = klen;
+            return true;
+        }
+
+        // 数值: [-]数字*[.数字*][(e|E)[+-]数字*], 与jsoncpp的readNumber/decodeNumber一致
+        bool Number(Field *f)
+        {
+            const char *begin = p_;
+            if (*p_ == '-')
+                p_++;
+            bool integral = true;
+            unsigned long long v = 0;
+            bool huge = false;
+            while (p_ < end_ && *p_ >= '0' && *p_ <= '9')
+            {
+                if (v > (1ULL << 40))
+                    huge = true;
+                else
+                    v = v * 10 + (*p_ - '0');
+                p_++;
+            }
+            if (p_ < end_ && *p_ == '.')
+            {
+                integral = false;
+                p_++;
+                while (p_ < end_ && *p_ >= '0' && *p_ <= '9')
+                    p_++;
+            }
+            if (p_ < end_ && (*p_ == 'e' || *p_ == 'E'))
+            {
+                integral = false;
+                p_++;
+                if (p_ < end_ && (*p_ == '+' || *p_ == '-'))
+                    p_++;
+                while (p_ < end_ && *p_ >= '0' && *p_ <= '9')
+                    p_++;
+            }
+
+            if (integral && !huge)
+            {
+                if (f)
+                {
+                    f->kind_ = KIND_INT;
+                    f->int_ = *begin == '-' ? -(long long)v : (long long)v;
+                }
+                return true;
+            }
+
+            // 小数或超大整数, 按double解析
+            size_t len = p_ - begin;
+            if (len >= max_number_len)
+                return false;
+            char tmp[max_number_len];
+            memcpy(tmp, begin, len);
+            tmp[len] = 0;
+            char *stop = nullptr;
+            errno = 0;
+            double d = strtod(tmp, &stop);
+            if (stop == tmp || *stop != 0)
+                return false;
+            if (errno == ERANGE && std::fabs(d) == HUGE_VAL)
+                return false;
+            if (f)
+            {
+                f->kind_ = KIND_REAL;
+                f->real_ = d;
+            }
+            return true;
+        }
+
+        // f不为空时, 把值存入f
+        bool ParseValue(int depth, Field *f)
+        {
+            if (depth > max_depth || p_ >= end_)
+                return false;
+            char c = *p_;
+            if (c == '{' || c == '[' || c == '"')
+            {
+                if (f)
+                    f->kind_ = KIND_BAD;
+                if (c == '"')
+                    return String();
+                if (c == '{')
+                    return ParseObject(depth + 1, nullptr, 0);
+                return ParseArray(depth + 1);
+            }
+            if (c == 't' || c == 'f' || c == 'n')
+            {
+                bool ok = c == 't' ? Literal("true", 4) : c == 'f' ? Literal("false", 5)
+                                                                   : Literal("null", 4);
+                if (ok && f)
+                {
+                    f->kind_ = c == 'n' ? KIND_NULL : KIND_INT;
+                    f->int_ = c == 't' ? 1 : 0;
+                }
+                return ok;
+            }
+            if (c == '-' || (c >= '0' && c <= '9'))
+                return Number(f);
+            return false;
+        }
+
+        // p_指向'{'
+        bool ParseObject(int depth, Field *fields, int n)
+        {
+            if (depth > max_depth)
+                return false;
+            p_++;
+            if (!SkipWs() || p_ >= end_)
+                return false;
+            if (*p_ == '}')
+            {
+                p_++;
+                return true;
+            }
+            bool emptykey = false;
+            while (true)
+            {
+                // 与jsoncpp一致: 上一个键是""时允许多余的','
+                if (emptykey && p_ < end_ && *p_ == '}')
+                {
+                    p_++;
+                    return true;
+                }
+                if (p_ >= end_ || *p_ != '"')
+                    return false;
+                emptykey = p_ + 1 < end_ && p_[1] == '"';
+                char key[32];
+                long keylen = -1;
+                if (!String(fields ? key : nullptr, sizeof(key), fields ? &keylen : nullptr))
+                    return false;
+                Field *f = nullptr;
+                for (int i = 0; i < n && keylen >= 0; i++)
+                {
+                    if (fields[i].len_ == (size_t)keylen && memcmp(fields[i].name_, key, keylen) == 0)
+                    {
+                        f = &fields[i];
+                        break;
+                    }
+                }
+
+                // 与jsoncpp一致: 键和':'之间不能有注释
+                SkipSpaces();
+                if (p_ >= end_ || *p_ != ':')
+                    return false;
+                p_++;
+                if (!SkipWs() || !ParseValue(depth, f))
+                    return false;
+                if (!SkipWs() || p_ >= end_)
+                    return false;
+                if (*p_ == '}')
+                {
+                    p_++;
+                    return true;
+                }
+                if (*p_ != ',')
+                    return false;
+                p_++;
+                if (!SkipWs())
+                    return false;
+            }
+        }
+
+        // p_指向'['
+        bool ParseArray(int depth)
+        {
+            p_++;
+            // 与jsoncpp一致: 只有空白时才是空数组, "[ /*c*/ ]"是非法的
+            SkipSpaces();
+            if (p_ < end_ && *p_ == ']')
+            {
+                p_++;
+                return true;
+            }
+            while (true)
+            {
+                if (!SkipWs() || !ParseValue(depth, nullptr))
+                    return false;
+                if (!SkipWs() || p_ >= end_)
+                    return false;
+                if (*p_ == ']')
+                {
+                    p_++;
+                    return true;
+                }
+                if (*p_ != ',')
+                    return false;
+                p_++;
+                if (!SkipWs())
+                    return false;
+            }
+        }
+
+    private:
+        const char *p_;
+        const char *end_;
+    };
+
+    // 解码doc中的JSON对象, 按字段名填充fields[0..n)
+    // 返回false: 格式错误, 或者某个字段不能转换为int
+    bool DecodeInts(std::string_view doc, Field *fields, int n)
+    {
+        Decoder decoder(doc);
+        if (!decoder.DecodeObject(fields, n))
+            return false;
+        for (int i = 0; i < n; i++)
+        {
+            Field &f = fields[i];
+            if (f.kind_ == KIND_BAD)
+                return false;
+            if (f.kind_ == KIND_INT && (f.int_ < INT_MIN || f.int_ > INT_MAX))
+                return false;
+            if (f.kind_ == KIND_REAL)
+            {
+                if (!(f.real_ >= INT_MIN && f.real_ <= INT_MAX))
+                    return false;
+                f.int_ = (long long)(int)f.real_;
+            }
+            if (f.kind_ == KIND_NULL)
+                f.int_ = 0;
+        }
+        return true;
+    }
+
+    // 整数转十进制, 返回长度
+    size_t WriteInt(char *buf, long long v)
+    {
+        char tmp[24];
+        size_t n = 0;
+        unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+        do
+        {
+            tmp[n++] = (char)('0' + u % 10);
+            u /= 10;
+        } while (u);
+        size_t len = 0;
+        if (v < 0)
+            buf[len++] = '-';
+        while (n)
+            buf[len++] = tmp[--n];
+        return len;
+    }
+
+    // 编码时每个字段最多占用的字节数: "name":-2147483648,
+    size_t EncodeBound(const Field *fields, int n)
+    {
+        size_t bound = 2;
+        for (int i = 0; i < n; i++)
+            bound += fields[i].len_ + 4 + 20;
+        return bound;
+    }
+
+    // 把fields编码为紧凑的JSON对象, 例如{"x":1,"opt":43,"y":2}, 返回长度
+    // buf至少要有EncodeBound(fields, n)字节
+    size_t EncodeInts(char *buf, const Field *fields, int n)
+    {
+        size_t len = 0;
+        buf[len++] = '{';
+        for (int i = 0; i < n; i++)
+        {
+            if (i > 0)
+                buf[len++] = ',';
+            buf[len++] = '"';
+            memcpy(buf + len, fields[i].name_, fields[i].len_);
+            len += fields[i].len_;
+            buf[len++] = '"';
+            buf[len++] = ':';
+            len += WriteInt(buf + len, fields[i].int_);
+        }
+        buf[len++] = '}';
+        return len;
+    }
+};
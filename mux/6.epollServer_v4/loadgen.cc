@@ -0,0 +1,526 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <random>
+#include <thread>
+#include <barrier>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include "mysocket.hpp"
+#include "epoller.hpp"
+#include "codec.hpp"
+#include "calc_kernel.hpp"
+#include "histogram.hpp"
+#include "util.hpp"
+#include "err.hpp"
+
+// 压测客户端: threads个线程各自用一个epoll管理conns/threads个连接, 持续duration秒, 输出吞吐量和延迟分位数
+// 闭环(默认): 每个连接上保持depth个未完成的请求(流水线), 收到一个响应就补发一个
+// 开环(rate=R): 按固定间隔或泊松过程安排每个请求的发送时刻, 不管响应回来没有; 延迟从安排的时刻算起
+//   服务器卡顿时闭环客户端跟着停发, 卡顿期间本该发出的请求没有被计入, 尾延迟被低估(coordinated omission)
+//   开环下连接上已有depth个未完成的请求时, 到期的请求推迟发送, 推迟的时间也算进延迟
+// sweep=N: 开环, 目标速率依次为rate、2*rate...N*rate, 每档duration秒, 达到的吞吐量低于目标的95%时视为饱和, 停止加压
+// csv=FILE: 每档一行写到FILE: 目标速率, 达到的速率, 延迟分位数(微秒), 错误数, 积压数, 用来画延迟-吞吐量曲线
+// 请求按mix中的运算符均匀随机生成(重复的运算符权重更大), 每个线程预先编码一池请求, 发送时只是拷贝字节
+// 报文的组帧和解析用服务器同一套Codec(JSON即AddHeader/Parse的长度报头格式), 响应按请求顺序核对结果
+// ./loadgen [ENDPOINT] [host=IP] [conns=N] [threads=M] [depth=D] [duration=S] [mix=OPS]
+//           [rate=R] [poisson] [sweep=N] [csv=FILE] [json|binary|line|http]
+// ENDPOINT默认tcp:8080(见Endpoint), host默认127.0.0.1(tcp6时为::1)
+// 例如: ./loadgen tcp:8080 conns=64 threads=4 depth=32 duration=10 mix=+++*/ binary
+//       ./loadgen conns=16 rate=50000 poisson sweep=10 duration=5 csv=curve.csv
+
+void Usage()
+{
+    std::cout << "Usage: ./loadgen [ENDPOINT] [host=IP] [conns=N] [threads=M] [depth=D] [duration=S] [mix=OPS]" << std::endl
+              << "                 [rate=R] [poisson] [sweep=N] [csv=FILE] [json|binary|line|http]" << std::endl;
+}
+
+static const int loadgen_pool = 4096;         // 每个线程预先编码的请求个数
+static const size_t loadgen_readsize = 65536; // 每次recv的大小
+static const int loadgen_events = 256;
+static const double saturation_ratio = 0.95; // 达到的吞吐量低于目标的这个比例视为饱和
+
+struct LoadOptions
+{
+    Endpoint ep_ = Endpoint(AF_INET, 8080);
+    std::string host_;
+    int conns_ = 64;
+    int threads_ = 4;
+    int depth_ = 32;
+    int duration_ = 10;
+    std::string mix_ = "+-*/%";
+    double rate_ = 0;     // 开环的目标速率(请求/秒), 0为闭环
+    bool poisson_ = false; // 开环的请求间隔服从指数分布, 否则固定间隔
+    int sweep_ = 0;       // 开环逐档加压的最多档数, 0为只跑rate_一档
+    std::string csv_;
+};
+
+// 一个预先编码好的请求和它应得的结果
+struct PooledRequest
+{
+    std::string frame_;
+    int ret_;
+    int code_;
+};
+
+template <Codec C>
+struct LoadConn
+{
+    Sock sock_;
+    C codec_;
+    std::string inbuffer_;
+    std::string outbuffer_;
+    std::deque<std::pair<int, uint64_t>> inflight_; // (请求池下标, 计时起点), 响应按请求顺序返回
+                                                    // 计时起点: 闭环为发送时间, 开环为安排的发送时刻
+    bool wantout_ = false;                          // 发送缓冲区满, 关心EPOLLOUT
+    bool dead_ = false;
+};
+
+struct LoadResult
+{
+    LatencyHistogram hist_;
+    uint64_t errors_ = 0;   // 结果与期望不一致的响应
+    uint64_t failures_ = 0; // 连接失败或断开的连接数
+    uint64_t scheduled_ = 0; // 开环: 截止时刻之前安排的请求数, 减去收到的响应数即为积压
+};
+
+template <Codec C>
+class LoadWorker
+{
+public:
+    // rate: 本线程的开环速率, 0为闭环
+    LoadWorker(const LoadOptions &opts, int conns, uint32_t seed, double rate)
+        : opts_(opts), nconns_(conns), rng_(seed), conns_(conns), rate_(rate), gap_(rate > 0 ? 1.0 / rate : 0)
+    {
+        BuildPool();
+    }
+
+    ~LoadWorker()
+    {
+        if (timerfd_ >= 0)
+            close(timerfd_);
+    }
+
+    // 建立所有连接, 还不发送请求
+    void Connect(LoadResult *result)
+    {
+        result_ = result;
+        epoller_.Create();
+        for (int i = 0; i < nconns_; i++)
+            Open(i);
+    }
+
+    // 所有线程的连接都建立之后开始发送; start: 开环的第一个请求的发送时刻
+    // 返回停止收发的时刻
+    uint64_t Run(uint64_t start, uint64_t deadline)
+    {
+        if (rate_ == 0)
+        {
+            for (LoadConn<C> &conn : conns_)
+                if (!conn.dead_)
+                    Refill(conn);
+        }
+        else
+        {
+            // 定时器精确到纳秒, 请求间隔小于epoll_wait的毫秒超时也能按时唤醒
+            timerfd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            epoller_.Register(timerfd_, EPOLLIN);
+            due_ = start;
+        }
+        Events events;
+        uint64_t now;
+        while ((now = util::NowNs()) < deadline)
+        {
+            if (rate_ > 0)
+                SendDue(deadline);
+            int n = epoller_.Wait(events, loadgen_events, 10);
+            for (int i = 0; i < n; i++)
+            {
+                if (events.GetFd(i) == timerfd_)
+                {
+                    uint64_t expirations;
+                    ssize_t r = read(timerfd_, &expirations, sizeof(expirations));
+                    (void)r;
+                    continue;
+                }
+                LoadConn<C> &conn = conns_[fdindex_[events.GetFd(i)]];
+                uint32_t ev = events.GetEvent(i);
+                if (ev & (EPOLLERR | EPOLLHUP))
+                {
+                    Fail(conn);
+                    continue;
+                }
+                if (ev & EPOLLOUT)
+                    Flush(conn);
+                if (ev & EPOLLIN)
+                    OnRead(conn);
+            }
+        }
+        // 截止时刻之前安排了、但因为连接都满了而没发出去的请求也算作积压
+        while (rate_ > 0 && due_ < deadline)
+        {
+            result_->scheduled_++;
+            due_ += NextGap();
+        }
+        return now;
+    }
+
+private:
+    void BuildPool()
+    {
+        for (int i = 0; i < loadgen_pool; i++)
+        {
+            Request req(rng_() % 10000, opts_.mix_[rng_() % opts_.mix_.size()], 1 + rng_() % 100);
+            PooledRequest p;
+            codec_.Encode(req, &p.frame_);
+            calc::Eval(req._x, req._opt, req._y, &p.ret_, &p.code_);
+            pool_.push_back(std::move(p));
+        }
+    }
+
+    void Open(int i)
+    {
+        LoadConn<C> &conn = conns_[i];
+        conn.sock_.Socket(opts_.ep_.family_);
+        if (conn.sock_.Connect(opts_.ep_, opts_.host_) < 0)
+        {
+            conn.dead_ = true;
+            result_->failures_++;
+            return;
+        }
+        int fd = conn.sock_.GetSockfd();
+        util::SetNonBlock(fd);
+        if (opts_.ep_.family_ != AF_UNIX)
+            util::SetNoDelay(fd);
+        if ((size_t)fd >= fdindex_.size())
+            fdindex_.resize(fd + 1);
+        fdindex_[fd] = i;
+        epoller_.Register(fd, EPOLLIN);
+    }
+
+    // 下一个请求与这一个请求的间隔(纳秒)
+    uint64_t NextGap()
+    {
+        double secs = opts_.poisson_ ? std::exponential_distribution<double>(rate_)(rng_) : gap_;
+        return (uint64_t)(secs * 1e9);
+    }
+
+    // 开环: 发出所有已经到期的请求, 轮流放到还没满depth的连接上, 每个连接攒好一次发出
+    // 连接都满了就停下, 等响应回来再发, 计时起点仍是安排的时刻; 否则定时器定在下一个请求的时刻
+    void SendDue(uint64_t deadline)
+    {
+        uint64_t now = util::NowNs();
+        dirty_.clear();
+        while (due_ <= now && due_ < deadline)
+        {
+            int tries = 0;
+            while (tries < nconns_ && (conns_[rr_].dead_ || (int)conns_[rr_].inflight_.size() >= opts_.depth_))
+            {
+                rr_ = (rr_ + 1) % nconns_;
+                tries++;
+            }
+            if (tries == nconns_)
+                break;
+            LoadConn<C> &conn = conns_[rr_];
+            int idx = next_++ % loadgen_pool;
+            if (conn.outbuffer_.empty())
+                dirty_.push_back(rr_);
+            conn.outbuffer_ += pool_[idx].frame_;
+            conn.inflight_.emplace_back(idx, due_);
+            result_->scheduled_++;
+            due_ += NextGap();
+            rr_ = (rr_ + 1) % nconns_;
+        }
+        for (int i : dirty_)
+            Flush(conns_[i]);
+        if (due_ > now && due_ < deadline)
+        {
+            struct itimerspec its = {};
+            its.it_value.tv_sec = due_ / 1000000000;
+            its.it_value.tv_nsec = due_ % 1000000000;
+            timerfd_settime(timerfd_, TFD_TIMER_ABSTIME, &its, nullptr);
+        }
+    }
+
+    // 补满depth个未完成的请求并发出
+    void Refill(LoadConn<C> &conn)
+    {
+        uint64_t now = util::NowNs();
+        while ((int)conn.inflight_.size() < opts_.depth_)
+        {
+            int idx = next_++ % loadgen_pool;
+            conn.outbuffer_ += pool_[idx].frame_;
+            conn.inflight_.emplace_back(idx, now);
+        }
+        Flush(conn);
+    }
+
+    void Flush(LoadConn<C> &conn)
+    {
+        size_t sent = 0;
+        while (!conn.dead_ && sent < conn.outbuffer_.size())
+        {
+            ssize_t n = send(conn.sock_.GetSockfd(), conn.outbuffer_.data() + sent, conn.outbuffer_.size() - sent, MSG_NOSIGNAL);
+            if (n > 0)
+                sent += n;
+            else if (n < 0 && errno == EINTR)
+                continue;
+            else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            else
+                Fail(conn);
+        }
+        conn.outbuffer_.erase(0, sent);
+        bool wantout = !conn.dead_ && !conn.outbuffer_.empty();
+        if (wantout != conn.wantout_)
+        {
+            conn.wantout_ = wantout;
+            epoller_.Modify(conn.sock_.GetSockfd(), EPOLLIN | (wantout ? (uint32_t)EPOLLOUT : 0u));
+        }
+    }
+
+    void OnRead(LoadConn<C> &conn)
+    {
+        char buffer[loadgen_readsize];
+        ssize_t n = recv(conn.sock_.GetSockfd(), buffer, sizeof(buffer), 0);
+        if (n <= 0)
+        {
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                Fail(conn);
+            return;
+        }
+        conn.inbuffer_.append(buffer, n);
+        std::string_view frame;
+        int ret;
+        uint64_t now = util::NowNs();
+        while ((ret = conn.codec_.Next(conn.inbuffer_, &frame)) > 0)
+        {
+            Response resp;
+            if (conn.inflight_.empty() || !conn.codec_.Decode(frame, &resp))
+            {
+                Fail(conn);
+                return;
+            }
+            auto [idx, sent] = conn.inflight_.front();
+            conn.inflight_.pop_front();
+            result_->hist_.Record(now - sent);
+            if (resp._ret != pool_[idx].ret_ || resp._code != pool_[idx].code_)
+                result_->errors_++;
+        }
+        conn.codec_.Consume(conn.inbuffer_);
+        if (ret < 0)
+        {
+            Fail(conn);
+            return;
+        }
+        if (rate_ == 0)
+            Refill(conn);
+    }
+
+    void Fail(LoadConn<C> &conn)
+    {
+        if (conn.dead_)
+            return;
+        LogMessage(WARNING, "connection lost, %zu requests in flight\n", conn.inflight_.size());
+        conn.dead_ = true;
+        result_->failures_++;
+        epoller_.Remove(conn.sock_.GetSockfd());
+        conn.sock_.Close();
+    }
+
+private:
+    const LoadOptions &opts_;
+    int nconns_;
+    std::mt19937 rng_;
+    C codec_; // 只用来编码请求池
+    std::vector<PooledRequest> pool_;
+    std::vector<LoadConn<C>> conns_;
+    std::vector<int> fdindex_; // fd -> conns_下标
+    Epoller epoller_;
+    uint64_t next_ = 0;
+    LoadResult *result_ = nullptr;
+
+    double rate_;         // 开环速率, 0为闭环
+    double gap_;          // 固定间隔(秒)
+    uint64_t due_ = 0;    // 下一个请求安排的发送时刻
+    int rr_ = 0;          // 下一个请求优先放的连接
+    int timerfd_ = -1;
+    std::vector<int> dirty_; // 本轮有新请求要发的连接
+};
+
+// 跑一档: rate为开环的总目标速率, 0为闭环; 各线程平分速率, 固定间隔时各线程的发送时刻错开
+// 所有线程建好连接后才开始计时, 时间窗口从第一个请求发出算到最后一个线程停止收发, 不含建立连接的时间
+template <Codec C>
+LoadResult RunStep(const LoadOptions &opts, double rate, double *secs)
+{
+    std::vector<LoadResult> results(opts.threads_);
+    std::vector<uint64_t> ends(opts.threads_);
+    std::vector<std::thread> threads;
+    uint64_t begin = 0, deadline = 0;
+    std::barrier ready(opts.threads_, [&]() noexcept
+                       {
+                           begin = util::NowNs();
+                           deadline = begin + (uint64_t)opts.duration_ * 1000000000; });
+    for (int t = 0; t < opts.threads_; t++)
+    {
+        // 连接数不能整除线程数时, 前面的线程多分一个
+        int conns = opts.conns_ / opts.threads_ + (t < opts.conns_ % opts.threads_ ? 1 : 0);
+        double trate = rate / opts.threads_;
+        uint64_t offset = trate > 0 ? (uint64_t)(1e9 / trate * t / opts.threads_) : 0;
+        threads.emplace_back([&, t, conns, trate, offset]()
+                             {
+                                 LoadWorker<C> worker(opts, conns, 20261019 + t, trate);
+                                 worker.Connect(&results[t]);
+                                 ready.arrive_and_wait();
+                                 ends[t] = worker.Run(begin + offset, deadline); });
+    }
+    for (std::thread &th : threads)
+        th.join();
+    *secs = (*std::max_element(ends.begin(), ends.end()) - begin) / 1e9;
+
+    LoadResult total;
+    for (const LoadResult &r : results)
+    {
+        total.hist_.Merge(r.hist_);
+        total.errors_ += r.errors_;
+        total.failures_ += r.failures_;
+        total.scheduled_ += r.scheduled_;
+    }
+    return total;
+}
+
+template <Codec C>
+int Run(const LoadOptions &opts)
+{
+    double secs = 0;
+    if (opts.rate_ == 0)
+    {
+        LoadResult total = RunStep<C>(opts, 0, &secs);
+        const LatencyHistogram &h = total.hist_;
+        printf("%s %s, %d conns, %d threads, depth %d, %.1fs\n", opts.ep_.ToString().c_str(), C::name, opts.conns_, opts.threads_,
+               opts.depth_, secs);
+        printf("requests %llu, %.0f req/s, errors %llu, failed conns %llu\n", (unsigned long long)h.Count(), h.Count() / secs,
+               (unsigned long long)total.errors_, (unsigned long long)total.failures_);
+        printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  p99.99 %.1f  max %.1f  mean %.1f\n", h.Percentile(0.5) / 1e3,
+               h.Percentile(0.9) / 1e3, h.Percentile(0.99) / 1e3, h.Percentile(0.999) / 1e3, h.Percentile(0.9999) / 1e3,
+               h.Max() / 1e3, h.Mean() / 1e3);
+        return total.failures_ == (uint64_t)opts.conns_ ? CONNECT_ERR : 0;
+    }
+
+    FILE *csv = nullptr;
+    if (!opts.csv_.empty())
+    {
+        csv = fopen(opts.csv_.c_str(), "w");
+        if (csv == nullptr)
+        {
+            LogMessage(FATAL, "open %s failed: %s\n", opts.csv_.c_str(), strerror(errno));
+            return USAGE_ERR;
+        }
+        fprintf(csv, "target_rps,achieved_rps,p50_us,p90_us,p99_us,p999_us,max_us,errors,backlog\n");
+    }
+    printf("%s %s, %d conns, %d threads, depth %d, %ds per step, open loop(%s)\n", opts.ep_.ToString().c_str(), C::name,
+           opts.conns_, opts.threads_, opts.depth_, opts.duration_, opts.poisson_ ? "poisson" : "fixed");
+    printf("%12s %12s %10s %10s %10s %10s %10s %8s %10s\n", "target/s", "achieved/s", "p50 us", "p90 us", "p99 us", "p99.9 us",
+           "max us", "errors", "backlog");
+    int steps = std::max(opts.sweep_, 1);
+    double best = 0;
+    int ret = 0;
+    for (int i = 1; i <= steps; i++)
+    {
+        double rate = opts.rate_ * i;
+        LoadResult total = RunStep<C>(opts, rate, &secs);
+        const LatencyHistogram &h = total.hist_;
+        double achieved = h.Count() / secs;
+        uint64_t backlog = total.scheduled_ - std::min(total.scheduled_, h.Count());
+        printf("%12.0f %12.0f %10.1f %10.1f %10.1f %10.1f %10.1f %8llu %10llu\n", rate, achieved, h.Percentile(0.5) / 1e3,
+               h.Percentile(0.9) / 1e3, h.Percentile(0.99) / 1e3, h.Percentile(0.999) / 1e3, h.Max() / 1e3,
+               (unsigned long long)total.errors_, (unsigned long long)backlog);
+        if (csv)
+        {
+            fprintf(csv, "%.0f,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f,%llu,%llu\n", rate, achieved, h.Percentile(0.5) / 1e3,
+                    h.Percentile(0.9) / 1e3, h.Percentile(0.99) / 1e3, h.Percentile(0.999) / 1e3, h.Max() / 1e3,
+                    (unsigned long long)total.errors_, (unsigned long long)backlog);
+            fflush(csv);
+        }
+        best = std::max(best, achieved);
+        if (total.failures_ == (uint64_t)opts.conns_)
+        {
+            ret = CONNECT_ERR;
+            break;
+        }
+        if (opts.sweep_ > 0 && achieved < rate * saturation_ratio)
+        {
+            printf("saturated at %.0f req/s target, max achieved %.0f req/s\n", rate, best);
+            break;
+        }
+    }
+    if (csv)
+        fclose(csv);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    LoadOptions opts;
+    const char *codec = BinaryCodec::name;
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        if (strncmp(arg, "host=", 5) == 0)
+            opts.host_ = arg + 5;
+        else if (strncmp(arg, "conns=", 6) == 0)
+            opts.conns_ = atoi(arg + 6);
+        else if (strncmp(arg, "threads=", 8) == 0)
+            opts.threads_ = atoi(arg + 8);
+        else if (strncmp(arg, "depth=", 6) == 0)
+            opts.depth_ = atoi(arg + 6);
+        else if (strncmp(arg, "duration=", 9) == 0)
+            opts.duration_ = atoi(arg + 9);
+        else if (strncmp(arg, "mix=", 4) == 0)
+            opts.mix_ = arg + 4;
+        else if (strncmp(arg, "rate=", 5) == 0)
+            opts.rate_ = atof(arg + 5);
+        else if (strcmp(arg, "poisson") == 0)
+            opts.poisson_ = true;
+        else if (strncmp(arg, "sweep=", 6) == 0)
+            opts.sweep_ = atoi(arg + 6);
+        else if (strncmp(arg, "csv=", 4) == 0)
+            opts.csv_ = arg + 4;
+        else if (strchr(arg, ':') != nullptr)
+        {
+            if (!Endpoint::Parse(arg, &opts.ep_) || opts.ep_.shm_ || opts.ep_.udp_)
+            {
+                Usage();
+                exit(USAGE_ERR);
+            }
+        }
+        else
+            codec = arg;
+    }
+    if (opts.host_.empty())
+        opts.host_ = opts.ep_.family_ == AF_INET6 ? "::1" : "127.0.0.1";
+    opts.threads_ = std::min(opts.threads_, opts.conns_);
+    if (opts.conns_ <= 0 || opts.threads_ <= 0 || opts.depth_ <= 0 || opts.duration_ <= 0 || opts.mix_.empty() ||
+        opts.mix_.find_first_not_of("+-*/%") != std::string::npos || opts.rate_ < 0 || opts.sweep_ < 0 ||
+        ((opts.sweep_ > 0 || !opts.csv_.empty()) && opts.rate_ == 0))
+    {
+        Usage();
+        exit(USAGE_ERR);
+    }
+    SetLogLevel(INFO); // Sock的建立/连接日志是DEBUG级别, 连接数多时不输出
+
+    if (strcmp(codec, BinaryCodec::name) == 0)
+        return Run<BinaryCodec>(opts);
+    if (strcmp(codec, JsonCodec::name) == 0)
+        return Run<JsonCodec>(opts);
+    if (strcmp(codec, LineCodec::name) == 0)
+        return Run<LineCodec>(opts);
+    if (strcmp(codec, HttpCodec::name) == 0)
+        return Run<HttpCodec>(opts);
+    Usage();
+    return USAGE_ERR;
+}
@@ -2,12 +2,20 @@
 
 #include <iostream>
 #include <string>
-#include <map>
+#include <vector>
+#include <atomic>
 #include <cstdio>
 #include <cstring>
+#include <cstdint>
+#include <cerrno>
 #include <time.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include "Mutex.hpp"
+#include "binlog.hpp"
 
 static const char *filename = "server.log";
 
@@ -21,40 +29,474 @@ enum loglevel_t
     ERROR,
     FATAL
 };
-static std::map<loglevel_t, std::string> ltos = {{TRACE, "TRACE"}, {DEBUG, "DEBUG"}, {INFO, "INFO"}, {WARNING, "WARNING"}, {ERROR, "ERROR"}, {FATAL, "FATAL"}};
+static const char *level_names[] = {"TRACE", "DEBUG", "INFO", "WARNING", "ERROR", "FATAL"};
+
+// 日志等级过滤, 见文件末尾的LogMessage
+// 编译期: 低于LOG_MIN_LEVEL的日志语句不生成代码, 例如 g++ -DLOG_MIN_LEVEL=INFO (make LOGLEVEL=INFO)
+// 运行期: 低于SetLogLevel设置的等级的日志只花一次比较, 默认全部输出
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL TRACE
+#endif
+static std::atomic<int> runtime_loglevel(TRACE);
+
+void SetLogLevel(loglevel_t lv)
+{
+    runtime_loglevel.store(lv, std::memory_order_relaxed);
+}
+
+bool LogEnabled(loglevel_t lv)
+{
+    return lv >= LOG_MIN_LEVEL && lv >= runtime_loglevel.load(std::memory_order_relaxed);
+}
+
+// 每个线程缓存的时间
+// 事件循环每轮epoll_wait返回后调用Tick, 这一轮里的日志都用这个时间, 不再读时钟
+// 没有调用过Tick的线程(线程池、测试)每条日志读一次CLOCK_REALTIME_COARSE, 走vDSO, 不进内核
+// 年月日时分秒的字符串每个线程每秒只用localtime_r格式化一次
+class LogClock
+{
+public:
+    static void Tick()
+    {
+        state_.ticked_ = true;
+        state_.ns_ = Read(CLOCK_REALTIME);
+    }
+
+    static int64_t Now()
+    {
+        return state_.ticked_ ? state_.ns_ : Read(CLOCK_REALTIME_COARSE);
+    }
+
+    // y-m-d h:m:s
+    static const char *TimeStr(int64_t ns)
+    {
+        time_t sec = ns / 1000000000;
+        if (sec != state_.sec_)
+        {
+            struct tm tm;
+            localtime_r(&sec, &tm);
+            snprintf(state_.str_, sizeof(state_.str_), "%d-%d-%d %d:%d:%d", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                     tm.tm_hour, tm.tm_min, tm.tm_sec);
+            state_.sec_ = sec;
+        }
+        return state_.str_;
+    }
+
+private:
+    static int64_t Read(clockid_t id)
+    {
+        struct timespec ts;
+        clock_gettime(id, &ts);
+        return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    struct State
+    {
+        bool ticked_ = false;
+        int64_t ns_ = 0;
+        time_t sec_ = -1;
+        char str_[64] = {0};
+    };
+    static thread_local State state_;
+};
+inline thread_local LogClock::State LogClock::state_;
+
+// 异步日志
+// 调用LogMessage的线程(生产者)只把等级、时间戳和格式化好的正文写进自己线程的环形缓冲区, 不加锁, 不做系统调用
+// 后台线程轮流取出各个线程的记录, 格式化标题, 攒成大块一次write到文件
+// 每个环形缓冲区只有一个生产者(所属线程)和一个消费者(后台线程), head_/tail_各自只由一方写, 不需要CAS
+// 同一线程的日志保持顺序, 不同线程的日志按批次交错
+
+static const size_t log_body_size = 240;   // 一条日志正文的最大长度, 超过截断
+static const size_t log_ring_size = 1024;  // 每个线程的环形缓冲区能放的记录数, 2的幂
+static const size_t log_batch_size = 64 << 10; // 后台线程攒够这么多字节就写一次
+static const int log_idle_us = 2000;       // 后台线程没有取到记录时最多休眠的时间, 生产者的缓冲区过半时会提前唤醒它
+
+// 缓冲区满时的处理方式
+enum logfull_t
+{
+    LOG_DROP, // 丢弃这条日志, 计数
+    LOG_BLOCK // 等待后台线程腾出位置
+};
+
+struct LogRecord
+{
+    int64_t ns_; // CLOCK_REALTIME
+    uint8_t lv_;
+    uint16_t len_;
+    char body_[log_body_size];
+};
+
+class LogRing
+{
+public:
+    // 生产者: 取一个空位, 缓冲区满时返回nullptr
+    LogRecord *Reserve()
+    {
+        uint64_t h = head_.load(std::memory_order_relaxed);
+        if (h - tail_.load(std::memory_order_acquire) == log_ring_size)
+            return nullptr;
+        return &slots_[h & (log_ring_size - 1)];
+    }
+    void Commit()
+    {
+        head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // 消费者: 对每条已提交的记录调用fn, 返回取出的条数
+    template <class F>
+    size_t Drain(F fn)
+    {
+        uint64_t t = tail_.load(std::memory_order_relaxed);
+        uint64_t h = head_.load(std::memory_order_acquire);
+        for (uint64_t i = t; i < h; i++)
+            fn(slots_[i & (log_ring_size - 1)]);
+        tail_.store(h, std::memory_order_release);
+        return h - t;
+    }
+
+    bool Empty() const
+    {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_relaxed);
+    }
+
+    // 生产者: 已用的位置数
+    size_t Size() const
+    {
+        return head_.load(std::memory_order_relaxed) - tail_.load(std::memory_order_acquire);
+    }
+
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<bool> dead_{false};    // 所属线程已经退出, 取空后由后台线程释放
+    std::atomic<bool> writing_{false}; // 生产者正在写一条记录, Stop等它提交后才做最后一次取空
+
+private:
+    alignas(64) std::atomic<uint64_t> head_{0}; // 生产者写
+    alignas(64) std::atomic<uint64_t> tail_{0}; // 消费者写
+    LogRecord slots_[log_ring_size];
+};
+
+class AsyncLogger
+{
+public:
+    static AsyncLogger &Instance()
+    {
+        static AsyncLogger logger;
+        return logger;
+    }
+
+    // 启动后台线程, path为nullptr时写到标准输出; 进程exit时自动取空所有缓冲区
+    bool Start(const char *path, logfull_t policy = LOG_DROP)
+    {
+        if (running_.load())
+            return true;
+        fflush(stdout);
+        fd_ = path ? open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644) : STDOUT_FILENO;
+        if (fd_ < 0)
+            return false;
+        policy_ = policy;
+        stop_.store(false);
+        if (pthread_create(&tid_, nullptr, Routine, this) != 0)
+            return false;
+        running_.store(true, std::memory_order_release);
+        static bool registered = false;
+        if (!registered)
+        {
+            atexit([]()
+                   { AsyncLogger::Instance().Stop(); });
+            registered = true;
+        }
+        return true;
+    }
+
+    // 停止后台线程, 写出所有剩余的记录
+    // 先让新的日志改为直接输出, 再等正在写的生产者提交, 后台线程看到stop_后取到空为止, 最后再取一次
+    void Stop()
+    {
+        if (!running_.exchange(false))
+            return;
+        std::vector<LogRing *> rings;
+        {
+            lockGuard lg(&ringsmtx_);
+            rings = rings_;
+        }
+        for (LogRing *ring : rings)
+        {
+            while (ring->writing_.load())
+                sched_yield();
+        }
+        stop_.store(true, std::memory_order_release);
+        Wakeup();
+        pthread_join(tid_, nullptr);
+        DrainAll();
+        if (fd_ != STDOUT_FILENO)
+            close(fd_);
+        fd_ = STDOUT_FILENO;
+    }
+
+    bool Running() const
+    {
+        return running_.load(std::memory_order_acquire);
+    }
+
+    // 生产者: 写一条记录, 缓冲区满时按policy_丢弃(计数)或等待
+    // 返回false表示已经停止, 没有写入, 由调用方直接输出
+    bool Append(loglevel_t lv, const char *format, va_list ap)
+    {
+        LogRing *ring = LocalRing();
+        // 先标记再检查running_, 与Stop的顺序相反: 要么这里看到已停止, 要么Stop等这条记录提交
+        ring->writing_.store(true);
+        if (!running_.load())
+        {
+            ring->writing_.store(false, std::memory_order_release);
+            return false;
+        }
+        LogRecord *rec = ring->Reserve();
+        while (rec == nullptr)
+        {
+            Wakeup();
+            if (policy_ == LOG_DROP) // 停止过程中后台线程还在取, 等待模式不会卡住
+            {
+                ring->dropped_.fetch_add(1, std::memory_order_relaxed);
+                ring->writing_.store(false, std::memory_order_release);
+                return true;
+            }
+            sched_yield();
+            rec = ring->Reserve();
+        }
+        rec->ns_ = LogClock::Now();
+        rec->lv_ = lv;
+        int n = vsnprintf(rec->body_, sizeof(rec->body_), format, ap);
+        rec->len_ = n < 0 ? 0 : n < (int)sizeof(rec->body_) ? n : sizeof(rec->body_) - 1;
+        if (n >= (int)sizeof(rec->body_)) // 截断时保留行尾, 不和下一条日志连成一行
+            rec->body_[rec->len_ - 1] = '\n';
+        ring->Commit();
+        ring->writing_.store(false, std::memory_order_release);
+        if (ring->Size() >= log_ring_size / 2)
+            Wakeup();
+        return true;
+    }
+
+    // 因为缓冲区满而丢弃的记录总数
+    uint64_t Dropped()
+    {
+        lockGuard lg(&ringsmtx_);
+        return dropped_ + CountDropped();
+    }
+
+private:
+    AsyncLogger() : fd_(STDOUT_FILENO), policy_(LOG_DROP), tid_(0), pid_(getpid())
+    {
+        pthread_cond_init(&wakecond_, nullptr);
+        batch_.reserve(log_batch_size + log_body_size + 64);
+    }
+
+    // 后台线程正在休眠时唤醒它; 唤醒丢失也只是多等一个log_idle_us
+    void Wakeup()
+    {
+        if (!sleeping_.load(std::memory_order_relaxed))
+            return;
+        lockGuard lg(&waitmtx_);
+        pthread_cond_signal(&wakecond_);
+    }
+
+    void Sleep()
+    {
+        lockGuard lg(&waitmtx_);
+        sleeping_.store(true, std::memory_order_relaxed);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += log_idle_us * 1000;
+        if (ts.tv_nsec >= 1000000000)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&wakecond_, waitmtx_.getmutex(), &ts);
+        sleeping_.store(false, std::memory_order_relaxed);
+    }
+
+    // 线程第一次写日志时创建自己的环形缓冲区, 线程退出时标记为dead_
+    struct RingHolder
+    {
+        LogRing *ring_ = nullptr;
+        ~RingHolder()
+        {
+            if (ring_)
+                ring_->dead_.store(true, std::memory_order_release);
+        }
+    };
+
+    LogRing *LocalRing()
+    {
+        static thread_local RingHolder holder;
+        if (holder.ring_ == nullptr)
+        {
+            holder.ring_ = new LogRing;
+            lockGuard lg(&ringsmtx_);
+            rings_.push_back(holder.ring_);
+        }
+        return holder.ring_;
+    }
+
+    static void *Routine(void *args)
+    {
+        AsyncLogger *self = static_cast<AsyncLogger *>(args);
+        while (!self->stop_.load(std::memory_order_acquire))
+        {
+            if (self->DrainAll() == 0)
+                self->Sleep();
+        }
+        // Stop已经等所有生产者提交, 取到空为止
+        while (self->DrainAll() > 0)
+            ;
+        return nullptr;
+    }
+
+    // 取空所有线程的缓冲区并写出, 返回取出的记录数; 只由后台线程(或停止后的Stop)调用
+    size_t DrainAll()
+    {
+        std::vector<LogRing *> rings;
+        {
+            lockGuard lg(&ringsmtx_);
+            rings = rings_;
+        }
+        size_t n = 0;
+        for (LogRing *ring : rings)
+        {
+            n += ring->Drain([this](const LogRecord &rec)
+                             { Format(rec); });
+        }
+        uint64_t dropped;
+        {
+            lockGuard lg(&ringsmtx_);
+            dropped = dropped_ + CountDropped();
+            ReleaseDead();
+        }
+        if (dropped != reported_)
+        {
+            char line[96];
+            int len = snprintf(line, sizeof(line), "[WARNING %s %d] 日志缓冲区满, 累计丢弃%llu条日志\n",
+                               LogClock::TimeStr(LogClock::Now()), pid_,
+                               (unsigned long long)dropped);
+            batch_.append(line, len);
+            reported_ = dropped;
+        }
+        Write();
+        return n;
+    }
+
+    // 日志格式：log = title(log level, time, pid) + body
+    // 时间只精确到秒, 同一秒内复用格式化好的字符串
+    void Format(const LogRecord &rec)
+    {
+        char title[96];
+        int len = snprintf(title, sizeof(title), "[%s %s %d] ", level_names[rec.lv_], LogClock::TimeStr(rec.ns_), pid_);
+        batch_.append(title, len);
+        batch_.append(rec.body_, rec.len_);
+        if (batch_.size() >= log_batch_size)
+            Write();
+    }
+
+    void Write()
+    {
+        size_t off = 0;
+        while (off < batch_.size())
+        {
+            ssize_t n = write(fd_, batch_.data() + off, batch_.size() - off);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                break; // 写失败时丢弃这一批, 不能再用日志报告
+            }
+            off += n;
+        }
+        batch_.clear();
+    }
+
+    // 以下两个需持有ringsmtx_
+    uint64_t CountDropped()
+    {
+        uint64_t n = 0;
+        for (LogRing *ring : rings_)
+            n += ring->dropped_.load(std::memory_order_relaxed);
+        return n;
+    }
+    void ReleaseDead()
+    {
+        for (size_t i = 0; i < rings_.size();)
+        {
+            if (rings_[i]->dead_.load(std::memory_order_acquire) && rings_[i]->Empty())
+            {
+                dropped_ += rings_[i]->dropped_.load(std::memory_order_relaxed);
+                delete rings_[i];
+                rings_[i] = rings_.back();
+                rings_.pop_back();
+            }
+            else
+                i++;
+        }
+    }
+
+private:
+    int fd_;
+    logfull_t policy_;
+    pthread_t tid_;
+    int pid_;
+    std::atomic<bool> running_{false};
+    std::atomic<bool> stop_{false};
+
+    Mutex waitmtx_;
+    pthread_cond_t wakecond_;
+    std::atomic<bool> sleeping_{false}; // 后台线程是否在wakecond_上休眠
+
+    Mutex ringsmtx_; // 只在线程注册、后台线程每轮取快照时加锁, 不在写日志的路径上
+    std::vector<LogRing *> rings_;
+    uint64_t dropped_ = 0; // 已释放的缓冲区丢弃的记录数
+
+    // 只由后台线程使用
+    std::string batch_;
+    uint64_t reported_ = 0;
+};
 
 // 日志格式：log = title(log level, time, pid) + body
-void LogMessage(loglevel_t lv, const char *format, ...)
-{
-    // 1. title
-    time_t t = time(nullptr);
-    struct tm *tp = localtime(&t);
-    // 2. time = y-m-d h:m:s
-    char timestr[64];
-    memset(timestr, 0, sizeof(timestr));
-    snprintf(timestr, sizeof(timestr), "%d-%d-%d %d:%d:%d", tp->tm_year + 1900, tp->tm_mon + 1, tp->tm_mday, tp->tm_hour, tp->tm_min, tp->tm_sec);
-    std::string logtitle = ltos[lv] + " " + timestr + " " + std::to_string(getpid());
-
-    // 3. body
+// 启动了BinaryLogger时写二进制日志, 否则启动了AsyncLogger时写入异步日志, 都没有启动时直接输出到终端
+// 不做等级过滤, 通过LogMessage调用; fmtid是调用点登记的格式串ID
+void LogWrite(loglevel_t lv, uint32_t fmtid, const char *format, ...)
+{
     va_list ap;
-    char logbody[128];
-    memset(logbody, 0, sizeof(logbody));
     va_start(ap, format);
-    vsnprintf(logbody, sizeof(logbody), format, ap);
+    BinaryLogger &binary = BinaryLogger::Instance();
+    AsyncLogger &logger = AsyncLogger::Instance();
+    if (binary.Running())
+        binary.Append(lv, LogClock::Now(), fmtid, format, ap);
+    else if (!logger.Running() || !logger.Append(lv, format, ap)) // 检查之后刚好停止时也直接输出
+    {
+        // 输出到终端, 正文不截断; 锁住stdout, 多个线程的日志不交错
+        flockfile(stdout);
+        printf("[%s %s %d] ", level_names[lv], LogClock::TimeStr(LogClock::Now()), getpid());
+        vprintf(format, ap);
+        funlockfile(stdout);
+    }
     va_end(ap);
-	
-    // 4. 输出
-    
-    // 输出到终端
-    // combine and output
-    printf("[%s] %s", logtitle.c_str(), logbody);
-
-    // 保存到文件
-    // FILE *fp = fopen(filename, "a");
-
-    // fprintf(fp, "[%s] %s", logtitle.c_str(), logbody);
-
-    // fclose(fp);
 }
 
-// LogMessage(FATAL, "epoll create failed, errno: %d - strerror: %s\n", errno, strerror(errno));
\ No newline at end of file
+// LogMessage(lv, format, ...): 等级过滤后调用LogWrite
+// 宏展开在调用处: 被过滤掉的日志不对参数求值(例如request.c_str()、strerror(errno)), lv必须是常量
+// 每个调用点第一次输出时登记格式串, 之后二进制日志只记录ID
+#define LOG_FORMAT_(format, ...) format
+#define LogMessage(lv, ...)                                                                          \
+    do                                                                                               \
+    {                                                                                                \
+        if constexpr ((lv) >= LOG_MIN_LEVEL)                                                         \
+        {                                                                                            \
+            if ((lv) >= runtime_loglevel.load(std::memory_order_relaxed))                            \
+            {                                                                                        \
+                static const uint32_t logfmtid = LogFormats::Instance().Register(LOG_FORMAT_(__VA_ARGS__)); \
+                LogWrite((lv), logfmtid, __VA_ARGS__);                                               \
+            }                                                                                        \
+        }                                                                                            \
+    } while (0)
+
+// LogMessage(FATAL, "epoll create failed, errno: %d - strerror: %s\n", errno, strerror(errno));
@@ -0,0 +1,84 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <tuple>
+#include <fstream>
+#include <sstream>
+#include "log.hpp"
+#include "err.hpp"
+
+void Usage()
+{
+    std::cout << "Usage: ./logdecode segment.bin..." << std::endl;
+}
+
+struct Segment
+{
+    LogSegmentHeader hdr_;
+    std::vector<LogLine> lines_;
+};
+
+// 把二进制日志段还原成文本日志, 格式和文本日志相同: [等级 时间 pid] 正文
+// ./logdecode server.log.*.bin > server.txt
+// 同一线程的段按段序号连起来, 保持写入顺序; 不同线程的日志按时间合并
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        Usage();
+        exit(USAGE_ERR);
+    }
+    std::vector<Segment> segments;
+    int ret = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        std::ifstream in(argv[i], std::ios::binary);
+        std::stringstream ss;
+        ss << in.rdbuf();
+        std::string data = ss.str();
+        Segment seg;
+        if (!in || !DecodeLogSegment(data.data(), data.size(), &seg.hdr_, &seg.lines_))
+        {
+            std::cerr << "bad log segment: " << argv[i] << std::endl;
+            ret = LOG_DECODE_ERR; // 坏段之前解出来的记录照常输出
+        }
+        segments.push_back(std::move(seg));
+    }
+    std::sort(segments.begin(), segments.end(), [](const Segment &a, const Segment &b)
+              { return std::make_tuple(a.hdr_.pid_, a.hdr_.thread_, a.hdr_.segno_) <
+                       std::make_tuple(b.hdr_.pid_, b.hdr_.thread_, b.hdr_.segno_); });
+
+    struct Entry
+    {
+        int64_t ns_;
+        uint32_t pid_;
+        const LogLine *line_;
+    };
+    std::vector<Entry> entries;
+    for (const Segment &seg : segments)
+    {
+        for (const LogLine &line : seg.lines_)
+            entries.push_back({line.ns_, seg.hdr_.pid_, &line});
+    }
+    std::stable_sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b)
+                     { return a.ns_ < b.ns_; });
+
+    std::string out;
+    for (const Entry &e : entries)
+    {
+        const LogLine &line = *e.line_;
+        char title[96];
+        const char *lv = line.lv_ <= FATAL ? level_names[line.lv_] : "UNKNOWN";
+        int len = snprintf(title, sizeof(title), "[%s %s %u] ", lv, LogClock::TimeStr(line.ns_), e.pid_);
+        out.append(title, len);
+        out.append(line.body_);
+        if (out.size() >= log_batch_size)
+        {
+            fwrite(out.data(), 1, out.size(), stdout);
+            out.clear();
+        }
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    return ret;
+}
@@ -1,43 +1,199 @@
 #include "reactor_server.hpp"
+#include "async_io.hpp"
+#include "calc_kernel.hpp"
+#include "expr_engine.hpp"
 #include <memory>
+#include <cstring>
+#include <thread>
+#include <signal.h>
 
+static const size_t program_cache_size = 4096; // 每个工作线程缓存的表达式程序个数
+
+// 表达式请求: 编译好的程序按 表达式文本 + 变量名和类型 缓存, 每个工作线程一份, 不加锁
+// 只有一组取值时逐条解释, 多组时按列批量求值
+Response expression(const Request &req)
+{
+    thread_local expr::ProgramCache cache(program_cache_size);
+    Response resp;
+    resp._isexpr = true;
+    const expr::Program *prog = cache.Get(req._expr, req._names, req._types);
+    if (prog->err_ != 0)
+    {
+        resp._code = prog->err_;
+        return resp;
+    }
+    resp._type = prog->type_;
+    resp._vals.resize(req._rows);
+    resp._codes.resize(req._rows);
+    if (req._rows == 1)
+        resp._codes[0] = expr::Eval(*prog, req._vals.data(), resp._vals.data());
+    else
+        expr::EvalBatch(*prog, req._vals.data(), req._rows, resp._vals.data(), resp._codes.data());
+    return resp;
+}
+
+// 计算语义见calc_kernel.hpp: 除数为0时'/'错误码1, '%'错误码2, 未知运算符错误码3
+// 批量请求按运算符分组, 用SIMD批量计算, 每个元素单独给出结果和错误码
+// 表达式请求交给expression
 Response calculator(const Request &req)
 {
+    if (req.IsExpr())
+        return expression(req);
     Response resp;
-    switch (req._opt)
+    if (req.IsBatch())
     {
-    case '+':
-        resp._ret = req._x + req._y;
-        break;
-    case '-':
-        resp._ret = req._x - req._y;
-        break;
-    case '*':
-        resp._ret = req._x * req._y;
-        break;
-    case '/':
-        if (req._y == 0)
-            resp._code = 1;
-        else
-            resp._ret = req._x / req._y;
-        break;
-    case '%':
-        if (req._y == 0)
-            resp._code = 2;
-        else
-            resp._ret = req._x % req._y;
-        break;
-    default:
-        resp._code = 3;
+        size_t n = req._opts.size();
+        resp._rets.resize(n);
+        resp._codes.resize(n);
+        calc::EvalBatch(req._xs.data(), req._opts.data(), req._ys.data(), n, resp._rets.data(), resp._codes.data());
+        return resp;
     }
+    calc::Eval(req._x, req._opt, req._y, &resp._ret, &resp._code);
     return resp;
 }
 
-int main()
+// 协程版本: 计算放到线程池, 等待期间IO线程继续处理其它连接, 算完回到IO线程发送响应
+Task<Response> calculator_async(const Request &req)
+{
+    co_return co_await Offload([&req]()
+                               { return calculator(req); });
+}
+
+static const size_t cache_bytes = 16 << 20; // 每个IO线程的响应缓存上限
+static const int defer_accept_secs = 5;     // defer: 连接建立后最多等多久的第一个数据包
+static const int expr_thread_num = 2;       // 表达式请求的隔离舱线程数
+
+// SIGINT/SIGTERM由专门的线程sigwait后优雅关闭服务器, 其它线程都屏蔽它们
+// 必须在创建任何线程(包括日志线程)之前屏蔽, 新线程继承屏蔽字
+sigset_t StopSignals()
 {
-    std::unique_ptr<ReactorServer> svr(new ReactorServer(calculator));
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    return set;
+}
+
+// 编解码方式在编译期选定, 每种协议实例化一份服务器
+// cache: calculator是确定性的, 可以开启响应缓存
+template <Codec C>
+void Run(bool async, bool cache, const std::string &capture, const AcceptOptions &opts, const std::vector<Endpoint> &endpoints)
+{
+    std::unique_ptr<ReactorServer<C>> svr;
+    if (async)
+        svr.reset(new ReactorServer<C>(calculator_async));
+    else
+    {
+        svr.reset(new ReactorServer<C>(calculator));
+        // 表达式请求(尤其是大批量取值的)比算式慢得多, 放进自己的线程池, 占满时不拖慢普通请求
+        svr->AddBulkhead([](const Request &req)
+                         { return req.IsExpr(); },
+                         expression, nullptr, expr_thread_num);
+    }
+    if (cache)
+        svr->EnableCache(cache_bytes);
+    if (!capture.empty())
+        svr->EnableCapture(capture);
+    svr->SetAcceptOptions(opts);
+    for (const Endpoint &ep : endpoints)
+        svr->AddEndpoint(ep);
     svr->Init();
-    svr->Start();
+    std::thread waiter([&svr]()
+                       {
+                           sigset_t set = StopSignals();
+                           int sig = 0;
+                           sigwait(&set, &sig);
+                           LogMessage(INFO, "收到信号%d, 停止服务器\n", sig);
+                           svr->Stop(); });
+    svr->Start(); // Stop之后返回
+    waiter.join();
+}
+
+void Usage()
+{
+    std::cout << "Usage: ./reactor_server [async] [cache] [logfile|binlog] [debug] [bulk] [defer] [udpgso] [capture=BASE] [listen=ENDPOINT]... [auto|json|binary|line|http]" << std::endl;
+}
+
+// ./reactor_server [async] [cache] [logfile|binlog] [debug] [bulk] [defer] [udpgso] [capture=BASE] [listen=ENDPOINT]... [auto|json|binary|line|http]
+// 日志由后台线程异步写出, logfile: 写到server.log, 否则写到终端
+// binlog: 写二进制日志段server.log.*.bin, 用./logdecode还原成文本
+// 默认只输出INFO及以上的日志, debug: 输出全部日志
+// 新连接默认按低延迟配置(TCP_NODELAY + QUICKACK), bulk: 加大收发缓冲区; defer: 开启TCP_DEFER_ACCEPT, 连接带着数据才被accept
+// listen=ENDPOINT: 监听地址, 可以给多个, 如 listen=tcp6:8080 listen=unix:@reactor; 不给时监听tcp:8080
+//   tcp:PORT(IPv4) tcp6:PORT(IPv6双栈) unix:PATH(Unix域套接字, @开头为抽象命名空间)
+//   shm:PATH(在unix地址PATH上握手, 数据走共享内存, IO线程有这种连接时忙轮询)
+//   udp:PORT udp6:PORT(每个IO线程一个SO_REUSEPORT套接字, 一个数据报一个请求, recvmmsg/sendmmsg批量收发)
+// udpgso: UDP套接字开启GRO/GSO, 合并同一对端的数据报, 减少协议栈开销
+// capture=BASE: 把收到的请求和响应时刻记录到BASE.<IO线程序号>.cap, 用./replay重放并对比延迟分布
+// auto(默认): 每个连接根据第一个字节在JSON、二进制和HTTP之间选择
+// SIGINT/SIGTERM: 停止接收新连接, 最多等default_drain_ms让已经收到的请求处理完, 然后退出
+int main(int argc, char *argv[])
+{
+    sigset_t stopset = StopSignals();
+    pthread_sigmask(SIG_BLOCK, &stopset, nullptr);
+
+    bool async = false, cache = false, logfile = false, binlog = false, debug = false;
+    AcceptOptions opts;
+    std::vector<Endpoint> endpoints;
+    std::string capture;
+    const char *codec = AutoCodec::name;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "async") == 0)
+            async = true;
+        else if (strcmp(argv[i], "cache") == 0)
+            cache = true;
+        else if (strcmp(argv[i], "logfile") == 0)
+            logfile = true;
+        else if (strcmp(argv[i], "binlog") == 0)
+            binlog = true;
+        else if (strcmp(argv[i], "debug") == 0)
+            debug = true;
+        else if (strcmp(argv[i], "bulk") == 0)
+            opts.profile_ = util::PROFILE_BULK;
+        else if (strcmp(argv[i], "defer") == 0)
+            opts.defer_accept_ = defer_accept_secs;
+        else if (strcmp(argv[i], "udpgso") == 0)
+            opts.udp_offload_ = true;
+        else if (strncmp(argv[i], "capture=", 8) == 0 && argv[i][8] != '\0')
+            capture = argv[i] + 8;
+        else if (strncmp(argv[i], "listen=", 7) == 0)
+        {
+            Endpoint ep;
+            if (!Endpoint::Parse(argv[i] + 7, &ep))
+            {
+                Usage();
+                exit(USAGE_ERR);
+            }
+            endpoints.push_back(ep);
+        }
+        else
+            codec = argv[i];
+    }
+
+    SetLogLevel(debug ? TRACE : INFO);
+    bool started = binlog ? BinaryLogger::Instance().Start(filename) : AsyncLogger::Instance().Start(logfile ? filename : nullptr);
+    if (!started)
+    {
+        std::cout << "open log file failed: " << strerror(errno) << std::endl;
+        exit(LOG_OPEN_ERR);
+    }
+
+    if (strcmp(codec, AutoCodec::name) == 0)
+        Run<AutoCodec>(async, cache, capture, opts, endpoints);
+    else if (strcmp(codec, JsonCodec::name) == 0)
+        Run<JsonCodec>(async, cache, capture, opts, endpoints);
+    else if (strcmp(codec, BinaryCodec::name) == 0)
+        Run<BinaryCodec>(async, cache, capture, opts, endpoints);
+    else if (strcmp(codec, LineCodec::name) == 0)
+        Run<LineCodec>(async, cache, capture, opts, endpoints);
+    else if (strcmp(codec, HttpCodec::name) == 0)
+        Run<HttpCodec>(async, cache, capture, opts, endpoints);
+    else
+    {
+        Usage();
+        exit(USAGE_ERR);
+    }
 
     return 0;
-}
\ No newline at end of file
+}
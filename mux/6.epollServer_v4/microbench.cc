@@ -0,0 +1,562 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <sched.h>
+#include <sys/socket.h>
+#include "protocol_netcal.hpp"
+#include "codec.hpp"
+#include "calc_kernel.hpp"
+#include "thread_pool.hpp"
+#include "reactor.hpp"
+#include "util.hpp"
+#include "err.hpp"
+
+// 热路径微基准: JSON协议的Parse/AddHeader/RemoveHeader、Request/Response的序列化和反序列化、HandleRequest2Response,
+// 线程池在多个生产者、消费者争用下的pushTask/popTask, Reactor在socketpair上的事件派发
+// 每项先翻倍迭代次数直到一次运行不少于min_ms毫秒(同时起预热作用), 再运行reps次, 取每次操作耗时的中位数
+// 离散程度用中位数绝对偏差(MAD)相对中位数的百分比表示, 明显偏大说明这次测量受到了干扰
+// 输出: text为对齐的表格, csv/json便于脚本比较不同提交的结果; label=STR写进每一行, 例如提交号
+// baseline=FILE: 与之前csv格式的结果比较, 变慢超过threshold%(默认10)且超过两边MAD之和的项视为退化, 有退化时返回1
+// ./microbench [format=text|csv|json] [out=FILE] [filter=SUBSTR] [reps=N] [min_ms=M] [pin=CPU] [label=STR]
+//              [baseline=FILE] [threshold=PCT]
+// 例如: ./microbench format=csv label=$(git rev-parse --short HEAD) out=base.csv
+//       ./microbench baseline=base.csv filter=json/
+
+using namespace protocol_ns_json;
+
+void Usage()
+{
+    std::cout << "Usage: ./microbench [format=text|csv|json] [out=FILE] [filter=SUBSTR] [reps=N] [min_ms=M] [pin=CPU] [label=STR]" << std::endl
+              << "                    [baseline=FILE] [threshold=PCT]" << std::endl;
+}
+
+static volatile size_t sink = 0; // 防止编译器把测试代码优化掉
+
+static const int micro_frames = 1024;        // Parse每轮解析的报文个数
+static const int micro_reactor_batch = 16;   // Reactor每个连接每轮发的请求数
+static const int micro_max_calibrate = 40;   // 校准时最多翻倍的次数
+
+struct MicroOptions
+{
+    std::string format_ = "text";
+    std::string out_;
+    std::string filter_;
+    int reps_ = 9;
+    int min_ms_ = 20;
+    int pin_ = -1;
+    std::string label_;
+    std::string baseline_;
+    double threshold_ = 10;
+};
+
+// 一个基准: run(iters)执行iters次操作
+struct MicroCase
+{
+    std::string name_;
+    std::function<void(uint64_t)> run_;
+};
+
+struct MicroResult
+{
+    std::string name_;
+    uint64_t iters_ = 0; // 每次运行的操作数
+    int reps_ = 0;
+    double ns_ = 0;  // 每次操作耗时的中位数
+    double min_ = 0; // 最快的一次
+    double max_ = 0; // 最慢的一次
+    double mad_ = 0; // 中位数绝对偏差, 占中位数的百分比
+};
+
+double Median(std::vector<double> v)
+{
+    std::sort(v.begin(), v.end());
+    size_t n = v.size();
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+uint64_t TimeRun(const MicroCase &c, uint64_t iters)
+{
+    uint64_t begin = util::NowNs();
+    c.run_(iters);
+    return util::NowNs() - begin;
+}
+
+MicroResult Measure(const MicroCase &c, const MicroOptions &opts)
+{
+    uint64_t min_ns = (uint64_t)opts.min_ms_ * 1000000;
+    uint64_t iters = 1;
+    for (int i = 0; i < micro_max_calibrate && TimeRun(c, iters) < min_ns; i++)
+        iters *= 2;
+    std::vector<double> samples;
+    for (int i = 0; i < opts.reps_; i++)
+        samples.push_back((double)TimeRun(c, iters) / iters);
+
+    MicroResult r;
+    r.name_ = c.name_;
+    r.iters_ = iters;
+    r.reps_ = opts.reps_;
+    r.ns_ = Median(samples);
+    r.min_ = *std::min_element(samples.begin(), samples.end());
+    r.max_ = *std::max_element(samples.begin(), samples.end());
+    std::vector<double> dev;
+    for (double s : samples)
+        dev.push_back(s > r.ns_ ? s - r.ns_ : r.ns_ - s);
+    r.mad_ = r.ns_ > 0 ? Median(dev) / r.ns_ * 100 : 0;
+    return r;
+}
+
+// ---------------- 协议 ----------------
+
+Response Calculate(const Request &req)
+{
+    Response resp;
+    calc::Eval(req._x, req._opt, req._y, &resp._ret, &resp._code);
+    return resp;
+}
+
+std::string JsonRequest(int i)
+{
+    std::string s;
+    Request(i, "+-*/%"[i % 5], i % 97 + 1).Serialize(&s);
+    return s;
+}
+
+std::string JsonResponse(int i)
+{
+    std::string s;
+    Response resp;
+    resp._ret = i * 7;
+    resp._code = i % 4;
+    resp.Serialize(&s);
+    return s;
+}
+
+void AddProtocolCases(std::vector<MicroCase> *cases)
+{
+    // 一轮micro_frames个报文, 解析完一轮重新装满缓冲区, 装满的拷贝分摊到每个报文上
+    cases->push_back({"json/Parse", [](uint64_t iters)
+                      {
+                          std::string stream;
+                          for (int i = 0; i < micro_frames; i++)
+                          {
+                              std::string s = JsonRequest(i);
+                              AddHeader(s);
+                              stream += s;
+                          }
+                          std::string buf, package;
+                          for (uint64_t i = 0; i < iters; i++)
+                          {
+                              if (buf.empty())
+                                  buf = stream;
+                              sink = sink + Parse(buf, &package);
+                          }
+                      }});
+    cases->push_back({"json/AddHeader", [](uint64_t iters)
+                      {
+                          std::string payload = JsonRequest(12345), s;
+                          for (uint64_t i = 0; i < iters; i++)
+                          {
+                              s = payload;
+                              AddHeader(s);
+                              sink = sink + s.size();
+                          }
+                      }});
+    cases->push_back({"json/RemoveHeader", [](uint64_t iters)
+                      {
+                          std::string payload = JsonRequest(12345), frame = payload, s;
+                          AddHeader(frame);
+                          for (uint64_t i = 0; i < iters; i++)
+                          {
+                              s = frame;
+                              RemoveHeader(s, payload.size());
+                              sink = sink + s.size();
+                          }
+                      }});
+    cases->push_back({"json/Request.Serialize", [](uint64_t iters)
+                      {
+                          Request req(12345, '*', 678);
+                          std::string s;
+                          for (uint64_t i = 0; i < iters; i++)
+                          {
+                              req._x = (int)i;
+                              req.Serialize(&s);
+                              sink = sink + s.size();
+                          }
+                      }});
+    cases->push_back({"json/Request.Deserialize", [](uint64_t iters)
+                      {
+                          std::vector<std::string> in;
+                          for (int i = 0; i < micro_frames; i++)
+                              in.push_back(JsonRequest(i * 131));
+                          Request req;
+                          for (uint64_t i = 0; i < iters; i++)
+                          {
+                              req.Deserialize(in[i % micro_frames]);
+                              sink = sink + req._x;
+                          }
+                      }});
+    cases->push_back({"json/Response.Serialize", [](uint64_t iters)
+                      {
+                          Response resp;
+                          resp._code = 2;
+                          std::string s;
+                          for (uint64_t i = 0; i < iters; i++)
+                          {
+                              resp._ret = (int)i;
+                              resp.Serialize(&s);
+                              sink = sink + s.size();
+                          }
+                      }});
+    cases->push_back({"json/Response.Deserialize", [](uint64_t iters)
+                      {
+                          std::vector<std::string> in;
+                          for (int i = 0; i < micro_frames; i++)
+                              in.push_back(JsonResponse(i * 131));
+                          Response resp;
+                          for (uint64_t i = 0; i < iters; i++)
+                          {
+                              resp.Deserialize(in[i % micro_frames]);
+                              sink = sink + resp._ret;
+                          }
+                      }});
+    // 两个重载: 已去报头的有效载荷(v4的Recv), 整个报文按值传入再去报头(旧的读路径)
+    cases->push_back({"json/HandleRequest2Response(payload)", [](uint64_t iters)
+                      {
+                          service_t service = Calculate;
+                          std::vector<std::string> in;
+                          for (int i = 0; i < micro_frames; i++)
+                              in.push_back(JsonRequest(i * 131));
+                          for (uint64_t i = 0; i < iters; i++)
+                              sink = sink + HandleRequest2Response(in[i % micro_frames], service).size();
+                      }});
+    cases->push_back({"json/HandleRequest2Response(frame)", [](uint64_t iters)
+                      {
+                          service_t service = Calculate;
+                          std::vector<std::string> in;
+                          std::vector<int> lens;
+                          for (int i = 0; i < micro_frames; i++)
+                          {
+                              in.push_back(JsonRequest(i * 131));
+                              lens.push_back(in.back().size());
+                              AddHeader(in.back());
+                          }
+                          for (uint64_t i = 0; i < iters; i++)
+                              sink = sink + HandleRequest2Response(in[i % micro_frames], lens[i % micro_frames], service).size();
+                      }});
+}
+
+// ---------------- 线程池 ----------------
+
+struct CountTask
+{
+    std::atomic<uint64_t> *done_ = nullptr;
+    void operator()()
+    {
+        done_->fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+// producers个线程一共push iters个任务, consumers个工作线程执行; 一次操作 = 一个任务的push + pop + 执行
+// 所有任务执行完才算结束, 工作线程的创建和回收分摊在iters个任务上
+void PoolRun(uint64_t iters, int producers, int consumers)
+{
+    std::atomic<uint64_t> done{0};
+    {
+        ThreadPool<CountTask> pool(consumers, "micro");
+        pool.start();
+        std::vector<std::thread> threads;
+        for (int p = 0; p < producers; p++)
+        {
+            uint64_t n = iters / producers + (p < (int)(iters % producers) ? 1 : 0);
+            threads.emplace_back([&pool, &done, n]()
+                                 {
+                                     for (uint64_t i = 0; i < n; i++)
+                                         pool.pushTask(CountTask{&done}); });
+        }
+        for (std::thread &th : threads)
+            th.join();
+        while (done.load(std::memory_order_relaxed) < iters)
+            sched_yield();
+    }
+    sink = sink + done.load();
+}
+
+void AddPoolCases(std::vector<MicroCase> *cases)
+{
+    const int shapes[][2] = {{1, 1}, {1, 4}, {4, 1}, {4, 4}};
+    for (const auto &s : shapes)
+    {
+        int producers = s[0], consumers = s[1];
+        std::string name = "pool/push+pop p" + std::to_string(producers) + " c" + std::to_string(consumers);
+        cases->push_back({name, [producers, consumers](uint64_t iters)
+                          { PoolRun(iters, producers, consumers); }});
+    }
+}
+
+// ---------------- Reactor ----------------
+
+Task<Response> CalculateAsync(const Request &req)
+{
+    co_return Calculate(req);
+}
+
+// 一个Reactor<BinaryCodec>管理conns个socketpair的服务器端, 在本线程上运行
+// 每轮在每个客户端写入micro_reactor_batch个请求, 然后LoopOnce直到收齐所有响应
+// 协程业务同步完成, 不经过线程池; 一次操作 = 一个请求的epoll派发、读取、解析、处理、编码和发送
+void ReactorRun(uint64_t iters, int conns)
+{
+    SetLogLevel(INFO); // 连接建立的DEBUG日志不计入
+    std::vector<int> clients, servers;
+    Reactor<BinaryCodec> *reactor = new Reactor<BinaryCodec>(LISTEN_NO, RW_YES, nullptr);
+    reactor->SetAsyncService(CalculateAsync);
+    reactor->Init();
+    for (int i = 0; i < conns; i++)
+    {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        {
+            LogMessage(FATAL, "socketpair failed: %s\n", strerror(errno));
+            exit(SOCKET_ERR);
+        }
+        util::SetNonBlock(sv[0]);
+        util::SetNonBlock(sv[1]);
+        clients.push_back(sv[0]);
+        servers.push_back(sv[1]);
+        reactor->AddConnection(sv[1], EPOLLIN);
+    }
+
+    BinaryCodec codec;
+    std::string batch, one;
+    for (int i = 0; i < micro_reactor_batch; i++)
+        codec.Encode(Request(i, '+', 1), &batch);
+    Response resp;
+    resp._ret = 1;
+    codec.Encode(resp, &one);
+    size_t want = one.size() * micro_reactor_batch; // 每个连接每轮的响应字节数, 二进制响应定长
+
+    uint64_t rounds = (iters + (uint64_t)conns * micro_reactor_batch - 1) / ((uint64_t)conns * micro_reactor_batch);
+    std::vector<size_t> got(conns);
+    char buf[65536];
+    for (uint64_t r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < conns; i++)
+        {
+            got[i] = 0;
+            ssize_t n = write(clients[i], batch.data(), batch.size());
+            (void)n;
+        }
+        int pending = conns;
+        while (pending > 0)
+        {
+            reactor->LoopOnce(100);
+            for (int i = 0; i < conns; i++)
+            {
+                ssize_t n;
+                while (got[i] < want && (n = read(clients[i], buf, sizeof(buf))) > 0)
+                {
+                    got[i] += n;
+                    if (got[i] == want)
+                        pending--;
+                }
+            }
+        }
+    }
+    delete reactor;
+    for (int i = 0; i < conns; i++)
+    {
+        close(clients[i]);
+        close(servers[i]);
+    }
+    SetLogLevel(TRACE);
+    sink = sink + rounds;
+}
+
+void AddReactorCases(std::vector<MicroCase> *cases)
+{
+    for (int conns : {1, 64})
+    {
+        std::string name = "reactor/dispatch " + std::to_string(conns) + " socketpair" + (conns > 1 ? "s" : "");
+        cases->push_back({name, [conns](uint64_t iters)
+                          { ReactorRun(iters, conns); }});
+    }
+}
+
+// ---------------- 输出 ----------------
+
+std::string JsonEscape(const std::string &s)
+{
+    std::string out;
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+void PrintHeader(FILE *out, const MicroOptions &opts)
+{
+    if (opts.format_ == "csv")
+        fprintf(out, "label,benchmark,iterations,reps,ns_per_op,min_ns,max_ns,mad_pct\n");
+    else if (opts.format_ == "json")
+        fprintf(out, "{\"label\": \"%s\", \"benchmarks\": [", JsonEscape(opts.label_).c_str());
+    else
+        fprintf(out, "%-40s %12s %12s %12s %8s %12s\n", "benchmark", "ns/op", "min ns", "max ns", "mad %", "iterations");
+}
+
+void PrintResult(FILE *out, const MicroOptions &opts, const MicroResult &r, bool first)
+{
+    if (opts.format_ == "csv")
+        fprintf(out, "%s,%s,%llu,%d,%.2f,%.2f,%.2f,%.2f\n", opts.label_.c_str(), r.name_.c_str(), (unsigned long long)r.iters_,
+                r.reps_, r.ns_, r.min_, r.max_, r.mad_);
+    else if (opts.format_ == "json")
+        fprintf(out, "%s\n  {\"name\": \"%s\", \"iterations\": %llu, \"reps\": %d, \"ns_per_op\": %.2f, \"min_ns\": %.2f, \"max_ns\": %.2f, \"mad_pct\": %.2f}",
+                first ? "" : ",", JsonEscape(r.name_).c_str(), (unsigned long long)r.iters_, r.reps_, r.ns_, r.min_, r.max_, r.mad_);
+    else
+        fprintf(out, "%-40s %12.1f %12.1f %12.1f %8.2f %12llu\n", r.name_.c_str(), r.ns_, r.min_, r.max_, r.mad_,
+                (unsigned long long)r.iters_);
+    fflush(out);
+}
+
+void PrintFooter(FILE *out, const MicroOptions &opts)
+{
+    if (opts.format_ == "json")
+        fprintf(out, "\n]}\n");
+}
+
+// 读取csv格式的结果: 基准名 -> (ns_per_op, mad_pct); 逗号不会出现在基准名里
+bool ReadBaseline(const std::string &path, std::map<std::string, std::pair<double, double>> *base)
+{
+    FILE *fp = fopen(path.c_str(), "r");
+    if (fp == nullptr)
+        return false;
+    char line[1024];
+    while (fgets(line, sizeof(line), fp))
+    {
+        std::vector<std::string> cols;
+        std::string cur;
+        for (char *p = line; *p && *p != '\n'; p++)
+        {
+            if (*p == ',')
+            {
+                cols.push_back(cur);
+                cur.clear();
+            }
+            else
+                cur += *p;
+        }
+        cols.push_back(cur);
+        if (cols.size() != 8 || cols[1] == "benchmark")
+            continue;
+        (*base)[cols[1]] = {atof(cols[4].c_str()), atof(cols[7].c_str())};
+    }
+    fclose(fp);
+    return true;
+}
+
+// 与基准结果比较, 输出到标准错误, 不混进csv/json; 返回退化的项数
+int Compare(const std::vector<MicroResult> &results, const std::map<std::string, std::pair<double, double>> &base, double threshold)
+{
+    int regressions = 0;
+    fprintf(stderr, "%-40s %12s %12s %9s\n", "vs baseline", "base ns", "now ns", "change");
+    for (const MicroResult &r : results)
+    {
+        auto it = base.find(r.name_);
+        if (it == base.end() || it->second.first <= 0)
+            continue;
+        double change = (r.ns_ / it->second.first - 1) * 100;
+        bool slower = change > threshold && change > r.mad_ + it->second.second;
+        regressions += slower;
+        fprintf(stderr, "%-40s %12.1f %12.1f %+8.1f%%%s\n", r.name_.c_str(), it->second.first, r.ns_, change, slower ? "  REGRESSION" : "");
+    }
+    return regressions;
+}
+
+int main(int argc, char *argv[])
+{
+    MicroOptions opts;
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        if (strncmp(arg, "format=", 7) == 0)
+            opts.format_ = arg + 7;
+        else if (strncmp(arg, "out=", 4) == 0)
+            opts.out_ = arg + 4;
+        else if (strncmp(arg, "filter=", 7) == 0)
+            opts.filter_ = arg + 7;
+        else if (strncmp(arg, "reps=", 5) == 0)
+            opts.reps_ = atoi(arg + 5);
+        else if (strncmp(arg, "min_ms=", 7) == 0)
+            opts.min_ms_ = atoi(arg + 7);
+        else if (strncmp(arg, "pin=", 4) == 0)
+            opts.pin_ = atoi(arg + 4);
+        else if (strncmp(arg, "label=", 6) == 0)
+            opts.label_ = arg + 6;
+        else if (strncmp(arg, "baseline=", 9) == 0)
+            opts.baseline_ = arg + 9;
+        else if (strncmp(arg, "threshold=", 10) == 0)
+            opts.threshold_ = atof(arg + 10);
+        else
+        {
+            Usage();
+            exit(USAGE_ERR);
+        }
+    }
+    if ((opts.format_ != "text" && opts.format_ != "csv" && opts.format_ != "json") || opts.reps_ <= 0 || opts.min_ms_ <= 0 ||
+        opts.threshold_ < 0 || opts.label_.find_first_of(",\"\\\n") != std::string::npos)
+    {
+        Usage();
+        exit(USAGE_ERR);
+    }
+
+    std::map<std::string, std::pair<double, double>> base;
+    if (!opts.baseline_.empty() && !ReadBaseline(opts.baseline_, &base))
+    {
+        std::cout << "open baseline " << opts.baseline_ << " failed: " << strerror(errno) << std::endl;
+        exit(READ_ERR);
+    }
+    // 固定在一个CPU上, 减少迁移和频率差异带来的波动; 线程池的工作线程继承同样的亲和性
+    if (opts.pin_ >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(opts.pin_, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0)
+            std::cerr << "pin to cpu " << opts.pin_ << " failed: " << strerror(errno) << std::endl;
+    }
+    FILE *out = stdout;
+    if (!opts.out_.empty() && (out = fopen(opts.out_.c_str(), "w")) == nullptr)
+    {
+        std::cout << "open " << opts.out_ << " failed: " << strerror(errno) << std::endl;
+        exit(WRITE_ERR);
+    }
+
+    std::vector<MicroCase> cases;
+    AddProtocolCases(&cases);
+    AddPoolCases(&cases);
+    AddReactorCases(&cases);
+
+    std::vector<MicroResult> results;
+    PrintHeader(out, opts);
+    for (const MicroCase &c : cases)
+    {
+        if (!opts.filter_.empty() && c.name_.find(opts.filter_) == std::string::npos)
+            continue;
+        results.push_back(Measure(c, opts));
+        PrintResult(out, opts, results.back(), results.size() == 1);
+    }
+    PrintFooter(out, opts);
+    if (out != stdout)
+        fclose(out);
+    if (!base.empty() && Compare(results, base, opts.threshold_) > 0)
+        return 1;
+    return 0;
+}
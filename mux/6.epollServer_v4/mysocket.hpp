@@ -4,6 +4,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <iostream>
@@ -11,24 +13,116 @@
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
+#include <cstddef>
 
 #include "err.hpp"
 #include "log.hpp"
 
-class Sock
+static const int default_backlog = 1024; // 全连接队列长度, 内核会截断到net.core.somaxconn
+
+// 套接字地址, 用字符串描述, 便于命令行配置:
+// tcp:PORT      IPv4, 监听时绑定INADDR_ANY
+// tcp6:PORT     IPv6, 监听时绑定in6addr_any并关闭IPV6_V6ONLY, 双栈同时接收IPv4连接
+// unix:PATH     Unix域流式套接字, 同一主机上不经过TCP/IP协议栈
+// unix:@NAME    Linux抽象命名空间, 不在文件系统里留下文件, 进程退出后自动消失
+// shm:PATH      共享内存传输(见shm_ring.hpp), PATH是握手用的unix套接字地址, 写法同unix
+// udp:PORT      UDP数据报, 一个数据报一个请求, 没有连接; udp6:PORT为IPv6双栈
+struct Endpoint
 {
-    static const int backlog = 32;
+    int family_ = AF_INET;
+    uint16_t port_ = 0;
+    std::string path_; // unix: 以'@'开头表示抽象命名空间
+    bool shm_ = false; // unix地址只用于握手, 数据走共享内存
+    bool udp_ = false; // 数据报套接字
+
+    Endpoint() = default;
+    Endpoint(int family, uint16_t port) : family_(family), port_(port) {}
+    Endpoint(const std::string &path, bool shm = false) : family_(AF_UNIX), path_(path), shm_(shm) {}
+
+    static bool Parse(const std::string &spec, Endpoint *ep)
+    {
+        size_t colon = spec.find(':');
+        if (colon == std::string::npos)
+            return false;
+        std::string scheme = spec.substr(0, colon), rest = spec.substr(colon + 1);
+        if (scheme == "unix" || scheme == "shm")
+        {
+            if (rest.empty() || rest == "@" || rest.size() >= sizeof(((struct sockaddr_un *)nullptr)->sun_path))
+                return false;
+            *ep = Endpoint(rest, scheme == "shm");
+            return true;
+        }
+        if (scheme != "tcp" && scheme != "tcp6" && scheme != "udp" && scheme != "udp6")
+            return false;
+        char *end = nullptr;
+        long port = strtol(rest.c_str(), &end, 10);
+        if (rest.empty() || *end != '\0' || port <= 0 || port > 65535)
+            return false;
+        *ep = Endpoint(scheme == "tcp" || scheme == "udp" ? AF_INET : AF_INET6, (uint16_t)port);
+        ep->udp_ = scheme[0] == 'u';
+        return true;
+    }
+
+    std::string ToString() const
+    {
+        if (family_ == AF_UNIX)
+            return (shm_ ? "shm:" : "unix:") + path_;
+        return (udp_ ? "udp" : "tcp") + std::string(family_ == AF_INET ? ":" : "6:") + std::to_string(port_);
+    }
 
+    // 填充套接字地址, 返回地址长度, 失败返回0
+    // host为空时是监听用的通配地址, 否则是要连接的对端IP(unix忽略host)
+    socklen_t ToSockaddr(struct sockaddr_storage *ss, const std::string &host = "") const
+    {
+        memset(ss, 0, sizeof(*ss));
+        if (family_ == AF_INET)
+        {
+            struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(port_);
+            sin->sin_addr.s_addr = INADDR_ANY;
+            if (!host.empty() && inet_pton(AF_INET, host.c_str(), &sin->sin_addr) != 1)
+                return 0;
+            return sizeof(*sin);
+        }
+        if (family_ == AF_INET6)
+        {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = htons(port_);
+            sin6->sin6_addr = in6addr_any;
+            if (!host.empty() && inet_pton(AF_INET6, host.c_str(), &sin6->sin6_addr) != 1)
+                return 0;
+            return sizeof(*sin6);
+        }
+        struct sockaddr_un *sun = (struct sockaddr_un *)ss;
+        if (path_.empty() || path_.size() >= sizeof(sun->sun_path))
+            return 0;
+        sun->sun_family = AF_UNIX;
+        memcpy(sun->sun_path, path_.data(), path_.size());
+        if (path_[0] == '@')
+        {
+            // 抽象命名空间: sun_path[0]为'\0', 名字的长度由地址长度决定, 不以'\0'结尾
+            sun->sun_path[0] = '\0';
+            return offsetof(struct sockaddr_un, sun_path) + path_.size();
+        }
+        return offsetof(struct sockaddr_un, sun_path) + path_.size() + 1;
+    }
+};
+
+class Sock
+{
 public:
-    Sock() : _sockfd(-1) {}
+    Sock() : _sockfd(-1), _family(AF_INET) {}
     ~Sock()
     {
         Close();
     }
 
-    void Socket()
+    // family: AF_INET、AF_INET6或AF_UNIX; type: SOCK_STREAM或SOCK_DGRAM
+    void Socket(int family = AF_INET, int type = SOCK_STREAM)
     {
-        int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        int sockfd = socket(family, type | SOCK_CLOEXEC, 0);
         if (sockfd < 0)
         {
             LogMessage(FATAL, "socket fail\n");
@@ -37,29 +131,52 @@ public:
         LogMessage(DEBUG, "socket success: %d\n", sockfd);
 
         _sockfd = sockfd;
+        _family = family;
 
         int optval = 1;
-        setsockopt(_sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+        if (family != AF_UNIX)
+            setsockopt(_sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+        if (family == AF_INET6)
+        {
+            // 双栈: 一个IPv6监听套接字同时接收IPv4连接, 对端地址是::ffff:a.b.c.d
+            optval = 0;
+            setsockopt(_sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &optval, sizeof(optval));
+        }
     }
 
     // server call
     void Bind(const uint16_t &port)
     {
-        struct sockaddr_in sin;
-        sin.sin_family = AF_INET;
-        sin.sin_port = htons(port);
-        sin.sin_addr.s_addr = INADDR_ANY;
+        Bind(Endpoint(_family, port));
+    }
 
-        if (bind(_sockfd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+    // server call
+    // 文件系统中的unix套接字: 先删掉上次运行留下的文件, 否则bind报EADDRINUSE; 关闭时删除
+    void Bind(const Endpoint &ep)
+    {
+        struct sockaddr_storage ss;
+        socklen_t len = ep.ToSockaddr(&ss);
+        if (len == 0 || ep.family_ != _family)
+        {
+            LogMessage(FATAL, "bind fail: bad address %s\n", ep.ToString().c_str());
+            exit(BIND_ERR);
+        }
+        bool file = ep.family_ == AF_UNIX && ep.path_[0] != '@';
+        if (file)
+            unlink(ep.path_.c_str());
+
+        if (bind(_sockfd, (struct sockaddr *)&ss, len) < 0)
         {
             LogMessage(FATAL, "bind fail: %s\n", strerror(errno));
             exit(BIND_ERR);
         }
+        if (file)
+            _path = ep.path_;
         LogMessage(DEBUG, "bind success\n");
     }
 
     // server call
-    void Listen()
+    void Listen(int backlog = default_backlog)
     {
         if (listen(_sockfd, backlog) < 0)
         {
@@ -70,37 +187,85 @@ public:
     }
 
     // server call
+    // SO_REUSEPORT: 多个套接字绑定同一端口, 内核按四元组把连接/数据报分给它们, 需在Bind之前调用
+    bool ReusePort()
+    {
+        int one = 1;
+        return setsockopt(_sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == 0;
+    }
+
+    // server call
+    // TCP_DEFER_ACCEPT: 三次握手完成后, 等到第一个数据包到达(最多secs秒)才让accept返回
+    // 先说话的协议(本服务器的几种协议都是)可以少一次"连接就绪但没有数据"的唤醒
+    bool DeferAccept(int secs)
+    {
+        if (_family == AF_UNIX)
+            return true;
+        return setsockopt(_sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs)) == 0;
+    }
+
+    // server call
+    // accept4: 返回的fd已经是非阻塞、close-on-exec的, 不必再用fcntl设置
+    // 不需要对端地址时不做转换
     int Accept(std::string *cln_ip = nullptr, uint16_t *cln_port = nullptr)
     {
-        struct sockaddr_in cln;
-        bzero(&cln, sizeof(cln));
+        struct sockaddr_storage cln;
         socklen_t len = sizeof(cln);
+        bool peer = cln_ip != nullptr || cln_port != nullptr;
 
-        int fd = accept(_sockfd, (struct sockaddr *)&cln, &len);
+        int fd = accept4(_sockfd, peer ? (struct sockaddr *)&cln : nullptr, peer ? &len : nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (fd < 0)
         {
-            LogMessage(INFO, "accept no client\n");
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                LogMessage(WARNING, "accept fail: %s\n", strerror(errno));
         }
         else
         {
+            // unix套接字的对端通常没有地址, ip为空、port为0
+            char ip[INET6_ADDRSTRLEN] = "";
+            uint16_t port = 0;
+            if (peer && cln.ss_family == AF_INET)
+            {
+                struct sockaddr_in *sin = (struct sockaddr_in *)&cln;
+                inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip));
+                port = ntohs(sin->sin_port);
+            }
+            else if (peer && cln.ss_family == AF_INET6)
+            {
+                struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&cln;
+                inet_ntop(AF_INET6, &sin6->sin6_addr, ip, sizeof(ip));
+                port = ntohs(sin6->sin6_port);
+            }
             if (cln_ip)
-                *cln_ip = inet_ntoa(cln.sin_addr);
+                *cln_ip = ip;
             if (cln_port)
-                *cln_port = ntohs(cln.sin_port);
+                *cln_port = port;
             LogMessage(DEBUG, "new client accepted\n");
         }
         return fd;
     }
 
     // client call
+    // svr_ip按Socket时的地址族解析: IPv4点分十进制或IPv6冒号格式
     int Connect(const std::string &svr_ip, const uint16_t &svr_port)
     {
-        struct sockaddr_in svr;
-        svr.sin_family = AF_INET;
-        svr.sin_port = htons(svr_port);
-        svr.sin_addr.s_addr = inet_addr(svr_ip.c_str());
+        return Connect(Endpoint(_family, svr_port), svr_ip);
+    }
 
-        int ret = connect(_sockfd, (struct sockaddr *)&svr, sizeof(svr));
+    // client call
+    // ep为unix地址时忽略svr_ip
+    int Connect(const Endpoint &ep, const std::string &svr_ip = "")
+    {
+        struct sockaddr_storage svr;
+        socklen_t len = ep.ToSockaddr(&svr, ep.family_ == AF_UNIX ? "" : svr_ip);
+        if (len == 0 || ep.family_ != _family)
+        {
+            LogMessage(WARNING, "connect fail: bad address %s %s\n", svr_ip.c_str(), ep.ToString().c_str());
+            errno = EINVAL;
+            return -1;
+        }
+
+        int ret = connect(_sockfd, (struct sockaddr *)&svr, len);
         if (ret < 0)
             LogMessage(WARNING, "connect fail: %s\n", strerror(errno));
         else
@@ -109,10 +274,23 @@ public:
         return ret;
     }
 
+    // 交出fd, 之后由调用方关闭(例如注册到Reactor的连接)
+    int Release()
+    {
+        int fd = _sockfd;
+        _sockfd = -1;
+        _path.clear();
+        return fd;
+    }
+
     void Close()
     {
         if (_sockfd >= 0)
             close(_sockfd);
+        _sockfd = -1;
+        if (!_path.empty())
+            unlink(_path.c_str());
+        _path.clear();
     }
 
     int GetSockfd() const
@@ -120,6 +298,13 @@ public:
         return _sockfd;
     }
 
+    int GetFamily() const
+    {
+        return _family;
+    }
+
 private:
     int _sockfd;
+    int _family;
+    std::string _path; // 绑定的unix套接字文件, 关闭时删除
 };
@@ -0,0 +1,114 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <deque>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "codec.hpp"
+#include "shm_ring.hpp"
+
+// 流水线客户端: 一个阻塞连接上同时有多个未完成的请求, 不必发一个等一个
+// tagged: 请求带编号(只有二进制协议支持), 服务器哪个先算完就先发回哪个, 慢请求不会挡住后面的快请求
+//         否则服务器按请求顺序应答, 客户端按顺序对应
+// 两种方式下Wait都通过resp->_id告诉调用者这是哪个请求的响应, 用法相同:
+//     uint32_t id = cli.Submit(req);  // 可以连续提交多个
+//     cli.Flush();
+//     cli.Wait(&resp);                // resp._id是对应请求的编号
+template <Codec C = BinaryCodec>
+class PipelineClient
+{
+public:
+    // fd: 已经连接好的阻塞socket, 不归PipelineClient所有
+    PipelineClient(int fd, bool tagged = true) : fd_(fd), shm_(nullptr), tagged_(tagged), nextid_(0)
+    {
+    }
+    // shm: 已经握手好的共享内存通道(见shm_ring.hpp), 不归PipelineClient所有
+    PipelineClient(ShmChannel *shm, bool tagged = true) : fd_(-1), shm_(shm), tagged_(tagged), nextid_(0)
+    {
+    }
+
+    // 把请求编码进发送缓冲区, 返回分配给它的编号; 调用Flush后才真正发出
+    uint32_t Submit(Request req)
+    {
+        uint32_t id = nextid_++;
+        req._id = id;
+        req._hasid = tagged_;
+        codec_.Encode(req, &outbuffer_);
+        if (!tagged_)
+            order_.push_back(id);
+        pending_++;
+        return id;
+    }
+
+    // 发出发送缓冲区中的所有请求, 失败返回false
+    bool Flush()
+    {
+        size_t sent = 0;
+        while (sent < outbuffer_.size())
+        {
+            ssize_t n = shm_ ? shm_->Send(outbuffer_.data() + sent, outbuffer_.size() - sent)
+                             : send(fd_, outbuffer_.data() + sent, outbuffer_.size() - sent, 0);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            sent += n;
+        }
+        outbuffer_.clear();
+        return true;
+    }
+
+    // 阻塞等待下一个响应(任意一个未完成的请求), 还有未发出的请求时先发出
+    // 连接断开、报文非法、编号对不上都返回false
+    bool Wait(Response *resp)
+    {
+        if (pending_ == 0)
+            return false;
+        if (!outbuffer_.empty() && !Flush())
+            return false;
+
+        std::string_view frame;
+        int ret = 0;
+        while ((ret = codec_.Next(inbuffer_, &frame)) == 0)
+        {
+            char buffer[4096];
+            ssize_t n = shm_ ? shm_->Recv(buffer, sizeof(buffer)) : recv(fd_, buffer, sizeof(buffer), 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            inbuffer_.append(buffer, n);
+        }
+        bool ok = ret > 0 && codec_.Decode(frame, resp);
+        codec_.Consume(inbuffer_);
+        if (!ok || resp->_hasid != tagged_)
+            return false;
+        if (!tagged_)
+        {
+            resp->_id = order_.front();
+            order_.pop_front();
+        }
+        pending_--;
+        return true;
+    }
+
+    // 已提交但还没有收到响应的请求个数
+    size_t Pending() const
+    {
+        return pending_;
+    }
+
+private:
+    int fd_;
+    ShmChannel *shm_;
+    bool tagged_;
+    uint32_t nextid_;
+    size_t pending_ = 0;
+    C codec_;
+    std::string inbuffer_;
+    std::string outbuffer_;
+    std::deque<uint32_t> order_; // 不带编号时, 未完成请求的编号(按发送顺序)
+};
@@ -1,13 +1,21 @@
 #pragma once
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <functional>
 #include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <charconv>
+#include <vector>
+#include <algorithm>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <jsoncpp/json/json.h>
+#include "json_codec.hpp"
 #include "log.hpp"
 #include "err.hpp"
+#include "task.hpp"
 
 #define SEP " "
 #define SEP_LEN strlen(SEP)
@@ -160,20 +168,28 @@ namespace protocol_ns_json
         return true;
     }
 
+    static const size_t max_json_frame = 4096; // 有效载荷长度上限, 超过视为非法报文
+    static const size_t max_len_digits = 4;    // 报头最多的数字个数
+
     // 分析readBuf是否有完整的报文, 如果有, 拷贝到package中, 并返回该报文的长度len
     // 未能获取完整package 返回0
     // 成功获取完整package 返回有效载荷长度len
+    // 报头不是十进制数字或者长度超过上限 返回-1, 不抛异常
     int Parse(std::string &readBuf, std::string *package)
     {
         // 1.找到报头——即有效载荷长度字符串
-        int lenEnd = readBuf.find(HEADER_SEP);
+        size_t lenEnd = readBuf.find(HEADER_SEP);
         if (lenEnd == std::string::npos)
-            return 0;
-        std::string lenStr = readBuf.substr(0, lenEnd);
-        int len = std::stoi(lenStr);
+            return readBuf.size() > max_len_digits + 1 ? -1 : 0;
+        int len = 0;
+        const char *end = readBuf.data() + lenEnd;
+        std::from_chars_result r = std::from_chars(readBuf.data(), end, len);
+        if (lenEnd == 0 || lenEnd > max_len_digits || readBuf[0] == '-' || r.ec != std::errc() || r.ptr != end ||
+            (size_t)len > max_json_frame)
+            return -1;
 
         // 2.确定package整体长度
-        int packageLen = len + lenStr.size() + HEADER_SEP_LEN;
+        size_t packageLen = len + lenEnd + HEADER_SEP_LEN;
         if (readBuf.size() < packageLen) // 缓冲区长度不足目标package长度
             return 0;
 
@@ -183,6 +199,98 @@ namespace protocol_ns_json
         return len;
     }
 
+    // 增量式报文解析器, 每个连接一个, 替代Parse:
+    // 1.记住解析状态(报头是否已解析、有效载荷长度), 数据不足时下次从上次扫描的位置继续, 已扫描的字节不再重复扫描
+    // 2.报头边扫描边累加长度, 不substr, 不stoi; 长度一超过上限就判为非法, 不等有效载荷到达
+    // 3.Next返回的有效载荷是指向接收缓冲区的string_view, 不拷贝
+    // 4.处理完一批报文后调用一次Consume, 才真正从缓冲区删除已处理的字节
+    // 有效载荷上限默认是max_json_frame, 服务器用SetMaxFrame按内存预算设置
+    class FrameParser
+    {
+    public:
+        // 单个报文(含报头)的最大长度, 有效载荷上限和报头的数字个数随之调整
+        void SetMaxFrame(size_t n)
+        {
+            max_frame_ = max_body_ = n;
+            max_digits_ = 1;
+            for (size_t v = n; v >= 10; v /= 10)
+                max_digits_++;
+        }
+
+        // 返回1: 得到一个完整报文, payload指向buf中的有效载荷
+        // 返回0: 数据不足, 等待更多数据
+        // 返回-1: 报头非法
+        // payload在Consume或buf被修改之前有效
+        int Next(const std::string &buf, std::string_view *payload)
+        {
+            if (bodylen_ < 0)
+            {
+                // 报头: 十进制长度 + "\r\n"
+                while (scan_ < buf.size())
+                {
+                    char c = buf[scan_];
+                    if (c == '\r')
+                    {
+                        if (scan_ + 1 >= buf.size())
+                            return 0; // "\n"还没到
+                        if (buf[scan_ + 1] != '\n' || scan_ == pos_ || scan_ + HEADER_SEP_LEN - pos_ + len_ > max_frame_)
+                            return -1;
+                        bodylen_ = len_;
+                        bodystart_ = scan_ + HEADER_SEP_LEN;
+                        break;
+                    }
+                    if (c < '0' || c > '9' || scan_ - pos_ >= max_digits_)
+                        return -1;
+                    len_ = len_ * 10 + (c - '0');
+                    if (len_ > max_body_)
+                        return -1;
+                    scan_++;
+                }
+                if (bodylen_ < 0)
+                    return 0;
+            }
+
+            if (buf.size() - bodystart_ < (size_t)bodylen_)
+                return 0;
+            *payload = std::string_view(buf.data() + bodystart_, bodylen_);
+            pos_ = scan_ = bodystart_ + bodylen_;
+            bodylen_ = -1;
+            len_ = 0;
+            return 1;
+        }
+
+        // buf中已经被Next取走的字节数
+        size_t Parsed() const { return pos_; }
+
+        // 从buf中删除已经被Next取走的报文
+        void Consume(std::string &buf)
+        {
+            if (pos_ == 0)
+                return;
+            buf.erase(0, pos_);
+            scan_ -= pos_;
+            if (bodylen_ >= 0)
+                bodystart_ -= pos_;
+            pos_ = 0;
+        }
+
+        void Reset()
+        {
+            pos_ = scan_ = bodystart_ = len_ = 0;
+            bodylen_ = -1;
+        }
+
+    private:
+        size_t pos_ = 0;       // 已取走报文的末尾
+        size_t scan_ = 0;      // 报头扫描位置
+        size_t bodystart_ = 0; // 有效载荷起始位置
+        size_t len_ = 0;       // 正在累加的报头长度
+        long long bodylen_ = -1; // 有效载荷长度, -1表示报头还未解析完
+        size_t max_body_ = max_json_frame;   // 有效载荷长度上限
+        size_t max_digits_ = max_len_digits; // 报头最多的数字个数
+        size_t max_frame_ = SIZE_MAX;        // 报头 + 有效载荷的长度上限
+    };
+
     // // 读取套接字失败返回-1
     // int ReadPackage(const int &sock, std::string &readBuf, std::string *package)
     // {
@@ -201,6 +309,18 @@ namespace protocol_ns_json
     //     return Parse(readBuf, package);
     // }
 
+    static const size_t max_json_len = 96; // Request/Response序列化后的最大长度
+
+    // 在out末尾追加一个完整报文: 报头 + body, 不产生临时字符串
+    void AppendFrame(std::string *out, const char *body, size_t len)
+    {
+        char header[24];
+        size_t hlen = json_fast::WriteInt(header, (long long)len);
+        memcpy(header + hlen, HEADER_SEP, HEADER_SEP_LEN);
+        out->append(header, hlen + HEADER_SEP_LEN);
+        out->append(body, len);
+    }
+
     // 客户端的请求
     // str: _x + _y
     class Request
@@ -211,40 +331,73 @@ namespace protocol_ns_json
         {
         }
 
-        // "7\r\n10 + 20"
+        // "22\r\n{"x":10,"opt":43,"y":20}"
         // struct->str
         bool Serialize(std::string *outStr)
         {
             if (outStr == nullptr)
                 return false;
 
-            Json::Value root;
-            root["x"] = _x;
-            root["opt"] = _opt;
-            root["y"] = _y;
-
-            Json::StyledWriter writer;
-            *outStr = writer.write(root);
+            char buf[max_json_len];
+            outStr->assign(buf, SerializeTo(buf));
             return true;
         }
 
+        // 序列化到buf(至少max_json_len字节), 返回长度, 不申请堆内存
+        size_t SerializeTo(char *buf) const
+        {
+            json_fast::Field fields[3] = {{"x"}, {"opt"}, {"y"}};
+            fields[0].int_ = _x;
+            fields[1].int_ = _opt;
+            fields[2].int_ = _y;
+            return json_fast::EncodeInts(buf, fields, 3);
+        }
+
         // str->struct
-        bool Deserialize(const std::string &inStr)
-        {
-            Json::Value root;
-            Json::Reader reader;
-            // bool parse(const std::string& document, Value& root, bool collectComments = true);
-            reader.parse(inStr, root);
-            _x = root["x"].asInt();
-            _opt = root["opt"].asInt();
-            _y = root["y"].asInt();
+        // 格式错误或字段不能转换为int时返回false
+        bool Deserialize(std::string_view inStr)
+        {
+            json_fast::Field fields[3] = {{"x"}, {"opt"}, {"y"}};
+            if (!json_fast::DecodeInts(inStr, fields, 3))
+                return false;
+            _x = (int)fields[0].int_;
+            _opt = (char)fields[1].int_;
+            _y = (int)fields[2].int_;
             return true;
         }
 
+        // 批量请求: 数组结构, 便于业务按运算符分组做SIMD计算; 只有二进制协议支持
+        bool IsBatch() const
+        {
+            return !_opts.empty();
+        }
+
     public:
         int _x;
         int _y;
         char _opt;
+
+        // 批量请求的操作数和运算符, 非空时忽略_x/_opt/_y
+        std::vector<int> _xs;
+        std::vector<int> _ys;
+        std::vector<char> _opts;
+
+        // 请求编号, 只有二进制协议支持: 带编号的请求不必按顺序应答, 服务器完成一个就发回一个, 响应带回相同的编号
+        uint32_t _id = 0;
+        bool _hasid = false;
+
+        // 表达式请求, 只有二进制协议支持, 非空时忽略上面的字段(编号除外), 见expr_engine.hpp
+        // _names/_types: 变量名和类型(0: int64, 1: double); _rows: 变量取值的组数
+        // _vals按变量分列存放: 第k个变量的第r组取值为_vals[k * _rows + r], double按位存放
+        bool IsExpr() const
+        {
+            return !_expr.empty();
+        }
+        std::string _expr;
+        std::vector<std::string> _names;
+        std::vector<uint8_t> _types;
+        std::vector<int64_t> _vals;
+        uint32_t _rows = 0;
     };
 
     // 服务器的响应
@@ -257,31 +410,77 @@ namespace protocol_ns_json
             if (outStr == nullptr)
                 return false;
 
-            Json::Value root;
-            root["ret"] = _ret;
-            root["code"] = _code;
-
-            Json::StyledWriter writer;
-            *outStr = writer.write(root);
+            char buf[max_json_len];
+            outStr->assign(buf, SerializeTo(buf));
             return true;
         }
 
-        bool Deserialize(const std::string &inStr)
+        size_t SerializeTo(char *buf) const
         {
-            Json::Value root;
-            Json::Reader reader;
-            reader.parse(inStr, root);
-            _ret = root["ret"].asInt();
-            _code = root["code"].asInt();
+            json_fast::Field fields[2] = {{"ret"}, {"code"}};
+            fields[0].int_ = _ret;
+            fields[1].int_ = _code;
+            return json_fast::EncodeInts(buf, fields, 2);
+        }
+
+        bool Deserialize(std::string_view inStr)
+        {
+            json_fast::Field fields[2] = {{"ret"}, {"code"}};
+            if (!json_fast::DecodeInts(inStr, fields, 2))
+                return false;
+            _ret = (int)fields[0].int_;
+            _code = (int)fields[1].int_;
             return true;
         }
 
+        // 批量响应, 与批量请求一一对应
+        bool IsBatch() const
+        {
+            return !_rets.empty();
+        }
+
     public:
         int _ret = 0;
         int _code = 0; // 1/2/3表示不同的错误码
+
+        // 批量响应的结果和错误码, 每个元素单独给出
+        std::vector<int> _rets;
+        std::vector<int> _codes;
+
+        // 对应请求的编号, 由服务器从请求复制过来
+        uint32_t _id = 0;
+        bool _hasid = false;
+
+        // 表达式响应: _code为编译错误码; 每组取值一个结果_vals(类型_type, double按位存放)和错误码_codes
+        bool IsExpr() const
+        {
+            return _isexpr;
+        }
+        bool _isexpr = false;
+        uint8_t _type = 0;
+        std::vector<int64_t> _vals;
     };
 
     using service_t = std::function<Response(const Request &)>;
+    // 协程版本的业务处理: 在Reactor线程上执行, 遇到IO/定时器/线程池计算时co_await让出线程, 不阻塞工作线程
+    using async_service_t = std::function<Task<Response>(const Request &)>;
+
+    // 传入请求的有效载荷payload(已去报头), 还有业务处理方法, 返回响应序列respstr
+    std::string HandleRequest2Response(std::string_view payload, service_t &service)
+    {
+        // 1.req反序列化
+        Request req;
+        req.Deserialize(payload);
+        // 2.业务处理->得到响应
+        Response resp = service(req);
+        // 3.resp序列化
+        std::string respstr;
+        resp.Serialize(&respstr);
+        // 4.resp加报头
+        AddHeader(respstr);
+
+        return respstr;
+    }
 
     // 传入请求序列reqstr和有效载荷长度payload_len, 还有业务处理方法, 返回响应序列respstr
     std::string HandleRequest2Response(std::string reqstr, int payload_len, service_t &service)
@@ -301,4 +500,888 @@ namespace protocol_ns_json
 
         return respstr;
     }
-};
\ No newline at end of file
+};
+
+// 紧凑的二进制协议, 与JSON协议共用Request/Response和业务处理函数
+// 报文: 类型标签(1字节) + 有效载荷长度(4字节小端) + 有效载荷
+// 请求有效载荷: x(4字节小端) opt(1字节) y(4字节小端), 共9字节
+// 响应有效载荷: ret(4字节小端) code(4字节小端), 共8字节
+// 批量请求有效载荷: n(4字节小端) x[n] y[n](4字节小端) opt[n](1字节), 共4+9n字节
+// 批量响应有效载荷: n(4字节小端) ret[n] code[n](4字节小端), 共4+8n字节
+// 批量报文按数组存放, 收发两端在小端机器上可以整块拷贝
+// 表达式请求有效载荷: len(4) 表达式文本[len] nvars(4) rows(4) {namelen(1) 变量名[namelen] type(1)}[nvars] vals[nvars*rows](8字节小端)
+// 表达式响应有效载荷: code(4) type(1) rows(4) vals[rows](8字节小端) codes[rows](4字节小端)
+// 带请求编号的报文: 类型标签 | TAG_ID_FLAG, 报头后多4字节请求编号(小端, 计入有效载荷长度), 其余不变
+namespace protocol_ns_binary
+{
+    using protocol_ns_json::Request;
+    using protocol_ns_json::Response;
+
+    // 类型标签都不是数字, 服务器可以根据连接的第一个字节区分JSON报文(以十进制长度开头)和二进制报文
+    static const uint8_t TAG_REQUEST = 0xB1;
+    static const uint8_t TAG_RESPONSE = 0xB2;
+    static const uint8_t TAG_BATCH_REQUEST = 0xB3;
+    static const uint8_t TAG_BATCH_RESPONSE = 0xB4;
+    static const uint8_t TAG_EXPR_REQUEST = 0xB5;
+    static const uint8_t TAG_EXPR_RESPONSE = 0xB6;
+    static const uint8_t TAG_ID_FLAG = 0x08; // 0xB9 ~ 0xBE: 上面6种报文的带编号版本
+    static const size_t HEADER_LEN = 5;
+    static const size_t ID_LEN = 4;
+    static const size_t REQUEST_LEN = 9;
+    static const size_t RESPONSE_LEN = 8;
+    static const uint32_t max_payload = 4096;                      // 有效载荷长度上限, 超过视为非法报文
+    static const uint32_t max_batch = 4096;                        // 一个批量报文最多的请求个数
+    static const uint32_t max_batch_payload = 4 + 9 * max_batch; // 批量报文的有效载荷长度上限
+    static const uint32_t max_expr_len = 1024;                     // 表达式文本长度上限
+    static const uint32_t max_expr_vars = 64;
+    static const uint32_t max_expr_name = 32;
+    static const uint32_t max_expr_values = 16384; // 一个表达式请求中变量取值的总个数上限
+    static const uint32_t max_expr_payload = 12 + max_expr_len + max_expr_vars * (2 + max_expr_name) + 8 * max_expr_values;
+
+    inline void PutU32(char *p, uint32_t v)
+    {
+        p[0] = (char)(v & 0xff);
+        p[1] = (char)((v >> 8) & 0xff);
+        p[2] = (char)((v >> 16) & 0xff);
+        p[3] = (char)((v >> 24) & 0xff);
+    }
+
+    inline uint32_t GetU32(const char *p)
+    {
+        const unsigned char *u = (const unsigned char *)p;
+        return (uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+    }
+
+    // 类型标签是否合法(含带编号的版本)
+    inline bool ValidTag(uint8_t tag)
+    {
+        uint8_t t = tag & ~TAG_ID_FLAG;
+        return t >= TAG_REQUEST && t <= TAG_EXPR_RESPONSE;
+    }
+
+    // 各类型报文(不含编号)的有效载荷长度上限
+    inline uint32_t MaxPayload(uint8_t tag)
+    {
+        uint8_t t = tag & ~TAG_ID_FLAG;
+        if (t >= TAG_EXPR_REQUEST)
+            return max_expr_payload;
+        if (t >= TAG_BATCH_REQUEST)
+            return max_batch_payload;
+        return max_payload;
+    }
+
+    // 写报头, len为不含编号的有效载荷长度; hasid时在报头后写入编号, 返回写入的字节数
+    inline size_t PutHeader(char *p, uint8_t tag, uint32_t len, bool hasid, uint32_t id)
+    {
+        if (!hasid)
+        {
+            p[0] = (char)tag;
+            PutU32(p + 1, len);
+            return HEADER_LEN;
+        }
+        p[0] = (char)(tag | TAG_ID_FLAG);
+        PutU32(p + 1, len + ID_LEN);
+        PutU32(p + HEADER_LEN, id);
+        return HEADER_LEN + ID_LEN;
+    }
+
+    // 拆出带编号报文的编号: tag去掉TAG_ID_FLAG, payload去掉编号; 不带编号时hasid为false
+    inline bool SplitId(uint8_t *tag, std::string_view *payload, uint32_t *id, bool *hasid)
+    {
+        *hasid = (*tag & TAG_ID_FLAG) != 0;
+        *id = 0;
+        if (!*hasid)
+            return true;
+        if (payload->size() < ID_LEN)
+            return false;
+        *tag &= ~TAG_ID_FLAG;
+        *id = GetU32(payload->data());
+        payload->remove_prefix(ID_LEN);
+        return true;
+    }
+
+    // 在out末尾追加一个完整的请求报文
+    void EncodeRequest(const Request &req, std::string *out)
+    {
+        char frame[HEADER_LEN + ID_LEN + REQUEST_LEN];
+        size_t h = PutHeader(frame, TAG_REQUEST, REQUEST_LEN, req._hasid, req._id);
+        PutU32(frame + h, (uint32_t)req._x);
+        frame[h + 4] = req._opt;
+        PutU32(frame + h + 5, (uint32_t)req._y);
+        out->append(frame, h + REQUEST_LEN);
+    }
+
+    bool DecodeRequest(std::string_view payload, Request *req)
+    {
+        if (payload.size() < REQUEST_LEN)
+            return false;
+        req->_xs.clear();
+        req->_ys.clear();
+        req->_opts.clear();
+        req->_expr.clear();
+        req->_x = (int)GetU32(payload.data());
+        req->_opt = payload[4];
+        req->_y = (int)GetU32(payload.data() + 5);
+        return true;
+    }
+
+    // 在out末尾追加一个完整的响应报文
+    void EncodeResponse(const Response &resp, std::string *out)
+    {
+        char frame[HEADER_LEN + ID_LEN + RESPONSE_LEN];
+        size_t h = PutHeader(frame, TAG_RESPONSE, RESPONSE_LEN, resp._hasid, resp._id);
+        PutU32(frame + h, (uint32_t)resp._ret);
+        PutU32(frame + h + 4, (uint32_t)resp._code);
+        out->append(frame, h + RESPONSE_LEN);
+    }
+
+    bool DecodeResponse(std::string_view payload, Response *resp)
+    {
+        if (payload.size() < RESPONSE_LEN)
+            return false;
+        resp->_ret = (int)GetU32(payload.data());
+        resp->_code = (int)GetU32(payload.data() + 4);
+        resp->_rets.clear();
+        resp->_codes.clear();
+        resp->_isexpr = false;
+        return true;
+    }
+
+    // int数组与小端字节序之间的转换, 小端机器上直接拷贝
+    inline void PutU32s(char *p, const int *v, size_t n)
+    {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        memcpy(p, v, n * 4);
+#else
+        for (size_t i = 0; i < n; i++)
+            PutU32(p + i * 4, (uint32_t)v[i]);
+#endif
+    }
+
+    inline void GetU32s(const char *p, int *v, size_t n)
+    {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        memcpy(v, p, n * 4);
+#else
+        for (size_t i = 0; i < n; i++)
+            v[i] = (int)GetU32(p + i * 4);
+#endif
+    }
+
+    // 在out末尾追加一个完整的批量请求报文
+    void EncodeBatchRequest(const Request &req, std::string *out)
+    {
+        uint32_t n = req._opts.size();
+        uint32_t len = 4 + 9 * n;
+        size_t old = out->size();
+        out->resize(old + HEADER_LEN + (req._hasid ? ID_LEN : 0) + len);
+        char *p = out->data() + old;
+        p += PutHeader(p, TAG_BATCH_REQUEST, len, req._hasid, req._id);
+        PutU32(p, n);
+        p += 4;
+        PutU32s(p, req._xs.data(), n);
+        PutU32s(p + 4 * n, req._ys.data(), n);
+        memcpy(p + 8 * n, req._opts.data(), n);
+    }
+
+    // 请求个数为0或超过max_batch, 或长度与个数不符, 都视为非法
+    bool DecodeBatchRequest(std::string_view payload, Request *req)
+    {
+        if (payload.size() < 4)
+            return false;
+        uint32_t n = GetU32(payload.data());
+        if (n == 0 || n > max_batch || payload.size() != 4 + 9 * (size_t)n)
+            return false;
+        const char *p = payload.data() + 4;
+        req->_expr.clear();
+        req->_xs.resize(n);
+        req->_ys.resize(n);
+        req->_opts.assign(p + 8 * n, p + 9 * n);
+        GetU32s(p, req->_xs.data(), n);
+        GetU32s(p + 4 * n, req->_ys.data(), n);
+        return true;
+    }
+
+    void EncodeBatchResponse(const Response &resp, std::string *out)
+    {
+        uint32_t n = resp._rets.size();
+        uint32_t len = 4 + 8 * n;
+        size_t old = out->size();
+        out->resize(old + HEADER_LEN + (resp._hasid ? ID_LEN : 0) + len);
+        char *p = out->data() + old;
+        p += PutHeader(p, TAG_BATCH_RESPONSE, len, resp._hasid, resp._id);
+        PutU32(p, n);
+        p += 4;
+        PutU32s(p, resp._rets.data(), n);
+        PutU32s(p + 4 * n, resp._codes.data(), n);
+    }
+
+    bool DecodeBatchResponse(std::string_view payload, Response *resp)
+    {
+        if (payload.size() < 4)
+            return false;
+        uint32_t n = GetU32(payload.data());
+        if (n == 0 || n > max_batch || payload.size() != 4 + 8 * (size_t)n)
+            return false;
+        const char *p = payload.data() + 4;
+        resp->_isexpr = false;
+        resp->_rets.resize(n);
+        resp->_codes.resize(n);
+        GetU32s(p, resp->_rets.data(), n);
+        GetU32s(p + 4 * n, resp->_codes.data(), n);
+        return true;
+    }
+
+    inline void PutU64(char *p, uint64_t v)
+    {
+        PutU32(p, (uint32_t)v);
+        PutU32(p + 4, (uint32_t)(v >> 32));
+    }
+
+    inline uint64_t GetU64(const char *p)
+    {
+        return (uint64_t)GetU32(p) | ((uint64_t)GetU32(p + 4) << 32);
+    }
+
+    inline void PutU64s(char *p, const int64_t *v, size_t n)
+    {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        memcpy(p, v, n * 8);
+#else
+        for (size_t i = 0; i < n; i++)
+            PutU64(p + i * 8, (uint64_t)v[i]);
+#endif
+    }
+
+    inline void GetU64s(const char *p, int64_t *v, size_t n)
+    {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        memcpy(v, p, n * 8);
+#else
+        for (size_t i = 0; i < n; i++)
+            v[i] = (int64_t)GetU64(p + i * 8);
+#endif
+    }
+
+    void EncodeExprRequest(const Request &req, std::string *out)
+    {
+        uint32_t nvars = req._names.size();
+        uint32_t len = 12 + req._expr.size() + 8 * req._vals.size();
+        for (const std::string &name : req._names)
+            len += 2 + name.size();
+        size_t old = out->size();
+        out->resize(old + HEADER_LEN + (req._hasid ? ID_LEN : 0) + len);
+        char *p = out->data() + old;
+        p += PutHeader(p, TAG_EXPR_REQUEST, len, req._hasid, req._id);
+        PutU32(p, req._expr.size());
+        memcpy(p + 4, req._expr.data(), req._expr.size());
+        p += 4 + req._expr.size();
+        PutU32(p, nvars);
+        PutU32(p + 4, req._rows);
+        p += 8;
+        for (uint32_t k = 0; k < nvars; k++)
+        {
+            *p++ = (char)req._names[k].size();
+            memcpy(p, req._names[k].data(), req._names[k].size());
+            p += req._names[k].size();
+            *p++ = (char)req._types[k];
+        }
+        PutU64s(p, req._vals.data(), req._vals.size());
+    }
+
+    // 文本为空或过长、变量名为空或过长、取值组数为0或过多、长度与个数不符, 都视为非法
+    bool DecodeExprRequest(std::string_view payload, Request *req)
+    {
+        const char *p = payload.data(), *end = payload.data() + payload.size();
+        if (end - p < 4)
+            return false;
+        uint32_t elen = GetU32(p);
+        p += 4;
+        if (elen == 0 || elen > max_expr_len || (size_t)(end - p) < elen + 8)
+            return false;
+        req->_expr.assign(p, elen);
+        p += elen;
+        uint32_t nvars = GetU32(p), rows = GetU32(p + 4);
+        p += 8;
+        if (nvars > max_expr_vars || rows == 0 || rows > max_batch || (uint64_t)nvars * rows > max_expr_values)
+            return false;
+        req->_names.resize(nvars);
+        req->_types.resize(nvars);
+        for (uint32_t k = 0; k < nvars; k++)
+        {
+            if (p == end)
+                return false;
+            uint8_t nlen = (uint8_t)*p++;
+            if (nlen == 0 || nlen > max_expr_name || end - p < nlen + 1)
+                return false;
+            req->_names[k].assign(p, nlen);
+            p += nlen;
+            req->_types[k] = (uint8_t)*p++;
+            if (req->_types[k] > 1)
+                return false;
+        }
+        if ((size_t)(end - p) != 8 * (size_t)nvars * rows)
+            return false;
+        req->_rows = rows;
+        req->_vals.resize((size_t)nvars * rows);
+        GetU64s(p, req->_vals.data(), req->_vals.size());
+        return true;
+    }
+
+    void EncodeExprResponse(const Response &resp, std::string *out)
+    {
+        uint32_t rows = resp._vals.size();
+        uint32_t len = 9 + 12 * rows;
+        size_t old = out->size();
+        out->resize(old + HEADER_LEN + (resp._hasid ? ID_LEN : 0) + len);
+        char *p = out->data() + old;
+        p += PutHeader(p, TAG_EXPR_RESPONSE, len, resp._hasid, resp._id);
+        PutU32(p, (uint32_t)resp._code);
+        p[4] = (char)resp._type;
+        PutU32(p + 5, rows);
+        p += 9;
+        PutU64s(p, resp._vals.data(), rows);
+        PutU32s(p + 8 * rows, resp._codes.data(), rows);
+    }
+
+    bool DecodeExprResponse(std::string_view payload, Response *resp)
+    {
+        if (payload.size() < 9)
+            return false;
+        uint32_t rows = GetU32(payload.data() + 5);
+        if (rows > max_batch || payload.size() != 9 + 12 * (size_t)rows)
+            return false;
+        const char *p = payload.data();
+        resp->_isexpr = true;
+        resp->_code = (int)GetU32(p);
+        resp->_type = (uint8_t)p[4];
+        resp->_rets.clear();
+        resp->_vals.resize(rows);
+        resp->_codes.resize(rows);
+        GetU64s(p + 9, resp->_vals.data(), rows);
+        GetU32s(p + 9 + 8 * rows, resp->_codes.data(), rows);
+        return true;
+    }
+
+    // 二进制报文解析器, 用法同protocol_ns_json::FrameParser
+    // 报头定长, 不需要扫描
+    // 各类型的有效载荷上限(MaxPayload)是协议能解码的最大报文, SetMaxFrame只能把它调小
+    class FrameParser
+    {
+    public:
+        // 单个报文(含报头)的最大长度
+        void SetMaxFrame(size_t n) { max_frame_ = n; }
+
+        // 返回1: 得到一个完整报文, payload指向buf中的有效载荷, tag为类型标签
+        // 返回0: 数据不足
+        // 返回-1: 类型标签或长度非法
+        // 带编号的报文, payload包含开头的编号, 用SplitId拆出
+        int Next(const std::string &buf, std::string_view *payload, uint8_t *tag = nullptr)
+        {
+            if (buf.size() - pos_ < HEADER_LEN)
+                return 0;
+            const char *p = buf.data() + pos_;
+            uint8_t t = (uint8_t)p[0];
+            uint32_t len = GetU32(p + 1);
+            if (!ValidTag(t))
+                return -1;
+            uint32_t idlen = t & TAG_ID_FLAG ? ID_LEN : 0;
+            if (len < idlen || len - idlen > MaxPayload(t) || HEADER_LEN + len > max_frame_)
+                return -1;
+            if (buf.size() - pos_ - HEADER_LEN < len)
+                return 0;
+            *payload = std::string_view(p + HEADER_LEN, len);
+            if (tag)
+                *tag = t;
+            pos_ += HEADER_LEN + len;
+            return 1;
+        }
+
+        // buf中已经被Next取走的字节数
+        size_t Parsed() const { return pos_; }
+
+        void Consume(std::string &buf)
+        {
+            if (pos_ == 0)
+                return;
+            buf.erase(0, pos_);
+            pos_ = 0;
+        }
+
+    private:
+        size_t pos_ = 0;              // 已取走报文的末尾
+        size_t max_frame_ = SIZE_MAX; // 报头 + 有效载荷的长度上限
+    };
+};
+
+// 按行分隔的文本协议, 可以直接用nc/telnet调试, 与JSON协议共用Request/Response和业务处理函数
+// 请求: "x opt y\n", 例如"10 + 20\n", 空格可以省略: "10+20\n"
+// 响应: "ret code\n", 例如"30 0\n"
+// 行尾的"\r"会被忽略, 空行被跳过
+namespace protocol_ns_line
+{
+    using protocol_ns_json::Request;
+    using protocol_ns_json::Response;
+
+    static const size_t max_line = 64; // 一行的最大长度(不含换行), 超过视为非法报文
+
+    // 跳过空格, 读一个int, 失败返回nullptr
+    inline const char *ReadInt(const char *p, const char *end, int *v)
+    {
+        while (p < end && *p == ' ')
+            p++;
+        std::from_chars_result r = std::from_chars(p, end, *v);
+        return r.ec == std::errc() ? r.ptr : nullptr;
+    }
+
+    // 在out末尾追加一个完整的请求报文
+    void EncodeRequest(const Request &req, std::string *out)
+    {
+        char line[32];
+        size_t len = json_fast::WriteInt(line, req._x);
+        line[len++] = ' ';
+        line[len++] = req._opt;
+        line[len++] = ' ';
+        len += json_fast::WriteInt(line + len, req._y);
+        line[len++] = '\n';
+        out->append(line, len);
+    }
+
+    bool DecodeRequest(std::string_view line, Request *req)
+    {
+        const char *p = line.data(), *end = line.data() + line.size();
+        if ((p = ReadInt(p, end, &req->_x)) == nullptr)
+            return false;
+        while (p < end && *p == ' ')
+            p++;
+        if (p == end || (*p >= '0' && *p <= '9')) // 缺少运算符
+            return false;
+        req->_opt = *p++;
+        if ((p = ReadInt(p, end, &req->_y)) == nullptr)
+            return false;
+        while (p < end && *p == ' ')
+            p++;
+        return p == end;
+    }
+
+    void EncodeResponse(const Response &resp, std::string *out)
+    {
+        char line[32];
+        size_t len = json_fast::WriteInt(line, resp._ret);
+        line[len++] = ' ';
+        len += json_fast::WriteInt(line + len, resp._code);
+        line[len++] = '\n';
+        out->append(line, len);
+    }
+
+    bool DecodeResponse(std::string_view line, Response *resp)
+    {
+        const char *p = line.data(), *end = line.data() + line.size();
+        if ((p = ReadInt(p, end, &resp->_ret)) == nullptr || (p = ReadInt(p, end, &resp->_code)) == nullptr)
+            return false;
+        while (p < end && *p == ' ')
+            p++;
+        return p == end;
+    }
+
+    // 按行切分的报文解析器, 用法同protocol_ns_json::FrameParser
+    // 一行只有一个算式, max_line是协议本身的上限, SetMaxFrame只能把它调小
+    class FrameParser
+    {
+    public:
+        // 单个报文(含换行)的最大长度
+        void SetMaxFrame(size_t n) { max_line_ = std::min(max_line, n > 1 ? n - 1 : 0); }
+
+        // 返回1: 得到一行, line指向buf中的内容(不含行尾)
+        // 返回0: 数据不足
+        // 返回-1: 行太长
+        int Next(const std::string &buf, std::string_view *line)
+        {
+            while (true)
+            {
+                const char *nl = (const char *)memchr(buf.data() + scan_, '\n', buf.size() - scan_);
+                if (nl == nullptr)
+                {
+                    scan_ = buf.size();
+                    return scan_ - pos_ > max_line_ ? -1 : 0;
+                }
+                size_t end = nl - buf.data();
+                size_t len = end - pos_;
+                if (len > 0 && buf[end - 1] == '\r')
+                    len--;
+                size_t start = pos_;
+                pos_ = scan_ = end + 1;
+                if (len > max_line_)
+                    return -1;
+                if (len == 0)
+                    continue;
+                *line = std::string_view(buf.data() + start, len);
+                return 1;
+            }
+        }
+
+        // buf中已经被Next取走的字节数
+        size_t Parsed() const { return pos_; }
+
+        void Consume(std::string &buf)
+        {
+            if (pos_ == 0)
+                return;
+            buf.erase(0, pos_);
+            scan_ -= pos_;
+            pos_ = 0;
+        }
+
+    private:
+        size_t pos_ = 0;  // 已取走报文的末尾
+        size_t scan_ = 0; // 已扫描过(没有换行)的位置
+        size_t max_line_ = max_line;
+    };
+};
+
+// HTTP/1.1, 与JSON协议共用Request/Response和业务处理函数, 可以直接用curl调试
+// 请求: POST /calc, 报文体是JSON协议的有效载荷, 例如 {"x":10,"opt":43,"y":20}
+// 响应: 200 OK, 报文体是 {"ret":30,"code":0}
+// 支持长连接和流水线, 报文体只支持Content-Length定界, 不支持分块传输
+// 起始行和首部解析成指向接收缓冲区的string_view, 不拷贝
+namespace protocol_ns_http
+{
+    using protocol_ns_json::Request;
+    using protocol_ns_json::Response;
+
+    static const size_t max_head = 8192;  // 起始行 + 首部的最大长度
+    static const size_t max_headers = 32; // 首部字段的最大个数
+    static const size_t max_body = 4096;  // 报文体的最大长度
+    static const char *calc_path = "/calc";
+
+    // 解析出的报文(请求或响应), 所有string_view指向接收缓冲区, 在Consume或缓冲区被修改之前有效
+    struct Message
+    {
+        bool response_ = false;        // true: 状态行; false: 请求行
+        std::string_view method_;      // 请求
+        std::string_view target_;      // 请求
+        int status_ = 0;               // 响应
+        int minor_ = 1;                // HTTP/1.minor_
+        bool keepalive_ = true;        // 发完这个报文的响应后是否保持连接
+        bool haslength_ = false;       // 有没有Content-Length
+        size_t length_ = 0;            // Content-Length
+        size_t nheaders_ = 0;
+        std::string_view names_[max_headers];
+        std::string_view values_[max_headers];
+        std::string_view body_;
+
+        // 按名字查找首部字段(不区分大小写, name必须是小写), 没有时返回空
+        std::string_view Header(std::string_view name) const;
+    };
+
+    // 不区分大小写比较, b必须是小写
+    inline bool EqualsLower(std::string_view a, std::string_view b)
+    {
+        if (a.size() != b.size())
+            return false;
+        for (size_t i = 0; i < a.size(); i++)
+        {
+            char c = a[i];
+            if (c >= 'A' && c <= 'Z')
+                c += 'a' - 'A';
+            if (c != b[i])
+                return false;
+        }
+        return true;
+    }
+
+    inline std::string_view Trim(std::string_view s)
+    {
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+            s.remove_prefix(1);
+        while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+            s.remove_suffix(1);
+        return s;
+    }
+
+    std::string_view Message::Header(std::string_view name) const
+    {
+        for (size_t i = 0; i < nheaders_; i++)
+        {
+            if (EqualsLower(names_[i], name))
+                return values_[i];
+        }
+        return std::string_view();
+    }
+
+    // "HTTP/1.x", 返回x, 非法返回-1
+    inline int ParseVersion(std::string_view v)
+    {
+        if (v.size() != 8 || v.substr(0, 7) != "HTTP/1." || v[7] < '0' || v[7] > '9')
+            return -1;
+        return v[7] - '0';
+    }
+
+    // 起始行: "METHOD target HTTP/1.x" 或 "HTTP/1.x 200 reason"
+    // 成功返回0, 否则返回应答的状态码
+    inline int ParseStartLine(std::string_view line, Message *msg)
+    {
+        size_t sp1 = line.find(' ');
+        if (sp1 == std::string_view::npos || sp1 == 0)
+            return 400;
+        if (line.substr(0, 5) == "HTTP/")
+        {
+            // 状态行, 原因短语可以为空
+            msg->response_ = true;
+            if ((msg->minor_ = ParseVersion(line.substr(0, sp1))) < 0)
+                return 505;
+            std::string_view code = line.substr(sp1 + 1, 3);
+            if (code.size() != 3 || (line.size() > sp1 + 4 && line[sp1 + 4] != ' '))
+                return 400;
+            msg->status_ = 0;
+            for (char c : code)
+            {
+                if (c < '0' || c > '9')
+                    return 400;
+                msg->status_ = msg->status_ * 10 + (c - '0');
+            }
+            return 0;
+        }
+        size_t sp2 = line.find(' ', sp1 + 1);
+        if (sp2 == std::string_view::npos || sp2 == sp1 + 1)
+            return 400;
+        msg->response_ = false;
+        msg->method_ = line.substr(0, sp1);
+        msg->target_ = line.substr(sp1 + 1, sp2 - sp1 - 1);
+        std::string_view version = line.substr(sp2 + 1);
+        if (version.substr(0, 5) != "HTTP/")
+            return 400;
+        if ((msg->minor_ = ParseVersion(version)) < 0)
+            return 505;
+        return 0;
+    }
+
+    // 解析起始行和首部, head不含最后的空行, 每行以"\r\n"结尾
+    // 成功返回0, 否则返回应答的状态码
+    int ParseHead(std::string_view head, Message *msg)
+    {
+        msg->nheaders_ = 0;
+        msg->haslength_ = false;
+        msg->length_ = 0;
+        size_t eol = head.find(HEADER_SEP);
+        int status = ParseStartLine(head.substr(0, eol), msg);
+        if (status != 0)
+            return status;
+
+        bool close = false, keepalive = false;
+        for (size_t p = eol + HEADER_SEP_LEN; p < head.size(); p = eol + HEADER_SEP_LEN)
+        {
+            eol = head.find(HEADER_SEP, p);
+            std::string_view line = head.substr(p, eol - p);
+            size_t colon = line.find(':');
+            if (colon == std::string_view::npos || colon == 0)
+                return 400;
+            std::string_view name = line.substr(0, colon);
+            std::string_view value = Trim(line.substr(colon + 1));
+            if (name.find_first_of(" \t") != std::string_view::npos) // 包括以空白开头的折叠行
+                return 400;
+            if (msg->nheaders_ == max_headers)
+                return 431;
+            msg->names_[msg->nheaders_] = name;
+            msg->values_[msg->nheaders_] = value;
+            msg->nheaders_++;
+
+            if (EqualsLower(name, "content-length"))
+            {
+                size_t len = 0;
+                std::from_chars_result r = std::from_chars(value.data(), value.data() + value.size(), len);
+                if (value.empty() || r.ec != std::errc() || r.ptr != value.data() + value.size())
+                    return 400;
+                if (msg->haslength_ && len != msg->length_) // 多个不一致的长度, 可能是请求走私
+                    return 400;
+                msg->haslength_ = true;
+                msg->length_ = len;
+            }
+            else if (EqualsLower(name, "transfer-encoding"))
+                return 501;
+            else if (EqualsLower(name, "connection"))
+            {
+                // 逗号分隔的选项
+                while (!value.empty())
+                {
+                    size_t comma = value.find(',');
+                    std::string_view opt = Trim(value.substr(0, comma));
+                    if (EqualsLower(opt, "close"))
+                        close = true;
+                    else if (EqualsLower(opt, "keep-alive"))
+                        keepalive = true;
+                    value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+                }
+            }
+        }
+        // HTTP/1.1默认长连接, HTTP/1.0默认短连接
+        msg->keepalive_ = msg->minor_ >= 1 ? !close : keepalive && !close;
+        return 0;
+    }
+
+    const char *Reason(int status)
+    {
+        switch (status)
+        {
+        case 200:
+            return "OK";
+        case 400:
+            return "Bad Request";
+        case 404:
+            return "Not Found";
+        case 405:
+            return "Method Not Allowed";
+        case 411:
+            return "Length Required";
+        case 413:
+            return "Content Too Large";
+        case 431:
+            return "Request Header Fields Too Large";
+        case 501:
+            return "Not Implemented";
+        case 505:
+            return "HTTP Version Not Supported";
+        default:
+            return "Error";
+        }
+    }
+
+    // 在out末尾追加一个完整的请求报文
+    void EncodeRequest(const Request &req, std::string *out)
+    {
+        static const char head[] = "POST /calc HTTP/1.1\r\nHost: calc\r\nContent-Type: application/json\r\nContent-Length: ";
+        char body[protocol_ns_json::max_json_len];
+        size_t len = req.SerializeTo(body);
+        char num[24];
+        size_t nlen = json_fast::WriteInt(num, (long long)len);
+        out->append(head, sizeof(head) - 1);
+        out->append(num, nlen);
+        out->append("\r\n\r\n", 4);
+        out->append(body, len);
+    }
+
+    // 在out末尾追加一个完整的200响应; connection: Connection首部的值, 为空时不加(HTTP/1.1默认保持连接)
+    // 发完响应后服务器关闭连接时要带上close, HTTP/1.0请求保持连接时要带上keep-alive
+    void EncodeResponse(const Response &resp, const char *connection, std::string *out)
+    {
+        static const char head[] = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: ";
+        char body[protocol_ns_json::max_json_len];
+        size_t len = resp.SerializeTo(body);
+        char num[24];
+        size_t nlen = json_fast::WriteInt(num, (long long)len);
+        out->append(head, sizeof(head) - 1);
+        out->append(num, nlen);
+        if (connection)
+        {
+            out->append("\r\nConnection: ", 14);
+            out->append(connection);
+        }
+        out->append("\r\n\r\n", 4);
+        out->append(body, len);
+    }
+
+    // 错误响应, 没有报文体, 发完后服务器关闭连接
+    void EncodeError(int status, std::string *out)
+    {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "HTTP/1.1 %d ", status);
+        out->append(line, n);
+        out->append(Reason(status));
+        out->append("\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    }
+
+    // 增量式报文解析器, 用法同protocol_ns_json::FrameParser
+    // 先找首部结束的空行, 已扫描过的字节不再重复扫描; 再按Content-Length等报文体到齐
+    // 报文体跨多次读取到达时, 缓冲区可能已经重新分配, 报文体到齐后重新解析一次首部, 让string_view指向新的缓冲区
+    // 报文体上限默认是max_body, 服务器用SetMaxFrame按内存预算设置; 首部不超过max_head
+    class FrameParser
+    {
+    public:
+        // 单个报文(首部 + 报文体)的最大长度
+        void SetMaxFrame(size_t n)
+        {
+            max_frame_ = max_body_ = n;
+            max_head_ = std::min(max_head, n);
+        }
+
+        // 返回1: 得到一个完整报文, msg中的string_view指向buf
+        // 返回0: 数据不足
+        // 返回-1: 报文非法, Status()是应答的状态码
+        int Next(const std::string &buf, Message *msg)
+        {
+            std::string_view data(buf);
+            if (bodylen_ < 0)
+            {
+                // 报文之间多余的空行忽略
+                while (scan_ == pos_ && pos_ < data.size() && (data[pos_] == '\r' || data[pos_] == '\n'))
+                    pos_ = ++scan_;
+                size_t from = scan_ >= pos_ + 3 ? scan_ - 3 : pos_;
+                size_t end = data.find("\r\n\r\n", from);
+                if (end == std::string_view::npos)
+                {
+                    scan_ = data.size();
+                    return scan_ - pos_ > max_head_ ? Fail(431) : 0;
+                }
+                if (end - pos_ > max_head_)
+                    return Fail(431);
+                headend_ = end + 4;
+                int status = ParseHead(data.substr(pos_, headend_ - 2 - pos_), msg);
+                if (status != 0)
+                    return Fail(status);
+                if (msg->length_ > max_body_ || headend_ - pos_ + msg->length_ > max_frame_)
+                    return Fail(413);
+                bodylen_ = msg->length_;
+                reparse_ = false;
+            }
+
+            if (data.size() - headend_ < (size_t)bodylen_)
+            {
+                reparse_ = true;
+                return 0;
+            }
+            if (reparse_)
+                ParseHead(data.substr(pos_, headend_ - 2 - pos_), msg);
+            msg->body_ = data.substr(headend_, bodylen_);
+            pos_ = scan_ = headend_ + bodylen_;
+            bodylen_ = -1;
+            return 1;
+        }
+
+        // buf中已经被Next取走的字节数
+        size_t Parsed() const { return pos_; }
+
+        void Consume(std::string &buf)
+        {
+            if (pos_ == 0)
+                return;
+            buf.erase(0, pos_);
+            scan_ -= pos_;
+            if (bodylen_ >= 0)
+                headend_ -= pos_;
+            pos_ = 0;
+        }
+
+        int Status() const
+        {
+            return status_;
+        }
+
+    private:
+        int Fail(int status)
+        {
+            status_ = status;
+            return -1;
+        }
+
+    private:
+        size_t pos_ = 0;         // 已取走报文的末尾, 也是当前报文的起始位置
+        size_t scan_ = 0;        // 已扫描过(没有空行)的位置
+        size_t headend_ = 0;     // 当前报文首部的末尾(空行之后)
+        long long bodylen_ = -1; // 当前报文体的长度, -1表示首部还不完整
+        bool reparse_ = false;   // 首部解析之后缓冲区可能被修改过
+        int status_ = 400;
+        size_t max_head_ = max_head;
+        size_t max_body_ = max_body;
+        size_t max_frame_ = SIZE_MAX; // 首部 + 报文体的长度上限
+    };
+};
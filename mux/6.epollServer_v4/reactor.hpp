@@ -3,27 +3,82 @@
 #include <iostream>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <map>
+#include <vector>
 #include <functional>
+#include <memory>
 #include <queue>
 #include <ctime>
 #include <cstring>
+#include <atomic>
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
+#include <netinet/udp.h>
 #include "epoller.hpp"
 #include "mysocket.hpp"
 #include "util.hpp"
-#include "protocol_netcal.hpp"
+#include "codec.hpp"
+#include "response_cache.hpp"
 #include "thread_pool.hpp"
+#include "Mutex.hpp"
+#include "task.hpp"
+#include "shm_ring.hpp"
+#include "capture.hpp"
 
 static const uint16_t defaultport = 8080;
 static const int default_max = 64;
 static const int buffersize = 1024;
 static const time_t max_live_time = 5;
 static const int service_thread_num = 3;
+static const uint64_t unordered_slot = UINT64_MAX; // 带编号的请求不参与排序, 完成后立即发送
+static const int pause_retry_ms = 5;               // 暂停读取的连接, 隔多久再检查一次预算
+static const size_t shrink_threshold = 4096;       // 缓冲区清空时, 容量超过它就释放, 空闲连接不占用大块内存
+static const int busy_poll_epoll_interval = 64;    // 忙轮询期间每轮询这么多次检查一次epoll(其它连接、定时器、投递的任务)
+static const int udp_batch = 64;                   // recvmmsg/sendmmsg一次最多收发的数据报个数
+static const size_t udp_max_payload = 65536;       // 每个接收缓冲区的大小; 开启GRO时内核会把同一对端的多个数据报合并进一个缓冲区
+static const size_t udp_gso_max_bytes = 65000;     // GSO一次交给内核的总字节数上限(一个IP报文以内)
+static const size_t timer_compact_min = 1024;      // 已取消的定时器超过这么多、且超过堆的一半时重建堆
+static const int offload_thread_num = 3;           // 协程Offload的计算线程池的线程数
+
+// 协程Offload用的计算线程池, 任务算完后把协程投递回原来的事件循环
+using work_pool_t = ThreadPool<std::function<void()>>;
+
+// 业务连接的内存预算, 见Reactor::SetLimits
+// 每个连接占用的内存有上限: 输入缓冲区不超过max_frame_(一个未完整到达的报文) + conn_budget_(一轮读取)
+// 输出积压超过conn_budget_或未应答的请求达到max_inflight_时暂停读取, 数据留在内核接收缓冲区, 由TCP流控让对端慢下来
+struct MemoryLimits
+{
+    size_t max_frame_ = 256 << 10;     // 单个报文(含报头)的最大长度, 超过视为非法报文; 由各连接的Codec在报头到达时检查(见Codec::SetMaxFrame)
+    size_t conn_budget_ = 1 << 20;     // 每个连接输入+输出缓冲区的上限; UDP套接字上待发送的响应也不超过它
+    size_t max_inflight_ = 1024;       // 每个连接已经派发、还没有完成的请求数上限
+    size_t global_budget_ = 1ul << 30; // 所有连接的缓冲区容量之和的上限(进程内所有Reactor共享), 超过时所有连接暂停读取; 0表示不限制
+};
+
+// 监听套接字的设置和新连接的套接字选项(见util::sockprofile_t), 只对带listensock的Reactor有效
+struct AcceptOptions
+{
+    int backlog_ = default_backlog;                           // listen的全连接队列长度
+    int defer_accept_ = 0;                                    // TCP_DEFER_ACCEPT的秒数, 0表示不开启
+    util::sockprofile_t profile_ = util::PROFILE_LOW_LATENCY; // 能继承的选项设在监听套接字上, 其余在accept后设置
+    bool udp_offload_ = false;                                // UDP套接字开启GRO(合并接收)和GSO(发给同一对端的等长响应合并发送)
+};
+
+// 进程内所有业务连接的缓冲区容量之和(字节)
+std::atomic<size_t> &GlobalBufferBytes()
+{
+    static std::atomic<size_t> bytes(0);
+    return bytes;
+}
 
 struct Connection;
-using namespace protocol_ns_json;
+class EventLoop;
+template <Codec C>
+class Reactor;
 using callback_t = std::function<void(Connection *)>; // 就绪事件处理函数，会用到Connection连接信息
+using route_t = std::function<bool(const Request &)>; // 请求的分类, 隔离舱按它选择业务处理和线程池
 
 #define LISTEN_YES 1
 #define LISTEN_NO 0
@@ -37,17 +92,32 @@ struct Connection
         : fd_(fd), events_(events), recver_(recver), sender_(sender), excepter_(excepter)
     {
     }
-    ~Connection()
+    virtual ~Connection()
+    {
+    }
+
+    // 读写连接上的数据, 语义同非阻塞的recv/send; 共享内存连接(见ShmConnection)改为读写环形队列
+    // 对端已经关闭时send返回EPIPE, 不产生SIGPIPE(默认动作是终止整个服务器进程)
+    virtual ssize_t Read(char *buf, size_t len)
+    {
+        return recv(fd_, buf, len, 0);
+    }
+    virtual ssize_t Write(const char *buf, size_t len)
     {
+        return send(fd_, buf, len, MSG_NOSIGNAL);
     }
 
     // 连接信息
     int fd_;
     uint32_t events_;
+    uint64_t seq_ = 0; // 连接序号, fd会被复用, 异步完成时用seq_确认还是原来的连接
 
     // 连接的输入输出缓冲区(用户级)
     std::string inbuffer_;
     std::string outbuffer_;
+    bool closing_ = false; // outbuffer发完后关闭连接
+    bool polled_ = false;  // 由事件循环轮询的连接, 写不下时不关心EPOLLOUT, 等对端读出后敲门铃
+    bool datagram_ = false; // UDP套接字(见UdpConnection), 没有连接状态
 
     // 就绪事件处理函数
     callback_t recver_;
@@ -55,92 +125,330 @@ struct Connection
     callback_t excepter_;
 };
 
+// 已完成但还不能发送(前面的请求还没完成)的响应: 业务算出的Response, 或响应缓存中已编码的报文
+struct Completion
+{
+    Response resp_;
+    std::string frame_;
+    bool encoded_ = false; // true: frame_是已编码的报文
+};
+
+// Reactor<C>上的业务连接, 多了编解码状态和请求顺序
+template <Codec C>
+struct CodecConnection : public Connection
+{
+    using Connection::Connection;
+
+    C codec_; // inbuffer_的增量解析状态, 以及响应的编码方式
+
+    // 请求按到达顺序编号, 响应可能乱序完成(线程池多线程/协程), 按编号顺序编码进outbuffer
+    // 带请求编号(Request::_hasid)的请求由客户端自己对应响应, 不占用顺序号, 不会被前面的慢请求阻塞
+    uint64_t nextslot_ = 0;
+    uint64_t nextsend_ = 0;
+    std::map<uint64_t, Completion> ready_;
+
+    // 开启响应缓存时, 未命中的请求的缓存键(报文类型 + 有效载荷), 响应编码后放入缓存
+    std::map<uint64_t, std::pair<uint8_t, std::string>> misskeys_;
+
+    // 第closeslot_个请求要求发完响应后关闭连接(HTTP的Connection: close, 或报文非法), 之后的数据不再处理
+    bool closereq_ = false;
+    uint64_t closeslot_ = 0;
+
+    // 内存预算: 已派发还没有完成的请求数, 是否暂停读取, 计入GlobalBufferBytes的字节数
+    size_t inflight_ = 0;
+    bool paused_ = false;
+    size_t charged_ = 0;
+};
+
+// 共享内存连接: fd_是握手用的unix套接字, 数据在chan_的环形队列里, 报文切分、派发和回写与套接字连接相同
+// 套接字只用来唤醒本线程(对端写入1个字节)和发现对端退出(关闭)
+template <Codec C>
+struct ShmConnection : public CodecConnection<C>
+{
+    using CodecConnection<C>::CodecConnection;
+
+    ssize_t Read(char *buf, size_t len) override
+    {
+        return chan_.TryRecv(buf, len);
+    }
+    ssize_t Write(const char *buf, size_t len) override
+    {
+        return chan_.TrySend(buf, len);
+    }
+
+    ShmChannel chan_;
+};
+
+// UDP数据报的对端地址
+struct UdpPeer
+{
+    struct sockaddr_storage addr_;
+    socklen_t len_;
+
+    bool operator==(const UdpPeer &p) const
+    {
+        return len_ == p.len_ && memcmp(&addr_, &p.addr_, len_) == 0;
+    }
+};
+
+struct UdpReply
+{
+    UdpPeer peer_;
+    std::string data_;
+};
+
+// 从begin开始, 能用一次GSO发出的响应个数: 同一对端, 除最后一个外等长, 总长不超过udp_gso_max_bytes, 不超过udp_batch个
+inline size_t UdpGsoRun(const std::vector<UdpReply> &replies, size_t begin)
+{
+    size_t segsize = replies[begin].data_.size(), bytes = segsize, end = begin + 1;
+    while (end < replies.size() && end - begin < (size_t)udp_batch && replies[end].peer_ == replies[begin].peer_ &&
+           replies[end].data_.size() <= segsize && bytes + replies[end].data_.size() <= udp_gso_max_bytes)
+    {
+        bytes += replies[end].data_.size();
+        if (replies[end++].data_.size() < segsize) // 短的只能是最后一个
+            break;
+    }
+    return end - begin;
+}
+
+// 交给业务处理、还没有完成的UDP请求: 响应发回peer_, 用解析请求的Codec编码
+template <Codec C>
+struct UdpPending
+{
+    UdpPeer peer_;
+    C codec_;
+    bool cache_ = false; // 响应编码后放入响应缓存, 键为kind_ + key_
+    uint8_t kind_ = 0;
+    std::string key_;
+};
+
+// UDP套接字: 每个IO线程一个(SO_REUSEPORT), 一个数据报是一个完整的请求, 不跨数据报保存解析状态
+// recvmmsg一次读入最多udp_batch个数据报, 响应攒在replies_里用sendmmsg一次发出
+template <Codec C>
+struct UdpConnection : public Connection
+{
+    UdpConnection(int fd, uint32_t events, callback_t recver, callback_t sender)
+        : Connection(fd, events, recver, sender, nullptr), buffers_(new char[udp_batch * udp_max_payload])
+    {
+        datagram_ = true;
+    }
+
+    std::unique_ptr<char[]> buffers_; // 接收缓冲区, 不初始化, 只有用到的页才占内存
+    struct mmsghdr msgs_[udp_batch];
+    struct iovec iovs_[udp_batch];
+    struct sockaddr_storage addrs_[udp_batch];
+    char controls_[udp_batch][CMSG_SPACE(sizeof(int))]; // GRO的分段大小
+
+    bool offload_ = false;
+    uint64_t nextslot_ = 0;
+    std::unordered_map<uint64_t, UdpPending<C>> pending_;
+    std::vector<UdpReply> replies_;
+    size_t replybytes_ = 0;     // replies_中响应的总字节数, 不超过MemoryLimits::conn_budget_
+    bool flushpending_ = false; // 已经安排了在本轮事件处理之后发送replies_
+    bool outwait_ = false;      // 发送缓冲区满, 关注了可写事件, replies_发完后取消
+    bool paused_ = false;       // replies_达到上限, 暂停读取; 发出一部分后恢复
+    uint64_t dropped_ = 0;      // 非法、截断、超过max_inflight_、待发送的响应超过上限而丢弃的数据报
+};
+
+// 定时器, 到期时在Reactor线程上执行cb
+struct Timer
+{
+    uint64_t expire_; // 到期时间(毫秒, 单调时钟)
+    uint64_t id_;
+    std::function<void()> cb_;
+
+    bool operator>(const Timer &t) const
+    {
+        return expire_ != t.expire_ ? expire_ > t.expire_ : id_ > t.id_;
+    }
+};
+
+// 线程池中执行的业务任务
+// 请求已经在Reactor线程上解析好, 工作线程只做业务处理, 不接触Connection
+// 响应通过Post交回Reactor线程, 由Reactor线程按连接的编解码方式写入outbuffer并发送
+template <Codec C>
 class ServiceTask
 {
 public:
-    ServiceTask(Connection *conn = nullptr, service_t s = nullptr) : conn_(conn), s_(s) {}
-    ~ServiceTask() {}
-
-    void operator()()
+    ServiceTask(Reactor<C> *r = nullptr, int fd = defaultfd, uint64_t seq = 0, uint64_t slot = 0, Request req = Request(), service_t s = nullptr)
+        : r_(r), fd_(fd), seq_(seq), slot_(slot), req_(std::move(req)), s_(s)
     {
-        while (!conn_->inbuffer_.empty())
-        {
-            std::string request;
-            // Parse返回请求序列的有效载荷长度payload_len
-            int plen = Parse(conn_->inbuffer_, &request);
-            if (plen == 0)
-                break;
-            else
-            {
-                // 此时已经有一个完整请求报文request
-                LogMessage(DEBUG, "request: %s\n", request.c_str());
-                std::string response = HandleRequest2Response(request, plen, s_);
-                LogMessage(DEBUG, "response: %s\n", response.c_str());
-
-                // 处理得到一个响应报文response, 直接发送!
-                // send(conn->fd_, response.c_str(), response.size(), 0);
-                conn_->outbuffer_ += response;
-                conn_->sender_(conn_);
-            }
-        }
     }
+    ~ServiceTask() {}
+
+    void operator()();
 
 private:
-    Connection *conn_;
+    Reactor<C> *r_;
+    int fd_;
+    uint64_t seq_;
+    uint64_t slot_;
+    Request req_;
     service_t s_;
 };
 
-// 本服务器默认都采用ET模式
-class Reactor
+// 隔离舱(见ReactorServer::AddBulkhead): 满足match_的请求交给service_, 在pool_上处理
+template <Codec C>
+struct Bulkhead
 {
-    // listenop区分epollServer是否携带listensock
+    route_t match_;
+    service_t service_;
+    ThreadPool<ServiceTask<C>> *pool_;
+};
 
+// 事件循环: epoll、定时器、跨线程投递、连接集合和发送, 与协议无关
+// 协程的awaiter和AsyncSock只依赖事件循环, 不关心服务器用的是哪种编解码
+// 本服务器默认都采用ET模式
+class EventLoop
+{
 public:
-    Reactor(int listenop, int rwop, service_t service, uint16_t port = defaultport)
-        : service_(service), port_(port), listenop_(listenop), rwop_(rwop)
+    EventLoop() : wakefd_(defaultfd), connseq_(0), timerseq_(0), quit_(false)
     {
     }
-    ~Reactor()
+    // 还注册着的连接由事件循环关闭; fd属于其它对象的连接要在这之前Unregister
+    ~EventLoop()
     {
         for (auto &kv : connections_)
         {
-            if (kv.second)
-                delete kv.second;
+            close(kv.first);
+            delete kv.second;
         }
+        if (wakefd_ >= 0)
+            close(wakefd_);
+    }
+
+    // 当前线程正在运行的事件循环, 协程的awaiter通过它注册定时器、IO事件, 以及回到Reactor线程
+    static EventLoop *&Current()
+    {
+        static thread_local EventLoop *cur = nullptr;
+        return cur;
     }
 
     void Init()
     {
         epoller_.Create();
-        if (listenop_ == LISTEN_YES)
+
+        // eventfd用于其它线程唤醒本Reactor, 执行Post投递的任务
+        wakefd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakefd_ < 0)
         {
-            listensock_.Socket();
-            listensock_.Bind(port_);
-            listensock_.Listen();
-            AddConnection(listensock_.GetSockfd(), EPOLLIN);
+            LogMessage(FATAL, "eventfd create failed, errno: %d - strerror: %s\n", errno, strerror(errno));
+            exit(EPOLL_CREATE_ERR);
         }
+        epoller_.Register(wakefd_, EPOLLIN | EPOLLET);
     }
 
-    // 事件派发
+    // 事件派发, 直到Quit
+    // 设置了忙轮询(见SetPoller)时: 刚处理过数据的ShmSpinUs()内不阻塞, 一直轮询, 每隔一段检查一次epoll
+    // 空闲超过它之后先让数据的生产者改为敲门铃, 再阻塞在epoll上
     void Dispatch()
     {
-        while (true)
+        uint64_t lastbusy = 0;
+        int spins = 0;
+        while (!Quitting())
         {
             int timeout = -1;
+            if (poll_)
+            {
+                if (poll_())
+                    lastbusy = util::NowUs();
+                if (util::NowUs() - lastbusy < ShmSpinUs())
+                {
+                    if (++spins < busy_poll_epoll_interval)
+                        continue;
+                    timeout = 0;
+                }
+                else if (!sleep_())
+                    timeout = 0;
+                spins = 0;
+            }
             LoopOnce(timeout);
         }
     }
+
+    // 忙轮询没有fd事件通知的数据(共享内存连接), 只能在本Reactor线程调用
+    // poll: 处理已经到达的数据, 返回true表示这次处理了数据
+    // sleep: 阻塞等待之前调用, 让数据的生产者改为唤醒本线程; 返回false表示已经有数据, 不能阻塞
+    void SetPoller(std::function<bool()> poll, std::function<bool()> sleep)
+    {
+        poll_ = std::move(poll);
+        sleep_ = std::move(sleep);
+    }
     void LoopOnce(int timeout)
     {
+        Current() = this;
         int maxevents = default_max;
+        // 有定时器时, 最多等到最近的定时器到期
+        if (!timers_.empty())
+        {
+            uint64_t now = util::NowMs();
+            int left = timers_.front().expire_ > now ? (int)(timers_.front().expire_ - now) : 0;
+            if (timeout < 0 || left < timeout)
+                timeout = left;
+        }
         // LogMessage(DEBUG, "waiting for epoll...\n");
         int readynum = epoller_.Wait(events_, maxevents, timeout);
-        if (readynum == 0)
+        LogClock::Tick(); // 这一轮处理中的日志共用一个时间戳
+        if (readynum > 0)
+            HandleEvent(readynum);
+        // else LogMessage(WARNING, "not fd ready\n");
+        RunTimers();
+    }
+
+    // 线程安全: 把任务投递到本Reactor线程执行, 例如线程池算完后恢复协程
+    void Post(std::function<void()> fn)
+    {
         {
-            // LogMessage(WARNING, "not fd ready\n");
-            return;
+            lockGuard lg(&postmtx_);
+            posted_.push_back(std::move(fn));
         }
-        HandleEvent(readynum);
+        Wake();
+    }
+
+    // 线程安全: 让Dispatch处理完当前这一轮事件后返回; 连接和还没执行的投递任务留到析构时释放
+    void Quit()
+    {
+        quit_.store(true, std::memory_order_release);
+        Wake();
+    }
+    bool Quitting() const
+    {
+        return quit_.load(std::memory_order_acquire);
+    }
+
+    // 协程中Offload不指定线程池时使用的计算线程池, 需在Dispatch之前设置; 线程池要先于本事件循环关闭
+    void SetWorkPool(work_pool_t *pool)
+    {
+        workpool_ = pool;
+    }
+    work_pool_t *WorkPool() const
+    {
+        return workpool_;
+    }
+
+    // 只能在本Reactor线程调用, ms毫秒后执行cb, 返回定时器id
+    uint64_t AddTimer(int ms, std::function<void()> cb)
+    {
+        Timer t;
+        t.expire_ = util::NowMs() + (ms > 0 ? ms : 0);
+        t.id_ = ++timerseq_;
+        t.cb_ = std::move(cb);
+        timers_.push_back(std::move(t));
+        std::push_heap(timers_.begin(), timers_.end(), std::greater<Timer>());
+        return timerseq_;
+    }
+
+    // 只能在本Reactor线程调用, 取消还没有触发的定时器(例如请求完成后取消它的超时)
+    // 先记下id, 到堆顶时丢弃; 取消的太多时重建堆, 不让它们占着内存等到期
+    void CancelTimer(uint64_t id)
+    {
+        cancelled_.insert(id);
+        if (cancelled_.size() < timer_compact_min || cancelled_.size() * 2 < timers_.size())
+            return;
+        std::erase_if(timers_, [this](const Timer &t)
+                      { return cancelled_.count(t.id_) > 0; });
+        cancelled_.clear();
+        std::make_heap(timers_.begin(), timers_.end(), std::greater<Timer>());
     }
 
     void HandleEvent(int readynum)
@@ -150,6 +458,11 @@ public:
             int fd = events_.GetFd(i);
             uint32_t events = events_.GetEvent(i);
 
+            if (fd == wakefd_)
+            {
+                RunPosted();
+                continue;
+            }
             if (events & EPOLLIN && ConnIsExist(fd))
             {
                 LogMessage(DEBUG, "fd: %d, 读事件就绪\n", fd);
@@ -171,149 +484,16 @@ public:
         }
     }
 
-    // 连接管理
-    void AddConnection(int fd, uint32_t events)
-    {
-        // 0.为ET模式作准备
-        events |= EPOLLET;          // 注册fd事件为EPOLLET
-        if (!util::SetNonBlock(fd)) // fd设为非阻塞, 因为ET模式的读写都是非阻塞的
-        {
-            LogMessage(WARNING, "SetNonBlock failed, errno: %d - strerror: %s\n", errno, strerror(errno));
-            // 异常处理TODO
-            return;
-        }
-
-        // 1.向epoll模型中注册新的fd (内核)
-        epoller_.Register(fd, events);
-
-        // 2.添加新连接的信息 (用户层)
-        Connection *conn;
-        if (listenop_ == LISTEN_YES && fd == listensock_.GetSockfd())
-        {
-            // 不同类型的listensock有不同的处理方法
-            if (rwop_ == RW_YES)
-            {
-                conn = new Connection(fd, events,
-                                      std::bind(&Reactor::AcceptForMe, this, std::placeholders::_1), nullptr, nullptr);
-            }
-
-            else if (rwop_ == RW_NO)
-            {
-                conn = new Connection(fd, events,
-                                      std::bind(&Reactor::AcceptForOther, this, std::placeholders::_1), nullptr, nullptr);
-            }
-        }
-
-        else
-        {
-            conn = new Connection(fd, events,
-                                  std::bind(&Reactor::Recv, this, std::placeholders::_1),
-                                  std::bind(&Reactor::Send, this, std::placeholders::_1),
-                                  std::bind(&Reactor::HandleException, this, std::placeholders::_1));
-        }
-
-        connections_[fd] = conn;
-    }
-
-    // 基于ET模式的就绪事件处理函数
-    // 对于accept/read事件，一旦epoll通知就绪，必须把缓冲区中所有的数据读完
-
-    void AcceptHelper(Connection *conn, int op)
-    {
-        do
-        {
-            int newfd = listensock_.Accept();
-            if (newfd < 0)
-            {
-                if (errno == EINTR)
-                    continue;
-                if (errno == EAGAIN || errno == EWOULDBLOCK) // 非阻塞读，发现读到没有连接了
-                {
-                    LogMessage(DEBUG, "连接accpet完了\n");
-                    break;
-                }
-                else
-                {
-                    conn->excepter_(conn);
-                    return;
-                }
-            }
-            else
-            {
-                if (op == 1)
-                    AddConnection(newfd, EPOLLIN);
-                else if (op == 2)
-                {
-                    outfds_.push(newfd);
-                }
-            }
-        } while (conn->events_ | EPOLLET);
-    }
-
-    void AcceptForMe(Connection *conn)
-    {
-        AcceptHelper(conn, 1);
-        LogMessage(DEBUG, "ListenAccept: 本轮接收连接结束\n");
-    }
-
-    // 推送获取到的连接fd, 不在本Reactor处理
-    void AcceptForOther(Connection *conn)
-    {
-        AcceptHelper(conn, 2);
-    }
-    bool GetAcceptedFd(int *fd)
+    // 注册自定义回调的连接, 例如协程中使用的AsyncSock
+    void AddConnection(int fd, uint32_t events, callback_t recver, callback_t sender, callback_t excepter)
     {
-        if (outfds_.empty())
-            return false;
-
-        *fd = outfds_.front();
-        outfds_.pop();
-        return true;
+        Register(new Connection(fd, events, recver, sender, excepter));
     }
 
-    void Recv(Connection *conn)
+    Connection *GetConnection(int fd)
     {
-        do
-        {
-            char buffer[buffersize] = {0};
-            int recvnum = recv(conn->fd_, buffer, sizeof(buffer), 0);
-            if (recvnum < 0)
-            {
-                if (errno == EINTR)
-                    continue;
-                if (errno == EAGAIN || errno == EWOULDBLOCK) // 非阻塞读,发现读到没有数据了,表示本轮读取结束break
-                    break;
-                else
-                {
-                    conn->excepter_(conn);
-                    return;
-                }
-            }
-            else if (recvnum == 0)
-            {
-                // 对端关闭连接了
-                LogMessage(DEBUG, "检测到对端关闭了连接, fd:%d\n", conn->fd_);
-                conn->excepter_(conn);
-                // 异常处理完毕, 不再读取, 直接返回
-                return;
-            }
-            else
-            {
-                // read success
-                buffer[recvnum] = 0;
-                conn->inbuffer_ += buffer;
-            }
-        } while (conn->events_ | EPOLLET);
-
-        LogMessage(DEBUG, "fd: %d, 本轮数据读取成功!\n", conn->fd_);
-
-        // 一轮读取结束, 此时inbuffer中有一段字节流数据, 但不确定是否有完整的request报文
-        // 接下来进行协议的分析 (网络版本计算器)
-        // inbuffer中有多少个完整的request报文，就处理多少个，直到读不到完整的request报文，则退出，等待下次inbuffer新增数据
-
-        // 处理数据的动作用工作线程来做?
-        ThreadPool<ServiceTask>::get_instance(service_thread_num)->pushTask(ServiceTask(conn, service_));
-        LogMessage(DEBUG, "线程池已接收当前业务\n");
+        auto it = connections_.find(fd);
+        return it == connections_.end() ? nullptr : it->second;
     }
 
     // 关于写事件
@@ -328,15 +508,16 @@ public:
         int sentnum = 0;
         do
         {
-            int num = conn->outbuffer_.size();                           // 预发送数
-            sentnum = send(conn->fd_, conn->outbuffer_.c_str(), num, 0); // 实际发送数
+            int num = conn->outbuffer_.size();                      // 预发送数
+            sentnum = conn->Write(conn->outbuffer_.c_str(), num); // 实际发送数
             if (sentnum < 0)
             {
                 if (errno == EINTR)
                     continue;
                 if (errno == EAGAIN || errno == EWOULDBLOCK) // 发送缓冲区已经满了
                 {
-                    EnableIO(conn->fd_, true, true);
+                    if (!conn->polled_)
+                        EnableIO(conn->fd_, true, true);
                     break;
                 }
                 else
@@ -359,6 +540,8 @@ public:
         } while (conn->events_ | EPOLLET);
 
         LogMessage(DEBUG, "fd: %d, 本轮数据发送成功, 发送字节数: %d\n", conn->fd_, sentnum);
+        if (conn->closing_ && conn->outbuffer_.empty())
+            conn->excepter_(conn);
     }
 
     void HandleException(Connection *conn)
@@ -395,19 +578,1138 @@ public:
         return connections_.empty();
     }
 
+protected:
+    // 连接管理: 向epoll模型中注册fd(内核), 添加连接的信息(用户层)
+    // conn由事件循环接管, 失败时返回false并释放conn
+    // nonblock: fd已经是非阻塞的(例如accept4得到的), 省掉两次fcntl
+    bool Register(Connection *conn, bool nonblock = false)
+    {
+        // 0.为ET模式作准备
+        conn->events_ |= EPOLLET;                        // 注册fd事件为EPOLLET
+        if (!nonblock && !util::SetNonBlock(conn->fd_)) // fd设为非阻塞, 因为ET模式的读写都是非阻塞的
+        {
+            LogMessage(WARNING, "SetNonBlock failed, errno: %d - strerror: %s\n", errno, strerror(errno));
+            // 异常处理TODO
+            delete conn;
+            return false;
+        }
+
+        // 1.向epoll模型中注册新的fd (内核)
+        epoller_.Register(conn->fd_, conn->events_);
+
+        // 2.添加新连接的信息 (用户层)
+        conn->seq_ = ++connseq_;
+        connections_[conn->fd_] = conn;
+        return true;
+    }
+
+    // 撤销注册并释放conn, 不关闭fd, 用于fd由其它对象管理的连接(例如监听套接字属于Sock)
+    void Unregister(Connection *conn)
+    {
+        epoller_.Remove(conn->fd_);
+        connections_.erase(conn->fd_);
+        delete conn;
+    }
+
+    std::vector<Connection *> AllConnections() const
+    {
+        std::vector<Connection *> conns;
+        for (auto &kv : connections_)
+            conns.push_back(kv.second);
+        return conns;
+    }
+
+private:
+    // 唤醒阻塞在epoll上的本Reactor线程
+    void Wake()
+    {
+        uint64_t one = 1;
+        ssize_t n = write(wakefd_, &one, sizeof(one));
+        (void)n;
+    }
+
+    void RunPosted()
+    {
+        uint64_t cnt = 0;
+        ssize_t n = read(wakefd_, &cnt, sizeof(cnt));
+        (void)n;
+        std::vector<std::function<void()>> tasks;
+        {
+            lockGuard lg(&postmtx_);
+            tasks.swap(posted_);
+        }
+        for (auto &fn : tasks)
+            fn();
+    }
+
+    void RunTimers()
+    {
+        uint64_t now = util::NowMs();
+        // 已取消的在堆顶时也弹出, LoopOnce按真正要触发的定时器计算等待时间
+        while (!timers_.empty() && (timers_.front().expire_ <= now || (!cancelled_.empty() && cancelled_.count(timers_.front().id_))))
+        {
+            std::pop_heap(timers_.begin(), timers_.end(), std::greater<Timer>());
+            Timer t = std::move(timers_.back());
+            timers_.pop_back();
+            if (cancelled_.erase(t.id_) == 0)
+                t.cb_();
+        }
+    }
+
 private:
-    uint16_t port_;                                     // 端口号
-    Sock listensock_;                                   // 监听套接字
     Epoller epoller_;                                   // epoll模型
     Events events_;                                     // 就绪事件的获取等待类
     std::unordered_map<int, Connection *> connections_; // 存放连接的集合
-    service_t service_;                                 // 业务逻辑处理函数
 
-    int listenop_;           // 是否携带listensock
-    int rwop_;               // 是否在本reactor读写数据
-    std::queue<int> outfds_; // 存放本reactor接收到的连接fd，一般是本reactor不处理数据IO，等待其它reacor接收的fd
+    int wakefd_; // eventfd, 其它线程唤醒本Reactor
+    Mutex postmtx_;
+    std::vector<std::function<void()>> posted_; // 其它线程投递过来的任务
+    uint64_t connseq_;
+    uint64_t timerseq_;
+    std::vector<Timer> timers_;              // 小根堆(std::push_heap/pop_heap), 可以取消后重建
+    std::unordered_set<uint64_t> cancelled_; // 已取消、还在堆里的定时器id
+    std::function<bool()> poll_;             // 忙轮询, 见SetPoller
+    std::function<bool()> sleep_;
+    std::atomic<bool> quit_; // 见Quit
+    work_pool_t *workpool_ = nullptr;
 };
 
+// 带协议的Reactor: 在事件循环上接收连接、切分报文、派发业务、按请求顺序回写响应
+// C: 编解码方式(见codec.hpp), 编译期选定, Recv中的报文切分和序列化调用直接内联
+template <Codec C = AutoCodec>
+class Reactor : public EventLoop
+{
+    // listenop区分epollServer是否携带listensock
+
+public:
+    // pool: 业务处理所用的线程池, 为空时使用进程级默认线程池
+    Reactor(int listenop, int rwop, service_t service, uint16_t port = defaultport, ThreadPool<ServiceTask<C>> *pool = nullptr)
+        : port_(port), service_(service), listenop_(listenop), rwop_(rwop), pool_(pool)
+    {
+    }
+
+    // 只能在事件循环停止后析构(见EventLoop::Quit)
+    // 监听套接字和UDP套接字的fd属于listensocks_, 撤销注册即可; 业务连接关闭, 归还计入全局的内存
+    ~Reactor()
+    {
+        for (Connection *c : AllConnections())
+        {
+            if (c->datagram_ || FindListenSock(c->fd_) >= 0)
+                Unregister(c);
+            else if (CodecConnection<C> *conn = dynamic_cast<CodecConnection<C> *>(c))
+                Close(conn);
+        }
+    }
+
+    // 设置协程版本的业务处理, 设置后请求在本Reactor线程上处理, 不再交给线程池
+    void SetAsyncService(async_service_t service)
+    {
+        async_service_ = service;
+    }
+
+    // 增加一个隔离舱(见ReactorServer::AddBulkhead), 按添加顺序匹配; 只能在Dispatch之前调用
+    void AddBulkhead(const Bulkhead<C> &b)
+    {
+        bulkheads_.push_back(b);
+    }
+
+    // 设置监听套接字和新连接的选项, 只能在Init之前调用
+    void SetAcceptOptions(const AcceptOptions &opts)
+    {
+        accept_ = opts;
+    }
+
+    // 增加一个监听地址(见Endpoint), 可以多次调用, 只能在Init之前调用
+    // 不调用时只监听tcp:port; 所有监听套接字接收的连接交给同一组IO Reactor
+    // UDP地址由读写数据的Reactor(RW_YES)各自打开一个套接字, 带listensock而不读写数据的Reactor忽略它
+    void AddEndpoint(const Endpoint &ep)
+    {
+        endpoints_.push_back(ep);
+    }
+
+    void Init()
+    {
+        EventLoop::Init();
+
+        if (listenop_ == LISTEN_YES && endpoints_.empty())
+            endpoints_.push_back(Endpoint(AF_INET, port_));
+        for (const Endpoint &ep : endpoints_)
+        {
+            // UDP套接字由读写数据的Reactor各自打开, 只负责accept的Reactor跳过
+            if (ep.udp_)
+            {
+                listensocks_.emplace_back(rwop_ == RW_YES ? OpenUdp(ep) : nullptr);
+                continue;
+            }
+            if (listenop_ == LISTEN_YES)
+            {
+                Sock *sock = new Sock;
+                listensocks_.emplace_back(sock);
+                sock->Socket(ep.family_);
+                // unix套接字没有Nagle和延迟ACK, 低延迟配置对它不需要设置
+                if ((ep.family_ != AF_UNIX || accept_.profile_ != util::PROFILE_LOW_LATENCY) &&
+                    !util::SetListenProfile(sock->GetSockfd(), accept_.profile_))
+                    LogMessage(WARNING, "set socket profile %s failed: %s\n", util::profile_names[accept_.profile_], strerror(errno));
+                if (accept_.defer_accept_ > 0 && !sock->DeferAccept(accept_.defer_accept_))
+                    LogMessage(WARNING, "TCP_DEFER_ACCEPT failed: %s\n", strerror(errno));
+                sock->Bind(ep);
+                sock->Listen(accept_.backlog_);
+                AddConnection(sock->GetSockfd(), EPOLLIN);
+                LogMessage(INFO, "listen on %s\n", ep.ToString().c_str());
+            }
+            else
+                listensocks_.emplace_back(nullptr);
+        }
+    }
+
+    // 关闭所有监听套接字(UDP套接字除外), 不再接收新连接; 全连接队列里还没有accept的连接被内核重置
+    // 只能在本Reactor线程调用, 或者本Reactor没有在运行事件循环
+    void CloseListen()
+    {
+        for (size_t i = 0; i < listensocks_.size(); i++)
+        {
+            if (!listensocks_[i] || endpoints_[i].udp_)
+                continue;
+            Connection *conn = GetConnection(listensocks_[i]->GetSockfd());
+            if (conn)
+                Unregister(conn);
+            listensocks_[i].reset();
+        }
+    }
+
+    // 连接管理
+    // 业务连接的fd来自Sock::Accept, 已经是非阻塞的, TCP_NODELAY等选项从监听套接字继承
+    using EventLoop::AddConnection;
+    void AddConnection(int fd, uint32_t events)
+    {
+        Connection *conn;
+        int index = FindListenSock(fd);
+        if (index >= 0)
+        {
+            // 不同类型的listensock有不同的处理方法
+            if (rwop_ == RW_YES)
+            {
+                conn = new Connection(fd, events,
+                                      std::bind(&Reactor::AcceptForMe, this, index, std::placeholders::_1), nullptr, nullptr);
+            }
+
+            else
+            {
+                conn = new Connection(fd, events,
+                                      std::bind(&Reactor::AcceptForOther, this, index, std::placeholders::_1), nullptr, nullptr);
+            }
+        }
+
+        else
+        {
+            CodecConnection<C> *cc = new CodecConnection<C>(fd, events,
+                                                            std::bind(&Reactor::Recv, this, std::placeholders::_1),
+                                                            std::bind(&Reactor::SendResponses, this, std::placeholders::_1),
+                                                            std::bind(&Reactor::Close, this, std::placeholders::_1));
+            cc->codec_.SetMaxFrame(limits_.max_frame_);
+            Register(cc, true);
+            return;
+        }
+        Register(conn);
+    }
+
+    // 共享内存连接(见ShmConnection): fd是从shm地址accept的unix套接字, 在这里完成握手
+    // 本线程有了共享内存连接后开始忙轮询(见EventLoop::Dispatch)
+    void AddShmConnection(int fd)
+    {
+        ShmConnection<C> *conn = new ShmConnection<C>(fd, EPOLLIN,
+                                                      std::bind(&Reactor::ShmRecv, this, std::placeholders::_1),
+                                                      std::bind(&Reactor::SendResponses, this, std::placeholders::_1),
+                                                      std::bind(&Reactor::Close, this, std::placeholders::_1));
+        conn->codec_.SetMaxFrame(limits_.max_frame_);
+        if (!conn->chan_.Accept(fd))
+        {
+            LogMessage(WARNING, "fd: %d, 共享内存握手失败: %s\n", fd, strerror(errno));
+            close(fd);
+            delete conn;
+            return;
+        }
+        conn->polled_ = true;
+        if (!Register(conn, true))
+            return;
+        shmconns_.emplace_back(fd, conn->seq_);
+        if (shmconns_.size() == 1)
+            SetPoller(std::bind(&Reactor::PollShm, this), std::bind(&Reactor::SleepShm, this));
+    }
+
+    // 在本Reactor上打开一个UDP套接字: 每个IO线程各绑一个到同一端口(SO_REUSEPORT), 内核按对端地址把数据报分给它们
+    Sock *OpenUdp(const Endpoint &ep)
+    {
+        Sock *sock = new Sock;
+        sock->Socket(ep.family_, SOCK_DGRAM);
+        if (!sock->ReusePort())
+            LogMessage(WARNING, "SO_REUSEPORT failed: %s\n", strerror(errno));
+        int one = 1;
+        bool offload = accept_.udp_offload_ && setsockopt(sock->GetSockfd(), SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+        if (accept_.udp_offload_ && !offload)
+            LogMessage(WARNING, "UDP_GRO failed: %s\n", strerror(errno));
+        sock->Bind(ep);
+        UdpConnection<C> *conn = new UdpConnection<C>(sock->GetSockfd(), EPOLLIN,
+                                                      std::bind(&Reactor::UdpRecv, this, std::placeholders::_1),
+                                                      std::bind(&Reactor::UdpFlush, this, std::placeholders::_1));
+        conn->offload_ = offload;
+        Register(conn);
+        LogMessage(INFO, "listen on %s%s\n", ep.ToString().c_str(), offload ? " (gro/gso)" : "");
+        return sock;
+    }
+
+    // 基于ET模式的就绪事件处理函数
+    // 对于accept/read事件，一旦epoll通知就绪，必须把缓冲区中所有的数据读完
+
+    void AcceptHelper(int index, Connection *conn, int op)
+    {
+        Sock *sock = listensocks_[index].get();
+        bool shm = endpoints_[index].shm_;
+        do
+        {
+            int newfd = sock->Accept();
+            if (newfd < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED) // 对端在accept之前就断开了, 接着取下一个
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) // 非阻塞读，发现读到没有连接了
+                {
+                    LogMessage(DEBUG, "连接accpet完了\n");
+                    break;
+                }
+                else
+                {
+                    // fd用完等错误: 监听套接字没有excepter_, 留在队列里的连接等下一次可读事件再取
+                    break;
+                }
+            }
+            else
+            {
+                // 响应随完成随发, 都是小报文, 开着Nagle会和对端的延迟ACK互相等待(约40ms); 默认的低延迟配置关闭Nagle
+                if (sock->GetFamily() != AF_UNIX)
+                    util::SetConnProfile(newfd, accept_.profile_);
+                if (op == 1)
+                {
+                    if (shm)
+                        AddShmConnection(newfd);
+                    else
+                        AddConnection(newfd, EPOLLIN);
+                }
+                else if (op == 2)
+                {
+                    outfds_.push(std::make_pair(newfd, shm));
+                }
+            }
+        } while (conn->events_ | EPOLLET);
+    }
+
+    void AcceptForMe(int index, Connection *conn)
+    {
+        AcceptHelper(index, conn, 1);
+        LogMessage(DEBUG, "ListenAccept: 本轮接收连接结束\n");
+    }
+
+    // 推送获取到的连接fd, 不在本Reactor处理
+    void AcceptForOther(int index, Connection *conn)
+    {
+        AcceptHelper(index, conn, 2);
+    }
+    // shm: 这个fd来自shm地址, 接收方要用AddShmConnection注册
+    bool GetAcceptedFd(int *fd, bool *shm = nullptr)
+    {
+        if (outfds_.empty())
+            return false;
+
+        *fd = outfds_.front().first;
+        if (shm)
+            *shm = outfds_.front().second;
+        outfds_.pop();
+        return true;
+    }
+
+    void Recv(Connection *c)
+    {
+        // 只有本Reactor创建的业务连接才会绑定Recv
+        CodecConnection<C> *conn = static_cast<CodecConnection<C> *>(c);
+        if (conn->paused_) // 等定时器恢复读取
+            return;
+        bool drained = false; // 内核接收缓冲区已经读空
+        while (!drained)
+        {
+            // 积压超出预算时暂停读取, 见MemoryLimits
+            if (Throttled(conn))
+            {
+                Pause(conn);
+                return;
+            }
+            do
+            {
+                char buffer[buffersize];
+                int recvnum = conn->Read(buffer, sizeof(buffer));
+                if (recvnum < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) // 非阻塞读,发现读到没有数据了,表示本轮读取结束break
+                    {
+                        drained = true;
+                        break;
+                    }
+                    else
+                    {
+                        conn->excepter_(conn);
+                        return;
+                    }
+                }
+                else if (recvnum == 0)
+                {
+                    // 对端关闭连接了
+                    LogMessage(DEBUG, "检测到对端关闭了连接, fd:%d\n", conn->fd_);
+                    conn->excepter_(conn);
+                    // 异常处理完毕, 不再读取, 直接返回
+                    return;
+                }
+                else
+                {
+                    // read success
+                    conn->inbuffer_.append(buffer, recvnum);
+                    // 一轮最多读入conn_budget_字节, 先处理掉再继续读, 对端持续发送时inbuffer也不会无限增长
+                    if (conn->inbuffer_.size() >= limits_.conn_budget_)
+                        break;
+                }
+            } while (conn->events_ | EPOLLET);
+
+            LogMessage(DEBUG, "fd: %d, 本轮数据读取成功!\n", conn->fd_);
+            if (!Process(conn)) // 连接已经关闭
+                return;
+        }
+    }
+
+    // 共享内存连接的套接字可读: 对端敲了门铃(有新数据, 或者读出后有了空间), 或者对端退出了
+    void ShmRecv(Connection *c)
+    {
+        char bell[64];
+        ssize_t n;
+        while ((n = recv(c->fd_, bell, sizeof(bell), 0)) > 0)
+            ;
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            LogMessage(DEBUG, "检测到对端关闭了共享内存连接, fd:%d\n", c->fd_);
+            c->excepter_(c);
+            return;
+        }
+        PollShmConn(static_cast<ShmConnection<C> *>(c));
+    }
+
+    // UDP套接字可读: 每次recvmmsg读入一批数据报, 处理完把同步完成的响应一次发出, 直到读空
+    void UdpRecv(Connection *c)
+    {
+        UdpConnection<C> *conn = static_cast<UdpConnection<C> *>(c);
+        int fd = conn->fd_;
+        while (true)
+        {
+            // 待发送的响应达到上限(发送缓冲区一直满): 数据报留在内核接收缓冲区, 满了由内核丢弃, 发出一部分后再读
+            if (conn->replybytes_ >= limits_.conn_budget_)
+            {
+                conn->paused_ = true;
+                break;
+            }
+            for (int i = 0; i < udp_batch; i++)
+            {
+                conn->iovs_[i] = {conn->buffers_.get() + i * udp_max_payload, udp_max_payload};
+                struct msghdr &hdr = conn->msgs_[i].msg_hdr;
+                hdr.msg_name = &conn->addrs_[i];
+                hdr.msg_namelen = sizeof(conn->addrs_[i]);
+                hdr.msg_iov = &conn->iovs_[i];
+                hdr.msg_iovlen = 1;
+                hdr.msg_control = conn->offload_ ? conn->controls_[i] : nullptr;
+                hdr.msg_controllen = conn->offload_ ? sizeof(conn->controls_[i]) : 0;
+                hdr.msg_flags = 0;
+            }
+            int n = recvmmsg(fd, conn->msgs_, udp_batch, MSG_DONTWAIT, nullptr);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    LogMessage(WARNING, "fd: %d, recvmmsg fail: %s\n", fd, strerror(errno));
+                break;
+            }
+            for (int i = 0; i < n; i++)
+            {
+                struct msghdr &hdr = conn->msgs_[i].msg_hdr;
+                UdpPeer peer;
+                memcpy(&peer.addr_, &conn->addrs_[i], hdr.msg_namelen);
+                peer.len_ = hdr.msg_namelen;
+                if (hdr.msg_flags & MSG_TRUNC) // 超过udp_max_payload
+                {
+                    conn->dropped_++;
+                    continue;
+                }
+                // GRO: 同一对端的多个数据报合并在一个缓冲区里, 除最后一个外都是segsize字节
+                size_t len = conn->msgs_[i].msg_len, segsize = len;
+                for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+                {
+                    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+                    {
+                        int size;
+                        memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+                        segsize = size > 0 ? size : len;
+                    }
+                }
+                const char *data = (const char *)conn->iovs_[i].iov_base;
+                for (size_t off = 0; off < len; off += segsize)
+                    HandleDatagram(conn, data + off, std::min(segsize, len - off), peer);
+            }
+            UdpFlush(conn);
+            // 没读满一批说明已经读空; 之后到达的数据报会再触发一次可读事件
+            if (n < udp_batch || GetConnection(fd) != conn)
+                break;
+        }
+    }
+
+    // 一个数据报就是一个完整的请求, 多出或不完整的数据都视为非法, 丢弃
+    void HandleDatagram(UdpConnection<C> *conn, const char *data, size_t len, const UdpPeer &peer)
+    {
+        // 同一批(GRO合并)中的数据报在响应达到上限后丢弃, 不再处理
+        if (conn->replybytes_ >= limits_.conn_budget_)
+        {
+            conn->dropped_++;
+            return;
+        }
+        UdpPending<C> pending;
+        pending.peer_ = peer;
+        pending.codec_.SetMaxFrame(limits_.max_frame_);
+        std::string &buf = conn->inbuffer_;
+        buf.assign(data, len);
+        std::string_view frame;
+        Request req;
+        if (pending.codec_.Next(buf, &frame) <= 0)
+        {
+            conn->dropped_++;
+            return;
+        }
+        uint8_t kind = pending.codec_.FrameKind();
+        if (cache_)
+        {
+            const std::string *hit = cache_->Get(kind, frame);
+            if (hit)
+            {
+                conn->replies_.push_back({peer, *hit});
+                conn->replybytes_ += hit->size();
+                return;
+            }
+            if (cache_->Cacheable(frame.size()))
+            {
+                pending.cache_ = true;
+                pending.kind_ = kind;
+                pending.key_.assign(frame);
+            }
+        }
+        bool ok = pending.codec_.Decode(frame, &req);
+        pending.codec_.Consume(buf);
+        if (!ok || !buf.empty() || conn->pending_.size() >= limits_.max_inflight_)
+        {
+            conn->dropped_++;
+            LogMessage(DEBUG, "fd: %d, 丢弃数据报, 长度: %zu\n", conn->fd_, len);
+            return;
+        }
+        // 带编号的请求键中含编号, 几乎不会重复, 不放入缓存
+        pending.cache_ = pending.cache_ && !req._hasid;
+        uint64_t slot = conn->nextslot_++;
+        conn->pending_.emplace(slot, std::move(pending));
+        if (async_service_)
+        {
+            RunAsync(std::move(req), conn->fd_, conn->seq_, slot);
+            return;
+        }
+        Submit(conn->fd_, conn->seq_, slot, std::move(req));
+    }
+
+    // 一个UDP请求完成: 编码后放进待发送的响应, 在本轮事件处理之后和其它响应一起发出
+    void UdpComplete(UdpConnection<C> *conn, uint64_t slot, Response resp)
+    {
+        auto it = conn->pending_.find(slot);
+        if (it == conn->pending_.end())
+            return;
+        UdpPending<C> &pending = it->second;
+        conn->replies_.push_back({pending.peer_, std::string()});
+        std::string &frame = conn->replies_.back().data_;
+        pending.codec_.Encode(resp, &frame);
+        conn->replybytes_ += frame.size();
+        if (pending.cache_)
+            cache_->Put(pending.kind_, pending.key_, frame);
+        conn->pending_.erase(it);
+        if (conn->flushpending_)
+            return;
+        conn->flushpending_ = true;
+        int fd = conn->fd_;
+        uint64_t seq = conn->seq_;
+        AddTimer(0, [this, fd, seq]()
+                 {
+                     Connection *c = GetConnection(fd);
+                     if (c == nullptr || c->seq_ != seq)
+                         return;
+                     static_cast<UdpConnection<C> *>(c)->flushpending_ = false;
+                     UdpFlush(c); });
+    }
+
+    // 用sendmmsg发出所有待发送的响应; 开启GSO时, 发给同一对端的连续等长响应合成一条消息, 由内核切分
+    // 发送缓冲区满时剩下的等可写事件再发, 发完后取消可写事件; 因响应积压暂停的读取在这里恢复
+    void UdpFlush(Connection *c)
+    {
+        UdpConnection<C> *conn = static_cast<UdpConnection<C> *>(c);
+        std::vector<UdpReply> &replies = conn->replies_;
+        size_t done = 0;
+        while (done < replies.size())
+        {
+            struct mmsghdr msgs[udp_batch];
+            struct iovec iovs[udp_batch * udp_batch];
+            char controls[udp_batch][CMSG_SPACE(sizeof(uint16_t))];
+            size_t first[udp_batch + 1]; // 第i条消息包含的响应: [first[i], first[i + 1])
+            int nmsg = 0;
+            size_t next = done, niov = 0;
+            while (nmsg < udp_batch && next < replies.size())
+            {
+                size_t segs = conn->offload_ ? UdpGsoRun(replies, next) : 1;
+                struct msghdr &hdr = msgs[nmsg].msg_hdr;
+                memset(&hdr, 0, sizeof(hdr));
+                hdr.msg_name = &replies[next].peer_.addr_;
+                hdr.msg_namelen = replies[next].peer_.len_;
+                hdr.msg_iov = &iovs[niov];
+                hdr.msg_iovlen = segs;
+                for (size_t k = 0; k < segs; k++)
+                    iovs[niov++] = {(void *)replies[next + k].data_.data(), replies[next + k].data_.size()};
+                if (segs > 1)
+                {
+                    hdr.msg_control = controls[nmsg];
+                    hdr.msg_controllen = sizeof(controls[nmsg]);
+                    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+                    cmsg->cmsg_level = SOL_UDP;
+                    cmsg->cmsg_type = UDP_SEGMENT;
+                    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                    uint16_t segsize = replies[next].data_.size();
+                    memcpy(CMSG_DATA(cmsg), &segsize, sizeof(segsize));
+                }
+                first[nmsg++] = next;
+                next += segs;
+            }
+            first[nmsg] = next;
+            int sent = sendmmsg(conn->fd_, msgs, nmsg, 0);
+            if (sent < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    if (!conn->outwait_)
+                        EnableIO(conn->fd_, true, true);
+                    conn->outwait_ = true;
+                    break;
+                }
+                // 第一条消息发不出去(例如对端地址不可达), 丢掉它, 继续发后面的
+                LogMessage(DEBUG, "fd: %d, sendmmsg fail: %s\n", conn->fd_, strerror(errno));
+                conn->dropped_ += first[1] - first[0];
+                sent = 1;
+            }
+            done = first[sent];
+        }
+        for (size_t i = 0; i < done; i++)
+            conn->replybytes_ -= replies[i].data_.size();
+        replies.erase(replies.begin(), replies.begin() + done);
+        if (replies.empty() && replies.capacity() > udp_batch * 4)
+            std::vector<UdpReply>().swap(replies);
+        if (replies.empty() && conn->outwait_)
+        {
+            conn->outwait_ = false;
+            EnableIO(conn->fd_, true, false);
+        }
+        // 不在这里直接读取: UdpRecv每批之后都会调用UdpFlush
+        if (conn->paused_ && conn->replybytes_ < limits_.conn_budget_)
+        {
+            conn->paused_ = false;
+            int fd = conn->fd_;
+            uint64_t seq = conn->seq_;
+            AddTimer(0, [this, fd, seq]()
+                     {
+                         Connection *c = GetConnection(fd);
+                         if (c != nullptr && c->seq_ == seq)
+                             UdpRecv(c); });
+        }
+    }
+
+    // 一轮读取结束, 此时inbuffer中有一段字节流数据, 但不确定是否有完整的request报文
+    // 接下来进行协议的分析 (网络版本计算器)
+    // inbuffer中有多少个完整的request报文，就处理多少个，直到读不到完整的request报文，则退出，等待下次inbuffer新增数据
+    // 返回false: 连接已经关闭
+    bool Process(CodecConnection<C> *conn)
+    {
+        int fd = conn->fd_;
+        uint64_t seq = conn->seq_;
+        if (conn->closereq_) // 等待前面的响应发完后关闭, 不再处理新的数据
+        {
+            conn->inbuffer_.clear();
+            Charge(conn);
+            return true;
+        }
+
+        // 报文解析是零拷贝的, 直接在本Reactor线程上做, 只把解析好的Request交给业务处理
+        // 先解析完所有报文再派发: 派发过程中可能发送响应, 发送出错会删除conn
+        // 命中响应缓存的请求在解析时就已经完成, 不会出现在reqs中
+        std::vector<Request> reqs;
+        std::vector<uint64_t> slots;
+        int ret = ParseRequests(conn, &reqs, &slots);
+        // Codec在报头到达时就按max_frame_检查完整报文的长度; 这里检查剩下的、连报头都还没到齐的部分
+        if (ret == 0 && conn->inbuffer_.size() > limits_.max_frame_)
+        {
+            LogMessage(WARNING, "fd: %d, %s报文超过%zu字节\n", fd, C::name, limits_.max_frame_);
+            ret = -1;
+        }
+        if (ret < 0)
+        {
+            LogMessage(WARNING, "fd: %d, 非法%s报文, 关闭连接\n", fd, C::name);
+            Reject(conn);
+        }
+        if (conn->closereq_)
+            conn->inbuffer_.clear();
+        if (!conn->outbuffer_.empty() || conn->closing_)
+        {
+            conn->sender_(conn); // 缓存命中的响应, 或者要关闭连接
+            Connection *c = GetConnection(fd);
+            if (c == nullptr || c->seq_ != seq) // 发送出错, 连接已经关闭
+                return false;
+        }
+
+        // 批量请求带有数组, 移动给业务处理, 不拷贝
+        conn->inflight_ += reqs.size();
+        for (size_t i = 0; i < reqs.size(); i++)
+        {
+            // 协程业务直接在本Reactor线程上处理, 等待时让出线程, 不占用工作线程
+            if (async_service_)
+            {
+                RunAsync(std::move(reqs[i]), fd, seq, slots[i]);
+                continue;
+            }
+            // 处理数据的动作用工作线程来做
+            Submit(fd, seq, slots[i], std::move(reqs[i]));
+        }
+        // 协程业务可能同步完成, 完成时发送出错会删除conn
+        Connection *c = GetConnection(fd);
+        if (c == nullptr || c->seq_ != seq)
+            return false;
+        Charge(conn);
+        return true;
+    }
+
+    // 用连接的Codec解析inbuffer中所有完整的请求, 每个请求按到达顺序分配一个顺序号, 带编号的请求为unordered_slot
+    // 开启响应缓存时, 命中的请求不解码, 直接完成; 其余请求和它们的顺序号放入reqs/slots
+    // 遇到要求关闭连接的请求时停止解析
+    // 返回0: 正常; -1: 报文非法, 或者报文(两次Next之间取走的原始字节)超过max_frame_
+    int ParseRequests(CodecConnection<C> *conn, std::vector<Request> *reqs, std::vector<uint64_t> *slots)
+    {
+        std::string_view frame;
+        int ret = 0;
+        // 捕获时记录报文的原始字节(frame只是有效载荷), 即两次Next之间取走的部分
+        uint64_t now = capture_ ? util::NowNs() : 0; // 这一批报文的到达时刻
+        size_t begin = conn->codec_.Parsed();
+        std::string_view raw;
+        while (!conn->closereq_ && (ret = conn->codec_.Next(conn->inbuffer_, &frame)) > 0)
+        {
+            size_t end = conn->codec_.Parsed();
+            if (end - begin > limits_.max_frame_) // Codec没有按SetMaxFrame检查时兜底
+            {
+                LogMessage(WARNING, "fd: %d, %s报文超过%zu字节\n", conn->fd_, C::name, limits_.max_frame_);
+                ret = -1;
+                break;
+            }
+            raw = std::string_view(conn->inbuffer_.data() + begin, end - begin);
+            begin = end;
+            uint8_t kind = conn->codec_.FrameKind();
+            if (cache_)
+            {
+                // 缓存中只有不带编号的响应(见下面), 命中的一定是有序请求
+                const std::string *hit = cache_->Get(kind, frame);
+                if (hit)
+                {
+                    uint64_t slot = conn->nextslot_++;
+                    if (capture_)
+                        capture_->Request(now, conn->seq_, slot, false, raw);
+                    CheckWantClose(conn, slot);
+                    if (slot == conn->nextsend_ && conn->ready_.empty()) // 常见情况: 前面的响应都已发出, 直接追加
+                    {
+                        conn->outbuffer_ += *hit;
+                        conn->nextsend_++;
+                        if (capture_)
+                            capture_->Response(now, conn->seq_, slot, false);
+                        CheckClosing(conn);
+                        continue;
+                    }
+                    Completion done;
+                    done.frame_ = *hit;
+                    done.encoded_ = true;
+                    Complete(conn, slot, std::move(done));
+                    continue;
+                }
+            }
+            reqs->emplace_back();
+            if (!conn->codec_.Decode(frame, &reqs->back()))
+            {
+                reqs->pop_back();
+                ret = -1;
+                break;
+            }
+            // 带编号的请求键中含编号, 几乎不会重复, 不放入缓存
+            uint64_t slot = reqs->back()._hasid ? unordered_slot : conn->nextslot_++;
+            slots->push_back(slot);
+            if (capture_)
+                capture_->Request(now, conn->seq_, reqs->back()._hasid ? reqs->back()._id : slot, reqs->back()._hasid, raw);
+            CheckWantClose(conn, slot);
+            if (cache_ && slot != unordered_slot && cache_->Cacheable(frame.size()))
+                conn->misskeys_.emplace(slot, std::make_pair(kind, std::string(frame)));
+        }
+        conn->codec_.Consume(conn->inbuffer_);
+        return ret < 0 ? -1 : 0;
+    }
+
+    // 把请求交给第一个匹配的隔离舱, 都不匹配时交给默认的业务线程池处理
+    // 线程池已经关闭(服务器正在停止)时拒绝任务, 这时在本线程就地处理: 请求照样得到响应, 已计入的inflight_/pending_照常释放
+    void Submit(int fd, uint64_t seq, uint64_t slot, Request req)
+    {
+        for (const Bulkhead<C> &b : bulkheads_)
+        {
+            if (b.match_(req))
+            {
+                Submit(b.pool_, ServiceTask<C>(this, fd, seq, slot, std::move(req), b.service_));
+                return;
+            }
+        }
+        if (pool_ == nullptr)
+            pool_ = ThreadPool<ServiceTask<C>>::get_instance(service_thread_num);
+        Submit(pool_, ServiceTask<C>(this, fd, seq, slot, std::move(req), service_));
+    }
+    void Submit(ThreadPool<ServiceTask<C>> *pool, ServiceTask<C> task)
+    {
+        if (!pool->pushTask(std::move(task)))
+            task();
+    }
+
+    // 顶层协程: req按值保存在协程帧中, 业务协程在整个执行期间都可以引用它
+    Detached RunAsync(Request req, int fd, uint64_t seq, uint64_t slot)
+    {
+        Response resp = co_await async_service_(req);
+        resp._id = req._id;
+        resp._hasid = req._hasid;
+        CompleteRequest(fd, seq, slot, std::move(resp));
+    }
+
+    // 只能在本Reactor线程调用, 按请求顺序把响应编码进outbuffer并发送; 带编号的响应不等前面的请求, 直接发送
+    void CompleteRequest(int fd, uint64_t seq, uint64_t slot, Response resp)
+    {
+        Connection *c = GetConnection(fd);
+        if (c == nullptr || c->seq_ != seq) // 连接已经关闭
+            return;
+        if (c->datagram_)
+        {
+            UdpComplete(static_cast<UdpConnection<C> *>(c), slot, std::move(resp));
+            return;
+        }
+        CodecConnection<C> *conn = static_cast<CodecConnection<C> *>(c);
+        conn->inflight_--;
+        Completion done;
+        done.resp_ = std::move(resp);
+        Complete(conn, slot, std::move(done));
+        conn->sender_(conn);
+    }
+
+    // 开启响应缓存, capacity: 本Reactor的缓存内存上限(字节); 只能在Dispatch之前调用
+    // 只适用于确定性的业务
+    void EnableCache(size_t capacity)
+    {
+        cache_.reset(new ResponseCache(capacity));
+    }
+    const ResponseCache *GetCache() const
+    {
+        return cache_.get();
+    }
+
+    // 开启流量捕获(见capture.hpp), 本Reactor的流式连接上收到的请求和响应时刻写到path; 只能在Dispatch之前调用
+    // start_ns: 捕获的起点, 同一服务器的各个Reactor用同一个; 文件打不开返回false
+    // UDP数据报不捕获
+    bool EnableCapture(const std::string &path, uint64_t start_ns)
+    {
+        std::unique_ptr<CaptureWriter> writer(new CaptureWriter);
+        if (!writer->Open(path, C::name, start_ns))
+            return false;
+        capture_ = std::move(writer);
+        FlushCapture();
+        return true;
+    }
+    const CaptureWriter *GetCapture() const
+    {
+        return capture_.get();
+    }
+
+    // 设置业务连接的内存预算, 只能在Dispatch之前调用
+    // conn_budget_至少要比max_frame_多一次读取, 否则一个最大的报文都读不完
+    void SetLimits(const MemoryLimits &limits)
+    {
+        limits_ = limits;
+        if (limits_.conn_budget_ < limits_.max_frame_ + buffersize)
+            limits_.conn_budget_ = limits_.max_frame_ + buffersize;
+    }
+
+    // 发送响应, 之后重新计算连接占用的内存
+    void SendResponses(Connection *c)
+    {
+        int fd = c->fd_;
+        uint64_t seq = c->seq_;
+        Send(c);
+        c = GetConnection(fd);
+        if (c != nullptr && c->seq_ == seq)
+            Charge(static_cast<CodecConnection<C> *>(c));
+    }
+
+    // 关闭业务连接, 归还它计入全局的内存
+    void Close(Connection *c)
+    {
+        CodecConnection<C> *conn = static_cast<CodecConnection<C> *>(c);
+        GlobalBufferBytes() -= conn->charged_;
+        conn->charged_ = 0;
+        HandleException(conn);
+    }
+
+private:
+    bool Throttled(const CodecConnection<C> *conn) const
+    {
+        if (conn->inbuffer_.size() + conn->outbuffer_.size() >= limits_.conn_budget_ || conn->inflight_ >= limits_.max_inflight_)
+            return true;
+        return limits_.global_budget_ > 0 && GlobalBufferBytes().load(std::memory_order_relaxed) >= limits_.global_budget_;
+    }
+
+    // 暂停读取: 边缘触发下已经到达的数据不会再通知, 由定时器稍后重新调用Recv
+    void Pause(CodecConnection<C> *conn)
+    {
+        conn->paused_ = true;
+        int fd = conn->fd_;
+        uint64_t seq = conn->seq_;
+        AddTimer(pause_retry_ms, [this, fd, seq]()
+                 {
+                     Connection *c = GetConnection(fd);
+                     if (c == nullptr || c->seq_ != seq)
+                         return;
+                     static_cast<CodecConnection<C> *>(c)->paused_ = false;
+                     c->recver_(c); });
+    }
+
+    // 清空的缓冲区释放大块容量, 然后把连接的缓冲区容量计入全局
+    void Charge(CodecConnection<C> *conn)
+    {
+        if (conn->inbuffer_.empty() && conn->inbuffer_.capacity() > shrink_threshold)
+            std::string().swap(conn->inbuffer_);
+        if (conn->outbuffer_.empty() && conn->outbuffer_.capacity() > shrink_threshold)
+            std::string().swap(conn->outbuffer_);
+        size_t bytes = conn->inbuffer_.capacity() + conn->outbuffer_.capacity();
+        if (bytes > conn->charged_)
+            GlobalBufferBytes() += bytes - conn->charged_;
+        else if (bytes < conn->charged_)
+            GlobalBufferBytes() -= conn->charged_ - bytes;
+        conn->charged_ = bytes;
+    }
+
+    // 报文非法: 错误响应(由Codec决定, 可以为空)排在前面已解析请求的响应之后, 发完后关闭连接
+    void Reject(CodecConnection<C> *conn)
+    {
+        Completion done;
+        conn->codec_.Reject(&done.frame_);
+        done.encoded_ = true;
+        uint64_t slot = conn->nextslot_++;
+        conn->closereq_ = true;
+        conn->closeslot_ = slot;
+        Complete(conn, slot, std::move(done));
+    }
+
+    void CheckWantClose(CodecConnection<C> *conn, uint64_t slot)
+    {
+        if (conn->codec_.WantClose())
+        {
+            conn->closereq_ = true;
+            conn->closeslot_ = slot;
+        }
+    }
+
+    // 要求关闭连接的请求的响应已经进入outbuffer
+    void CheckClosing(CodecConnection<C> *conn)
+    {
+        if (conn->closereq_ && conn->nextsend_ > conn->closeslot_)
+            conn->closing_ = true;
+    }
+
+    // 第slot个请求完成: 轮到它时直接编码进outbuffer, 并带出后面已经完成的响应; 否则暂存
+    void Complete(CodecConnection<C> *conn, uint64_t slot, Completion done)
+    {
+        if (slot == unordered_slot)
+        {
+            Emit(conn, slot, done);
+            return;
+        }
+        if (slot != conn->nextsend_)
+        {
+            conn->ready_.emplace(slot, std::move(done));
+            return;
+        }
+        Emit(conn, slot, done);
+        conn->nextsend_++;
+        while (!conn->ready_.empty() && conn->ready_.begin()->first == conn->nextsend_)
+        {
+            Emit(conn, conn->nextsend_, conn->ready_.begin()->second);
+            conn->ready_.erase(conn->ready_.begin());
+            conn->nextsend_++;
+        }
+        CheckClosing(conn);
+    }
+
+    void Emit(CodecConnection<C> *conn, uint64_t slot, const Completion &done)
+    {
+        if (capture_)
+        {
+            bool tagged = slot == unordered_slot;
+            capture_->Response(util::NowNs(), conn->seq_, tagged ? done.resp_._id : slot, tagged);
+        }
+        if (done.encoded_)
+        {
+            conn->outbuffer_ += done.frame_;
+            return;
+        }
+        size_t old = conn->outbuffer_.size();
+        conn->codec_.Encode(done.resp_, &conn->outbuffer_);
+        if (cache_ && !conn->misskeys_.empty())
+        {
+            auto it = conn->misskeys_.find(slot);
+            if (it != conn->misskeys_.end())
+            {
+                std::string_view frame(conn->outbuffer_.data() + old, conn->outbuffer_.size() - old);
+                cache_->Put(it->second.first, it->second.second, frame);
+                conn->misskeys_.erase(it);
+            }
+        }
+    }
+
+    // 定时把捕获的记录写进文件, 流量小的时候也不会在内存里攒太久
+    void FlushCapture()
+    {
+        capture_->Flush();
+        AddTimer(capture_flush_ms, [this]()
+                 { FlushCapture(); });
+    }
+
+    // 处理一个共享内存连接上已经到达的请求, 发送积压的响应; 返回true表示处理了数据
+    bool PollShmConn(ShmConnection<C> *conn)
+    {
+        int fd = conn->fd_;
+        uint64_t seq = conn->seq_;
+        bool busy = false;
+        conn->chan_.In().Awake();
+        if (!conn->paused_ && conn->chan_.In().Readable())
+        {
+            busy = true;
+            Recv(conn);
+            Connection *c = GetConnection(fd);
+            if (c == nullptr || c->seq_ != seq) // 连接已经关闭
+                return true;
+        }
+        if (!conn->outbuffer_.empty() && conn->chan_.Out().Writable())
+        {
+            busy = true;
+            SendResponses(conn);
+        }
+        return busy;
+    }
+
+    // 忙轮询本线程所有的共享内存连接, 顺便去掉已经关闭的
+    bool PollShm()
+    {
+        bool busy = false;
+        for (size_t i = 0; i < shmconns_.size();)
+        {
+            Connection *c = GetConnection(shmconns_[i].first);
+            if (c == nullptr || c->seq_ != shmconns_[i].second)
+            {
+                shmconns_[i] = shmconns_.back();
+                shmconns_.pop_back();
+                continue;
+            }
+            busy |= PollShmConn(static_cast<ShmConnection<C> *>(c));
+            i++;
+        }
+        return busy;
+    }
+
+    // 阻塞等待之前: 所有共享内存连接登记等待, 客户端写入后敲门铃; 返回false表示已经有数据
+    // 暂停读取的连接由定时器恢复, 有数据也不妨碍阻塞
+    bool SleepShm()
+    {
+        for (auto &kv : shmconns_)
+        {
+            Connection *c = GetConnection(kv.first);
+            if (c == nullptr || c->seq_ != kv.second)
+                continue;
+            ShmConnection<C> *conn = static_cast<ShmConnection<C> *>(c);
+            if (conn->chan_.In().WaitData() && !conn->paused_)
+                return false;
+        }
+        return true;
+    }
+
+private:
+    // 返回fd在listensocks_中的下标, 不是监听套接字返回-1
+    int FindListenSock(int fd)
+    {
+        for (size_t i = 0; i < listensocks_.size(); i++)
+        {
+            if (listensocks_[i] && !endpoints_[i].udp_ && listensocks_[i]->GetSockfd() == fd)
+                return i;
+        }
+        return -1;
+    }
+
+private:
+    uint16_t port_;                                // 端口号
+    std::vector<Endpoint> endpoints_;              // 监听地址
+    std::vector<std::unique_ptr<Sock>> listensocks_; // 监听套接字或UDP套接字, 与endpoints_一一对应, 本Reactor不负责的为空
+    AcceptOptions accept_;
+    service_t service_; // 业务逻辑处理函数
+
+    int listenop_;           // 是否携带listensock
+    int rwop_;               // 是否在本reactor读写数据
+    std::queue<std::pair<int, bool>> outfds_; // 存放本reactor接收到的连接fd(以及是否来自shm地址)，一般是本reactor不处理数据IO，等待其它reacor接收的fd
+    std::vector<std::pair<int, uint64_t>> shmconns_; // 本线程的共享内存连接(fd, 连接序号), 忙轮询用
+
+    ThreadPool<ServiceTask<C>> *pool_; // 业务线程池(不归Reactor所有)
+    std::vector<Bulkhead<C>> bulkheads_; // 隔离舱, 线程池同样不归Reactor所有
+
+    async_service_t async_service_; // 协程业务处理函数
+
+    std::unique_ptr<ResponseCache> cache_; // 响应缓存, 为空表示未开启
+    std::unique_ptr<CaptureWriter> capture_; // 流量捕获, 为空表示未开启
+
+    MemoryLimits limits_; // 业务连接的内存预算
+};
+
+template <Codec C>
+void ServiceTask<C>::operator()()
+{
+    Response resp = s_(req_);
+    resp._id = req_._id;
+    resp._hasid = req_._hasid;
+
+    // 回到Reactor线程编码并发送
+    Reactor<C> *r = r_;
+    int fd = fd_;
+    uint64_t seq = seq_, slot = slot_;
+    r->Post([r, fd, seq, slot, resp = std::move(resp)]() mutable
+            { r->CompleteRequest(fd, seq, slot, std::move(resp)); });
+}
+
 // 改良
 // 1.要想从fd读取数据，必须满足两个条件：fd读事件就绪、fd缓冲区至少有一个完整报文。
 // 同理，向fd写数据时，除了要fd写事件就绪，还要求已经有一个处理好的完整的响应报文
@@ -2,85 +2,243 @@
 #include <iostream>
 #include <vector>
 #include <queue>
+#include <atomic>
 #include "log.hpp"
 #include "Thread.hpp"
 #include "Mutex.hpp"
-#include "Cond.hpp"
 #include "reactor.hpp"
 
 static const int reactor_num = 5;
+static const int cache_log_interval = 10000; // 开启响应缓存时, 输出命中统计的间隔(毫秒)
 
 // class IoReactorTask
-class ReactorServer;
-
 struct ThreadData
 {
-    ThreadData(ReactorServer *rs, int index) : rs_(rs), index_(index)
+    ThreadData(EventLoop *loop, int index) : loop_(loop), index_(index)
     {
     }
-    ReactorServer *rs_;
+    EventLoop *loop_;
     int index_;
 };
 
+// C: 所有连接使用的编解码方式(见codec.hpp), 默认根据连接的第一个字节在JSON和二进制之间选择
+template <Codec C = AutoCodec>
 class ReactorServer
 {
 public:
-    ReactorServer(service_t service, uint16_t port = defaultport)
-        : listenReactor_(nullptr), iothreads_(nullptr), port_(port), service_(service)
+    // pool: 外部传入的业务线程池, 用于多个服务共享线程池; 为空时本服务器创建自己的线程池
+    // 外部的线程池由调用方关闭, 而且要在本服务器析构之前关闭(任务完成后会向IO Reactor投递响应)
+    ReactorServer(service_t service, uint16_t port = defaultport, ThreadPool<ServiceTask<C>> *pool = nullptr)
+        : listenReactor_(nullptr), iothreads_(nullptr), iorunning_(false), port_(port), service_(service), pool_(pool),
+          workpool_(nullptr), cachebytes_(0), stop_(false), drain_ms_(default_drain_ms)
     {
-        listenReactor_ = new Reactor(LISTEN_YES, RW_NO, service, port);
+        if (pool_ == nullptr)
+        {
+            pool_ = new ThreadPool<ServiceTask<C>>(service_thread_num, "svc" + std::to_string(port));
+            ownpools_.push_back(pool_);
+        }
+        listenReactor_ = new Reactor<C>(LISTEN_YES, RW_NO, service, port, pool_);
         iothreads_ = new Thread[reactor_num];
-        fds_.resize(sizeof(iothreads_));
-        mcs_.resize(fds_.size());
     }
+    // 协程版本的业务处理, 请求在IO线程的Reactor上处理; 其中不指定线程池的Offload使用本服务器的计算线程池, Stop时一起排空
+    ReactorServer(async_service_t service, uint16_t port = defaultport)
+        : ReactorServer(service_t(nullptr), port)
+    {
+        async_service_ = service;
+        workpool_ = new work_pool_t(offload_thread_num, "offload" + std::to_string(port));
+    }
+
+    // 没有调用Stop时也先让IO线程退出并回收, 再释放它们的Reactor
+    // 线程池先于Reactor释放: 析构时排空任务队列、等正在执行的任务结束, 这些任务完成后还会向IO Reactor投递响应
     ~ReactorServer()
     {
+        StopIo();
+        for (ThreadPool<ServiceTask<C>> *pool : ownpools_)
+            delete pool;
+        if (workpool_)
+            delete workpool_;
         if (listenReactor_)
             delete listenReactor_;
         if (iothreads_)
             delete[] iothreads_;
+        for (Reactor<C> *r : ioreactors_)
+            delete r;
     }
 
     void Init()
     {
+        listenReactor_->SetAcceptOptions(accept_);
+        for (const Endpoint &ep : endpoints_)
+            listenReactor_->AddEndpoint(ep);
         listenReactor_->Init();
+        pool_->start();
+        for (const Bulkhead<C> &b : bulkheads_)
+            b.pool_->start();
+        if (workpool_)
+            workpool_->start();
+        uint64_t capturestart = util::NowNs();
         for (int i = 0; i < reactor_num; i++)
         {
-            iothreads_[i] = Thread(i + 1, ThreadRoutine, new ThreadData(this, i + 1));
+            // 创建每个线程的Reactor, 用于数据IO; 在这里创建是为了主线程可以直接向它投递fd
+            Reactor<C> *ioReactor = new Reactor<C>(LISTEN_NO, RW_YES, service_, port_, pool_);
+            if (async_service_)
+                ioReactor->SetAsyncService(async_service_);
+            ioReactor->SetWorkPool(workpool_);
+            for (const Bulkhead<C> &b : bulkheads_)
+                ioReactor->AddBulkhead(b);
+            if (cachebytes_ > 0)
+                ioReactor->EnableCache(cachebytes_);
+            ioReactor->SetLimits(limits_);
+            if (!capture_.empty())
+            {
+                std::string path = capture_ + "." + std::to_string(i + 1) + ".cap";
+                if (!ioReactor->EnableCapture(path, capturestart))
+                {
+                    LogMessage(FATAL, "open capture file %s failed: %s\n", path.c_str(), strerror(errno));
+                    exit(CAPTURE_OPEN_ERR);
+                }
+                LogMessage(INFO, "capture to %s\n", path.c_str());
+            }
+            ioReactor->SetAcceptOptions(accept_);
+            // UDP没有连接可分配, 每个IO线程绑定自己的套接字, 由内核按对端分流
+            for (const Endpoint &ep : endpoints_)
+            {
+                if (ep.udp_)
+                    ioReactor->AddEndpoint(ep);
+            }
+            ioReactor->Init();
+            ioreactors_.push_back(ioReactor);
+
+            iothreads_[i] = Thread(i + 1, ThreadRoutine, new ThreadData(ioReactor, i + 1));
+        }
+    }
+
+    // 隔离舱: 满足match的请求交给service, 在单独的线程池上处理, 慢业务占满自己的线程时不影响其它请求; 需在Init之前调用
+    // 可以添加多个, 按添加顺序匹配, 都不满足的请求交给构造时的service; 只对线程池版本的业务有效
+    // pool为空时创建threadnum个线程的线程池, 归本服务器所有; 返回所用的线程池, 可以根据负载resize
+    ThreadPool<ServiceTask<C>> *AddBulkhead(route_t match, service_t service, ThreadPool<ServiceTask<C>> *pool = nullptr,
+                                            int threadnum = service_thread_num)
+    {
+        if (pool == nullptr)
+        {
+            pool = new ThreadPool<ServiceTask<C>>(threadnum, "svc" + std::to_string(port_) + "-" + std::to_string(bulkheads_.size() + 1));
+            ownpools_.push_back(pool);
+        }
+        bulkheads_.push_back(Bulkhead<C>{std::move(match), service, pool});
+        return pool;
+    }
+
+    // 开启响应缓存, 每个IO线程的Reactor一份, 互不加锁; capacity: 每份的内存上限(字节)
+    // 只适用于确定性的业务, 需在Init之前调用
+    void EnableCache(size_t capacity)
+    {
+        cachebytes_ = capacity;
+    }
+
+    // 开启流量捕获: 第i个IO线程写base.i.cap(见capture.hpp), 用./replay重放; 需在Init之前调用
+    void EnableCapture(const std::string &base)
+    {
+        capture_ = base;
+    }
+
+    // 业务连接的内存预算(见MemoryLimits), 全局预算由所有IO线程共享; 需在Init之前调用
+    void SetLimits(const MemoryLimits &limits)
+    {
+        limits_ = limits;
+    }
+
+    // 监听套接字的backlog、TCP_DEFER_ACCEPT和新连接的套接字选项(见AcceptOptions); 需在Init之前调用
+    void SetAcceptOptions(const AcceptOptions &opts)
+    {
+        accept_ = opts;
+    }
+
+    // 增加一个监听地址, 如tcp6:8080、unix:@reactor、shm:@reactor、udp:8080(见Endpoint), 可以多次调用; 需在Init之前调用
+    // 不调用时只监听tcp:port; 所有地址共用同一个监听Reactor和同一组IO Reactor, UDP地址由每个IO Reactor各自绑定
+    void AddEndpoint(const Endpoint &ep)
+    {
+        endpoints_.push_back(ep);
+    }
+
+    // 所有IO线程的缓存命中/未命中次数之和
+    void GetCacheStats(uint64_t *hits, uint64_t *misses)
+    {
+        *hits = *misses = 0;
+        for (Reactor<C> *r : ioreactors_)
+        {
+            if (r->GetCache())
+            {
+                *hits += r->GetCache()->Hits();
+                *misses += r->GetCache()->Misses();
+            }
         }
     }
 
+    // 运行服务器, 直到Stop; 返回时已经排空业务线程池、回收了IO线程
     void Start()
     {
         IoThreadStart();
-        int timeout = -1;
-        int index = 1; // 线程号从1开始
-        while (true)
+        int timeout = cachebytes_ > 0 ? cache_log_interval : -1;
+        uint64_t lastlog = util::NowMs();
+        int index = 0;
+        std::vector<std::vector<std::pair<int, bool>>> batches(reactor_num); // (fd, 是否来自shm地址)
+        while (!listenReactor_->Quitting())
         {
             // 1.listenReactor等待accept新连接fd
             listenReactor_->LoopOnce(timeout);
+            if (cachebytes_ > 0 && util::NowMs() - lastlog >= (uint64_t)cache_log_interval)
+            {
+                uint64_t hits, misses;
+                GetCacheStats(&hits, &misses);
+                LogMessage(INFO, "响应缓存 命中: %llu, 未命中: %llu\n", (unsigned long long)hits, (unsigned long long)misses);
+                lastlog = util::NowMs();
+            }
 
             // 2.获取listenReactor的accept得到的fd
             int newfd = 0;
-            while (listenReactor_->GetAcceptedFd(&newfd))
+            bool shm = false;
+            while (listenReactor_->GetAcceptedFd(&newfd, &shm))
             {
-                // 3.将newfd分配给某个线程中
-                // 轮询分配
-                LogMessage(DEBUG, "开始一次分配fd, fd: %d -> 线程: %d\n", newfd, index);
-                {
-                    lockGuard lg(&mcs_[index].first);
-                    fds_[index].push(newfd);
-
-                    // 唤醒等待fd分配的线程
-                    mcs_[index].second.Wakeup();
-                }
-
+                // 3.将newfd分配给某个线程中, 轮询分配
+                LogMessage(DEBUG, "开始一次分配fd, fd: %d -> 线程: %d\n", newfd, index + 1);
+                batches[index].emplace_back(newfd, shm);
                 index = (index + 1) % reactor_num;
             }
+            // 4.一轮accept到的fd按线程打包, 每个线程只Post一次(一次加锁、一次eventfd唤醒), 由它自己注册连接
+            for (int i = 0; i < reactor_num; i++)
+            {
+                if (batches[i].empty())
+                    continue;
+                Reactor<C> *ioReactor = ioreactors_[i];
+                ioReactor->Post([ioReactor, fds = std::move(batches[i])]()
+                                {
+                                    for (auto &fd : fds)
+                                    {
+                                        if (fd.second)
+                                            ioReactor->AddShmConnection(fd.first);
+                                        else
+                                            ioReactor->AddConnection(fd.first, EPOLLIN);
+                                    } });
+                batches[i].clear();
+            }
             // 分配fd结束后, 循环进行, listenReactor的工作就是不停的等待新连接, 有新连接就分配给线程
 
             // Reactor需要在新线程中持续维护, 线程池貌似不行, 因为线程池是处理短期任务为主的
         }
+        Drain();
+    }
+
+    // 优雅关闭, 线程安全(例如在等待SIGTERM的线程中调用), 只有第一次调用有效; Start随后返回:
+    // 1.关闭监听套接字, 不再接收新连接
+    // 2.本服务器创建的线程池(包括协程Offload的计算线程池)在deadline_ms内排空任务, 期间IO线程照常发送响应,
+    //   新到的请求在IO线程就地处理(见Reactor::Submit、OffloadAwaiter)
+    // 3.IO线程先处理完已投递的响应和协程恢复, 再退出事件循环并回收, 之后才能释放它们的Reactor
+    void Stop(int deadline_ms = default_drain_ms)
+    {
+        if (stop_.exchange(true))
+            return;
+        drain_ms_ = deadline_ms;
+        listenReactor_->Quit();
     }
 
     void IoThreadStart()
@@ -89,94 +247,85 @@ public:
         {
             iothreads_[i].run();
         }
+        iorunning_ = true;
     }
 
     static void *ThreadRoutine(void *args)
     {
-        pthread_detach(pthread_self());
         ThreadData *td = static_cast<ThreadData *>(args);
-        // 1.创建属于该线程的Reactor, 用于数据IO
-        Reactor *ioReactor = new Reactor(LISTEN_NO, RW_YES, td->rs_->service_, td->rs_->port_);
-        ioReactor->Init();
-
-        int timeout = 1000;
-        // 这里线程要进行两个等，一等主线程分配fd，二等现有fd事件就绪
-        // 两个等都需要“别人”通知，一等要主线程通知，二等要epoller通知
-        // 如果是阻塞等待，有如下BUG：
-        // 线程已经存在fd，在“一等”的过程中，fd事件就绪，但是主线程一直不分配fd，“一等”迟迟不结束，fd就绪事件也一直无法处理
-
-        // 因此，两个等都不能阻塞等待，而是非阻塞
-        // 每次等待就等一小会，等到了，就进行对应的处理动作，等不到，就超时退出，进行另一个等待
-        while (true)
-        {
-            // 2.等待主线程分配fd
-
-            // 线程没有fd时，就要阻塞等待到有fd分配为止
-            // 线程至少有一个fd时，等一会fd分配就行，等不到就去处理就绪事件了
-            int newfd = 0;
-            int wait_time = timeout / 1000;
-            if (ioReactor->ConnsIsEmpty())
-            {
-                wait_time = -1;
-                LogMessage(DEBUG, "线程: %d, 阻塞等待fd分配中\n", td->index_);
-            }
-
-            newfd = td->rs_->WaitFd(td->index_, wait_time); // 等待单位是秒
-            // 3.拿到了一个fd, 建立新连接
-            if (newfd > 0)
-            {
-                LogMessage(DEBUG, "线程: %d, 获取到一个fd\n", td->index_);
-                ioReactor->AddConnection(newfd, EPOLLIN);
-                LogMessage(DEBUG, "线程: %d, 已注册连接fd: %d\n", td->index_, newfd);
-            }
-
-            // 4.等待现有fd的事件就绪, 并处理就绪事件
-            ioReactor->LoopOnce(timeout); // 等待单位是毫秒
+        EventLoop *ioReactor = td->loop_;
 
-            // detect timeout
-        }
-
-        // 线程刚开始运行（首次循环），一定是没有fd的，必须先等待主线程分配至少一个fd
-        // 线程获取到第一个fd后，就可以等待现有fd的事件就绪, 并处理就绪事件（Looponce）
-        // Looponce有超时时间，时间一到，内部可能处理了就绪事件，也有可能在这段时间内根本没有就绪事件
-        // 因此，Looponce结束之后，不管什么情况，进行一次超时探测，对于长时间没有访问的fd，断开连接
-        // Loop结束后，进行下次等待分配fd
+        // 以前线程要进行两个等: 一等主线程分配fd(条件变量), 二等现有fd事件就绪(epoll)
+        // 两个等只能轮流超时等待, 新连接和就绪事件最多要延迟一个超时时间才被处理
+        // 现在主线程通过Post投递fd, eventfd会唤醒epoll_wait, 线程只需要在epoll上阻塞等待
+        LogMessage(DEBUG, "线程: %d, 开始事件派发\n", td->index_);
+        delete td;
+        ioReactor->Dispatch();
 
         /*超时探测 TODOOOOOOOOOOOOOOOOOO*/
-
-        delete td;
+        return nullptr;
     }
 
-    // wait_time == -1：阻塞等待
-    // wait_time >= 0：非阻塞等待
-    int WaitFd(int index, int wait_time)
+    // 业务线程池, 可根据负载调用GetPool()->resize()
+    ThreadPool<ServiceTask<C>> *GetPool()
     {
+        return pool_;
+    }
 
-        // 对于fds_[index]的访问, 必须是主线程push之后, 其它线程再来pop
-        // 而这样子加锁, 可能导致顺序不一致, 主线程即使有了新fd, 也因为无法竞争锁而无法pop新fd入容器中
-
-        lockGuard lg(&mcs_[index].first);
-        while (fds_[index].empty())
+private:
+    // Start的事件循环结束后执行Stop的关闭步骤, 所有线程池共用一个期限
+    void Drain()
+    {
+        listenReactor_->CloseListen();
+        uint64_t deadline = util::NowMs() + drain_ms_;
+        for (ThreadPool<ServiceTask<C>> *pool : ownpools_)
         {
-            // LogMessage(DEBUG, "线程: %d, 正在等待fd分配\n", index);
-            if (mcs_[index].second.Wait(mcs_[index].first, wait_time)) // 条件等待, 等待主线程分配fd
-                continue;
-            else
-                return defaultfd;
+            uint64_t now = util::NowMs();
+            pool->shutdown(now < deadline ? (int)(deadline - now) : 0);
         }
-
-        int fd = fds_[index].front();
-        fds_[index].pop();
-        return fd;
+        // 算完的Offload把协程投递回IO线程, 由StopIo排在Quit之前恢复并发送响应
+        if (workpool_)
+        {
+            uint64_t now = util::NowMs();
+            workpool_->shutdown(now < deadline ? (int)(deadline - now) : 0);
+        }
+        StopIo();
+        LogMessage(INFO, "服务器已停止\n");
     }
 
-private:
-    Reactor *listenReactor_;
-    Thread *iothreads_; // 每个线程维护一个Reactor, 用于数据IO
+    // 让IO线程退出事件循环并回收; Quit也通过Post投递, 排在线程池已投递的响应和协程恢复之后执行
+    void StopIo()
+    {
+        if (!iorunning_)
+            return;
+        for (Reactor<C> *r : ioreactors_)
+            r->Post([r]()
+                    { r->Quit(); });
+        for (int i = 0; i < reactor_num; i++)
+            iothreads_[i].join();
+        iorunning_ = false;
+    }
 
-    std::vector<std::queue<int>> fds_; // fds_[i]: 为第i号线程分配fd的队列 （加锁？同步变量？保证主线程和工作线程之间的线程安全和同步）
-    std::vector<std::pair<Mutex, Cond>> mcs_;
+    Reactor<C> *listenReactor_;
+    Thread *iothreads_;                    // 每个线程维护一个Reactor, 用于数据IO
+    std::vector<Reactor<C> *> ioreactors_; // ioreactors_[i]: 第i+1号线程的Reactor
+    bool iorunning_;                       // IO线程已经启动, 还没有回收
 
     uint16_t port_;
     service_t service_;
+    async_service_t async_service_;
+
+    ThreadPool<ServiceTask<C>> *pool_;
+    std::vector<Bulkhead<C>> bulkheads_;
+    std::vector<ThreadPool<ServiceTask<C>> *> ownpools_; // 本服务器创建的线程池(默认的和隔离舱的)
+    work_pool_t *workpool_;                              // 协程版本的Offload计算线程池, 线程池版本为空
+
+    size_t cachebytes_; // 每个IO线程的响应缓存上限, 0表示不开启
+    std::string capture_; // 流量捕获文件名前缀, 为空表示不开启
+    MemoryLimits limits_;
+    AcceptOptions accept_;
+    std::vector<Endpoint> endpoints_;
+
+    std::atomic<bool> stop_; // 已经调用过Stop
+    std::atomic<int> drain_ms_;
 };
\ No newline at end of file
@@ -0,0 +1,509 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <unordered_map>
+#include <type_traits>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include "mysocket.hpp"
+#include "epoller.hpp"
+#include "codec.hpp"
+#include "capture.hpp"
+#include "histogram.hpp"
+#include "util.hpp"
+#include "err.hpp"
+
+// 流量重放: 读入reactor_server capture=BASE写下的捕获文件(见capture.hpp), 对服务器重放
+// 捕获到的每个连接对应一个重放连接, 原样发送捕获到的请求报文, 发送时刻保持原来的到达间隔, speed=X时间隔除以X
+// 开环: 到点就发, 不等前面的响应; 延迟从安排的发送时刻算起, 服务器卡顿造成的排队也算进延迟
+// 带编号的请求按编号对应响应, 其余请求按顺序对应
+// 结束后把重放测得的延迟分布与捕获时服务器记录的延迟分布(请求读入 -> 响应编码)逐个分位数对比
+// 捕获的延迟不含网络和客户端的时间, 两者的差包括了这部分开销
+// ./replay [ENDPOINT] [host=IP] [threads=M] [speed=X] [drain=S] FILE...
+// ENDPOINT默认tcp:8080, host默认127.0.0.1(tcp6时为::1); drain: 发完后最多再等多少秒的响应
+// 例如: ./reactor_server capture=/tmp/cap  ->  ./replay speed=2 /tmp/cap.*.cap
+
+void Usage()
+{
+    std::cout << "Usage: ./replay [ENDPOINT] [host=IP] [threads=M] [speed=X] [drain=S] FILE..." << std::endl;
+}
+
+static const size_t replay_readsize = 65536; // 每次recv的大小
+static const int replay_events = 256;
+
+struct ReplayOptions
+{
+    Endpoint ep_ = Endpoint(AF_INET, 8080);
+    std::string host_;
+    int threads_ = 4;
+    double speed_ = 1;
+    int drain_ = 5;
+    std::vector<std::string> files_;
+};
+
+// 一个要重放的请求, frame_指向捕获文件的内容
+struct ReplayRequest
+{
+    uint64_t due_; // 相对重放起点的发送时刻(纳秒), 已经除以speed
+    std::string_view frame_;
+    uint32_t key_;
+    bool tagged_;
+};
+
+// 捕获到的一个连接上的请求, 按到达顺序
+struct ReplayStream
+{
+    std::vector<ReplayRequest> reqs_;
+};
+
+struct ReplayResult
+{
+    LatencyHistogram hist_;
+    uint64_t sent_ = 0;
+    uint64_t lost_ = 0;       // 没有收到响应的请求(连接断开, 或drain时间内没有回来)
+    uint64_t unexpected_ = 0; // 对不上任何请求的响应
+    uint64_t failures_ = 0;   // 连接失败或断开的连接数
+};
+
+template <Codec C>
+struct ReplayConn
+{
+    Sock sock_;
+    C codec_;
+    std::string inbuffer_;
+    std::string outbuffer_;
+    std::deque<uint64_t> ordered_;                               // 有序请求的计时起点, 响应按顺序返回
+    std::unordered_map<uint32_t, std::deque<uint64_t>> tagged_; // 请求编号 -> 计时起点
+    size_t inflight_ = 0;
+    bool wantout_ = false;
+    bool dead_ = false;
+};
+
+template <Codec C>
+class ReplayWorker
+{
+public:
+    ReplayWorker(const ReplayOptions &opts, std::vector<const ReplayStream *> streams)
+        : opts_(opts), streams_(std::move(streams)), conns_(streams_.size())
+    {
+        for (size_t i = 0; i < streams_.size(); i++)
+        {
+            for (const ReplayRequest &req : streams_[i]->reqs_)
+                sched_.emplace_back(req.due_, i);
+        }
+        // 同一时刻的请求保持原来的顺序, 同一连接上的请求不会颠倒
+        std::stable_sort(sched_.begin(), sched_.end(), [](const std::pair<uint64_t, int> &a, const std::pair<uint64_t, int> &b)
+                         { return a.first < b.first; });
+        next_.assign(streams_.size(), 0);
+    }
+
+    ~ReplayWorker()
+    {
+        if (timerfd_ >= 0)
+            close(timerfd_);
+    }
+
+    // 在重放开始之前建立所有连接, 连接的时间不算进重放
+    void Open(ReplayResult *result)
+    {
+        result_ = result;
+        epoller_.Create();
+        timerfd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        epoller_.Register(timerfd_, EPOLLIN);
+        for (size_t i = 0; i < conns_.size(); i++)
+            Open(i);
+    }
+
+    // start: 重放起点, 单调时钟
+    void Run(uint64_t start)
+    {
+        start_ = start;
+        uint64_t drain = (uint64_t)opts_.drain_ * 1000000000;
+        uint64_t last = sched_.empty() ? 0 : sched_.back().first;
+        Events events;
+        while (true)
+        {
+            SendDue();
+            uint64_t now = util::NowNs();
+            if (pos_ == sched_.size() && (inflight_ == 0 || now >= start_ + last + drain))
+                break;
+            int n = epoller_.Wait(events, replay_events, 10);
+            for (int i = 0; i < n; i++)
+            {
+                if (events.GetFd(i) == timerfd_)
+                {
+                    uint64_t expirations;
+                    ssize_t r = read(timerfd_, &expirations, sizeof(expirations));
+                    (void)r;
+                    continue;
+                }
+                ReplayConn<C> &conn = conns_[fdindex_[events.GetFd(i)]];
+                uint32_t ev = events.GetEvent(i);
+                if (ev & EPOLLOUT)
+                    Flush(conn);
+                if (ev & EPOLLIN)
+                    OnRead(conn);
+                if ((ev & (EPOLLERR | EPOLLHUP)) && !conn.dead_)
+                    Fail(conn);
+            }
+        }
+        result_->lost_ += inflight_;
+    }
+
+private:
+    void Open(int i)
+    {
+        ReplayConn<C> &conn = conns_[i];
+        conn.sock_.Socket(opts_.ep_.family_);
+        if (conn.sock_.Connect(opts_.ep_, opts_.host_) < 0)
+        {
+            conn.dead_ = true;
+            result_->failures_++;
+            return;
+        }
+        int fd = conn.sock_.GetSockfd();
+        util::SetNonBlock(fd);
+        if (opts_.ep_.family_ != AF_UNIX)
+            util::SetNoDelay(fd);
+        if ((size_t)fd >= fdindex_.size())
+            fdindex_.resize(fd + 1);
+        fdindex_[fd] = i;
+        epoller_.Register(fd, EPOLLIN);
+        // 自动选择协议的服务器按连接的第一个字节选Codec, 客户端用第一个请求选出同样的Codec来解析响应
+        if constexpr (std::is_same_v<C, AutoCodec>)
+        {
+            std::string first(streams_[i]->reqs_.front().frame_);
+            std::string_view frame;
+            conn.codec_.Next(first, &frame);
+            conn.codec_.Consume(first);
+        }
+    }
+
+    // 发出所有已经到期的请求, 每个连接攒好一次发出; 定时器定在下一个请求的时刻
+    void SendDue()
+    {
+        uint64_t now = util::NowNs();
+        dirty_.clear();
+        while (pos_ < sched_.size() && start_ + sched_[pos_].first <= now)
+        {
+            int i = sched_[pos_].second;
+            const ReplayRequest &req = streams_[i]->reqs_[next_[i]++];
+            uint64_t due = start_ + req.due_;
+            pos_++;
+            ReplayConn<C> &conn = conns_[i];
+            if (conn.dead_)
+            {
+                result_->lost_++;
+                continue;
+            }
+            if (conn.outbuffer_.empty())
+                dirty_.push_back(i);
+            conn.outbuffer_ += req.frame_;
+            if (req.tagged_)
+                conn.tagged_[req.key_].push_back(due);
+            else
+                conn.ordered_.push_back(due);
+            conn.inflight_++;
+            inflight_++;
+            result_->sent_++;
+        }
+        for (int i : dirty_)
+            Flush(conns_[i]);
+        if (pos_ < sched_.size())
+        {
+            uint64_t due = start_ + sched_[pos_].first;
+            struct itimerspec its = {};
+            its.it_value.tv_sec = due / 1000000000;
+            its.it_value.tv_nsec = due % 1000000000;
+            timerfd_settime(timerfd_, TFD_TIMER_ABSTIME, &its, nullptr);
+        }
+    }
+
+    void Flush(ReplayConn<C> &conn)
+    {
+        size_t sent = 0;
+        while (!conn.dead_ && sent < conn.outbuffer_.size())
+        {
+            ssize_t n = send(conn.sock_.GetSockfd(), conn.outbuffer_.data() + sent, conn.outbuffer_.size() - sent, MSG_NOSIGNAL);
+            if (n > 0)
+                sent += n;
+            else if (n < 0 && errno == EINTR)
+                continue;
+            else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            else
+                Fail(conn);
+        }
+        if (conn.dead_)
+            return;
+        conn.outbuffer_.erase(0, sent);
+        bool wantout = !conn.outbuffer_.empty();
+        if (wantout != conn.wantout_)
+        {
+            conn.wantout_ = wantout;
+            epoller_.Modify(conn.sock_.GetSockfd(), EPOLLIN | (wantout ? (uint32_t)EPOLLOUT : 0u));
+        }
+    }
+
+    void OnRead(ReplayConn<C> &conn)
+    {
+        while (!conn.dead_)
+        {
+            char buffer[replay_readsize];
+            ssize_t n = recv(conn.sock_.GetSockfd(), buffer, sizeof(buffer), 0);
+            if (n <= 0)
+            {
+                if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                    Fail(conn);
+                return;
+            }
+            conn.inbuffer_.append(buffer, n);
+            std::string_view frame;
+            int ret;
+            uint64_t now = util::NowNs();
+            while ((ret = conn.codec_.Next(conn.inbuffer_, &frame)) > 0)
+            {
+                Response resp;
+                if (!conn.codec_.Decode(frame, &resp))
+                {
+                    Fail(conn);
+                    return;
+                }
+                Match(conn, resp, now);
+            }
+            conn.codec_.Consume(conn.inbuffer_);
+            if (ret < 0)
+            {
+                Fail(conn);
+                return;
+            }
+            if ((size_t)n < sizeof(buffer))
+                return;
+        }
+    }
+
+    void Match(ReplayConn<C> &conn, const Response &resp, uint64_t now)
+    {
+        std::deque<uint64_t> *q = &conn.ordered_;
+        auto it = conn.tagged_.end();
+        if (resp._hasid)
+        {
+            it = conn.tagged_.find(resp._id);
+            q = it == conn.tagged_.end() ? nullptr : &it->second;
+        }
+        if (q == nullptr || q->empty())
+        {
+            result_->unexpected_++;
+            return;
+        }
+        result_->hist_.Record(now > q->front() ? now - q->front() : 0);
+        q->pop_front();
+        if (it != conn.tagged_.end() && q->empty())
+            conn.tagged_.erase(it);
+        conn.inflight_--;
+        inflight_--;
+    }
+
+    // 连接断开: 还没收到的响应算作丢失; 服务器按HTTP的Connection: close关闭且没有未完成的请求时不算失败
+    void Fail(ReplayConn<C> &conn)
+    {
+        if (conn.dead_)
+            return;
+        if (conn.inflight_ > 0)
+        {
+            LogMessage(WARNING, "connection lost, %zu requests in flight\n", conn.inflight_);
+            result_->failures_++;
+        }
+        result_->lost_ += conn.inflight_;
+        inflight_ -= conn.inflight_;
+        conn.inflight_ = 0;
+        conn.dead_ = true;
+        epoller_.Remove(conn.sock_.GetSockfd());
+        conn.sock_.Close();
+    }
+
+private:
+    const ReplayOptions &opts_;
+    std::vector<const ReplayStream *> streams_;
+    std::vector<ReplayConn<C>> conns_;
+    std::vector<std::pair<uint64_t, int>> sched_; // (发送时刻, 连接下标), 按时刻排序
+    std::vector<size_t> next_;                     // 每个连接下一个要发的请求
+    size_t pos_ = 0;                               // sched_中下一个要发的请求
+    size_t inflight_ = 0;
+    std::vector<int> fdindex_; // fd -> conns_下标
+    std::vector<int> dirty_;   // 本轮有新请求要发的连接
+    Epoller epoller_;
+    int timerfd_ = -1;
+    uint64_t start_ = 0;
+    ReplayResult *result_ = nullptr;
+};
+
+void PrintRow(const char *name, double p50, double p90, double p99, double p999, double max, double mean)
+{
+    printf("%-18s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, p50, p90, p99, p999, max, mean);
+}
+
+void PrintHist(const char *name, const LatencyHistogram &h)
+{
+    PrintRow(name, h.Percentile(0.5) / 1e3, h.Percentile(0.9) / 1e3, h.Percentile(0.99) / 1e3, h.Percentile(0.999) / 1e3,
+             h.Max() / 1e3, h.Mean() / 1e3);
+}
+
+template <Codec C>
+int Run(const ReplayOptions &opts, const std::vector<CaptureFile> &files)
+{
+    // 捕获的延迟分布, 以及每个捕获连接上的请求; 时刻换算成相对第一个请求, 再除以speed
+    LatencyHistogram original;
+    uint64_t unanswered = 0, first = UINT64_MAX, last = 0, total = 0;
+    for (const CaptureFile &file : files)
+    {
+        unanswered += CaptureLatencies(file, &original);
+        for (const CaptureEvent &ev : file.events_)
+        {
+            if (ev.rec_.type_ != CAPTURE_REQUEST)
+                continue;
+            first = std::min(first, ev.rec_.ns_);
+            last = std::max(last, ev.rec_.ns_);
+        }
+    }
+    std::vector<std::unique_ptr<ReplayStream>> streams;
+    for (const CaptureFile &file : files)
+    {
+        std::unordered_map<uint32_t, ReplayStream *> byconn;
+        for (const CaptureEvent &ev : file.events_)
+        {
+            if (ev.rec_.type_ != CAPTURE_REQUEST)
+                continue;
+            ReplayStream *&s = byconn[ev.rec_.conn_];
+            if (s == nullptr)
+            {
+                streams.emplace_back(new ReplayStream);
+                s = streams.back().get();
+            }
+            s->reqs_.push_back({(uint64_t)((ev.rec_.ns_ - first) / opts.speed_), ev.frame_, ev.rec_.key_, ev.rec_.tagged_ != 0});
+            total++;
+        }
+    }
+    if (total == 0)
+    {
+        printf("no requests captured\n");
+        return INPUT_ERR;
+    }
+
+    int threads = std::min<int>(opts.threads_, streams.size());
+    std::vector<std::vector<const ReplayStream *>> parts(threads);
+    for (size_t i = 0; i < streams.size(); i++)
+        parts[i % threads].push_back(streams[i].get());
+    std::vector<std::unique_ptr<ReplayWorker<C>>> workers;
+    std::vector<ReplayResult> results(threads);
+    for (int t = 0; t < threads; t++)
+    {
+        workers.emplace_back(new ReplayWorker<C>(opts, parts[t]));
+        workers.back()->Open(&results[t]);
+    }
+    std::vector<std::thread> ths;
+    uint64_t start = util::NowNs();
+    for (int t = 0; t < threads; t++)
+        ths.emplace_back([&workers, t, start]()
+                         { workers[t]->Run(start); });
+    for (std::thread &th : ths)
+        th.join();
+    double secs = (util::NowNs() - start) / 1e9;
+
+    ReplayResult sum;
+    for (const ReplayResult &r : results)
+    {
+        sum.hist_.Merge(r.hist_);
+        sum.sent_ += r.sent_;
+        sum.lost_ += r.lost_;
+        sum.unexpected_ += r.unexpected_;
+        sum.failures_ += r.failures_;
+    }
+    double span = (last - first) / 1e9;
+    printf("%zu files (%s), %zu conns, %llu requests over %.2fs captured, %llu without response\n", files.size(), C::name,
+           streams.size(), (unsigned long long)total, span, (unsigned long long)unanswered);
+    printf("replay to %s at %.2fx: %.2fs, sent %llu, responses %llu, lost %llu, unexpected %llu, failed conns %llu\n",
+           opts.ep_.ToString().c_str(), opts.speed_, secs, (unsigned long long)sum.sent_, (unsigned long long)sum.hist_.Count(),
+           (unsigned long long)sum.lost_, (unsigned long long)sum.unexpected_, (unsigned long long)sum.failures_);
+    printf("%-18s %10s %10s %10s %10s %10s %10s\n", "latency us", "p50", "p90", "p99", "p99.9", "max", "mean");
+    PrintHist("captured (server)", original);
+    PrintHist("replay (client)", sum.hist_);
+    const LatencyHistogram &o = original, &r = sum.hist_;
+    PrintRow("difference", (r.Percentile(0.5) - (double)o.Percentile(0.5)) / 1e3, (r.Percentile(0.9) - (double)o.Percentile(0.9)) / 1e3,
+             (r.Percentile(0.99) - (double)o.Percentile(0.99)) / 1e3, (r.Percentile(0.999) - (double)o.Percentile(0.999)) / 1e3,
+             (r.Max() - (double)o.Max()) / 1e3, (r.Mean() - o.Mean()) / 1e3);
+    return sum.failures_ == streams.size() ? CONNECT_ERR : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    ReplayOptions opts;
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        if (strncmp(arg, "host=", 5) == 0)
+            opts.host_ = arg + 5;
+        else if (strncmp(arg, "threads=", 8) == 0)
+            opts.threads_ = atoi(arg + 8);
+        else if (strncmp(arg, "speed=", 6) == 0)
+            opts.speed_ = atof(arg + 6);
+        else if (strncmp(arg, "drain=", 6) == 0)
+            opts.drain_ = atoi(arg + 6);
+        else if (strchr(arg, ':') != nullptr)
+        {
+            if (!Endpoint::Parse(arg, &opts.ep_) || opts.ep_.shm_ || opts.ep_.udp_)
+            {
+                Usage();
+                exit(USAGE_ERR);
+            }
+        }
+        else
+            opts.files_.push_back(arg);
+    }
+    if (opts.host_.empty())
+        opts.host_ = opts.ep_.family_ == AF_INET6 ? "::1" : "127.0.0.1";
+    if (opts.files_.empty() || opts.threads_ <= 0 || opts.speed_ <= 0 || opts.drain_ < 0)
+    {
+        Usage();
+        exit(USAGE_ERR);
+    }
+    SetLogLevel(INFO); // Sock的建立/连接日志是DEBUG级别, 连接数多时不输出
+
+    std::vector<CaptureFile> files(opts.files_.size());
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (!ReadCapture(opts.files_[i], &files[i]))
+        {
+            LogMessage(FATAL, "read capture %s failed: %s\n", opts.files_[i].c_str(), strerror(errno));
+            return READ_ERR;
+        }
+        if (files[i].truncated_)
+            LogMessage(WARNING, "capture %s ends with a partial record\n", opts.files_[i].c_str());
+        if (strcmp(files[i].header_.codec_, files[0].header_.codec_) != 0)
+        {
+            LogMessage(FATAL, "capture %s uses codec %s, %s uses %s\n", opts.files_[i].c_str(), files[i].header_.codec_,
+                       opts.files_[0].c_str(), files[0].header_.codec_);
+            return INPUT_ERR;
+        }
+    }
+
+    const char *codec = files[0].header_.codec_;
+    if (strcmp(codec, AutoCodec::name) == 0)
+        return Run<AutoCodec>(opts, files);
+    if (strcmp(codec, BinaryCodec::name) == 0)
+        return Run<BinaryCodec>(opts, files);
+    if (strcmp(codec, JsonCodec::name) == 0)
+        return Run<JsonCodec>(opts, files);
+    if (strcmp(codec, LineCodec::name) == 0)
+        return Run<LineCodec>(opts, files);
+    if (strcmp(codec, HttpCodec::name) == 0)
+        return Run<HttpCodec>(opts, files);
+    LogMessage(FATAL, "unknown codec %s\n", codec);
+    return INPUT_ERR;
+}
@@ -0,0 +1,174 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <atomic>
+#include <cstdint>
+
+// 响应缓存: 请求报文的有效载荷 -> 已经编码好的响应报文
+// 只适用于确定性的业务(相同请求总是得到相同响应), 例如calculator, 需要显式开启
+// 每个Reactor一个, 只在Reactor线程上访问, 不加锁; 统计计数可以被其它线程读取
+// 淘汰策略CLOCK: 命中时只设置引用位, 需要空间时时钟指针扫过环形数组,
+// 引用位为1的清零跳过(第二次机会), 为0的淘汰; 比LRU少了每次命中时的链表移动
+
+static const size_t cache_entry_overhead = 64; // 每个条目在键和值之外的估计开销(哈希节点、环形数组槽)
+
+class ResponseCache
+{
+public:
+    // capacity: 内存上限(字节), 按 键长 + 值长 + cache_entry_overhead 计算
+    // 单个条目超过capacity/16时不缓存, 避免一个大的批量请求冲掉整个缓存
+    explicit ResponseCache(size_t capacity)
+        : capacity_(capacity), bytes_(0), hand_(0), hits_(0), misses_(0), evictions_(0)
+    {
+    }
+
+    // kind: 报文类型, 与有效载荷一起作为键, 区分同一Reactor上不同协议/类型的报文
+    // 命中返回已编码的响应报文, 在下一次Put之前有效; 未命中返回nullptr
+    const std::string *Get(uint8_t kind, std::string_view payload)
+    {
+        auto it = index_.find(KeyRef{kind, payload});
+        if (it == index_.end())
+        {
+            Count(misses_);
+            return nullptr;
+        }
+        Count(hits_);
+        ring_[it->second.slot_].ref_ = true;
+        return &it->second.frame_;
+    }
+
+    // 键是否值得缓存(不会因为太大被Put拒绝)
+    bool Cacheable(size_t payloadlen, size_t framelen = 0) const
+    {
+        return 1 + payloadlen + framelen + cache_entry_overhead <= capacity_ / 16;
+    }
+
+    void Put(uint8_t kind, std::string_view payload, std::string_view frame)
+    {
+        if (!Cacheable(payload.size(), frame.size()))
+            return;
+        auto it = index_.find(KeyRef{kind, payload});
+        if (it != index_.end())
+        {
+            bytes_ -= it->second.frame_.size();
+            it->second.frame_.assign(frame);
+            bytes_ += frame.size();
+            ring_[it->second.slot_].ref_ = true;
+            return;
+        }
+
+        size_t need = 1 + payload.size() + frame.size() + cache_entry_overhead;
+        while (bytes_ + need > capacity_ && !index_.empty())
+            Evict();
+
+        std::string key;
+        key.reserve(1 + payload.size());
+        key.push_back((char)kind);
+        key.append(payload);
+        size_t slot;
+        if (!free_.empty())
+        {
+            slot = free_.back();
+            free_.pop_back();
+        }
+        else
+        {
+            slot = ring_.size();
+            ring_.emplace_back();
+        }
+        auto res = index_.emplace(std::move(key), Value{std::string(frame), slot});
+        ring_[slot].node_ = &*res.first;
+        ring_[slot].ref_ = false;
+        bytes_ += need;
+    }
+
+    uint64_t Hits() const { return hits_.load(std::memory_order_relaxed); }
+    uint64_t Misses() const { return misses_.load(std::memory_order_relaxed); }
+    uint64_t Evictions() const { return evictions_.load(std::memory_order_relaxed); }
+    size_t Size() const { return index_.size(); }
+    size_t Bytes() const { return bytes_; }
+
+private:
+    // 查找时不拼接字符串: 用(kind, payload)直接与存储的键(kind字节 + payload)比较
+    struct KeyRef
+    {
+        uint8_t kind_;
+        std::string_view payload_;
+    };
+    struct KeyHash
+    {
+        using is_transparent = void;
+        size_t operator()(KeyRef k) const
+        {
+            return std::hash<std::string_view>()(k.payload_) ^ ((size_t)k.kind_ * 0x9E3779B97F4A7C15ull);
+        }
+        size_t operator()(const std::string &k) const
+        {
+            return (*this)(KeyRef{(uint8_t)k[0], std::string_view(k).substr(1)});
+        }
+    };
+    struct KeyEqual
+    {
+        using is_transparent = void;
+        bool operator()(const std::string &a, const std::string &b) const { return a == b; }
+        bool operator()(KeyRef a, const std::string &b) const
+        {
+            return (uint8_t)b[0] == a.kind_ && std::string_view(b).substr(1) == a.payload_;
+        }
+        bool operator()(const std::string &a, KeyRef b) const { return (*this)(b, a); }
+    };
+    struct Value
+    {
+        std::string frame_;
+        size_t slot_; // 在环形数组中的位置
+    };
+    using index_t = std::unordered_map<std::string, Value, KeyHash, KeyEqual>;
+    struct Slot
+    {
+        index_t::value_type *node_ = nullptr; // 哈希表节点, rehash不会移动节点; 空槽为nullptr
+        bool ref_ = false;
+    };
+
+    // 单写者, 不需要原子的读-改-写, 只保证其它线程读到完整的值
+    static void Count(std::atomic<uint64_t> &c)
+    {
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // 时钟指针前进, 淘汰第一个引用位为0的条目
+    void Evict()
+    {
+        while (true)
+        {
+            if (hand_ >= ring_.size())
+                hand_ = 0;
+            Slot &s = ring_[hand_++];
+            if (s.node_ == nullptr)
+                continue;
+            if (s.ref_)
+            {
+                s.ref_ = false;
+                continue;
+            }
+            bytes_ -= s.node_->first.size() + s.node_->second.frame_.size() + cache_entry_overhead;
+            free_.push_back(s.node_->second.slot_);
+            index_.erase(index_.find(s.node_->first)); // 按迭代器删除, 键引用的是节点自己的内存
+            s.node_ = nullptr;
+            Count(evictions_);
+            return;
+        }
+    }
+
+    size_t capacity_;
+    size_t bytes_; // 已用内存(估计)
+    index_t index_;
+    std::vector<Slot> ring_;   // CLOCK的环形数组
+    std::vector<size_t> free_; // ring_中的空槽
+    size_t hand_;              // 时钟指针
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+    std::atomic<uint64_t> evictions_;
+};
@@ -0,0 +1,454 @@
+#pragma once
+
+#include <atomic>
+#include <new>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "util.hpp"
+
+// 共享内存传输: 同一主机上的客户端不经过套接字收发数据
+// 每个客户端一块memfd共享内存, 里面是两个单生产者单消费者的字节环形队列: 请求(客户端 -> 服务器)和响应(服务器 -> 客户端)
+// 环形队列里是和套接字上一样的字节流, 报文的切分仍由Codec完成
+// 握手: 客户端连接服务器的unix套接字(shm:PATH), 服务器建好共享内存, 连同客户端的门铃eventfd用SCM_RIGHTS发过去
+// 门铃: 只有对端准备阻塞等待时才敲, 对端在忙轮询时收发都不做系统调用
+//   服务器 -> 客户端: eventfd; 客户端 -> 服务器: 往握手的unix套接字写1个字节(它本来就在服务器的epoll里), 套接字关闭表示对端退出
+
+static const size_t shm_ring_size = 1 << 20; // 每个方向的环形队列大小, 必须是2的幂
+static const uint64_t shm_spin_us = 50;      // 没有数据时先忙轮询多久, 再登记阻塞等待(见ShmSpinUs)
+static const char shm_magic[8] = {'S', 'H', 'M', 'R', 'I', 'N', 'G', '1'};
+
+// 实际的忙轮询时长: 只有一个可用CPU时, 轮询只会和对端抢CPU, 对端反而要等到时间片用完; 这时不轮询, 直接登记等待
+inline uint64_t ShmSpinUs()
+{
+    static const uint64_t us = []()
+    {
+        cpu_set_t set;
+        return sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 1 ? shm_spin_us : 0;
+    }();
+    return us;
+}
+
+// 环形队列的控制信息, 在共享内存中; 生产者和消费者各写各的缓存行
+struct ShmRingHeader
+{
+    alignas(64) std::atomic<uint64_t> head_;      // 生产者已写入的总字节数
+    alignas(64) std::atomic<uint64_t> tail_;      // 消费者已读出的总字节数
+    alignas(64) std::atomic<uint32_t> sleeping_;  // 消费者准备阻塞等待, 生产者写入后要敲门铃
+    alignas(64) std::atomic<uint32_t> wantspace_; // 生产者写满了在等空间, 消费者读出后要敲门铃
+};
+
+struct ShmRegionHeader
+{
+    char magic_[8];
+    uint64_t ringsize_;
+    char reserved_[48];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared memory ring needs lock-free atomics");
+
+// 进程内对一个环形队列的视图, 只被一个生产者或一个消费者使用
+// 生产者/消费者各自缓存对方的位置, 只在看起来满/空时才去读对方的缓存行
+// 写入/读出后*bell为true表示对端在等, 调用者负责敲门铃
+class ShmRing
+{
+public:
+    ShmRing() : hdr_(nullptr), data_(nullptr), mask_(0), peer_(0) {}
+
+    void Attach(ShmRingHeader *hdr, char *data, size_t size)
+    {
+        hdr_ = hdr;
+        data_ = data;
+        mask_ = size - 1;
+        peer_ = 0;
+    }
+
+    // 生产者: 写入尽可能多的字节, 返回写入的字节数
+    size_t Write(const char *buf, size_t len, bool *bell)
+    {
+        uint64_t head = hdr_->head_.load(std::memory_order_relaxed);
+        if (Capacity() - (head - peer_) < len)
+            peer_ = hdr_->tail_.load(std::memory_order_acquire);
+        size_t n = std::min(len, Capacity() - (size_t)(head - peer_));
+        if (n == 0)
+            return 0;
+        Copy(data_, head, buf, n);
+        hdr_->head_.store(head + n, std::memory_order_release);
+        // 与消费者登记sleeping_之后检查head_配对(见WaitData): 两边至少有一边看到对方
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        *bell = hdr_->sleeping_.load(std::memory_order_relaxed) && hdr_->sleeping_.exchange(0);
+        return n;
+    }
+
+    // 消费者: 读出最多len个字节, 返回读出的字节数
+    size_t Read(char *buf, size_t len, bool *bell)
+    {
+        uint64_t tail = hdr_->tail_.load(std::memory_order_relaxed);
+        if (peer_ - tail < len)
+            peer_ = hdr_->head_.load(std::memory_order_acquire);
+        size_t n = std::min(len, (size_t)(peer_ - tail));
+        if (n == 0)
+            return 0;
+        size_t off = tail & mask_;
+        size_t first = std::min(n, Capacity() - off);
+        memcpy(buf, data_ + off, first);
+        memcpy(buf + first, data_, n - first);
+        hdr_->tail_.store(tail + n, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        *bell = hdr_->wantspace_.load(std::memory_order_relaxed) && hdr_->wantspace_.exchange(0);
+        return n;
+    }
+
+    // 消费者: 有没有可读的数据
+    bool Readable()
+    {
+        uint64_t tail = hdr_->tail_.load(std::memory_order_relaxed);
+        if (peer_ != tail)
+            return true;
+        peer_ = hdr_->head_.load(std::memory_order_acquire);
+        return peer_ != tail;
+    }
+
+    // 生产者: 有没有空间
+    bool Writable()
+    {
+        uint64_t head = hdr_->head_.load(std::memory_order_relaxed);
+        if (head - peer_ < Capacity())
+            return true;
+        peer_ = hdr_->tail_.load(std::memory_order_acquire);
+        return head - peer_ < Capacity();
+    }
+
+    // 消费者阻塞等待之前调用: 登记sleeping_, 返回true表示这时已经有数据, 不要阻塞
+    bool WaitData()
+    {
+        hdr_->sleeping_.store(1, std::memory_order_seq_cst);
+        if (!Readable())
+            return false;
+        hdr_->sleeping_.store(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    // 消费者醒来后调用, 不再需要生产者敲门铃
+    void Awake()
+    {
+        if (hdr_->sleeping_.load(std::memory_order_relaxed))
+            hdr_->sleeping_.store(0, std::memory_order_relaxed);
+    }
+
+    // 生产者写满后调用: 登记wantspace_, 返回true表示这时已经有空间, 不要阻塞
+    bool WaitSpace()
+    {
+        hdr_->wantspace_.store(1, std::memory_order_seq_cst);
+        if (!Writable())
+            return false;
+        hdr_->wantspace_.store(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    size_t Capacity() const
+    {
+        return mask_ + 1;
+    }
+
+private:
+    void Copy(char *data, uint64_t pos, const char *buf, size_t n)
+    {
+        size_t off = pos & mask_;
+        size_t first = std::min(n, Capacity() - off);
+        memcpy(data + off, buf, first);
+        memcpy(data, buf + first, n - first);
+    }
+
+private:
+    ShmRingHeader *hdr_;
+    char *data_;
+    size_t mask_;
+    uint64_t peer_; // 缓存的对方位置: 生产者缓存tail_, 消费者缓存head_
+};
+
+// 一个客户端的共享内存通道: 服务器一端用Accept建立, 客户端一端用Connect接收
+// sockfd是握手的unix套接字, 不归ShmChannel所有
+class ShmChannel
+{
+public:
+    ShmChannel() : base_(nullptr), size_(0), sockfd_(-1), bellfd_(-1), server_(false) {}
+    ~ShmChannel()
+    {
+        if (base_)
+            munmap(base_, size_);
+        if (bellfd_ >= 0)
+            close(bellfd_);
+    }
+    ShmChannel(const ShmChannel &) = delete;
+    ShmChannel &operator=(const ShmChannel &) = delete;
+
+    // server call
+    // 建立共享内存和客户端的门铃, 从sockfd发给客户端; ringsize必须是2的幂
+    bool Accept(int sockfd, size_t ringsize = shm_ring_size)
+    {
+        if (ringsize == 0 || (ringsize & (ringsize - 1)) != 0)
+            return false;
+        sockfd_ = sockfd;
+        server_ = true;
+        int memfd = memfd_create("reactor-shm", MFD_CLOEXEC);
+        if (memfd < 0)
+            return false;
+        size_t size = RegionSize(ringsize);
+        bool ok = ftruncate(memfd, size) == 0 && Map(memfd, size);
+        if (ok)
+        {
+            ShmRegionHeader *region = (ShmRegionHeader *)base_;
+            memcpy(region->magic_, shm_magic, sizeof(shm_magic));
+            region->ringsize_ = ringsize;
+            for (int i = 0; i < 2; i++)
+                new (RingHeader(i)) ShmRingHeader();
+            Attach(ringsize);
+            bellfd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            ok = bellfd_ >= 0 && SendFds(memfd, bellfd_);
+        }
+        close(memfd); // 映射保持有效, 客户端持有自己的fd
+        return ok;
+    }
+
+    // client call
+    // sockfd是已经连接上服务器shm地址的阻塞unix套接字
+    bool Connect(int sockfd)
+    {
+        sockfd_ = sockfd;
+        server_ = false;
+        int memfd = -1;
+        if (!RecvFds(&memfd, &bellfd_))
+            return false;
+        struct stat st;
+        bool ok = fstat(memfd, &st) == 0 && (size_t)st.st_size > sizeof(ShmRegionHeader) && Map(memfd, st.st_size);
+        close(memfd);
+        if (!ok)
+            return false;
+        ShmRegionHeader *region = (ShmRegionHeader *)base_;
+        uint64_t ringsize = region->ringsize_;
+        if (memcmp(region->magic_, shm_magic, sizeof(shm_magic)) != 0 || ringsize == 0 || (ringsize & (ringsize - 1)) != 0 ||
+            RegionSize(ringsize) != size_)
+            return false;
+        Attach(ringsize);
+        return true;
+    }
+
+    // 本端读的环形队列和写的环形队列
+    ShmRing &In()
+    {
+        return in_;
+    }
+    ShmRing &Out()
+    {
+        return out_;
+    }
+
+    // 非阻塞读写, 语义同非阻塞的recv/send: 没有数据/没有空间时返回-1, errno为EAGAIN
+    ssize_t TryRecv(char *buf, size_t len)
+    {
+        bool bell = false;
+        size_t n = in_.Read(buf, len, &bell);
+        if (bell)
+            Ring();
+        if (n > 0)
+            return n;
+        errno = EAGAIN;
+        return -1;
+    }
+    ssize_t TrySend(const char *buf, size_t len)
+    {
+        bool bell = false;
+        size_t n = out_.Write(buf, len, &bell);
+        if (n == 0 && out_.WaitSpace())
+            n = out_.Write(buf, len, &bell);
+        if (bell)
+            Ring();
+        if (n > 0)
+            return n;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // client call
+    // 阻塞读, 语义同recv: 先忙轮询ShmSpinUs(), 再登记等待并阻塞在门铃上; 服务器退出返回0
+    ssize_t Recv(char *buf, size_t len)
+    {
+        uint64_t start = 0;
+        while (true)
+        {
+            ssize_t n = TryRecv(buf, len);
+            if (n > 0)
+                return n;
+            if (start == 0)
+                start = util::NowUs();
+            if (util::NowUs() - start < ShmSpinUs())
+                continue;
+            if (in_.WaitData())
+                continue;
+            if (!Sleep())
+            {
+                n = TryRecv(buf, len); // 服务器退出前写入的数据照常读出
+                return n > 0 ? n : 0;
+            }
+            in_.Awake();
+        }
+    }
+
+    // client call
+    // 阻塞写完, 语义同send; 服务器退出返回-1, errno为EPIPE
+    ssize_t Send(const char *buf, size_t len)
+    {
+        size_t sent = 0;
+        while (sent < len)
+        {
+            ssize_t n = TrySend(buf + sent, len - sent);
+            if (n > 0)
+            {
+                sent += n;
+                continue;
+            }
+            if (!Sleep())
+            {
+                errno = EPIPE;
+                return -1;
+            }
+        }
+        return sent;
+    }
+
+    // 敲对端的门铃
+    void Ring()
+    {
+        if (server_)
+        {
+            uint64_t one = 1;
+            ssize_t n = write(bellfd_, &one, sizeof(one));
+            (void)n;
+        }
+        else
+        {
+            // 套接字里已经有没被读走的字节时写不进也没关系, 服务器一样会醒
+            char b = 0;
+            ssize_t n = send(sockfd_, &b, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+            (void)n;
+        }
+    }
+
+private:
+    static size_t RegionSize(size_t ringsize)
+    {
+        return sizeof(ShmRegionHeader) + 2 * (sizeof(ShmRingHeader) + ringsize);
+    }
+
+    // 第i个环形队列: 0是请求, 1是响应
+    ShmRingHeader *RingHeader(int i)
+    {
+        size_t ringsize = ((ShmRegionHeader *)base_)->ringsize_;
+        return (ShmRingHeader *)((char *)base_ + sizeof(ShmRegionHeader) + i * (sizeof(ShmRingHeader) + ringsize));
+    }
+
+    bool Map(int memfd, size_t size)
+    {
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (p == MAP_FAILED)
+            return false;
+        base_ = p;
+        size_ = size;
+        return true;
+    }
+
+    void Attach(size_t ringsize)
+    {
+        ShmRing &req = server_ ? in_ : out_;
+        ShmRing &resp = server_ ? out_ : in_;
+        req.Attach(RingHeader(0), (char *)(RingHeader(0) + 1), ringsize);
+        resp.Attach(RingHeader(1), (char *)(RingHeader(1) + 1), ringsize);
+    }
+
+    // client call
+    // 阻塞在门铃和握手套接字上, 返回false表示服务器退出了
+    bool Sleep()
+    {
+        struct pollfd fds[2] = {{bellfd_, POLLIN, 0}, {sockfd_, POLLIN, 0}};
+        while (poll(fds, 2, -1) < 0)
+        {
+            if (errno != EINTR)
+                return false;
+        }
+        if (fds[1].revents) // 服务器不往握手套接字写数据, 可读就是关闭了
+            return false;
+        uint64_t cnt;
+        ssize_t n = read(bellfd_, &cnt, sizeof(cnt));
+        (void)n;
+        return true;
+    }
+
+    bool SendFds(int memfd, int bellfd)
+    {
+        char byte = 'S';
+        struct iovec iov = {&byte, 1};
+        char control[CMSG_SPACE(2 * sizeof(int))];
+        memset(control, 0, sizeof(control));
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+        int fds[2] = {memfd, bellfd};
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+        return sendmsg(sockfd_, &msg, MSG_NOSIGNAL) == 1;
+    }
+
+    bool RecvFds(int *memfd, int *bellfd)
+    {
+        char byte = 0;
+        struct iovec iov = {&byte, 1};
+        char control[CMSG_SPACE(2 * sizeof(int))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n;
+        while ((n = recvmsg(sockfd_, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+            ;
+        struct cmsghdr *cmsg = n == 1 ? CMSG_FIRSTHDR(&msg) : nullptr;
+        if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+            return false;
+        int fds[2];
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        if (byte != 'S')
+        {
+            close(fds[0]);
+            close(fds[1]);
+            return false;
+        }
+        *memfd = fds[0];
+        *bellfd = fds[1];
+        return true;
+    }
+
+private:
+    void *base_;
+    size_t size_;
+    int sockfd_;
+    int bellfd_; // 客户端的门铃eventfd: 服务器写, 客户端等
+    bool server_;
+    ShmRing in_;
+    ShmRing out_;
+};
@@ -0,0 +1,122 @@
+#pragma once
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+// C++20协程的返回类型
+// Task<T>: 惰性启动, 被co_await时才开始执行, 执行完毕后通过对称转移恢复等待它的协程
+// Detached: 立即启动, 结束后自行销毁协程帧, 用作顶层协程(由Reactor发起, 没有人等待它)
+// 本项目不使用异常, 协程中出现未捕获的异常直接terminate
+
+template <class T>
+class Task;
+
+namespace task_detail
+{
+    // 协程结束时, 转移到等待者继续执行; 没有等待者则返回到resume的调用处
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+
+        template <class Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept
+        {
+            std::coroutine_handle<> cont = h.promise().continuation_;
+            if (cont)
+                return cont;
+            return std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    struct PromiseBase
+    {
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void unhandled_exception() { std::terminate(); }
+
+        std::coroutine_handle<> continuation_;
+    };
+};
+
+template <class T>
+class Task
+{
+public:
+    struct promise_type : task_detail::PromiseBase
+    {
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        void return_value(T value) { value_.emplace(std::move(value)); }
+
+        std::optional<T> value_;
+    };
+
+    Task(Task &&other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task()
+    {
+        if (h_)
+            h_.destroy();
+    }
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont)
+    {
+        h_.promise().continuation_ = cont;
+        return h_;
+    }
+    T await_resume() { return std::move(*h_.promise().value_); }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> h) : h_(h) {}
+
+    std::coroutine_handle<promise_type> h_;
+};
+
+template <>
+class Task<void>
+{
+public:
+    struct promise_type : task_detail::PromiseBase
+    {
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        void return_void() {}
+    };
+
+    Task(Task &&other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task()
+    {
+        if (h_)
+            h_.destroy();
+    }
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont)
+    {
+        h_.promise().continuation_ = cont;
+        return h_;
+    }
+    void await_resume() {}
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> h) : h_(h) {}
+
+    std::coroutine_handle<promise_type> h_;
+};
+
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
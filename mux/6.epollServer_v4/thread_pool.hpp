@@ -1,23 +1,50 @@
 #pragma once
 #include <iostream>
+#include <string>
 #include <queue>
+#include <list>
 #include <vector>
+#include <ctime>
+#include <cerrno>
 #include <pthread.h>
 #include "Thread.hpp"
 #include "Mutex.hpp"
-#include "reactor.hpp"
+#include "log.hpp"
 
-static const int max_cap = 3;
 static const int default_threadnum = 5;
+static const int default_drain_ms = 3000; // 析构时排空任务队列、等待正在执行的任务的最长时间(毫秒)
 
 // 使用说明:
 // 1.要自己封装任务类型Task, Task必须包含operator(), 这是该Task的执行函数
-// 2.线程池会自己启动, 用户调用时直接使用get_instance, 并传入想要的工作线程个数即可
+// 2.线程池不再是单例, 每个服务可以有自己的线程池(隔离舱: 慢服务不会占满快服务的线程), 构造后调用start启动
+// 3.运行中可以根据负载信号(如pending()任务堆积数)调用resize调整工作线程个数
+// 4.shutdown先停止接收新任务, 在期限内排空任务队列、等正在执行的任务结束, 回收所有线程; 析构时会自动shutdown
+//   超过期限还在执行的任务不能打断, shutdown照样返回, 析构时再等它们结束(任务可能引用线程池)
+// 5.get_instance保留为进程级的默认线程池
 
 template <class Task>
 class ThreadPool
 {
 public:
+    ThreadPool(int threadnum = default_threadnum, const std::string &name = "pool")
+        : _name(name), _target(threadnum < 0 ? 0 : threadnum), _alive(0), _running(false), _stopping(false), _nextindex(1)
+    {
+        pthread_cond_init(&_cond, nullptr);
+        pthread_cond_init(&_exitcond, nullptr);
+    }
+
+    ~ThreadPool()
+    {
+        shutdown(default_drain_ms);
+        {
+            lockGuard lg(&_mutex);
+            waitExit(nullptr);
+        }
+
+        pthread_cond_destroy(&_cond);
+        pthread_cond_destroy(&_exitcond);
+    }
+
     // _tp也是临界资源, 要保护起来
     static ThreadPool<Task> *get_instance(const int &threadnum = default_threadnum)
     {
@@ -34,7 +61,7 @@ public:
             if (_tp == nullptr)
             {
                 // 第一次访问单例时创建
-                _tp = new ThreadPool<Task>(threadnum);
+                _tp = new ThreadPool<Task>(threadnum, "default");
                 // 启动所有线程
                 _tp->start();
             }
@@ -43,39 +70,105 @@ public:
         return _tp;
     }
 
-    ~ThreadPool()
+    // 启动线程池, 创建_target个工作线程
+    void start()
     {
-        // 回收线程
-        for (auto &thr : _threads)
-        {
-            thr.join();
-        }
-        // delete
-
-        pthread_cond_destroy(&_cond);
+        lockGuard lg(&_mutex);
+        if (_running)
+            return;
+        _running = true;
+        _stopping = false;
+        while (_alive < _target)
+            spawn();
     }
 
-    void pushTask(const Task &in)
+    // 线程池关闭后不再接收任务, 返回false; 只有成功时才移走in, 失败时调用方可以就地执行它
+    bool pushTask(Task &&in)
     {
         lockGuard lg(&_mutex);
+        if (_stopping)
+            return false;
 
-        _tasks.push(in);
+        _tasks.push(std::move(in));
         pthread_cond_signal(&_cond);
+        return true;
     }
 
-private:
-    // 禁止用户构造、拷贝、赋值
-    ThreadPool(const int &cap) : _threads(cap), _cap(cap)
-    {               
-        // 创建线程, 所有线程处于等待任务的状态
-        for (int i = 0; i < _cap; i++)
+    // 调整工作线程个数
+    // 扩容: 立即创建新线程
+    // 缩容: 唤醒所有线程, 多余的线程在取下一个任务前自行退出(不会打断正在执行的任务)
+    void resize(int threadnum)
+    {
+        lockGuard lg(&_mutex);
+        reap();
+        _target = threadnum < 0 ? 0 : threadnum;
+        if (!_running || _stopping)
+            return;
+        while (_alive < _target)
+            spawn();
+        if (_alive > _target)
+            pthread_cond_broadcast(&_cond);
+        LogMessage(INFO, "线程池[%s] 调整线程数: %d\n", _name.c_str(), _target);
+    }
+
+    // 优雅关闭: 拒绝新任务, 最多等待deadline_ms毫秒让工作线程排空任务队列、执行完手头的任务, 回收所有线程
+    // 超过期限时丢弃剩余任务; 还在执行的任务不等了, threadNum()是它们的个数, 可以再次调用shutdown接着等
+    // 返回被丢弃的任务个数
+    size_t shutdown(int deadline_ms)
+    {
+        lockGuard lg(&_mutex);
+        if (!_running)
+            return 0;
+        _stopping = true;
+        pthread_cond_broadcast(&_cond);
+
+        struct timespec abstime;
+        clock_gettime(CLOCK_REALTIME, &abstime);
+        abstime.tv_sec += deadline_ms / 1000;
+        abstime.tv_nsec += (long)(deadline_ms % 1000) * 1000000;
+        if (abstime.tv_nsec >= 1000000000)
         {
-            _threads[i] = Thread(i + 1, threadRoutine, this);
+            abstime.tv_sec += 1;
+            abstime.tv_nsec -= 1000000000;
         }
 
-        pthread_cond_init(&_cond, nullptr);
+        while (_alive > 0 && !_tasks.empty())
+        {
+            if (pthread_cond_timedwait(&_exitcond, _mutex.getmutex(), &abstime) == ETIMEDOUT)
+                break;
+        }
+
+        size_t dropped = _tasks.size();
+        while (!_tasks.empty())
+            _tasks.pop();
+        if (dropped > 0)
+            LogMessage(WARNING, "线程池[%s] 关闭超时, 丢弃任务数: %d\n", _name.c_str(), (int)dropped);
+
+        // 队列已空, 剩下的线程执行完手头的任务就会退出, 同样最多等到期限
+        if (!waitExit(&abstime))
+            LogMessage(WARNING, "线程池[%s] 关闭超时, 还在执行的任务数: %d\n", _name.c_str(), _alive);
+        return dropped;
     }
 
+    const std::string &name() const
+    {
+        return _name;
+    }
+
+    int threadNum()
+    {
+        lockGuard lg(&_mutex);
+        return _alive;
+    }
+
+    // 任务堆积数, 可作为resize的负载信号
+    size_t pending()
+    {
+        lockGuard lg(&_mutex);
+        return _tasks.size();
+    }
+
+private:
     ThreadPool(const ThreadPool<Task> &tp) = delete;
     ThreadPool<Task> &operator=(const ThreadPool<Task> &tp) = delete;
 
@@ -89,11 +182,10 @@ private:
     {
         ThreadPool *tp = static_cast<ThreadPool *>(args);
 
-        while (true)
+        Task t;
+        // 获取任务, 任务队列如果为空，需要等待; popTask返回false表示本线程应当退出
+        while (tp->popTask(&t))
         {
-            // 获取任务, 任务队列如果为空，需要等待
-            Task t = tp->popTask();
-
             // 处理任务(线程池应该处理短时任务，有限的线程干无限的事，线程干完一个任务就可以处理下一个任务)
             // 即：t()不能是循环任务
             t();
@@ -102,42 +194,98 @@ private:
         return nullptr;
     }
 
-    Task popTask()
+    bool popTask(Task *out)
     {
-        Task out;
+        lockGuard lg(&_mutex);
 
-        // 临界区
+        while (_tasks.empty() && !_stopping && _alive <= _target)
         {
-            lockGuard lg(&_mutex);
+            pthread_cond_wait(&_cond, _mutex.getmutex());
+        }
 
-            while (_tasks.empty())
-            {
-                pthread_cond_wait(&_cond, _mutex.getmutex());
-            }
-            out = _tasks.front();
-            _tasks.pop();
+        // 关闭中: 先把队列排空, 队列空了再退出
+        // 缩容中: 多余的线程直接退出, 剩下的任务由其他线程处理
+        if ((_stopping && _tasks.empty()) || (!_stopping && _alive > _target))
+        {
+            _alive--;
+            _exited.push_back(pthread_self());
+            pthread_cond_broadcast(&_exitcond);
+            return false;
         }
 
-        return out;
+        *out = std::move(_tasks.front());
+        _tasks.pop();
+        if (_stopping && _tasks.empty())
+            pthread_cond_broadcast(&_exitcond);
+        return true;
     }
-    // 启动线程池, 所有线程开始运行
-    void start()
+
+    // 以下函数调用前必须持有_mutex
+
+    // 等待所有工作线程退出并回收, abstime为空时不限时; 全部退出返回true
+    bool waitExit(const struct timespec *abstime)
     {
-        for (auto &thr : _threads)
+        while (_alive > 0)
         {
-            thr.run();
+            if (abstime == nullptr)
+                pthread_cond_wait(&_exitcond, _mutex.getmutex());
+            else if (pthread_cond_timedwait(&_exitcond, _mutex.getmutex(), abstime) == ETIMEDOUT)
+                break;
+        }
+        reap();
+        if (_alive > 0)
+            return false;
+        _running = false;
+        return true;
+    }
+
+    void spawn()
+    {
+        _threads.emplace_back(_nextindex++, threadRoutine, this); // list保证Thread对象地址不变
+        Thread &thr = _threads.back();
+        thr.run();
+        _alive++;
+
+        // 线程名(最长15个字符)便于top -H / gdb区分不同的线程池
+        char tname[16] = {0};
+        snprintf(tname, sizeof(tname), "%s-%d", _name.c_str(), _nextindex - 1);
+        pthread_setname_np(thr.getTid(), tname);
+    }
+
+    // 回收已经退出的线程
+    void reap()
+    {
+        for (pthread_t tid : _exited)
+        {
+            for (auto it = _threads.begin(); it != _threads.end(); ++it)
+            {
+                if (pthread_equal(it->getTid(), tid))
+                {
+                    it->join();
+                    _threads.erase(it);
+                    break;
+                }
+            }
         }
+        _exited.clear();
     }
 
 private:
+    std::string _name;
     std::queue<Task> _tasks; // 任务队列大小无限制，采用stl中的自动扩容
-    std::vector<Thread> _threads;
+    std::list<Thread> _threads;
+    std::vector<pthread_t> _exited; // 已退出等待join的线程
 
     // 消费线程访问任务队列的锁和条件变量
     Mutex _mutex;
     pthread_cond_t _cond;
+    pthread_cond_t _exitcond; // 线程退出/队列排空时通知shutdown
 
-    int _cap; // 线程池的最大容量
+    int _target; // 期望的工作线程个数
+    int _alive;  // 当前存活的工作线程个数
+    bool _running;
+    bool _stopping;
+    int _nextindex; // 线程编号
 
     static ThreadPool<Task> *_tp;
     static Mutex _tp_mutex;
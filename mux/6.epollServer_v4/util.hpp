@@ -3,6 +3,11 @@
 #include <iostream>
 #include <unistd.h>
 #include <fcntl.h>
+#include <ctime>
+#include <cstdint>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 #include "log.hpp"
 
 namespace util
@@ -21,4 +26,67 @@ namespace util
         }
         return true;
     }
+
+    // 关闭Nagle算法: 小报文立即发出, 不等前一个报文的ACK
+    bool SetNoDelay(int fd)
+    {
+        int one = 1;
+        return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == 0;
+    }
+
+    // 连接的套接字选项
+    // PROFILE_LOW_LATENCY: 关闭Nagle, 开启QUICKACK, 小报文立即发出、立即确认
+    // PROFILE_BULK: 保留Nagle合并小报文, 收发缓冲区固定为bulk_buffer_size(关闭自动调节), 适合大块传输
+    enum sockprofile_t
+    {
+        PROFILE_LOW_LATENCY,
+        PROFILE_BULK
+    };
+    static const char *profile_names[] = {"lowlatency", "bulk"};
+    static const int bulk_buffer_size = 4 << 20; // 内核会截断到net.core.rmem_max/wmem_max
+
+    // 设在监听套接字上: accept出的连接继承TCP_NODELAY和收发缓冲区, 不必每个连接再设一次
+    // 缓冲区必须在listen之前设置, 窗口扩大因子在握手时就确定了
+    bool SetListenProfile(int fd, sockprofile_t profile)
+    {
+        if (profile == PROFILE_LOW_LATENCY)
+            return SetNoDelay(fd);
+        int size = bulk_buffer_size;
+        return setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == 0 &&
+               setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == 0;
+    }
+
+    // accept之后每个连接单独设置的选项: QUICKACK不会继承
+    // 内核在连接交互起来后可能回到延迟ACK, 这里只保证开头的请求不被延迟确认
+    bool SetConnProfile(int fd, sockprofile_t profile)
+    {
+        if (profile != PROFILE_LOW_LATENCY)
+            return true;
+        int one = 1;
+        return setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one)) == 0;
+    }
+
+    // 单调时钟, 毫秒
+    uint64_t NowMs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    // 单调时钟, 微秒
+    uint64_t NowUs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    // 单调时钟, 纳秒
+    uint64_t NowNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
 };
\ No newline at end of file